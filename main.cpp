@@ -11,6 +11,20 @@
 #include <vector>
 #include <fstream>
 #include <string>
+#include <sstream>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <cfloat>
+#include <climits>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <unordered_map>
 
 
 #define GLEW_STATIC 1   // This allows linking with Static Library on Windows, without DLL
@@ -21,422 +35,10409 @@
 
 #include <glm/glm.hpp>  // GLM is an optimized math library with syntax to similar to OpenGL Shading Language
 #include <glm/gtc/matrix_transform.hpp> // include this to create transformation matrices
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtc/packing.hpp>
+#include <glm/gtc/noise.hpp>
 
-// Global Variables
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>    // file mapping
+#undef near
+#undef far
+#else
+#include <sys/mman.h>   // file mapping
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__APPLE__)
+#include <mach-o/dyld.h> // executable path
+#endif
+#endif
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>  // SSE intrinsics for the matrix and culling kernels
+#define USE_SSE 1
+#else
+#define USE_SSE 0
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>  // SSE2 integer intrinsics for the vertex quantization kernels
+#define USE_SSE2 1
+#else
+#define USE_SSE2 0
+#endif
+
+// GL State Cache
 // ---------------------------------
 
-// Primitive Scale
-float GridUnit = 0.01f;
+/* Kinds of calls going through the state cache, for the per-frame counters */
+enum GLCallKind
+{
+	CallUseProgram,
+	CallBindVertexArray,
+	CallBindBuffer,
+	CallCapability,
+	CallUniform,
+	CallDraw,
+	CallUpload,
+	GLCallKindCount
+};
 
-// Mouse Controls
-double lastCursorPosX = -1.0f;
-double lastCursorPosY = -1.0f;
-bool isLeftButtonPressed = false;
-bool isRightButtonPressed = false;
-bool isMiddleButtonPressed = false;
+/* GL entry points used by the state cache. The default backend forwards to GLEW; the recording
+   backend only logs the calls, so the cache can be measured without a context */
+struct GLBackend
+{
+	void (*useProgram)(unsigned int program);
+	void (*bindVertexArray)(unsigned int vao);
+	void (*bindBuffer)(unsigned int target, unsigned int buffer);
+	void (*bindBufferBase)(unsigned int target, unsigned int index, unsigned int buffer);
+	void (*setCapability)(unsigned int capability, bool enabled);
+	void (*uniform)(int location, unsigned int type, int count, const void* value);
+	void (*drawArrays)(unsigned int mode, int first, int count);
+	void (*drawElements)(unsigned int mode, int count, unsigned int indexType, const void* indices, int instanceCount, int baseVertex);
+	void (*multiDrawArrays)(unsigned int mode, const int* first, const int* count, int drawCount);
+	void (*multiDrawElements)(unsigned int mode, const int* count, unsigned int indexType, const void* const* indices, int drawCount,
+		const int* baseVertex);
+	void (*multiDrawIndirect)(unsigned int mode, unsigned int indexType, size_t offset, int drawCount);
+	void (*bufferData)(unsigned int target, size_t size, const void* data, unsigned int usage);
+	void (*bufferSubData)(unsigned int target, size_t offset, size_t size, const void* data);
+	void (*copyBufferSubData)(unsigned int readTarget, unsigned int writeTarget, size_t readOffset, size_t writeOffset, size_t size);
+};
 
-// Camera
-glm::vec3 cameraPosition;
-glm::vec3 cameraLookAt;
-glm::vec3 cameraUp;
-glm::vec3 cameraRight;
+void forwardUseProgram(unsigned int program) { glUseProgram(program); }
+void forwardBindVertexArray(unsigned int vao) { glBindVertexArray(vao); }
+void forwardBindBuffer(unsigned int target, unsigned int buffer) { glBindBuffer(target, buffer); }
+void forwardBindBufferBase(unsigned int target, unsigned int index, unsigned int buffer) { glBindBufferBase(target, index, buffer); }
 
-// Model-View-Projection Matrices
-glm::mat4 worldMatrix;
-glm::mat4 viewMatrix;
-glm::mat4 projectionMatrix;
+void forwardSetCapability(unsigned int capability, bool enabled)
+{
+	if (enabled)
+		glEnable(capability);
+	else
+		glDisable(capability);
+}
 
-// Global identifiers
-unsigned int shaderProgram;
+// Every type ShaderProgram::Reflect accepts, see uniformComponentCount
+void forwardUniform(int location, unsigned int type, int count, const void* value)
+{
+	const float* f = (const float*)value;
+	const int* i = (const int*)value;
+	const unsigned int* u = (const unsigned int*)value;
+	const double* d = (const double*)value;
+	switch (type)
+	{
+	case GL_FLOAT: glUniform1fv(location, count, f); break;
+	case GL_FLOAT_VEC2: glUniform2fv(location, count, f); break;
+	case GL_FLOAT_VEC3: glUniform3fv(location, count, f); break;
+	case GL_FLOAT_VEC4: glUniform4fv(location, count, f); break;
+	case GL_FLOAT_MAT2: glUniformMatrix2fv(location, count, GL_FALSE, f); break;
+	case GL_FLOAT_MAT3: glUniformMatrix3fv(location, count, GL_FALSE, f); break;
+	case GL_FLOAT_MAT4: glUniformMatrix4fv(location, count, GL_FALSE, f); break;
+	case GL_FLOAT_MAT2x3: glUniformMatrix2x3fv(location, count, GL_FALSE, f); break;
+	case GL_FLOAT_MAT2x4: glUniformMatrix2x4fv(location, count, GL_FALSE, f); break;
+	case GL_FLOAT_MAT3x2: glUniformMatrix3x2fv(location, count, GL_FALSE, f); break;
+	case GL_FLOAT_MAT3x4: glUniformMatrix3x4fv(location, count, GL_FALSE, f); break;
+	case GL_FLOAT_MAT4x2: glUniformMatrix4x2fv(location, count, GL_FALSE, f); break;
+	case GL_FLOAT_MAT4x3: glUniformMatrix4x3fv(location, count, GL_FALSE, f); break;
+	case GL_INT_VEC2: case GL_BOOL_VEC2: glUniform2iv(location, count, i); break;
+	case GL_INT_VEC3: case GL_BOOL_VEC3: glUniform3iv(location, count, i); break;
+	case GL_INT_VEC4: case GL_BOOL_VEC4: glUniform4iv(location, count, i); break;
+	case GL_UNSIGNED_INT: glUniform1uiv(location, count, u); break;
+	case GL_UNSIGNED_INT_VEC2: glUniform2uiv(location, count, u); break;
+	case GL_UNSIGNED_INT_VEC3: glUniform3uiv(location, count, u); break;
+	case GL_UNSIGNED_INT_VEC4: glUniform4uiv(location, count, u); break;
+	case GL_DOUBLE: glUniform1dv(location, count, d); break;
+	case GL_DOUBLE_VEC2: glUniform2dv(location, count, d); break;
+	case GL_DOUBLE_VEC3: glUniform3dv(location, count, d); break;
+	case GL_DOUBLE_VEC4: glUniform4dv(location, count, d); break;
+	case GL_DOUBLE_MAT2: glUniformMatrix2dv(location, count, GL_FALSE, d); break;
+	case GL_DOUBLE_MAT3: glUniformMatrix3dv(location, count, GL_FALSE, d); break;
+	case GL_DOUBLE_MAT4: glUniformMatrix4dv(location, count, GL_FALSE, d); break;
+	case GL_DOUBLE_MAT2x3: glUniformMatrix2x3dv(location, count, GL_FALSE, d); break;
+	case GL_DOUBLE_MAT2x4: glUniformMatrix2x4dv(location, count, GL_FALSE, d); break;
+	case GL_DOUBLE_MAT3x2: glUniformMatrix3x2dv(location, count, GL_FALSE, d); break;
+	case GL_DOUBLE_MAT3x4: glUniformMatrix3x4dv(location, count, GL_FALSE, d); break;
+	case GL_DOUBLE_MAT4x2: glUniformMatrix4x2dv(location, count, GL_FALSE, d); break;
+	case GL_DOUBLE_MAT4x3: glUniformMatrix4x3dv(location, count, GL_FALSE, d); break;
+	default: glUniform1iv(location, count, i); break; // ints, bools, samplers and images
+	}
+}
 
+void forwardDrawArrays(unsigned int mode, int first, int count) { glDrawArrays(mode, first, count); }
 
-// Create Geometry
-// ---------------------------------
+// Indices are offset by baseVertex before fetching vertices
+void forwardDrawElements(unsigned int mode, int count, unsigned int indexType, const void* indices, int instanceCount, int baseVertex)
+{
+	if (instanceCount == 1 && baseVertex == 0)
+		glDrawElements(mode, count, indexType, indices);
+	else if (instanceCount == 1)
+		glDrawElementsBaseVertex(mode, count, indexType, (void*)indices, baseVertex);
+	else if (baseVertex == 0)
+		glDrawElementsInstanced(mode, count, indexType, indices, instanceCount);
+	else
+		glDrawElementsInstancedBaseVertex(mode, count, indexType, indices, instanceCount, baseVertex);
+}
 
-/* This struct holds the vao, vbo and ebo identifiers used to draw the geometry */
-struct Geometry
+void forwardMultiDrawArrays(unsigned int mode, const int* first, const int* count, int drawCount)
 {
-	unsigned int vao;
-	unsigned int vbo;
-	unsigned int ebo;
-	Geometry(unsigned int vao, unsigned int vbo, unsigned int ebo) : vao(0), vbo(0), ebo(0) {}
+	glMultiDrawArrays(mode, first, count, drawCount);
+}
+
+// baseVertex is null when every draw starts at vertex 0
+void forwardMultiDrawElements(unsigned int mode, const int* count, unsigned int indexType, const void* const* indices, int drawCount,
+	const int* baseVertex)
+{
+	if (baseVertex)
+		glMultiDrawElementsBaseVertex(mode, (int*)count, indexType, (void**)indices, drawCount, (int*)baseVertex);
+	else
+		glMultiDrawElements(mode, count, indexType, indices, drawCount);
+}
+
+// Commands are read from the bound draw indirect buffer, indexType is 0 for non-indexed draws
+void forwardMultiDrawIndirect(unsigned int mode, unsigned int indexType, size_t offset, int drawCount)
+{
+	if (indexType == 0)
+		glMultiDrawArraysIndirect(mode, (const void*)offset, drawCount, 0);
+	else
+		glMultiDrawElementsIndirect(mode, indexType, (const void*)offset, drawCount, 0);
+}
+
+void forwardBufferData(unsigned int target, size_t size, const void* data, unsigned int usage)
+{
+	glBufferData(target, size, data, usage);
+}
+
+void forwardBufferSubData(unsigned int target, size_t offset, size_t size, const void* data)
+{
+	glBufferSubData(target, offset, size, data);
+}
+
+void forwardCopyBufferSubData(unsigned int readTarget, unsigned int writeTarget, size_t readOffset, size_t writeOffset, size_t size)
+{
+	glCopyBufferSubData(readTarget, writeTarget, readOffset, writeOffset, size);
+}
+
+GLBackend forwardingBackend()
+{
+	GLBackend backend = { forwardUseProgram, forwardBindVertexArray, forwardBindBuffer, forwardBindBufferBase, forwardSetCapability,
+		forwardUniform, forwardDrawArrays, forwardDrawElements, forwardMultiDrawArrays, forwardMultiDrawElements,
+		forwardMultiDrawIndirect, forwardBufferData, forwardBufferSubData, forwardCopyBufferSubData };
+	return backend;
+}
+
+/* A call logged by the recording backend */
+struct RecordedGLCall
+{
+	GLCallKind kind;
+	unsigned int a;
+	unsigned int b;
 };
 
-// Initialize Geometry Structures
-Geometry Grid(0, 0, 0);
-Geometry Cube(0, 0, 0);
+std::vector<RecordedGLCall> recordedGLCalls;
+
+void recordCall(GLCallKind kind, unsigned int a, unsigned int b)
+{
+	RecordedGLCall call = { kind, a, b };
+	recordedGLCalls.push_back(call);
+}
 
-void createGeometryGrid()
+void recordUseProgram(unsigned int program) { recordCall(CallUseProgram, program, 0); }
+void recordBindVertexArray(unsigned int vao) { recordCall(CallBindVertexArray, vao, 0); }
+void recordBindBuffer(unsigned int target, unsigned int buffer) { recordCall(CallBindBuffer, target, buffer); }
+void recordBindBufferBase(unsigned int target, unsigned int /*index*/, unsigned int buffer) { recordCall(CallBindBuffer, target, buffer); }
+void recordSetCapability(unsigned int capability, bool enabled) { recordCall(CallCapability, capability, enabled); }
+void recordUniform(int location, unsigned int type, int /*count*/, const void* /*value*/) { recordCall(CallUniform, location, type); }
+void recordDrawArrays(unsigned int mode, int /*first*/, int count) { recordCall(CallDraw, mode, count); }
+void recordDrawElements(unsigned int mode, int count, unsigned int /*indexType*/, const void* /*indices*/, int /*instanceCount*/, int /*baseVertex*/) { recordCall(CallDraw, mode, count); }
+
+void recordMultiDrawArrays(unsigned int mode, const int* /*first*/, const int* /*count*/, int drawCount) { recordCall(CallDraw, mode, drawCount); }
+void recordMultiDrawElements(unsigned int mode, const int* /*count*/, unsigned int /*indexType*/, const void* const* /*indices*/, int drawCount,
+	const int* /*baseVertex*/) { recordCall(CallDraw, mode, drawCount); }
+void recordMultiDrawIndirect(unsigned int mode, unsigned int /*indexType*/, size_t /*offset*/, int drawCount) { recordCall(CallDraw, mode, drawCount); }
+void recordBufferData(unsigned int target, size_t size, const void* /*data*/, unsigned int /*usage*/) { recordCall(CallUpload, target, (unsigned int)size); }
+void recordBufferSubData(unsigned int target, size_t /*offset*/, size_t size, const void* /*data*/) { recordCall(CallUpload, target, (unsigned int)size); }
+void recordCopyBufferSubData(unsigned int /*readTarget*/, unsigned int writeTarget, size_t /*readOffset*/, size_t /*writeOffset*/, size_t size)
+{
+	recordCall(CallUpload, writeTarget, (unsigned int)size);
+}
+
+GLBackend recordingBackend()
 {
-	// Generate 100x100 Grid
-	glm::vec3 vertexArray[800];
-	// Z Lines (200 Vertices)
-	float xCoord = -(GridUnit*100/2);
-	for (int x = 0; x < 200; x += 2)
+	GLBackend backend = { recordUseProgram, recordBindVertexArray, recordBindBuffer, recordBindBufferBase, recordSetCapability,
+		recordUniform, recordDrawArrays, recordDrawElements, recordMultiDrawArrays, recordMultiDrawElements,
+		recordMultiDrawIndirect, recordBufferData, recordBufferSubData, recordCopyBufferSubData };
+	return backend;
+}
+
+/* Issued and elided call counts */
+struct GLCallCounters
+{
+	unsigned int issued[GLCallKindCount];
+	unsigned int elided[GLCallKindCount];
+
+	GLCallCounters()
 	{
-		if (x != 0)
-			xCoord += GridUnit;
+		Reset();
+	}
 
-		vertexArray[x] = glm::vec3(xCoord, 0.0f, -(GridUnit * 100 / 2));
-		vertexArray[x + 1] = glm::vec3(xCoord, 0.0f, (GridUnit * 100 / 2));
+	void Reset()
+	{
+		memset(issued, 0, sizeof(issued));
+		memset(elided, 0, sizeof(elided));
 	}
 
-	// X Lines (200 Vertices)
-	float zCoord = -(GridUnit * 100 / 2);
-	for (int z = 200; z < 400; z += 2)
+	unsigned int TotalIssued() const
 	{
-		if (z != 200)
-			zCoord += GridUnit;
+		unsigned int total = 0;
+		for (int i = 0; i < GLCallKindCount; i++)
+			total += issued[i];
+		return total;
+	}
 
-		vertexArray[z] = glm::vec3(-(GridUnit * 100 / 2), 0.0f, zCoord);
-		vertexArray[z + 1] = glm::vec3((GridUnit * 100 / 2), 0.0f, zCoord);
+	unsigned int TotalElided() const
+	{
+		unsigned int total = 0;
+		for (int i = 0; i < GLCallKindCount; i++)
+			total += elided[i];
+		return total;
 	}
+};
 
-	// Create a vertex array
-	glGenVertexArrays(1, &Grid.vao);
-	glBindVertexArray(Grid.vao);
+const unsigned int UnknownState = 0xFFFFFFFFu;
 
+/* Buffer binding points shadowed by the cache, the element array buffer is tracked per vao */
+const unsigned int CachedBufferTargets[] = { GL_ARRAY_BUFFER, GL_UNIFORM_BUFFER, GL_COPY_READ_BUFFER,
+	GL_COPY_WRITE_BUFFER, GL_PIXEL_UNPACK_BUFFER, GL_DRAW_INDIRECT_BUFFER, GL_SHADER_STORAGE_BUFFER };
+const int CachedBufferTargetCount = sizeof(CachedBufferTargets) / sizeof(CachedBufferTargets[0]);
 
-	// Upload Vertex Buffer to the GPU, keep a reference to it (vertexBufferObject)
-	glGenBuffers(1, &Grid.vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, Grid.vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertexArray), vertexArray, GL_STATIC_DRAW);
+/* Shadows the bound program, vao, buffers and capabilities, and drops calls that would not change
+   anything. All binds must go through it for the shadow state to stay valid */
+struct GLStateCache
+{
+	GLBackend backend;
+	unsigned int program;
+	unsigned int vao;
+	unsigned int buffers[CachedBufferTargetCount];
+	std::vector<unsigned int> elementBuffers;				// indexed by vao
+	std::vector<std::pair<unsigned int, unsigned int> > capabilities;	// capability, enabled or UnknownState
 
-	glVertexAttribPointer(	0,                   // attribute 0 matches aPos in Vertex Shader
-							3,                   // size
-							GL_FLOAT,            // type
-							GL_FALSE,            // normalized?
-							sizeof(glm::vec3),	 // stride - each vertex contains 1 vec3 (position)
-							(void*)0             // array buffer offset
-	);
-	glEnableVertexAttribArray(0);
+	// Counters of the frame being recorded and of the last complete frame
+	GLCallCounters frame;
+	GLCallCounters lastFrame;
 
-	glBindVertexArray(0);
-}
+	GLStateCache() : backend(forwardingBackend())
+	{
+		Invalidate();
+	}
 
-void createGeometryUnitCube()
-{
-	glm::vec3 vertexArray[] =
+	// Forget the shadow state, e.g. after GL calls made behind the cache's back
+	void Invalidate()
 	{
-		// Axis Polygon (X Default)
-		glm::vec3(-(GridUnit/2), 0.0f, -(GridUnit / 2)),			// Bottom-left		0
-		glm::vec3((GridUnit / 2), 0.0f, -(GridUnit / 2)),			// Bottom-right		1
-		glm::vec3((GridUnit / 2), GridUnit, -(GridUnit / 2)),		// Top-right		2
-		glm::vec3(-(GridUnit / 2), GridUnit, -(GridUnit / 2)),		// Top-left			3
+		program = UnknownState;
+		vao = UnknownState;
+		for (int i = 0; i < CachedBufferTargetCount; i++)
+			buffers[i] = UnknownState;
+		elementBuffers.clear();
+		capabilities.clear();
+	}
 
-		glm::vec3(-(GridUnit / 2), 0.0f, (GridUnit / 2)),			// Bottom-left		4
-		glm::vec3((GridUnit / 2), 0.0f, (GridUnit / 2)),			// Bottom-right		5
-		glm::vec3((GridUnit / 2), GridUnit, (GridUnit / 2)),		// Top-right		6
-		glm::vec3(-(GridUnit / 2), GridUnit, (GridUnit / 2))		// Top-left			7
-	};
+	// Forget a buffer deleted with glDeleteBuffers, which unbinds it. Its name can come back from
+	// glGenBuffers, and binding it then must not be dropped as redundant
+	void ForgetBuffer(unsigned int buffer)
+	{
+		for (int i = 0; i < CachedBufferTargetCount; i++)
+		{
+			if (buffers[i] == buffer)
+				buffers[i] = 0;
+		}
+		for (size_t i = 0; i < elementBuffers.size(); i++)
+		{
+			if (elementBuffers[i] == buffer)
+				elementBuffers[i] = UnknownState;
+		}
+	}
 
-	unsigned int elements[] =
+	void BeginFrame()
 	{
-		// Back Face
-		2, 1, 0,
-		0, 3, 2,
+		lastFrame = frame;
+		frame.Reset();
+	}
 
-		// Front Face
-		4, 5, 6,
-		6, 7, 4,
+	void UseProgram(unsigned int id)
+	{
+		if (program == id)
+		{
+			frame.elided[CallUseProgram]++;
+			return;
+		}
+		program = id;
+		backend.useProgram(id);
+		frame.issued[CallUseProgram]++;
+	}
 
-		// Top Face
-		2, 3, 7,
-		7, 6, 2,
+	void BindVertexArray(unsigned int id)
+	{
+		if (vao == id)
+		{
+			frame.elided[CallBindVertexArray]++;
+			return;
+		}
+		vao = id;
+		backend.bindVertexArray(id);
+		frame.issued[CallBindVertexArray]++;
+	}
 
-		// Bottom Face
-		1, 5, 4,
-		4, 0, 1,
+	void BindBuffer(unsigned int target, unsigned int buffer)
+	{
+		unsigned int* binding = nullptr;
+		if (target == GL_ELEMENT_ARRAY_BUFFER && vao != UnknownState)
+		{
+			if (vao >= elementBuffers.size())
+				elementBuffers.resize(vao + 1, UnknownState);
+			binding = &elementBuffers[vao];
+		}
+		for (int i = 0; i < CachedBufferTargetCount && !binding; i++)
+		{
+			if (CachedBufferTargets[i] == target)
+				binding = &buffers[i];
+		}
 
-		// Right Face
-		2, 6, 5,
-		5, 1, 2,
+		if (binding && *binding == buffer)
+		{
+			frame.elided[CallBindBuffer]++;
+			return;
+		}
+		if (binding)
+			*binding = buffer;
+		backend.bindBuffer(target, buffer);
+		frame.issued[CallBindBuffer]++;
+	}
 
-		// Left Face
-		3, 0, 4,
-		4, 7, 3
-	};
+	// Bind a buffer to an indexed binding point. This also replaces the generic binding of target
+	void BindBufferBase(unsigned int target, unsigned int index, unsigned int buffer)
+	{
+		backend.bindBufferBase(target, index, buffer);
+		frame.issued[CallBindBuffer]++;
+		for (int i = 0; i < CachedBufferTargetCount; i++)
+		{
+			if (CachedBufferTargets[i] == target)
+				buffers[i] = buffer;
+		}
+	}
+
+	void SetCapability(unsigned int capability, bool enabled)
+	{
+		unsigned int state = enabled ? 1 : 0;
+		for (size_t i = 0; i < capabilities.size(); i++)
+		{
+			if (capabilities[i].first != capability)
+				continue;
+			if (capabilities[i].second == state)
+			{
+				frame.elided[CallCapability]++;
+				return;
+			}
+			capabilities[i].second = state;
+			backend.setCapability(capability, enabled);
+			frame.issued[CallCapability]++;
+			return;
+		}
+		capabilities.push_back(std::make_pair(capability, state));
+		backend.setCapability(capability, enabled);
+		frame.issued[CallCapability]++;
+	}
+
+	void Enable(unsigned int capability)
+	{
+		SetCapability(capability, true);
+	}
 
-	// Create a vertex array
-	glGenVertexArrays(1, &Cube.vao);
-	glBindVertexArray(Cube.vao);
+	void Disable(unsigned int capability)
+	{
+		SetCapability(capability, false);
+	}
 
+	// Uniform values are shadowed per program by ShaderProgram, which reports elided uploads here
+	void Uniform(int location, unsigned int type, int count, const void* value)
+	{
+		backend.uniform(location, type, count, value);
+		frame.issued[CallUniform]++;
+	}
 
-	// Upload Vertex Buffer Object
-	glGenBuffers(1, &Cube.vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, Cube.vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertexArray), vertexArray, GL_STATIC_DRAW);
+	void ElideUniform()
+	{
+		frame.elided[CallUniform]++;
+	}
 
-	glVertexAttribPointer(	0,                   // attribute 0 matches aPos in Vertex Shader
-							3,                   // size
-							GL_FLOAT,            // type
-							GL_FALSE,            // normalized?
-							sizeof(glm::vec3),	 // stride - each vertex contains 1 vec3 (position)
-							(void*)0             // array buffer offset
-	);
-	glEnableVertexAttribArray(0);
+	void DrawArrays(unsigned int mode, int first, int count)
+	{
+		backend.drawArrays(mode, first, count);
+		frame.issued[CallDraw]++;
+	}
 
-	// Upload Element Buffer Object
-	glGenBuffers(1, &Cube.ebo);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, Cube.ebo);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(elements), elements, GL_STATIC_DRAW);
+	void DrawElements(unsigned int mode, int count, unsigned int indexType, const void* indices, int instanceCount = 1, int baseVertex = 0)
+	{
+		backend.drawElements(mode, count, indexType, indices, instanceCount, baseVertex);
+		frame.issued[CallDraw]++;
+	}
 
-	glBindVertexArray(0);
-}
+	void MultiDrawArrays(unsigned int mode, const int* first, const int* count, int drawCount)
+	{
+		backend.multiDrawArrays(mode, first, count, drawCount);
+		frame.issued[CallDraw]++;
+	}
 
-// ---------------------------------
+	void MultiDrawElements(unsigned int mode, const int* count, unsigned int indexType, const void* const* indices, int drawCount,
+		const int* baseVertex = nullptr)
+	{
+		backend.multiDrawElements(mode, count, indexType, indices, drawCount, baseVertex);
+		frame.issued[CallDraw]++;
+	}
 
-/* Read in a file as a string. Used for shaders */
-std::string readFile(const char *filePath) {
-	std::string content;
-	std::ifstream fileStream(filePath, std::ios::in);
+	// drawCount commands starting offset bytes into the bound draw indirect buffer
+	void MultiDrawIndirect(unsigned int mode, unsigned int indexType, size_t offset, int drawCount)
+	{
+		backend.multiDrawIndirect(mode, indexType, offset, drawCount);
+		frame.issued[CallDraw]++;
+	}
 
-	if (!fileStream.is_open()) {
-		std::cerr << "Could not read file " << filePath << ". File does not exist." << std::endl;
-		return "";
+	// Uploads to the buffer bound to target
+	void BufferData(unsigned int target, size_t size, const void* data, unsigned int usage)
+	{
+		backend.bufferData(target, size, data, usage);
+		frame.issued[CallUpload]++;
+	}
+
+	void BufferSubData(unsigned int target, size_t offset, size_t size, const void* data)
+	{
+		backend.bufferSubData(target, offset, size, data);
+		frame.issued[CallUpload]++;
 	}
 
-	std::string line = "";
-	while (!fileStream.eof()) {
-		std::getline(fileStream, line);
-		content.append(line + "\n");
+	// Copies between the buffers bound to readTarget and writeTarget
+	void CopyBufferSubData(unsigned int readTarget, unsigned int writeTarget, size_t readOffset, size_t writeOffset, size_t size)
+	{
+		backend.copyBufferSubData(readTarget, writeTarget, readOffset, writeOffset, size);
+		frame.issued[CallUpload]++;
 	}
+};
+
+GLStateCache glState;
+
+// Shader Programs
+// ---------------------------------
+
+/* FNV-1a hash of a uniform name, usable at compile time */
+constexpr unsigned int hashName(const char* name, unsigned int hash = 2166136261u)
+{
+	return *name == 0 ? hash : hashName(name + 1, (hash ^ (unsigned char)*name) * 16777619u);
+}
+
+// Hashed names of the uniforms used by the framework
+constexpr unsigned int UniformMvpMatrix = hashName("mvpMatrix");
+constexpr unsigned int UniformFragmentColour = hashName("fragmentColour");
+constexpr unsigned int UniformDrawOffset = hashName("drawOffset");
+constexpr unsigned int UniformViewProjectionMatrix = hashName("viewProjectionMatrix");
+constexpr unsigned int UniformPositionScale = hashName("positionScale");
+constexpr unsigned int UniformPositionOffset = hashName("positionOffset");
+constexpr unsigned int UniformGridUnit = hashName("gridUnit");
+constexpr unsigned int UniformEyePosition = hashName("eyePosition");
+constexpr unsigned int UniformMorphRange = hashName("morphRange");
+
+// Uniform blocks and their fixed binding points
+constexpr unsigned int UniformBlockFrameData = hashName("FrameData");
+const unsigned int FrameDataBinding = 0;
 
-	fileStream.close();
-	return content;
+// Shader storage binding of the per-draw data read through gl_DrawID
+const unsigned int DrawDataBinding = 0;
+
+/* Binding point of a uniform block shared across programs, or -1 */
+int uniformBlockBinding(unsigned int nameHash)
+{
+	if (nameHash == UniformBlockFrameData)
+		return FrameDataBinding;
+	return -1;
 }
 
-/* Compiles and Links Shaders into a Shader Program, returning the program id*/
-unsigned int createShaderProgram()
+/* Samplers and images, set as a single int naming a texture or image unit */
+bool isOpaqueUniformType(unsigned int type)
 {
-    // vertex shader
-    int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-	std::string vertexShaderString = readFile("../../res/shaders/vertex0.vert");
-	const char* vertexShaderSource = vertexShaderString.c_str();
-    glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-    glCompileShader(vertexShader);
-    
-    // check for shader compile errors
-    int success;
-    char infoLog[512];
-    glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
-    if (!success)
-    {
-        glGetShaderInfoLog(vertexShader, 512, NULL, infoLog);
-        std::cerr << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
-    }
-    
-    // grid fragment shader
-    int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-	std::string fragmentShaderString = readFile("../../res/shaders/fragment0.frag");
-	const char* fragmentShaderSource = fragmentShaderString.c_str();
-    glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-    glCompileShader(fragmentShader);
-    
-    // check for shader compile errors
-    glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
-    if (!success)
-    {
-        glGetShaderInfoLog(fragmentShader, 512, NULL, infoLog);
-        std::cerr << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
-    }
-    
-    // link shaders
-    int shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glLinkProgram(shaderProgram);
-    
-    // check for linking errors
-    glGetProgramiv(fragmentShader, GL_LINK_STATUS, &success);
-    if (!success) {
-        glGetProgramInfoLog(shaderProgram, 512, NULL, infoLog);
-        std::cerr << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
-    }
-    
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
-    
-    return shaderProgram;
+	return (type >= GL_SAMPLER_1D && type <= GL_SAMPLER_2D_RECT_SHADOW) || (type >= GL_SAMPLER_1D_ARRAY && type <= GL_SAMPLER_CUBE_SHADOW)
+		|| (type >= GL_INT_SAMPLER_1D && type <= GL_UNSIGNED_INT_SAMPLER_BUFFER)
+		|| (type >= GL_SAMPLER_CUBE_MAP_ARRAY && type <= GL_UNSIGNED_INT_SAMPLER_CUBE_MAP_ARRAY)
+		|| (type >= GL_SAMPLER_2D_MULTISAMPLE && type <= GL_UNSIGNED_INT_SAMPLER_2D_MULTISAMPLE_ARRAY)
+		|| (type >= GL_IMAGE_1D && type <= GL_UNSIGNED_INT_IMAGE_2D_MULTISAMPLE_ARRAY);
 }
 
+/* Number of 32-bit components stored for one element of a uniform type, doubles taking two. 0 for
+   a type that cannot be set through glUniform */
+unsigned int uniformComponentCount(unsigned int type)
+{
+	switch (type)
+	{
+	case GL_FLOAT: case GL_INT: case GL_UNSIGNED_INT: case GL_BOOL: return 1;
+	case GL_FLOAT_VEC2: case GL_INT_VEC2: case GL_UNSIGNED_INT_VEC2: case GL_BOOL_VEC2: case GL_DOUBLE: return 2;
+	case GL_FLOAT_VEC3: case GL_INT_VEC3: case GL_UNSIGNED_INT_VEC3: case GL_BOOL_VEC3: return 3;
+	case GL_FLOAT_VEC4: case GL_INT_VEC4: case GL_UNSIGNED_INT_VEC4: case GL_BOOL_VEC4: case GL_FLOAT_MAT2: case GL_DOUBLE_VEC2: return 4;
+	case GL_FLOAT_MAT2x3: case GL_FLOAT_MAT3x2: case GL_DOUBLE_VEC3: return 6;
+	case GL_FLOAT_MAT2x4: case GL_FLOAT_MAT4x2: case GL_DOUBLE_VEC4: case GL_DOUBLE_MAT2: return 8;
+	case GL_FLOAT_MAT3: return 9;
+	case GL_FLOAT_MAT3x4: case GL_FLOAT_MAT4x3: case GL_DOUBLE_MAT2x3: case GL_DOUBLE_MAT3x2: return 12;
+	case GL_FLOAT_MAT4: case GL_DOUBLE_MAT2x4: case GL_DOUBLE_MAT4x2: return 16;
+	case GL_DOUBLE_MAT3: return 18;
+	case GL_DOUBLE_MAT3x4: case GL_DOUBLE_MAT4x3: return 24;
+	case GL_DOUBLE_MAT4: return 32;
+	default: return isOpaqueUniformType(type) ? 1 : 0;
+	}
+}
+
+/* The scalar a uniform type is made of, which picks the glGetUniform and glUniform variants */
+enum UniformScalar
+{
+	UniformScalarFloat,
+	UniformScalarInt,		// also bools, samplers and images
+	UniformScalarUnsigned,
+	UniformScalarDouble
+};
+
+UniformScalar uniformScalar(unsigned int type)
+{
+	switch (type)
+	{
+	case GL_FLOAT: case GL_FLOAT_VEC2: case GL_FLOAT_VEC3: case GL_FLOAT_VEC4: case GL_FLOAT_MAT2: case GL_FLOAT_MAT3: case GL_FLOAT_MAT4:
+	case GL_FLOAT_MAT2x3: case GL_FLOAT_MAT2x4: case GL_FLOAT_MAT3x2: case GL_FLOAT_MAT3x4: case GL_FLOAT_MAT4x2: case GL_FLOAT_MAT4x3:
+		return UniformScalarFloat;
+	case GL_UNSIGNED_INT: case GL_UNSIGNED_INT_VEC2: case GL_UNSIGNED_INT_VEC3: case GL_UNSIGNED_INT_VEC4:
+		return UniformScalarUnsigned;
+	case GL_DOUBLE: case GL_DOUBLE_VEC2: case GL_DOUBLE_VEC3: case GL_DOUBLE_VEC4: case GL_DOUBLE_MAT2: case GL_DOUBLE_MAT3: case GL_DOUBLE_MAT4:
+	case GL_DOUBLE_MAT2x3: case GL_DOUBLE_MAT2x4: case GL_DOUBLE_MAT3x2: case GL_DOUBLE_MAT3x4: case GL_DOUBLE_MAT4x2: case GL_DOUBLE_MAT4x3:
+		return UniformScalarDouble;
+	default:
+		return UniformScalarInt;
+	}
+}
 
+/* An active uniform found by reflection */
+struct UniformSlot
+{
+	unsigned int nameHash;
+	int location;
+	unsigned int type;
+	unsigned int size;			// array length
+	unsigned int valueOffset;	// first component in ShaderProgram::values
+};
+
+/* A linked shader program and the table of its active uniforms, reflected once after linking.
+   Setters look uniforms up by hashed name and skip the upload when the value is unchanged */
+struct ShaderProgram
+{
+	unsigned int id;
+	std::vector<UniformSlot> uniforms;	// sorted by name hash
+	std::vector<unsigned int> values;	// last uploaded value of every uniform, as raw 32-bit words
+
+	ShaderProgram() : id(0) {}
+	explicit ShaderProgram(unsigned int id) : id(id)
+	{
+		Reflect();
+	}
+
+	// Query every active uniform once, with its location, type and current value. Uniforms of a type
+	// that cannot be set, or whose name hashes the same as another's, are reported and left out
+	void Reflect()
+	{
+		uniforms.clear();
+		values.clear();
+		std::vector<std::string> names;
+
+		int count = 0;
+		glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &count);
+		for (int i = 0; i < count; i++)
+		{
+			char name[256];
+			GLsizei length = 0;
+			GLint size = 0;
+			GLenum type = 0;
+			glGetActiveUniform(id, i, sizeof(name), &length, &size, &type, name);
+
+			// Arrays are reported as "name[0]"
+			std::string uniformName(name, length);
+			size_t bracket = uniformName.find('[');
+			if (bracket != std::string::npos)
+				uniformName.resize(bracket);
+
+			int location = glGetUniformLocation(id, name);
+			if (location < 0)
+				continue; // uniform block members are not set through locations
+			if (uniformComponentCount(type) == 0) {
+				std::cerr << "Uniform " << uniformName << " of program " << id << " has unsupported type 0x" << std::hex << type << std::dec
+					<< ", it will not be set." << std::endl;
+				continue;
+			}
+			unsigned int nameHash = hashName(uniformName.c_str());
+			size_t clash = 0;
+			while (clash < uniforms.size() && uniforms[clash].nameHash != nameHash)
+				clash++;
+			if (clash < uniforms.size()) {
+				std::cerr << "Uniforms " << names[clash] << " and " << uniformName << " of program " << id << " have the same name hash, "
+					<< uniformName << " will not be set." << std::endl;
+				continue;
+			}
+			names.push_back(uniformName);
+
+			// The current value of the first element, read through a buffer large enough for a dmat4
+			const UniformSlot& slot = AddUniform(nameHash, location, type, size);
+			double current[16];
+			switch (uniformScalar(type))
+			{
+			case UniformScalarFloat: glGetUniformfv(id, location, (float*)current); break;
+			case UniformScalarUnsigned: glGetUniformuiv(id, location, (unsigned int*)current); break;
+			case UniformScalarDouble: glGetUniformdv(id, location, current); break;
+			default: glGetUniformiv(id, location, (int*)current); break;
+			}
+			memcpy(&values[slot.valueOffset], current, uniformComponentCount(type) * sizeof(unsigned int));
+		}
+		SortUniforms();
+
+		// Attach the shared uniform blocks to their binding points
+		int blockCount = 0;
+		glGetProgramiv(id, GL_ACTIVE_UNIFORM_BLOCKS, &blockCount);
+		for (int i = 0; i < blockCount; i++)
+		{
+			char name[256];
+			GLsizei length = 0;
+			glGetActiveUniformBlockName(id, i, sizeof(name), &length, name);
+			int binding = uniformBlockBinding(hashName(name));
+			if (binding >= 0)
+				glUniformBlockBinding(id, i, binding);
+		}
+	}
+
+	// Append a uniform to the table, with a zeroed shadow value. SortUniforms() must follow
+	const UniformSlot& AddUniform(unsigned int nameHash, int location, unsigned int type, unsigned int size)
+	{
+		UniformSlot slot;
+		slot.nameHash = nameHash;
+		slot.location = location;
+		slot.type = type;
+		slot.size = size;
+		slot.valueOffset = (unsigned int)values.size();
+		values.resize(values.size() + uniformComponentCount(type) * size);
+		uniforms.push_back(slot);
+		return uniforms.back();
+	}
+
+	void SortUniforms()
+	{
+		std::sort(uniforms.begin(), uniforms.end(),
+			[](const UniformSlot& a, const UniformSlot& b) { return a.nameHash < b.nameHash; });
+	}
+
+	void Use()
+	{
+		glState.UseProgram(id);
+	}
+
+	// Returns the slot of a uniform, or nullptr if the program does not use it
+	UniformSlot* Find(unsigned int nameHash)
+	{
+		std::vector<UniformSlot>::iterator it = std::lower_bound(uniforms.begin(), uniforms.end(), nameHash,
+			[](const UniformSlot& slot, unsigned int hash) { return slot.nameHash < hash; });
+		return it != uniforms.end() && it->nameHash == nameHash ? &*it : nullptr;
+	}
+
+	// Upload a value unless the shadow copy already holds it. A value larger than the uniform is ignored
+	void Set(unsigned int nameHash, const void* value, size_t bytes)
+	{
+		UniformSlot* slot = Find(nameHash);
+		if (!slot || bytes > uniformComponentCount(slot->type) * slot->size * sizeof(unsigned int))
+			return;
+
+		void* shadow = &values[slot->valueOffset];
+		if (memcmp(shadow, value, bytes) == 0)
+		{
+			glState.ElideUniform();
+			return;
+		}
+		memcpy(shadow, value, bytes);
+		Use();
+		glState.Uniform(slot->location, slot->type, 1, value);
+	}
+
+	void SetInt(unsigned int nameHash, int value)
+	{
+		Set(nameHash, &value, sizeof(value));
+	}
+
+	void SetFloat(unsigned int nameHash, float value)
+	{
+		Set(nameHash, &value, sizeof(value));
+	}
+
+	void SetVec2(unsigned int nameHash, const glm::vec2& value)
+	{
+		Set(nameHash, &value[0], sizeof(value));
+	}
+
+	void SetVec3(unsigned int nameHash, const glm::vec3& value)
+	{
+		Set(nameHash, &value[0], sizeof(value));
+	}
+
+	void SetVec4(unsigned int nameHash, const glm::vec4& value)
+	{
+		Set(nameHash, &value[0], sizeof(value));
+	}
+
+	void SetMat4(unsigned int nameHash, const glm::mat4& value)
+	{
+		Set(nameHash, &value[0][0], sizeof(value));
+	}
+};
+
+// Global Variables
+// ---------------------------------
+
+// Primitive Scale
+float GridUnit = 0.01f;
+
+// Mouse Controls
+double lastCursorPosX = -1.0f;
+double lastCursorPosY = -1.0f;
+bool isLeftButtonPressed = false;
+bool isRightButtonPressed = false;
+bool isMiddleButtonPressed = false;
+
+// Camera
+glm::vec3 cameraPosition;
+glm::vec3 cameraLookAt;
+glm::vec3 cameraUp;
+glm::vec3 cameraRight;
+
+// Model-View-Projection Matrices
+glm::mat4 worldMatrix;
+glm::mat4 viewMatrix;
+glm::mat4 projectionMatrix;
+
+// Global identifiers
+ShaderProgram shaderProgram;
+ShaderProgram instancedShaderProgram;
+ShaderProgram indirectShaderProgram;
+ShaderProgram gridShaderProgram;
+ShaderProgram terrainShaderProgram;
+
+// Instanced drawing needs GL 3.3 vertex attribute divisors
+bool instancingSupported = false;
+
+// The grid is drawn procedurally when GL 3.3 is there, from a line buffer of gridCells x gridCells otherwise
+bool proceduralGridEnabled = false;
+unsigned int gridCells = 100;
+unsigned int gridVao = 0;	// empty, a core context draws nothing without a vao bound
+
+// The streamed terrain replaces the grid with --terrain, needs GL 3.3
+bool terrainEnabled = false;
+
+// Multi-draw indirect needs GL 4.3 and gl_DrawID from ARB_shader_draw_parameters
+bool indirectSupported = false;
+
+
+// Streaming Ring Buffer
+// ---------------------------------
+
+/* Returned by StreamBuffer::Write when the data does not fit in a region */
+const size_t InvalidStreamOffset = (size_t)-1;
+
+/* Persistent mapping cycles through this many regions, so the CPU writes one while the GPU reads the others */
+const unsigned int StreamRegionCount = 3;
+
+/* Counters of a StreamBuffer since the last Reset */
+struct StreamBufferStats
+{
+	size_t bytesStreamed;
+	unsigned int writes;
+	unsigned int wrapArounds;		// times writing restarted at the start of the buffer
+	unsigned int overflows;			// writes larger than a region, left to the caller
+	unsigned int fenceWaits;		// regions the GPU was still reading when the CPU came back to them
+	double fenceWaitMilliseconds;
+
+	StreamBufferStats() { Reset(); }
+	void Reset()
+	{
+		bytesStreamed = 0;
+		writes = 0;
+		wrapArounds = 0;
+		overflows = 0;
+		fenceWaits = 0;
+		fenceWaitMilliseconds = 0.0;
+	}
+};
+
+/* This struct streams per-frame data through a ring of regions in one buffer. With GL 4.4 or
+   ARB_buffer_storage the buffer is persistently mapped and each region is guarded by a fence,
+   otherwise it falls back to a single region that is orphaned whenever it is started again */
+struct StreamBuffer
+{
+	unsigned int target;
+	unsigned int buffer;
+	size_t regionSize;
+	unsigned int regionCount;
+	bool persistent;
+	unsigned char* mapped;
+	GLsync fences[StreamRegionCount];
+
+	// Write position, the offset is relative to the start of the current region
+	unsigned int region;
+	size_t offset;
+
+	StreamBufferStats stats;
+
+	StreamBuffer() : target(0), buffer(0), regionSize(0), regionCount(0), persistent(false), mapped(nullptr), region(0), offset(0)
+	{
+		for (unsigned int i = 0; i < StreamRegionCount; i++)
+			fences[i] = 0;
+	}
+
+	void Create(unsigned int bufferTarget, size_t bytesPerRegion, bool allowPersistent = true)
+	{
+		target = bufferTarget;
+		regionSize = bytesPerRegion;
+		persistent = allowPersistent && (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage);
+		regionCount = persistent ? StreamRegionCount : 1;
+		region = 0;
+		offset = 0;
+
+		glGenBuffers(1, &buffer);
+		glState.BindBuffer(target, buffer);
+		if (persistent)
+		{
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(target, regionSize * regionCount, NULL, flags);
+			mapped = (unsigned char*)glMapBufferRange(target, 0, regionSize * regionCount, flags);
+			if (!mapped)
+			{
+				// Storage is immutable once allocated, so orphaning needs a new buffer
+				std::cerr << "Could not map a stream buffer persistently. Falling back to orphaning." << std::endl;
+				glDeleteBuffers(1, &buffer);
+				glState.ForgetBuffer(buffer);
+				glGenBuffers(1, &buffer);
+				glState.BindBuffer(target, buffer);
+				persistent = false;
+				regionCount = 1;
+			}
+		}
+		if (!persistent)
+			glState.BufferData(target, regionSize, NULL, GL_STREAM_DRAW);
+	}
+
+	void Destroy()
+	{
+		for (unsigned int i = 0; i < StreamRegionCount; i++)
+		{
+			if (fences[i])
+				glDeleteSync(fences[i]);
+			fences[i] = 0;
+		}
+		if (mapped)
+		{
+			glState.BindBuffer(target, buffer);
+			glUnmapBuffer(target);
+			mapped = nullptr;
+		}
+		glDeleteBuffers(1, &buffer);
+		glState.ForgetBuffer(buffer);
+		buffer = 0;
+	}
+
+	// Start writing the next region. Called once per frame, and mid-frame when a region fills up
+	void NextRegion()
+	{
+		if (persistent)
+		{
+			// The GPU reads the finished region with the commands issued so far
+			if (fences[region])
+				glDeleteSync(fences[region]);
+			fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+			region = (region + 1) % regionCount;
+			WaitForRegion(region);
+		}
+		else
+		{
+			glState.BindBuffer(target, buffer);
+			glState.BufferData(target, regionSize, NULL, GL_STREAM_DRAW);
+		}
+		if (region == 0)
+			stats.wrapArounds++;
+		offset = 0;
+	}
+
+	void BeginFrame()
+	{
+		if (offset > 0)
+			NextRegion();
+	}
+
+	// Copy the data into the current region and return its offset in the buffer, or InvalidStreamOffset
+	size_t Write(const void* data, size_t bytes, size_t alignment = 16)
+	{
+		if (bytes > regionSize)
+		{
+			stats.overflows++;
+			return InvalidStreamOffset;
+		}
+		size_t aligned = (offset + alignment - 1) / alignment * alignment;
+		if (aligned + bytes > regionSize)
+		{
+			NextRegion();
+			aligned = 0;
+		}
+
+		size_t bufferOffset = region * regionSize + aligned;
+		if (persistent)
+			memcpy(mapped + bufferOffset, data, bytes);
+		else
+		{
+			glState.BindBuffer(target, buffer);
+			glState.BufferSubData(target, bufferOffset, bytes, data);
+		}
+		offset = aligned + bytes;
+		stats.bytesStreamed += bytes;
+		stats.writes++;
+		return bufferOffset;
+	}
+
+	// Block until the GPU has finished reading the region from its previous lap
+	void WaitForRegion(unsigned int index)
+	{
+		if (!fences[index])
+			return;
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		GLenum status = glClientWaitSync(fences[index], 0, 0);
+		if (status == GL_TIMEOUT_EXPIRED)
+		{
+			stats.fenceWaits++;
+			while (status == GL_TIMEOUT_EXPIRED)
+				status = glClientWaitSync(fences[index], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		}
+		stats.fenceWaitMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		glDeleteSync(fences[index]);
+		fences[index] = 0;
+	}
+};
+
+// Instance data of every instanced draw goes through this buffer
+StreamBuffer instanceStream;
+
+// Changed multi-draw indirect commands and draw data are copied in from this buffer
+StreamBuffer indirectStaging;
+
+
+// Bounding Volumes
+// ---------------------------------
+
+/* An axis-aligned box, as center and half extent, and a sphere around the same center */
+struct BoundingVolume
+{
+	glm::vec3 center;
+	glm::vec3 extent;
+	float radius;
+	BoundingVolume() : center(0.0f), extent(0.0f), radius(0.0f) {}
+};
+
+/* Tightest box around the points, and the smallest sphere around the box center that holds them.
+   stride is the distance between points, for positions inside interleaved vertices */
+BoundingVolume computeBounds(const glm::vec3* points, size_t count, size_t stride = sizeof(glm::vec3))
+{
+	BoundingVolume bounds;
+	if (count == 0)
+		return bounds;
+	const unsigned char* bytes = (const unsigned char*)points;
+	glm::vec3 lower = points[0], upper = points[0];
+	for (size_t i = 1; i < count; i++)
+	{
+		const glm::vec3& point = *(const glm::vec3*)(bytes + i * stride);
+		lower = glm::min(lower, point);
+		upper = glm::max(upper, point);
+	}
+	bounds.center = (lower + upper) * 0.5f;
+	bounds.extent = (upper - lower) * 0.5f;
+	for (size_t i = 0; i < count; i++)
+		bounds.radius = std::max(bounds.radius, glm::length(*(const glm::vec3*)(bytes + i * stride) - bounds.center));
+	return bounds;
+}
+
+/* Bounds of the unit cube geometry, known without reading it back */
+BoundingVolume unitCubeBounds()
+{
+	BoundingVolume bounds;
+	bounds.center = glm::vec3(0.0f, GridUnit / 2, 0.0f);
+	bounds.extent = glm::vec3(GridUnit / 2);
+	bounds.radius = glm::length(bounds.extent);
+	return bounds;
+}
+
+/* Bounds of local after the affine transform m. The box stays axis-aligned, so it grows under rotation */
+BoundingVolume transformBounds(const glm::mat4& m, const BoundingVolume& local)
+{
+	BoundingVolume bounds;
+	bounds.center = glm::vec3(m * glm::vec4(local.center, 1.0f));
+	bounds.extent = glm::abs(glm::vec3(m[0])) * local.extent.x + glm::abs(glm::vec3(m[1])) * local.extent.y
+		+ glm::abs(glm::vec3(m[2])) * local.extent.z;
+	float maxScale = std::max(glm::length(glm::vec3(m[0])), std::max(glm::length(glm::vec3(m[1])), glm::length(glm::vec3(m[2]))));
+	bounds.radius = local.radius * maxScale;
+	return bounds;
+}
+
+/* World-space boxes stored as one array per component, the layout the culling kernel reads 4 at a time */
+struct BoundingBoxArrays
+{
+	std::vector<float> centerX, centerY, centerZ;
+	std::vector<float> extentX, extentY, extentZ;
+
+	size_t Size() const
+	{
+		return centerX.size();
+	}
+
+	void Reserve(size_t count)
+	{
+		centerX.reserve(count);
+		centerY.reserve(count);
+		centerZ.reserve(count);
+		extentX.reserve(count);
+		extentY.reserve(count);
+		extentZ.reserve(count);
+	}
+
+	void PushBack(const BoundingVolume& bounds)
+	{
+		centerX.push_back(bounds.center.x);
+		centerY.push_back(bounds.center.y);
+		centerZ.push_back(bounds.center.z);
+		extentX.push_back(bounds.extent.x);
+		extentY.push_back(bounds.extent.y);
+		extentZ.push_back(bounds.extent.z);
+	}
+
+	void Set(size_t i, const BoundingVolume& bounds)
+	{
+		centerX[i] = bounds.center.x;
+		centerY[i] = bounds.center.y;
+		centerZ[i] = bounds.center.z;
+		extentX[i] = bounds.extent.x;
+		extentY[i] = bounds.extent.y;
+		extentZ[i] = bounds.extent.z;
+	}
+};
+
+/* The six planes of a view frustum, pointing inwards as (normal, distance) */
+struct Frustum
+{
+	glm::vec4 planes[6];
+};
+
+/* Extracts the left, right, bottom, top, near and far planes from the rows of a view-projection matrix */
+Frustum extractFrustum(const glm::mat4& viewProjection)
+{
+	glm::vec4 rows[4];
+	for (int r = 0; r < 4; r++)
+		rows[r] = glm::vec4(viewProjection[0][r], viewProjection[1][r], viewProjection[2][r], viewProjection[3][r]);
+
+	Frustum frustum;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		frustum.planes[axis * 2] = rows[3] + rows[axis];
+		frustum.planes[axis * 2 + 1] = rows[3] - rows[axis];
+	}
+	for (int p = 0; p < 6; p++)
+		frustum.planes[p] /= glm::length(glm::vec3(frustum.planes[p]));
+	return frustum;
+}
+
+/* True when the box is not entirely behind one of the planes. Conservative near the frustum corners */
+bool frustumIntersectsBox(const Frustum& frustum, const glm::vec3& center, const glm::vec3& extent)
+{
+	for (int p = 0; p < 6; p++)
+	{
+		glm::vec3 normal(frustum.planes[p]);
+		if (glm::dot(normal, center) + frustum.planes[p].w + glm::dot(glm::abs(normal), extent) < 0.0f)
+			return false;
+	}
+	return true;
+}
+
+/* Like frustumIntersectsBox, for the planes set in planeMask only. Clears the bits of the planes the
+   box is entirely in front of, so boxes inside it need not test them again */
+bool frustumClassifyBox(const Frustum& frustum, const glm::vec3& center, const glm::vec3& extent, unsigned int& planeMask)
+{
+	for (int p = 0; p < 6; p++)
+	{
+		if (!(planeMask & (1u << p)))
+			continue;
+		glm::vec3 normal(frustum.planes[p]);
+		float distance = glm::dot(normal, center) + frustum.planes[p].w, reach = glm::dot(glm::abs(normal), extent);
+		if (distance + reach < 0.0f)
+			return false;
+		if (distance - reach >= 0.0f)
+			planeMask &= ~(1u << p);
+	}
+	return true;
+}
+
+bool frustumIntersectsSphere(const Frustum& frustum, const glm::vec3& center, float radius)
+{
+	for (int p = 0; p < 6; p++)
+	{
+		if (glm::dot(glm::vec3(frustum.planes[p]), center) + frustum.planes[p].w < -radius)
+			return false;
+	}
+	return true;
+}
+
+/* Visible and culled counts of a frame. Objects outside the frustum count as culled, objects hidden
+   behind occluders as occluded */
+struct CullStats
+{
+	unsigned int visible;
+	unsigned int culled;
+	unsigned int occluded;
+	CullStats() : visible(0), culled(0), occluded(0) {}
+};
+
+/* Tests boxes[first, first + count) against the frustum and writes 1 to visible[i] for the boxes
+   that intersect it. The SSE path tests 4 boxes per instruction. Returns the number of visible boxes */
+size_t cullBoxes(const Frustum& frustum, const BoundingBoxArrays& boxes, size_t first, size_t count, unsigned char* visible)
+{
+	size_t visibleCount = 0;
+	size_t i = first;
+	size_t end = first + count;
+#if USE_SSE
+	__m128 signMask = _mm_set1_ps(-0.0f);
+	__m128 planeX[6], planeY[6], planeZ[6], planeW[6], absX[6], absY[6], absZ[6];
+	for (int p = 0; p < 6; p++)
+	{
+		planeX[p] = _mm_set1_ps(frustum.planes[p].x);
+		planeY[p] = _mm_set1_ps(frustum.planes[p].y);
+		planeZ[p] = _mm_set1_ps(frustum.planes[p].z);
+		planeW[p] = _mm_set1_ps(frustum.planes[p].w);
+		absX[p] = _mm_andnot_ps(signMask, planeX[p]);
+		absY[p] = _mm_andnot_ps(signMask, planeY[p]);
+		absZ[p] = _mm_andnot_ps(signMask, planeZ[p]);
+	}
+	for (; i + 4 <= end; i += 4)
+	{
+		__m128 cx = _mm_loadu_ps(&boxes.centerX[i]);
+		__m128 cy = _mm_loadu_ps(&boxes.centerY[i]);
+		__m128 cz = _mm_loadu_ps(&boxes.centerZ[i]);
+		__m128 ex = _mm_loadu_ps(&boxes.extentX[i]);
+		__m128 ey = _mm_loadu_ps(&boxes.extentY[i]);
+		__m128 ez = _mm_loadu_ps(&boxes.extentZ[i]);
+
+		// A box is outside a plane when its distance plus its projected extent is negative
+		__m128 outside = _mm_setzero_ps();
+		for (int p = 0; p < 6; p++)
+		{
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planeX[p], cx), _mm_mul_ps(planeY[p], cy)),
+				_mm_add_ps(_mm_mul_ps(planeZ[p], cz), planeW[p]));
+			__m128 reach = _mm_add_ps(_mm_add_ps(_mm_mul_ps(absX[p], ex), _mm_mul_ps(absY[p], ey)), _mm_mul_ps(absZ[p], ez));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, reach), _mm_setzero_ps()));
+		}
+		int outsideBits = _mm_movemask_ps(outside);
+		for (int k = 0; k < 4; k++)
+		{
+			visible[i + k] = !((outsideBits >> k) & 1);
+			visibleCount += visible[i + k];
+		}
+	}
+#endif
+	for (; i < end; i++)
+	{
+		glm::vec3 center(boxes.centerX[i], boxes.centerY[i], boxes.centerZ[i]);
+		glm::vec3 extent(boxes.extentX[i], boxes.extentY[i], boxes.extentZ[i]);
+		visible[i] = frustumIntersectsBox(frustum, center, extent);
+		visibleCount += visible[i];
+	}
+	return visibleCount;
+}
+
+// Bounding Volume Hierarchy
+// ---------------------------------
+
+/* A node of the hierarchy. Interior nodes have count 0 and their children at first and first + 1,
+   leaves reference count primitives starting at first in Bvh::primitives */
+struct BvhNode
+{
+	glm::vec3 lower;
+	unsigned int first;
+	glm::vec3 upper;
+	unsigned int count;
+};
+
+const unsigned int BvhLeafSize = 4;
+const int BvhBinCount = 16;
+
+// Deeper nodes stay leaves, which bounds the traversal stacks
+const unsigned int BvhMaxDepth = 60;
+
+// Returned by Bvh::Raycast when nothing is hit
+const unsigned int BvhNoHit = 0xFFFFFFFFu;
+
+/* Ray against box slab test, returns the entry distance or a negative value on a miss */
+float intersectRayBox(const glm::vec3& origin, const glm::vec3& inverseDirection, float maxDistance,
+	const glm::vec3& lower, const glm::vec3& upper)
+{
+	glm::vec3 t0 = (lower - origin) * inverseDirection;
+	glm::vec3 t1 = (upper - origin) * inverseDirection;
+	glm::vec3 tMin = glm::min(t0, t1), tMax = glm::max(t0, t1);
+	float entry = std::max(std::max(tMin.x, tMin.y), std::max(tMin.z, 0.0f));
+	float exit = std::min(std::min(tMax.x, tMax.y), std::min(tMax.z, maxDistance));
+	return entry <= exit ? entry : -1.0f;
+}
+
+/* Bounding volume hierarchy over a BoundingBoxArrays. Built top-down with binned SAH, with the
+   subtrees below the first levels built on worker threads, and refitted bottom-up when the boxes
+   move without the tree being rebuilt. Children are always stored after their parent */
+struct Bvh
+{
+	std::vector<BvhNode> nodes;
+	std::vector<unsigned int> primitives;	// box indices, grouped by leaf
+	const BoundingBoxArrays* boxes;
+
+	// Build scratch: the boxes copied next to their index, partitioned in place so every pass over
+	// a node's primitives reads memory in order. Nodes are claimed in pairs from nodeCount
+	struct BuildPrimitive
+	{
+		glm::vec3 lower;
+		unsigned int index;
+		glm::vec3 upper;
+		float pad;
+	};
+	std::vector<BuildPrimitive> buildPrimitives;
+	std::atomic<unsigned int> nodeCount;
+
+	Bvh() : boxes(nullptr), nodeCount(0) {}
+
+	unsigned int Size() const
+	{
+		return nodeCount;
+	}
+
+	glm::vec3 BoxLower(unsigned int i) const
+	{
+		return glm::vec3(boxes->centerX[i] - boxes->extentX[i], boxes->centerY[i] - boxes->extentY[i], boxes->centerZ[i] - boxes->extentZ[i]);
+	}
+
+	glm::vec3 BoxUpper(unsigned int i) const
+	{
+		return glm::vec3(boxes->centerX[i] + boxes->extentX[i], boxes->centerY[i] + boxes->extentY[i], boxes->centerZ[i] + boxes->extentZ[i]);
+	}
+
+	static float HalfArea(const glm::vec3& lower, const glm::vec3& upper)
+	{
+		glm::vec3 d = glm::max(upper - lower, glm::vec3(0.0f));
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+
+	// Full rebuild over every box. The boxes must outlive the hierarchy. Without boxes the tree is
+	// empty, with no nodes at all, rather than a root that would read as an interior node
+	void Build(const BoundingBoxArrays& source, unsigned int threadCount = 1)
+	{
+		boxes = &source;
+		unsigned int count = (unsigned int)source.Size();
+		if (count == 0)
+		{
+			nodes.clear();
+			primitives.clear();
+			nodeCount = 0;
+			return;
+		}
+		buildPrimitives.resize(count);
+		glm::vec3 lower(FLT_MAX), upper(-FLT_MAX);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			BuildPrimitive& primitive = buildPrimitives[i];
+			primitive.lower = BoxLower(i);
+			primitive.upper = BoxUpper(i);
+			primitive.index = i;
+			lower = glm::min(lower, primitive.lower);
+			upper = glm::max(upper, primitive.upper);
+		}
+		nodes.resize(2 * count);
+		nodeCount = 1;
+		nodes[0].first = 0;
+		nodes[0].count = count;
+		nodes[0].lower = lower;
+		nodes[0].upper = upper;
+
+		// Each level of spawning doubles the number of threads building in parallel
+		unsigned int spawnDepth = 0;
+		while ((1u << spawnDepth) < threadCount)
+			spawnDepth++;
+		Subdivide(0, 0, spawnDepth);
+
+		nodes.resize(nodeCount);
+		primitives.resize(count);
+		for (unsigned int i = 0; i < count; i++)
+			primitives[i] = buildPrimitives[i].index;
+		std::vector<BuildPrimitive>().swap(buildPrimitives);
+	}
+
+	void UpdateNodeBounds(unsigned int index)
+	{
+		BvhNode& node = nodes[index];
+		glm::vec3 lower(FLT_MAX), upper(-FLT_MAX);
+		for (unsigned int i = node.first; i < node.first + node.count; i++)
+		{
+			lower = glm::min(lower, BoxLower(primitives[i]));
+			upper = glm::max(upper, BoxUpper(primitives[i]));
+		}
+		node.lower = lower;
+		node.upper = upper;
+	}
+
+	// Split a leaf along the cheapest of the binned SAH planes, recursing into both halves
+	void Subdivide(unsigned int index, unsigned int depth, unsigned int spawnDepth)
+	{
+		BvhNode& node = nodes[index];
+		if (node.count <= BvhLeafSize || depth >= BvhMaxDepth)
+			return;
+		BuildPrimitive* begin = &buildPrimitives[node.first];
+		BuildPrimitive* end = begin + node.count;
+
+		// Bin the centroids (doubled, to skip the halving) along each axis of their bounds
+		glm::vec3 centroidLower(FLT_MAX), centroidUpper(-FLT_MAX);
+		for (BuildPrimitive* p = begin; p != end; p++)
+		{
+			glm::vec3 centroid = p->lower + p->upper;
+			centroidLower = glm::min(centroidLower, centroid);
+			centroidUpper = glm::max(centroidUpper, centroid);
+		}
+
+		int bestAxis = -1;
+		int bestSplit = 0;
+		float bestCost = HalfArea(node.lower, node.upper) * node.count;
+		glm::vec3 bestLeftLower, bestLeftUpper, bestRightLower, bestRightUpper;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float axisLower = centroidLower[axis], axisExtent = centroidUpper[axis] - centroidLower[axis];
+			if (axisExtent <= 0.0f)
+				continue;
+
+			unsigned int binCount[BvhBinCount] = { 0 };
+			glm::vec3 binLower[BvhBinCount], binUpper[BvhBinCount];
+			for (int b = 0; b < BvhBinCount; b++)
+			{
+				binLower[b] = glm::vec3(FLT_MAX);
+				binUpper[b] = glm::vec3(-FLT_MAX);
+			}
+			float scale = BvhBinCount / axisExtent;
+			for (BuildPrimitive* p = begin; p != end; p++)
+			{
+				int b = std::min(BvhBinCount - 1, (int)((p->lower[axis] + p->upper[axis] - axisLower) * scale));
+				binCount[b]++;
+				binLower[b] = glm::min(binLower[b], p->lower);
+				binUpper[b] = glm::max(binUpper[b], p->upper);
+			}
+
+			// Sweep from both sides to get the bounds and cost of every plane between bins
+			glm::vec3 leftLower[BvhBinCount - 1], leftUpper[BvhBinCount - 1], rightLower[BvhBinCount - 1], rightUpper[BvhBinCount - 1];
+			unsigned int leftCount[BvhBinCount - 1], rightCount[BvhBinCount - 1];
+			glm::vec3 sweepLeftLower(FLT_MAX), sweepLeftUpper(-FLT_MAX), sweepRightLower(FLT_MAX), sweepRightUpper(-FLT_MAX);
+			unsigned int leftSum = 0, rightSum = 0;
+			for (int b = 0; b < BvhBinCount - 1; b++)
+			{
+				leftSum += binCount[b];
+				sweepLeftLower = glm::min(sweepLeftLower, binLower[b]);
+				sweepLeftUpper = glm::max(sweepLeftUpper, binUpper[b]);
+				leftCount[b] = leftSum;
+				leftLower[b] = sweepLeftLower;
+				leftUpper[b] = sweepLeftUpper;
+
+				int r = BvhBinCount - 1 - b;
+				rightSum += binCount[r];
+				sweepRightLower = glm::min(sweepRightLower, binLower[r]);
+				sweepRightUpper = glm::max(sweepRightUpper, binUpper[r]);
+				rightCount[r - 1] = rightSum;
+				rightLower[r - 1] = sweepRightLower;
+				rightUpper[r - 1] = sweepRightUpper;
+			}
+			for (int b = 0; b < BvhBinCount - 1; b++)
+			{
+				if (leftCount[b] == 0 || rightCount[b] == 0)
+					continue;
+				float cost = HalfArea(leftLower[b], leftUpper[b]) * leftCount[b] + HalfArea(rightLower[b], rightUpper[b]) * rightCount[b];
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = b;
+					bestLeftLower = leftLower[b];
+					bestLeftUpper = leftUpper[b];
+					bestRightLower = rightLower[b];
+					bestRightUpper = rightUpper[b];
+				}
+			}
+		}
+
+		// Keep it a leaf when no split beats it, unless it is too large to test linearly
+		BuildPrimitive* split;
+		if (bestAxis >= 0)
+		{
+			float axisLower = centroidLower[bestAxis];
+			float scale = BvhBinCount / (centroidUpper[bestAxis] - axisLower);
+			split = std::partition(begin, end, [&](const BuildPrimitive& p)
+			{
+				return std::min(BvhBinCount - 1, (int)((p.lower[bestAxis] + p.upper[bestAxis] - axisLower) * scale)) <= bestSplit;
+			});
+		}
+		else if (node.count > BvhLeafSize * 4)
+			split = begin + node.count / 2;
+		else
+			return;
+
+		unsigned int mid = node.first + (unsigned int)(split - begin);
+		unsigned int left = nodeCount.fetch_add(2);
+		nodes[left].first = node.first;
+		nodes[left].count = mid - node.first;
+		nodes[left + 1].first = mid;
+		nodes[left + 1].count = node.first + node.count - mid;
+		if (bestAxis >= 0)
+		{
+			nodes[left].lower = bestLeftLower;
+			nodes[left].upper = bestLeftUpper;
+			nodes[left + 1].lower = bestRightLower;
+			nodes[left + 1].upper = bestRightUpper;
+		}
+		else
+		{
+			// Every centroid is the same, the halves share the node's bounds
+			nodes[left].lower = nodes[left + 1].lower = node.lower;
+			nodes[left].upper = nodes[left + 1].upper = node.upper;
+		}
+		node.first = left;
+		node.count = 0;
+
+		if (spawnDepth > 0)
+		{
+			std::thread worker(&Bvh::Subdivide, this, left, depth + 1, spawnDepth - 1);
+			Subdivide(left + 1, depth + 1, spawnDepth - 1);
+			worker.join();
+		}
+		else
+		{
+			Subdivide(left, depth + 1, 0);
+			Subdivide(left + 1, depth + 1, 0);
+		}
+	}
+
+	// Recompute every node's bounds from the current boxes, keeping the tree. Quality degrades as
+	// boxes move away from where they were at build time, rebuild when it matters
+	void Refit()
+	{
+		if (nodeCount == 0)
+			return;
+		for (unsigned int n = nodeCount; n-- > 0;)
+		{
+			BvhNode& node = nodes[n];
+			if (node.count > 0)
+			{
+				UpdateNodeBounds(n);
+				continue;
+			}
+			const BvhNode& left = nodes[node.first];
+			const BvhNode& right = nodes[node.first + 1];
+			node.lower = glm::min(left.lower, right.lower);
+			node.upper = glm::max(left.upper, right.upper);
+		}
+	}
+
+	// Append the boxes intersecting the frustum. Each node only tests the planes its parent straddles,
+	// and the subtrees entirely inside the frustum are appended without testing their boxes
+	void QueryFrustum(const Frustum& frustum, std::vector<unsigned int>& results) const
+	{
+		if (nodeCount == 0)
+			return;
+		unsigned int stack[64], planeMasks[64];
+		int top = 0;
+		stack[top] = 0;
+		planeMasks[top++] = 0x3F;
+		while (top > 0)
+		{
+			top--;
+			const BvhNode& node = nodes[stack[top]];
+			unsigned int planeMask = planeMasks[top];
+			if (!frustumClassifyBox(frustum, (node.lower + node.upper) * 0.5f, (node.upper - node.lower) * 0.5f, planeMask))
+				continue;
+			if (planeMask == 0)
+			{
+				AppendSubtree(stack[top], results);
+				continue;
+			}
+			if (node.count == 0)
+			{
+				stack[top] = node.first;
+				planeMasks[top++] = planeMask;
+				stack[top] = node.first + 1;
+				planeMasks[top++] = planeMask;
+				continue;
+			}
+			for (unsigned int i = node.first; i < node.first + node.count; i++)
+			{
+				unsigned int p = primitives[i];
+				glm::vec3 center(boxes->centerX[p], boxes->centerY[p], boxes->centerZ[p]);
+				glm::vec3 extent(boxes->extentX[p], boxes->extentY[p], boxes->extentZ[p]);
+				unsigned int boxMask = planeMask;
+				if (frustumClassifyBox(frustum, center, extent, boxMask))
+					results.push_back(p);
+			}
+		}
+	}
+
+	// Append every box below a node
+	void AppendSubtree(unsigned int index, std::vector<unsigned int>& results) const
+	{
+		unsigned int stack[64];
+		int top = 0;
+		stack[top++] = index;
+		while (top > 0)
+		{
+			const BvhNode& node = nodes[stack[--top]];
+			if (node.count == 0)
+			{
+				stack[top++] = node.first;
+				stack[top++] = node.first + 1;
+				continue;
+			}
+			results.insert(results.end(), primitives.begin() + node.first, primitives.begin() + node.first + node.count);
+		}
+	}
+
+	// Closest box hit by the ray within maxDistance, skipping boxes p with !(mask[p] & maskBits) when a
+	// mask is given. Returns BvhNoHit on a miss
+	unsigned int Raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, float* hitDistance = nullptr,
+		const unsigned char* mask = nullptr, unsigned char maskBits = 0xFF) const
+	{
+		unsigned int hit = BvhNoHit;
+		if (nodeCount == 0)
+			return hit;
+		glm::vec3 inverseDirection = 1.0f / direction;
+		float closest = maxDistance;
+		unsigned int stack[64];
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			const BvhNode& node = nodes[stack[--top]];
+			if (intersectRayBox(origin, inverseDirection, closest, node.lower, node.upper) < 0.0f)
+				continue;
+			if (node.count == 0)
+			{
+				// Visit the nearer child first, so the farther one is more likely to be skipped
+				const BvhNode& left = nodes[node.first];
+				const BvhNode& right = nodes[node.first + 1];
+				float leftDistance = intersectRayBox(origin, inverseDirection, closest, left.lower, left.upper);
+				float rightDistance = intersectRayBox(origin, inverseDirection, closest, right.lower, right.upper);
+				bool leftFirst = rightDistance < 0.0f || (leftDistance >= 0.0f && leftDistance <= rightDistance);
+				stack[top++] = leftFirst ? node.first + 1 : node.first;
+				stack[top++] = leftFirst ? node.first : node.first + 1;
+				continue;
+			}
+			for (unsigned int i = node.first; i < node.first + node.count; i++)
+			{
+				unsigned int p = primitives[i];
+				if (mask && !(mask[p] & maskBits))
+					continue;
+				float distance = intersectRayBox(origin, inverseDirection, closest, BoxLower(p), BoxUpper(p));
+				if (distance >= 0.0f && (distance < closest || hit == BvhNoHit))
+				{
+					closest = distance;
+					hit = p;
+				}
+			}
+		}
+		if (hitDistance)
+			*hitDistance = closest;
+		return hit;
+	}
+
+	// Append the boxes overlapping the sphere
+	void QuerySphere(const glm::vec3& center, float radius, std::vector<unsigned int>& results) const
+	{
+		if (nodeCount == 0)
+			return;
+		float radiusSquared = radius * radius;
+		unsigned int stack[64];
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			const BvhNode& node = nodes[stack[--top]];
+			glm::vec3 closest = glm::clamp(center, node.lower, node.upper);
+			if (glm::dot(closest - center, closest - center) > radiusSquared)
+				continue;
+			if (node.count == 0)
+			{
+				stack[top++] = node.first;
+				stack[top++] = node.first + 1;
+				continue;
+			}
+			for (unsigned int i = node.first; i < node.first + node.count; i++)
+			{
+				unsigned int p = primitives[i];
+				glm::vec3 point = glm::clamp(center, BoxLower(p), BoxUpper(p));
+				if (glm::dot(point - center, point - center) <= radiusSquared)
+					results.push_back(p);
+			}
+		}
+	}
+};
+
+// Occlusion Culling
+// ---------------------------------
+
+/* Returns the milliseconds elapsed since start */
+double elapsedMilliseconds(std::chrono::high_resolution_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// Screen tiles rasterized independently, widths are multiples of the 4 pixels written at once
+const int OcclusionTileWidth = 64;
+const int OcclusionTileHeight = 32;
+
+/* An occluder triangle in buffer pixels, with depth in [0, 1] */
+struct OcclusionTriangle
+{
+	float x[3];
+	float y[3];
+	float z[3];
+};
+
+/* A level of the depth pyramid. Each texel holds the nearest and farthest occluder depth of the
+   pixels it covers, 1 where nothing was drawn */
+struct OcclusionLevel
+{
+	int width;
+	int height;
+	std::vector<float> minDepth;
+	std::vector<float> maxDepth;
+};
+
+/* Low resolution software depth buffer of a few occluders, and the min/max pyramid built from it.
+   Occluders are rasterized per screen tile on threadCount threads, 4 pixels per SSE instruction. The
+   threads beyond the caller's are started once and woken for each Rasterize.
+   Boxes are then tested hierarchically: a texel hides the box when the box's nearest depth is behind
+   the texel's farthest occluder, and proves it visible when it is in front of the nearest one */
+struct OcclusionBuffer
+{
+	int width;
+	int height;
+	int tilesX;
+	int tilesY;
+	unsigned int threadCount;
+	std::vector<float> depth;
+	std::vector<OcclusionLevel> levels;
+
+	// Occluders of the frame being built
+	glm::mat4 viewProjection;
+	std::vector<OcclusionTriangle> triangles;
+	std::vector<std::vector<unsigned int> > bins;	// triangle indices per tile
+
+	// Timings of the last Rasterize, in milliseconds
+	double rasterTime;
+	double pyramidTime;
+
+	// Raster threads, waiting for the next frame between calls
+	std::vector<std::thread> workers;
+	std::mutex workMutex;
+	std::condition_variable workReady;
+	std::condition_variable workDone;
+	std::atomic<int> nextTile;
+	unsigned int rasterFrame;	// under workMutex, as are the two below
+	unsigned int workersBusy;
+	bool stopping;
+
+	OcclusionBuffer(int bufferWidth = 256, int bufferHeight = 192)
+		: threadCount(std::max(1u, std::thread::hardware_concurrency())), viewProjection(1.0f), rasterTime(0.0), pyramidTime(0.0),
+		nextTile(0), rasterFrame(0), workersBusy(0), stopping(false)
+	{
+		Resize(bufferWidth, bufferHeight);
+	}
+	~OcclusionBuffer() { StopWorkers(); }
+	OcclusionBuffer(const OcclusionBuffer&) = delete;
+	OcclusionBuffer& operator=(const OcclusionBuffer&) = delete;
+
+	void Resize(int bufferWidth, int bufferHeight)
+	{
+		width = (bufferWidth + 3) & ~3;
+		height = bufferHeight;
+		tilesX = (width + OcclusionTileWidth - 1) / OcclusionTileWidth;
+		tilesY = (height + OcclusionTileHeight - 1) / OcclusionTileHeight;
+		depth.assign(width * height, 1.0f);
+		bins.resize(tilesX * tilesY);
+
+		levels.clear();
+		int levelWidth = width, levelHeight = height;
+		while (true)
+		{
+			OcclusionLevel level;
+			level.width = levelWidth;
+			level.height = levelHeight;
+			level.minDepth.assign(levelWidth * levelHeight, 1.0f);
+			level.maxDepth.assign(levelWidth * levelHeight, 1.0f);
+			levels.push_back(level);
+			if (levelWidth == 1 && levelHeight == 1)
+				break;
+			levelWidth = (levelWidth + 1) / 2;
+			levelHeight = (levelHeight + 1) / 2;
+		}
+	}
+
+	// Start a frame seen through viewProjection
+	void Begin(const glm::mat4& frameViewProjection)
+	{
+		viewProjection = frameViewProjection;
+		triangles.clear();
+	}
+
+	// Project a point to buffer pixels and depth. Returns false when it is behind the near plane
+	bool Project(const glm::vec3& point, glm::vec3& projected) const
+	{
+		glm::vec4 clip = viewProjection * glm::vec4(point, 1.0f);
+		if (clip.w <= 1e-5f || clip.z < -clip.w)
+			return false;
+		float inverseW = 1.0f / clip.w;
+		projected = glm::vec3((clip.x * inverseW * 0.5f + 0.5f) * width, (clip.y * inverseW * 0.5f + 0.5f) * height,
+			clip.z * inverseW * 0.5f + 0.5f);
+		return true;
+	}
+
+	// Queue the 12 triangles of a box, given in the local space of world. Faces crossing the near
+	// plane are dropped, which can only hide less
+	void AddOccluder(const glm::mat4& world, const BoundingVolume& local)
+	{
+		static const int faces[6][4] = { { 0, 1, 3, 2 }, { 4, 6, 7, 5 }, { 0, 4, 5, 1 }, { 2, 3, 7, 6 }, { 0, 2, 6, 4 }, { 1, 5, 7, 3 } };
+		glm::vec3 corners[8];
+		bool inFront[8];
+		for (int c = 0; c < 8; c++)
+		{
+			glm::vec3 corner = local.center + glm::vec3(c & 1 ? local.extent.x : -local.extent.x,
+				c & 2 ? local.extent.y : -local.extent.y, c & 4 ? local.extent.z : -local.extent.z);
+			inFront[c] = Project(glm::vec3(world * glm::vec4(corner, 1.0f)), corners[c]);
+		}
+		for (int f = 0; f < 6; f++)
+		{
+			const int* q = faces[f];
+			if (!inFront[q[0]] || !inFront[q[1]] || !inFront[q[2]] || !inFront[q[3]])
+				continue;
+			for (int t = 0; t < 2; t++)
+			{
+				int v[3] = { q[0], q[1 + t], q[2 + t] };
+				OcclusionTriangle triangle;
+				for (int k = 0; k < 3; k++)
+				{
+					triangle.x[k] = corners[v[k]].x;
+					triangle.y[k] = corners[v[k]].y;
+					triangle.z[k] = corners[v[k]].z;
+				}
+				triangles.push_back(triangle);
+			}
+		}
+	}
+
+	// Rasterize the queued occluders and build the pyramid
+	void Rasterize()
+	{
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+		// Bin each triangle into the tiles its bounds overlap
+		for (size_t b = 0; b < bins.size(); b++)
+			bins[b].clear();
+		for (unsigned int t = 0; t < triangles.size(); t++)
+		{
+			const OcclusionTriangle& tri = triangles[t];
+			float minX = std::min(tri.x[0], std::min(tri.x[1], tri.x[2])), maxX = std::max(tri.x[0], std::max(tri.x[1], tri.x[2]));
+			float minY = std::min(tri.y[0], std::min(tri.y[1], tri.y[2])), maxY = std::max(tri.y[0], std::max(tri.y[1], tri.y[2]));
+			if (maxX < 0.0f || maxY < 0.0f || minX >= width || minY >= height)
+				continue;
+			int tileX0 = std::max(0, (int)minX / OcclusionTileWidth), tileX1 = std::min(tilesX - 1, (int)maxX / OcclusionTileWidth);
+			int tileY0 = std::max(0, (int)minY / OcclusionTileHeight), tileY1 = std::min(tilesY - 1, (int)maxY / OcclusionTileHeight);
+			for (int ty = tileY0; ty <= tileY1; ty++)
+				for (int tx = tileX0; tx <= tileX1; tx++)
+					bins[ty * tilesX + tx].push_back(t);
+		}
+
+		// Tiles are claimed one at a time, so threads never write the same pixels
+		if (workers.size() != std::max(1u, threadCount) - 1)
+			StartWorkers(std::max(1u, threadCount) - 1);
+		nextTile = 0;
+		if (!workers.empty())
+		{
+			std::lock_guard<std::mutex> lock(workMutex);
+			rasterFrame++;
+			workersBusy = (unsigned int)workers.size();
+		}
+		workReady.notify_all();
+		RasterizeTiles();
+		if (!workers.empty())
+		{
+			std::unique_lock<std::mutex> lock(workMutex);
+			while (workersBusy > 0)
+				workDone.wait(lock);
+		}
+		rasterTime = elapsedMilliseconds(start);
+
+		start = std::chrono::high_resolution_clock::now();
+		BuildPyramid();
+		pyramidTime = elapsedMilliseconds(start);
+	}
+
+	void RasterizeTiles()
+	{
+		int tileCount = tilesX * tilesY;
+		for (int t; (t = nextTile++) < tileCount;)
+			RasterizeTile(t);
+	}
+
+	void StartWorkers(unsigned int workerCount)
+	{
+		StopWorkers();
+		stopping = false;
+		unsigned int frame = rasterFrame;
+		for (unsigned int w = 0; w < workerCount; w++)
+			workers.push_back(std::thread([this, frame]() { WorkerLoop(frame); }));
+	}
+
+	void StopWorkers()
+	{
+		{
+			std::lock_guard<std::mutex> lock(workMutex);
+			stopping = true;
+		}
+		workReady.notify_all();
+		for (size_t w = 0; w < workers.size(); w++)
+			workers[w].join();
+		workers.clear();
+	}
+
+	// Rasterize tiles each time rasterFrame moves on from frame
+	void WorkerLoop(unsigned int frame)
+	{
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(workMutex);
+				while (!stopping && rasterFrame == frame)
+					workReady.wait(lock);
+				if (stopping)
+					return;
+				frame = rasterFrame;
+			}
+			RasterizeTiles();
+			std::lock_guard<std::mutex> lock(workMutex);
+			if (--workersBusy == 0)
+				workDone.notify_one();
+		}
+	}
+
+	void RasterizeTile(int tile)
+	{
+		int tileX0 = (tile % tilesX) * OcclusionTileWidth, tileY0 = (tile / tilesX) * OcclusionTileHeight;
+		int tileX1 = std::min(width, tileX0 + OcclusionTileWidth) - 1, tileY1 = std::min(height, tileY0 + OcclusionTileHeight) - 1;
+		for (int y = tileY0; y <= tileY1; y++)
+			std::fill(depth.begin() + y * width + tileX0, depth.begin() + y * width + tileX1 + 1, 1.0f);
+
+		const std::vector<unsigned int>& bin = bins[tile];
+		for (size_t i = 0; i < bin.size(); i++)
+		{
+			OcclusionTriangle tri = triangles[bin[i]];
+			float area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) - (tri.x[2] - tri.x[0]) * (tri.y[1] - tri.y[0]);
+			if (area == 0.0f)
+				continue;
+			if (area < 0.0f)
+			{
+				std::swap(tri.x[1], tri.x[2]);
+				std::swap(tri.y[1], tri.y[2]);
+				std::swap(tri.z[1], tri.z[2]);
+				area = -area;
+			}
+
+			// Edge functions A x + B y + C, positive inside, and the depth plane built from them. Edge e
+			// is opposite vertex (e + 2) % 3
+			float a[3], b[3], c[3];
+			for (int e = 0; e < 3; e++)
+			{
+				int from = e, to = (e + 1) % 3;
+				a[e] = tri.y[from] - tri.y[to];
+				b[e] = tri.x[to] - tri.x[from];
+				c[e] = -(a[e] * tri.x[from] + b[e] * tri.y[from]);
+			}
+			float inverseArea = 1.0f / area;
+			float zA = (a[1] * tri.z[0] + a[2] * tri.z[1] + a[0] * tri.z[2]) * inverseArea;
+			float zB = (b[1] * tri.z[0] + b[2] * tri.z[1] + b[0] * tri.z[2]) * inverseArea;
+			float zC = (c[1] * tri.z[0] + c[2] * tri.z[1] + c[0] * tri.z[2]) * inverseArea;
+
+			// Stay conservative at this resolution: only cover pixels the triangle covers entirely, with
+			// the farthest depth the plane reaches inside them
+			for (int e = 0; e < 3; e++)
+				c[e] -= 0.5f * (std::abs(a[e]) + std::abs(b[e]));
+			zC += 0.5f * (std::abs(zA) + std::abs(zB));
+
+			int minX = std::max(tileX0, (int)std::floor(std::min(tri.x[0], std::min(tri.x[1], tri.x[2]))));
+			int maxX = std::min(tileX1, (int)std::ceil(std::max(tri.x[0], std::max(tri.x[1], tri.x[2]))));
+			int minY = std::max(tileY0, (int)std::floor(std::min(tri.y[0], std::min(tri.y[1], tri.y[2]))));
+			int maxY = std::min(tileY1, (int)std::ceil(std::max(tri.y[0], std::max(tri.y[1], tri.y[2]))));
+			minX &= ~3;
+			if (minX > maxX || minY > maxY)
+				continue;
+			RasterizeSpan(a, b, c, zA, zB, zC, minX, maxX, minY, maxY);
+		}
+	}
+
+	// Write the nearest depth of the triangle into the pixels of the rectangle it covers. minX is a multiple of 4
+	void RasterizeSpan(const float a[3], const float b[3], const float c[3], float zA, float zB, float zC,
+		int minX, int maxX, int minY, int maxY)
+	{
+#if USE_SSE
+		__m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+		__m128 zero = _mm_setzero_ps();
+		for (int y = minY; y <= maxY; y++)
+		{
+			float py = y + 0.5f;
+			float* row = &depth[y * width];
+			for (int x = minX; x <= maxX; x += 4)
+			{
+				__m128 px = _mm_add_ps(_mm_set1_ps((float)x), offsets);
+				__m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[0]), px), _mm_set1_ps(b[0] * py + c[0])), zero);
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[1]), px), _mm_set1_ps(b[1] * py + c[1])), zero));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[2]), px), _mm_set1_ps(b[2] * py + c[2])), zero));
+				if (_mm_movemask_ps(inside) == 0)
+					continue;
+				__m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(zA), px), _mm_set1_ps(zB * py + zC));
+				__m128 current = _mm_loadu_ps(row + x);
+				__m128 nearest = _mm_min_ps(current, z);
+				_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, current)));
+			}
+		}
+#else
+		for (int y = minY; y <= maxY; y++)
+		{
+			float py = y + 0.5f;
+			for (int x = minX; x <= maxX; x++)
+			{
+				float px = x + 0.5f;
+				if (a[0] * px + b[0] * py + c[0] < 0.0f || a[1] * px + b[1] * py + c[1] < 0.0f || a[2] * px + b[2] * py + c[2] < 0.0f)
+					continue;
+				float& d = depth[y * width + x];
+				d = std::min(d, zA * px + zB * py + zC);
+			}
+		}
+#endif
+	}
+
+	void BuildPyramid()
+	{
+		levels[0].minDepth = depth;
+		levels[0].maxDepth = depth;
+		for (size_t l = 1; l < levels.size(); l++)
+		{
+			const OcclusionLevel& fine = levels[l - 1];
+			OcclusionLevel& coarse = levels[l];
+			for (int y = 0; y < coarse.height; y++)
+			{
+				int y0 = y * 2, y1 = std::min(y * 2 + 1, fine.height - 1);
+				for (int x = 0; x < coarse.width; x++)
+				{
+					int x0 = x * 2, x1 = std::min(x * 2 + 1, fine.width - 1);
+					int i00 = y0 * fine.width + x0, i01 = y0 * fine.width + x1, i10 = y1 * fine.width + x0, i11 = y1 * fine.width + x1;
+					coarse.minDepth[y * coarse.width + x] = std::min(std::min(fine.minDepth[i00], fine.minDepth[i01]),
+						std::min(fine.minDepth[i10], fine.minDepth[i11]));
+					coarse.maxDepth[y * coarse.width + x] = std::max(std::max(fine.maxDepth[i00], fine.maxDepth[i01]),
+						std::max(fine.maxDepth[i10], fine.maxDepth[i11]));
+				}
+			}
+		}
+	}
+
+	// False when the box is certainly hidden by the rasterized occluders
+	bool IsVisible(const glm::vec3& center, const glm::vec3& extent) const
+	{
+		glm::vec3 lower(FLT_MAX), upper(-FLT_MAX);
+		for (int c = 0; c < 8; c++)
+		{
+			glm::vec3 corner = center + glm::vec3(c & 1 ? extent.x : -extent.x, c & 2 ? extent.y : -extent.y, c & 4 ? extent.z : -extent.z);
+			glm::vec3 projected;
+			if (!Project(corner, projected))
+				return true;
+			lower = glm::min(lower, projected);
+			upper = glm::max(upper, projected);
+		}
+		int x0 = std::max(0, (int)std::floor(lower.x)), x1 = std::min(width - 1, (int)std::floor(upper.x));
+		int y0 = std::max(0, (int)std::floor(lower.y)), y1 = std::min(height - 1, (int)std::floor(upper.y));
+		if (x0 > x1 || y0 > y1)
+			return true;
+
+		// Start at the coarsest level where the rectangle spans at most 2x2 texels
+		int level = 0;
+		while (level + 1 < (int)levels.size() && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+			level++;
+		return IsRegionVisible(level, x0, y0, x1, y1, lower.z);
+	}
+
+	// Test the texels of a level overlapping the pixel rectangle, refining where the box is between
+	// the nearest and farthest occluder
+	bool IsRegionVisible(int level, int x0, int y0, int x1, int y1, float nearestDepth) const
+	{
+		const OcclusionLevel& l = levels[level];
+		for (int ty = y0 >> level; ty <= (y1 >> level); ty++)
+		{
+			for (int tx = x0 >> level; tx <= (x1 >> level); tx++)
+			{
+				int i = ty * l.width + tx;
+				if (nearestDepth > l.maxDepth[i])
+					continue;
+				if (level == 0 || nearestDepth < l.minDepth[i])
+					return true;
+				int childSize = 1 << (level - 1);
+				int childX0 = std::max(x0, (tx * 2) * childSize), childX1 = std::min(x1, (tx * 2 + 2) * childSize - 1);
+				int childY0 = std::max(y0, (ty * 2) * childSize), childY1 = std::min(y1, (ty * 2 + 2) * childSize - 1);
+				if (IsRegionVisible(level - 1, childX0, childY0, childX1, childY1, nearestDepth))
+					return true;
+			}
+		}
+		return false;
+	}
+};
+
+// Culling results of the last drawScene, which skips the tests when culling is disabled. Occlusion
+// culling only runs together with frustum culling, and only on scenes of occlusionCullingMinNodes nodes
+// or more, below which rasterizing the occluders costs more than the draws it saves
+CullStats frameCullStats;
+bool frustumCullingEnabled = true;
+bool occlusionCullingEnabled = true;
+unsigned int occlusionCullingMinNodes = 256;
+OcclusionBuffer occlusionBuffer;
+
+
+// Index Buffers
+// ---------------------------------
+
+inline unsigned int indexTypeSize(unsigned int indexType)
+{
+	return indexType == GL_UNSIGNED_BYTE ? 1 : indexType == GL_UNSIGNED_SHORT ? 2 : 4;
+}
+
+/* The narrowest index type addressing every vertex of a mesh, as indices are relative to its base vertex */
+inline unsigned int indexTypeFor(unsigned int vertexCount)
+{
+	return vertexCount <= 0x100 ? GL_UNSIGNED_BYTE : vertexCount <= 0x10000 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
+
+/* Part of a triangle list small enough for 16-bit indices: the source vertices it uses, in order of
+   first use, and its triangles indexing them */
+struct IndexCluster
+{
+	std::vector<unsigned int> vertices;
+	std::vector<unsigned int> indices;
+};
+
+/* Splits a triangle list into clusters of at most maxVertices vertices, keeping the triangle order.
+   Vertices shared across a cluster boundary are duplicated into both */
+void buildIndexClusters(const unsigned int* indices, unsigned int indexCount, unsigned int maxVertices, std::vector<IndexCluster>& clusters)
+{
+	clusters.clear();
+	unsigned int vertexRange = 0;
+	for (unsigned int i = 0; i < indexCount; i++)
+		vertexRange = std::max(vertexRange, indices[i] + 1);
+
+	// Cluster number + 1 a vertex was last added to, and its index there
+	std::vector<unsigned int> stamp(vertexRange, 0), local(vertexRange);
+	for (unsigned int t = 0; t + 3 <= indexCount; t += 3)
+	{
+		// Distinct vertices of the triangle not yet in the current cluster
+		unsigned int a = indices[t], b = indices[t + 1], c = indices[t + 2];
+		unsigned int current = (unsigned int)clusters.size();
+		unsigned int added = (stamp[a] != current) + (stamp[b] != current && b != a) + (stamp[c] != current && c != a && c != b);
+		if (clusters.empty() || clusters.back().vertices.size() + added > maxVertices)
+			clusters.push_back(IndexCluster());
+
+		IndexCluster& cluster = clusters.back();
+		unsigned int clusterStamp = (unsigned int)clusters.size();
+		for (int k = 0; k < 3; k++)
+		{
+			unsigned int vertex = indices[t + k];
+			if (stamp[vertex] != clusterStamp)
+			{
+				stamp[vertex] = clusterStamp;
+				local[vertex] = (unsigned int)cluster.vertices.size();
+				cluster.vertices.push_back(vertex);
+			}
+			cluster.indices.push_back(local[vertex]);
+		}
+	}
+}
+
+/* Compresses indices for storage. Each index is coded against the high-water mark, one past the
+   highest index so far: vertices used for the first time in order code as 0 and recently used ones
+   as small numbers, written zigzagged as 7-bit varints. Meshes with their vertices in order of first
+   use mostly take one byte per index */
+void encodeIndices(const unsigned int* indices, unsigned int indexCount, std::vector<unsigned char>& out)
+{
+	unsigned int next = 0;
+	for (unsigned int i = 0; i < indexCount; i++)
+	{
+		int delta = (int)(next - indices[i]);
+		unsigned int value = ((unsigned int)delta << 1) ^ (unsigned int)(delta >> 31);
+		while (value >= 0x80)
+		{
+			out.push_back((unsigned char)(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back((unsigned char)value);
+		next = std::max(next, indices[i] + 1);
+	}
+}
+
+/* Decodes indexCount indices written by encodeIndices, returning false when data is truncated,
+   malformed or longer than the indices */
+bool decodeIndices(const unsigned char* data, size_t size, unsigned int* indices, unsigned int indexCount)
+{
+	const unsigned char* end = data + size;
+	unsigned int next = 0;
+	for (unsigned int i = 0; i < indexCount; i++)
+	{
+		unsigned int value;
+		if (data < end && *data < 0x80)
+			value = *data++;
+		else
+		{
+			value = 0;
+			for (int shift = 0; ; shift += 7)
+			{
+				if (data == end || shift > 28)
+					return false;
+				unsigned char byte = *data++;
+				value |= (unsigned int)(byte & 0x7F) << shift;
+				if (byte < 0x80)
+					break;
+			}
+		}
+		unsigned int index = next - ((value >> 1) ^ (0u - (value & 1)));
+		indices[i] = index;
+		next = std::max(next, index + 1);
+	}
+	return data == end;
+}
+
+/* Header of a compressed index file, followed by dataSize bytes of encodeIndices output */
+struct IndexFileHeader
+{
+	char magic[4];
+	unsigned int version;
+	unsigned int indexCount;
+	unsigned int vertexCount;
+	unsigned int dataSize;
+};
+
+const char IndexFileMagic[4] = { 'I', 'D', 'X', 'C' };
+const unsigned int IndexFileVersion = 1;
+
+bool saveIndexFile(const char* filePath, const unsigned int* indices, unsigned int indexCount, unsigned int vertexCount)
+{
+	std::vector<unsigned char> data;
+	encodeIndices(indices, indexCount, data);
+	IndexFileHeader header;
+	memcpy(header.magic, IndexFileMagic, sizeof(header.magic));
+	header.version = IndexFileVersion;
+	header.indexCount = indexCount;
+	header.vertexCount = vertexCount;
+	header.dataSize = (unsigned int)data.size();
+
+	std::ofstream fileStream(filePath, std::ios::out | std::ios::binary);
+	if (!fileStream.is_open()) {
+		std::cerr << "Could not write file " << filePath << "." << std::endl;
+		return false;
+	}
+	fileStream.write((const char*)&header, sizeof(header));
+	fileStream.write((const char*)data.data(), data.size());
+	return fileStream.good();
+}
+
+/* Reads a file written by saveIndexFile with one read, decoding it into indices */
+bool loadIndexFile(const char* filePath, std::vector<unsigned int>& indices, unsigned int& vertexCount)
+{
+	std::ifstream fileStream(filePath, std::ios::in | std::ios::binary | std::ios::ate);
+	if (!fileStream.is_open()) {
+		std::cerr << "Could not read file " << filePath << ". File does not exist." << std::endl;
+		return false;
+	}
+	std::streamoff size = fileStream.tellg();
+	if (size < 0) {
+		std::cerr << "Could not read file " << filePath << "." << std::endl;
+		return false;
+	}
+	std::vector<unsigned char> contents((size_t)size);
+	fileStream.seekg(0);
+	if (size > 0 && !fileStream.read((char*)contents.data(), contents.size())) {
+		std::cerr << "Could not read file " << filePath << "." << std::endl;
+		return false;
+	}
+
+	IndexFileHeader header;
+	if (contents.size() < sizeof(header))
+		memset(&header, 0, sizeof(header));
+	else
+		memcpy(&header, contents.data(), sizeof(header));
+	if (memcmp(header.magic, IndexFileMagic, sizeof(header.magic)) != 0 || header.version != IndexFileVersion
+		|| header.dataSize != contents.size() - sizeof(header)) {
+		std::cerr << "Index file " << filePath << " is not a version " << IndexFileVersion << " index file." << std::endl;
+		return false;
+	}
+
+	// Every index takes at least a byte, which bounds the count before anything is allocated for it
+	if (header.indexCount > header.dataSize) {
+		std::cerr << "Index file " << filePath << " is corrupt." << std::endl;
+		return false;
+	}
+	indices.resize(header.indexCount);
+	vertexCount = header.vertexCount;
+	bool decoded = decodeIndices(contents.data() + sizeof(header), header.dataSize, indices.data(), header.indexCount);
+	for (unsigned int i = 0; decoded && i < header.indexCount; i++)
+		decoded = indices[i] < vertexCount;
+	if (!decoded) {
+		std::cerr << "Index file " << filePath << " is corrupt." << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Geometry Registry
+// ---------------------------------
+
+const unsigned int InvalidRange = 0xFFFFFFFFu;
+
+/* An attribute of a vertex format, as passed to glVertexAttribPointer */
+struct VertexAttribute
+{
+	unsigned int index;
+	int size;
+	unsigned int type;
+	unsigned char normalized;
+	unsigned int offset;
+};
+
+/* Vertex layout shared by every mesh of a geometry pool */
+struct VertexFormat
+{
+	unsigned int stride;
+	unsigned int attributeCount;
+	VertexAttribute attributes[4];
+};
+
+/* Bytes of a component of an attribute type, 0 for types vertex formats do not use */
+unsigned int attributeTypeSize(unsigned int type)
+{
+	switch (type)
+	{
+	case GL_BYTE: case GL_UNSIGNED_BYTE: return 1;
+	case GL_SHORT: case GL_UNSIGNED_SHORT: case GL_HALF_FLOAT: return 2;
+	case GL_INT: case GL_UNSIGNED_INT: case GL_FLOAT: return 4;
+	default: return 0;
+	}
+}
+
+/* Whether a format can be passed to glVertexAttribPointer as it is: every attribute at a location
+   every GL has, of a known type, and inside the stride */
+bool isValidVertexFormat(const VertexFormat& format)
+{
+	if (format.stride == 0 || format.stride > 256 || format.attributeCount > 4)
+		return false;
+	for (unsigned int a = 0; a < format.attributeCount; a++)
+	{
+		const VertexAttribute& attribute = format.attributes[a];
+		unsigned int typeSize = attributeTypeSize(attribute.type);
+		if (attribute.index >= 16 || attribute.size < 1 || attribute.size > 4 || typeSize == 0
+			|| attribute.offset > format.stride || attribute.size * typeSize > format.stride - attribute.offset)
+			return false;
+	}
+	return true;
+}
+
+// Float positions at attribute 0, the layout of aPos in every vertex shader
+const VertexFormat PositionFormat = { sizeof(glm::vec3), 1, { { 0, 3, GL_FLOAT, GL_FALSE, 0 } } };
+
+/* A mesh sub-allocated from the geometry registry: the vao and buffers it shares with every mesh of
+   its vertex format, and its ranges in them. Indexed meshes are drawn from firstIndex, counted in
+   indices of indexType, with their indices offset by baseVertex, the others from baseVertex. The
+   registry keeps the ranges up to date when it moves the mesh */
+struct Geometry
+{
+	unsigned int vao;
+	unsigned int vbo;
+	unsigned int ebo;
+	unsigned int pool;
+	unsigned int baseVertex;
+	unsigned int vertexCount;
+	unsigned int firstIndex;
+	unsigned int indexCount;
+	unsigned int indexType;		// 0 for non-indexed meshes
+	BoundingVolume bounds;		// in model space
+	Geometry() : vao(0), vbo(0), ebo(0), pool(InvalidRange), baseVertex(0), vertexCount(0), firstIndex(0), indexCount(0), indexType(0) {}
+
+	// Space taken in the pool's index buffer, in 32-bit words so every mesh starts aligned for any index type
+	unsigned int IndexWords() const { return (indexCount * indexTypeSize(indexType) + 3) / 4; }
+};
+
+// Initialize Geometry Structures
+Geometry Grid;
+Geometry Cube;
+
+/* First-fit allocator over [0, capacity). Free ranges are kept sorted by offset and merged with
+   their neighbours when released */
+struct RangeAllocator
+{
+	struct Range
+	{
+		unsigned int offset;
+		unsigned int size;
+	};
+
+	struct ByOffset
+	{
+		bool operator()(const Range& a, const Range& b) const { return a.offset < b.offset; }
+	};
+
+	unsigned int capacity;
+	unsigned int used;
+	std::vector<Range> freeRanges;
+
+	RangeAllocator() : capacity(0), used(0) {}
+
+	void Reset(unsigned int size)
+	{
+		capacity = size;
+		used = 0;
+		freeRanges.clear();
+		if (size > 0)
+		{
+			Range all = { 0, size };
+			freeRanges.push_back(all);
+		}
+	}
+
+	// Returns the offset of the range, or InvalidRange when no free range is large enough
+	unsigned int Allocate(unsigned int size)
+	{
+		for (size_t i = 0; i < freeRanges.size(); i++)
+		{
+			if (freeRanges[i].size < size)
+				continue;
+			unsigned int offset = freeRanges[i].offset;
+			freeRanges[i].offset += size;
+			freeRanges[i].size -= size;
+			if (freeRanges[i].size == 0)
+				freeRanges.erase(freeRanges.begin() + i);
+			used += size;
+			return offset;
+		}
+		return InvalidRange;
+	}
+
+	void Free(unsigned int offset, unsigned int size)
+	{
+		if (size == 0)
+			return;
+		used -= size;
+		Range range = { offset, size };
+		size_t i = std::lower_bound(freeRanges.begin(), freeRanges.end(), range, ByOffset()) - freeRanges.begin();
+		freeRanges.insert(freeRanges.begin() + i, range);
+
+		// Merge with the next range, then with the previous one
+		if (i + 1 < freeRanges.size() && freeRanges[i].offset + freeRanges[i].size == freeRanges[i + 1].offset)
+		{
+			freeRanges[i].size += freeRanges[i + 1].size;
+			freeRanges.erase(freeRanges.begin() + i + 1);
+		}
+		if (i > 0 && freeRanges[i - 1].offset + freeRanges[i - 1].size == freeRanges[i].offset)
+		{
+			freeRanges[i - 1].size += freeRanges[i].size;
+			freeRanges.erase(freeRanges.begin() + i);
+		}
+	}
+
+	// Extend the capacity, keeping every allocation in place
+	void Grow(unsigned int newCapacity)
+	{
+		if (!freeRanges.empty() && freeRanges.back().offset + freeRanges.back().size == capacity)
+			freeRanges.back().size += newCapacity - capacity;
+		else
+		{
+			Range tail = { capacity, newCapacity - capacity };
+			freeRanges.push_back(tail);
+		}
+		capacity = newCapacity;
+	}
+
+	unsigned int LargestFree() const
+	{
+		unsigned int largest = 0;
+		for (size_t i = 0; i < freeRanges.size(); i++)
+			largest = std::max(largest, freeRanges[i].size);
+		return largest;
+	}
+};
+
+/* The buffers of one vertex format: a vertex buffer, an index buffer holding 8, 16 and 32-bit indices
+   side by side, the vao reading them and the meshes allocated from them */
+struct GeometryPool
+{
+	VertexFormat format;
+	unsigned int vao;
+	unsigned int vbo;
+	unsigned int ebo;
+	RangeAllocator vertices;	// in vertices
+	RangeAllocator indices;		// in 32-bit words
+	std::vector<Geometry*> meshes;
+	std::vector<unsigned int> attachedVaos;	// other vaos reading the pool's vertices, e.g. instanced ones
+};
+
+/* Fill and fragmentation of a pool. Fragmentation is the share of free space outside the largest
+   free range */
+struct GeometryOccupancy
+{
+	unsigned int meshes;
+	unsigned int vertexCapacity;
+	unsigned int verticesUsed;
+	unsigned int vertexFreeRanges;
+	float vertexFragmentation;
+	unsigned int indexCapacity;
+	unsigned int indicesUsed;
+	unsigned int indexFreeRanges;
+	float indexFragmentation;
+};
+
+/* Sub-allocates the vertices and indices of every mesh from a few large buffers, one pool per vertex
+   format, so meshes of a format share a vao and are drawn with base vertex and first index offsets.
+   Indices are stored in the narrowest type the mesh's vertex count allows. Pools double when full,
+   and Defragment() packs their meshes to the front. Both move data on the GPU with
+   glCopyBufferSubData and patch the registered Geometry structs */
+struct GeometryRegistry
+{
+	std::vector<GeometryPool> pools;
+	unsigned int initialVertices;
+	unsigned int initialIndices;	// in 32-bit words
+
+	// Narrowest index type Add picks. Some hardware converts 8-bit indices on the CPU, so they can be
+	// turned off with GL_UNSIGNED_SHORT, and GL_UNSIGNED_INT keeps every mesh at 32 bits
+	unsigned int smallestIndexType;
+
+	// Data moved by reallocations and defragmentation
+	unsigned int reallocations;
+	size_t bytesMoved;
+
+	std::vector<unsigned char> narrowedIndices;
+
+	GeometryRegistry() : initialVertices(1 << 16), initialIndices(1 << 18), smallestIndexType(GL_UNSIGNED_BYTE), reallocations(0), bytesMoved(0) {}
+
+	unsigned int PoolIndex(const VertexFormat& format)
+	{
+		for (size_t i = 0; i < pools.size(); i++)
+		{
+			if (memcmp(&pools[i].format, &format, sizeof(format)) == 0)
+				return (unsigned int)i;
+		}
+		GeometryPool pool;
+		pool.format = format;
+		glGenVertexArrays(1, &pool.vao);
+		pool.vbo = 0;
+		pool.ebo = 0;
+		pools.push_back(pool);
+		Reallocate(pools.back(), initialVertices, initialIndices, false);
+		return (unsigned int)(pools.size() - 1);
+	}
+
+	// Copy a mesh into the pool of its format. indices are relative to the mesh's first vertex, and
+	// may be null for non-indexed meshes. geometry must stay at the same address until it is removed
+	void Add(Geometry& geometry, const VertexFormat& format, const void* vertexData, unsigned int vertexCount,
+		const unsigned int* indexData = nullptr, unsigned int indexCount = 0)
+	{
+		unsigned int indexType = indexCount ? std::max(indexTypeFor(vertexCount), smallestIndexType) : 0;
+		AddTyped(geometry, format, vertexData, vertexCount, indexCount ? NarrowIndices(indexData, indexCount, indexType) : nullptr,
+			indexCount, indexType);
+	}
+
+	// Add a mesh whose indices are already of indexType, uploading vertices and indices straight from
+	// the caller's memory. indexType may be narrower than smallestIndexType
+	void AddTyped(Geometry& geometry, const VertexFormat& format, const void* vertexData, unsigned int vertexCount,
+		const void* indexData, unsigned int indexCount, unsigned int indexType)
+	{
+		Reserve(geometry, format, vertexCount, indexCount, indexType);
+		glState.BindBuffer(GL_COPY_WRITE_BUFFER, geometry.vbo);
+		glState.BufferSubData(GL_COPY_WRITE_BUFFER, (size_t)geometry.baseVertex * format.stride, (size_t)vertexCount * format.stride, vertexData);
+		if (indexCount)
+		{
+			glState.BindBuffer(GL_COPY_WRITE_BUFFER, geometry.ebo);
+			glState.BufferSubData(GL_COPY_WRITE_BUFFER, (size_t)geometry.firstIndex * indexTypeSize(indexType),
+				(size_t)indexCount * indexTypeSize(indexType), indexData);
+		}
+	}
+
+	// Allocate the ranges of a mesh without filling them, for uploads spread over several frames. The
+	// caller writes them through geometry.vbo and geometry.ebo, which change when the pool moves, and
+	// must not draw the mesh before it is done
+	void Reserve(Geometry& geometry, const VertexFormat& format, unsigned int vertexCount, unsigned int indexCount, unsigned int indexType)
+	{
+		unsigned int poolIndex = PoolIndex(format);
+		GeometryPool& pool = pools[poolIndex];
+		geometry.indexCount = indexCount;
+		geometry.indexType = indexCount ? indexType : 0;
+		unsigned int indexWords = geometry.IndexWords();
+		unsigned int baseVertex = pool.vertices.Allocate(vertexCount);
+		unsigned int indexWord = indexCount ? pool.indices.Allocate(indexWords) : 0;
+		if (baseVertex == InvalidRange || indexWord == InvalidRange)
+		{
+			// Pack the pool, doubling the buffers that would still be too small
+			if (baseVertex != InvalidRange)
+				pool.vertices.Free(baseVertex, vertexCount);
+			if (indexWord != InvalidRange && indexCount)
+				pool.indices.Free(indexWord, indexWords);
+			unsigned int vertexCapacity = pool.vertices.capacity, indexCapacity = pool.indices.capacity;
+			while (vertexCapacity - pool.vertices.used < vertexCount)
+				vertexCapacity *= 2;
+			while (indexCapacity - pool.indices.used < indexWords)
+				indexCapacity *= 2;
+			Reallocate(pool, vertexCapacity, indexCapacity, true);
+			baseVertex = pool.vertices.Allocate(vertexCount);
+			indexWord = indexCount ? pool.indices.Allocate(indexWords) : 0;
+		}
+
+		geometry.pool = poolIndex;
+		geometry.vao = pool.vao;
+		geometry.vbo = pool.vbo;
+		geometry.ebo = pool.ebo;
+		geometry.baseVertex = baseVertex;
+		geometry.vertexCount = vertexCount;
+		geometry.firstIndex = indexWord * 4 / indexTypeSize(geometry.indexType);
+		pool.meshes.push_back(&geometry);
+	}
+
+	// Grow the pool of a format to at least vertexCapacity vertices and indexCapacity 32-bit words of
+	// indices, so meshes streamed in later fit without reallocating on the way
+	void ReserveCapacity(const VertexFormat& format, unsigned int vertexCapacity, unsigned int indexCapacity)
+	{
+		GeometryPool& pool = pools[PoolIndex(format)];
+		if (vertexCapacity > pool.vertices.capacity || indexCapacity > pool.indices.capacity)
+			Reallocate(pool, std::max(vertexCapacity, pool.vertices.capacity), std::max(indexCapacity, pool.indices.capacity), false);
+	}
+
+	// Add a mesh of any size with 16-bit indices at most: meshes with more vertices than 16 bits address
+	// are split into clusters, each added as its own geometry. Returns the number of geometries used.
+	// geometries must be empty: the registry keeps pointers to its elements, which resizing it would move
+	unsigned int AddClustered(std::vector<Geometry>& geometries, const VertexFormat& format, const void* vertexData,
+		unsigned int vertexCount, const unsigned int* indexData, unsigned int indexCount)
+	{
+		if (!geometries.empty()) {
+			std::cerr << "AddClustered needs an empty vector of geometries, it holds " << geometries.size() << "." << std::endl;
+			return 0;
+		}
+		if (vertexCount <= 0x10000)
+		{
+			geometries.resize(1);
+			Add(geometries[0], format, vertexData, vertexCount, indexData, indexCount);
+			return 1;
+		}
+
+		std::vector<IndexCluster> clusters;
+		buildIndexClusters(indexData, indexCount, 0x10000, clusters);
+		geometries.resize(clusters.size());
+		std::vector<unsigned char> clusterVertices;
+		for (size_t c = 0; c < clusters.size(); c++)
+		{
+			const std::vector<unsigned int>& sources = clusters[c].vertices;
+			clusterVertices.resize(sources.size() * format.stride);
+			for (size_t v = 0; v < sources.size(); v++)
+				memcpy(&clusterVertices[v * format.stride], (const unsigned char*)vertexData + (size_t)sources[v] * format.stride, format.stride);
+			Add(geometries[c], format, clusterVertices.data(), (unsigned int)sources.size(),
+				clusters[c].indices.data(), (unsigned int)clusters[c].indices.size());
+		}
+		return (unsigned int)clusters.size();
+	}
+
+	// Indices in the given type, in a scratch buffer for the narrower ones
+	const void* NarrowIndices(const unsigned int* indexData, unsigned int indexCount, unsigned int indexType)
+	{
+		if (indexType == GL_UNSIGNED_INT)
+			return indexData;
+		narrowedIndices.resize((size_t)indexCount * indexTypeSize(indexType));
+		if (indexType == GL_UNSIGNED_SHORT)
+		{
+			unsigned short* narrowed = (unsigned short*)narrowedIndices.data();
+			for (unsigned int i = 0; i < indexCount; i++)
+				narrowed[i] = (unsigned short)indexData[i];
+		}
+		else
+		{
+			for (unsigned int i = 0; i < indexCount; i++)
+				narrowedIndices[i] = (unsigned char)indexData[i];
+		}
+		return narrowedIndices.data();
+	}
+
+	// Release the mesh's ranges. The data stays in place until reused
+	void Remove(Geometry& geometry)
+	{
+		if (geometry.pool == InvalidRange)
+			return;
+		GeometryPool& pool = pools[geometry.pool];
+		pool.vertices.Free(geometry.baseVertex, geometry.vertexCount);
+		if (geometry.indexCount)
+			pool.indices.Free(geometry.firstIndex * indexTypeSize(geometry.indexType) / 4, geometry.IndexWords());
+		pool.meshes.erase(std::find(pool.meshes.begin(), pool.meshes.end(), &geometry));
+		geometry.pool = InvalidRange;
+		geometry.vertexCount = 0;
+		geometry.indexCount = 0;
+	}
+
+	// Point another vao at the vertices and indices of the geometry's pool, and keep it pointed there
+	// when the pool moves. Leaves vao bound
+	void Attach(const Geometry& geometry, unsigned int vao)
+	{
+		GeometryPool& pool = pools[geometry.pool];
+		pool.attachedVaos.push_back(vao);
+		PointVao(pool, vao);
+	}
+
+	// Pack the meshes of every pool to the front of its buffers, so the free space is one range
+	void Defragment()
+	{
+		for (size_t i = 0; i < pools.size(); i++)
+		{
+			GeometryPool& pool = pools[i];
+			if (pool.vertices.freeRanges.size() > 1 || pool.indices.freeRanges.size() > 1)
+				Reallocate(pool, pool.vertices.capacity, pool.indices.capacity, true);
+		}
+	}
+
+	GeometryOccupancy Occupancy(unsigned int poolIndex) const
+	{
+		const GeometryPool& pool = pools[poolIndex];
+		GeometryOccupancy occupancy;
+		occupancy.meshes = (unsigned int)pool.meshes.size();
+		occupancy.vertexCapacity = pool.vertices.capacity;
+		occupancy.verticesUsed = pool.vertices.used;
+		occupancy.vertexFreeRanges = (unsigned int)pool.vertices.freeRanges.size();
+		unsigned int vertexFree = pool.vertices.capacity - pool.vertices.used;
+		occupancy.vertexFragmentation = vertexFree ? 1.0f - (float)pool.vertices.LargestFree() / vertexFree : 0.0f;
+		occupancy.indexCapacity = pool.indices.capacity;
+		occupancy.indicesUsed = pool.indices.used;
+		occupancy.indexFreeRanges = (unsigned int)pool.indices.freeRanges.size();
+		unsigned int indexFree = pool.indices.capacity - pool.indices.used;
+		occupancy.indexFragmentation = indexFree ? 1.0f - (float)pool.indices.LargestFree() / indexFree : 0.0f;
+		return occupancy;
+	}
+
+	void Destroy()
+	{
+		for (size_t i = 0; i < pools.size(); i++)
+		{
+			glDeleteVertexArrays(1, &pools[i].vao);
+			glDeleteBuffers(1, &pools[i].vbo);
+			glDeleteBuffers(1, &pools[i].ebo);
+			for (size_t m = 0; m < pools[i].meshes.size(); m++)
+				pools[i].meshes[m]->pool = InvalidRange;
+		}
+		pools.clear();
+		glState.Invalidate();
+	}
+
+	// Leaves vao bound
+	void PointVao(const GeometryPool& pool, unsigned int vao)
+	{
+		glState.BindVertexArray(vao);
+		glState.BindBuffer(GL_ARRAY_BUFFER, pool.vbo);
+		for (unsigned int a = 0; a < pool.format.attributeCount; a++)
+		{
+			const VertexAttribute& attribute = pool.format.attributes[a];
+			glVertexAttribPointer(attribute.index, attribute.size, attribute.type, attribute.normalized, pool.format.stride,
+				(void*)(size_t)attribute.offset);
+			glEnableVertexAttribArray(attribute.index);
+		}
+		glState.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, pool.ebo);
+	}
+
+	// Move the pool into new buffers of the given capacities, packing its meshes in order of their
+	// vertices when compact is set and keeping their offsets otherwise
+	void Reallocate(GeometryPool& pool, unsigned int vertexCapacity, unsigned int indexCapacity, bool compact)
+	{
+		unsigned int buffers[2];
+		glGenBuffers(2, buffers);
+		glState.BindBuffer(GL_COPY_WRITE_BUFFER, buffers[0]);
+		glState.BufferData(GL_COPY_WRITE_BUFFER, (size_t)vertexCapacity * pool.format.stride, nullptr, GL_STATIC_DRAW);
+		glState.BindBuffer(GL_COPY_WRITE_BUFFER, buffers[1]);
+		glState.BufferData(GL_COPY_WRITE_BUFFER, (size_t)indexCapacity * 4, nullptr, GL_STATIC_DRAW);
+
+		struct ByBaseVertex
+		{
+			bool operator()(const Geometry* a, const Geometry* b) const { return a->baseVertex < b->baseVertex; }
+		};
+		if (compact)
+		{
+			std::sort(pool.meshes.begin(), pool.meshes.end(), ByBaseVertex());
+			pool.vertices.Reset(vertexCapacity);
+			pool.indices.Reset(indexCapacity);
+		}
+		else if (pool.vbo)
+		{
+			pool.vertices.Grow(vertexCapacity);
+			pool.indices.Grow(indexCapacity);
+		}
+		else
+		{
+			pool.vertices.Reset(vertexCapacity);
+			pool.indices.Reset(indexCapacity);
+		}
+
+		for (size_t m = 0; m < pool.meshes.size(); m++)
+		{
+			Geometry& mesh = *pool.meshes[m];
+			unsigned int baseVertex = compact ? pool.vertices.Allocate(mesh.vertexCount) : mesh.baseVertex;
+			unsigned int indexSize = indexTypeSize(mesh.indexType);
+			unsigned int indexWord = mesh.firstIndex * indexSize / 4;
+			unsigned int newIndexWord = compact && mesh.indexCount ? pool.indices.Allocate(mesh.IndexWords()) : indexWord;
+			glState.BindBuffer(GL_COPY_READ_BUFFER, pool.vbo);
+			glState.BindBuffer(GL_COPY_WRITE_BUFFER, buffers[0]);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (size_t)mesh.baseVertex * pool.format.stride,
+				(size_t)baseVertex * pool.format.stride, (size_t)mesh.vertexCount * pool.format.stride);
+			bytesMoved += (size_t)mesh.vertexCount * pool.format.stride;
+			if (mesh.indexCount)
+			{
+				glState.BindBuffer(GL_COPY_READ_BUFFER, pool.ebo);
+				glState.BindBuffer(GL_COPY_WRITE_BUFFER, buffers[1]);
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (size_t)indexWord * 4, (size_t)newIndexWord * 4,
+					(size_t)mesh.IndexWords() * 4);
+				bytesMoved += (size_t)mesh.IndexWords() * 4;
+			}
+			mesh.baseVertex = baseVertex;
+			mesh.firstIndex = newIndexWord * 4 / indexSize;
+			mesh.vbo = buffers[0];
+			mesh.ebo = buffers[1];
+		}
+
+		// Deleted names can come back from glGenBuffers, so the cached bindings are dropped with them
+		if (pool.vbo)
+		{
+			glDeleteBuffers(1, &pool.vbo);
+			glDeleteBuffers(1, &pool.ebo);
+			reallocations++;
+		}
+		glState.Invalidate();
+		pool.vbo = buffers[0];
+		pool.ebo = buffers[1];
+		PointVao(pool, pool.vao);
+		for (size_t v = 0; v < pool.attachedVaos.size(); v++)
+			PointVao(pool, pool.attachedVaos[v]);
+		glState.BindVertexArray(0);
+	}
+};
+
+GeometryRegistry geometryRegistry;
+
+/* Draws a whole registered mesh with the bound program and vao, which is the mesh's own or one
+   attached to its pool */
+void drawGeometry(const Geometry& geometry, unsigned int mode, int instanceCount = 1)
+{
+	if (geometry.indexCount)
+		glState.DrawElements(mode, geometry.indexCount, geometry.indexType, (void*)(size_t)(geometry.firstIndex * indexTypeSize(geometry.indexType)),
+			instanceCount, geometry.baseVertex);
+	else
+		glState.DrawArrays(mode, geometry.baseVertex, geometry.vertexCount);
+}
+
+// Vertex Quantization
+// ---------------------------------
+
+// Positions as four half floats, w = 1. Read as floats by the fetch hardware, so any shader taking a vec3 aPos works
+const VertexFormat PositionHalfFormat = { 8, 1, { { 0, 4, GL_HALF_FLOAT, GL_FALSE, 0 } } };
+
+/* Lit vertex with float attributes, the unquantized layout of QuantizedVertex */
+struct LitVertex
+{
+	glm::vec3 position;
+	glm::vec3 normal;
+	glm::vec4 colour;
+};
+
+const VertexFormat LitVertexFormat = { sizeof(LitVertex), 3, { { 0, 3, GL_FLOAT, GL_FALSE, 0 },
+	{ 6, 3, GL_FLOAT, GL_FALSE, offsetof(LitVertex, normal) }, { 7, 4, GL_FLOAT, GL_FALSE, offsetof(LitVertex, colour) } } };
+
+/* Lit vertex read by vertex0_quantized.vert: snorm16 position within the mesh bounds, octahedral
+   snorm16 normal and unorm8 colour. 16 bytes instead of LitVertex's 40 */
+struct QuantizedVertex
+{
+	short position[4];
+	unsigned int normal;
+	unsigned int colour;
+};
+
+const VertexFormat QuantizedVertexFormat = { sizeof(QuantizedVertex), 3, { { 0, 4, GL_SHORT, GL_TRUE, 0 },
+	{ 6, 2, GL_SHORT, GL_TRUE, offsetof(QuantizedVertex, normal) }, { 7, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(QuantizedVertex, colour) } } };
+
+/* Maps a mesh's bounds to the [-1, 1] range of snorm16 positions: position = stored * scale + offset */
+struct PositionQuantization
+{
+	glm::vec3 scale;
+	glm::vec3 offset;
+};
+
+PositionQuantization positionQuantization(const BoundingVolume& bounds)
+{
+	PositionQuantization quantization = { glm::max(bounds.extent, glm::vec3(FLT_MIN)), bounds.center };
+	return quantization;
+}
+
+/* Unit vector to octahedral coordinates: projected onto the octahedron |x| + |y| + |z| = 1, with the
+   lower half folded over the diagonals, packed as two snorm16. Zero normals, which have no direction,
+   encode as +z */
+unsigned int octahedralEncode(const glm::vec3& normal)
+{
+	float length = std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+	if (!(length > 0.0f))
+		return glm::packSnorm2x16(glm::vec2(0.0f));
+	glm::vec2 p = glm::vec2(normal) / length;
+	if (normal.z < 0.0f)
+		p = (1.0f - glm::abs(glm::vec2(p.y, p.x))) * glm::vec2(p.x >= 0.0f ? 1.0f : -1.0f, p.y >= 0.0f ? 1.0f : -1.0f);
+	return glm::packSnorm2x16(p);
+}
+
+glm::vec3 octahedralDecode(unsigned int encoded)
+{
+	glm::vec2 p = glm::unpackSnorm2x16(encoded);
+	glm::vec3 normal(p.x, p.y, 1.0f - std::abs(p.x) - std::abs(p.y));
+	if (normal.z < 0.0f)
+	{
+		normal.x = (1.0f - std::abs(p.y)) * (p.x >= 0.0f ? 1.0f : -1.0f);
+		normal.y = (1.0f - std::abs(p.x)) * (p.y >= 0.0f ? 1.0f : -1.0f);
+	}
+	return glm::normalize(normal);
+}
+
+/* Quantizes vertices one at a time with glm's packing functions */
+void quantizeVerticesReference(const glm::vec3* positions, const glm::vec3* normals, const glm::vec4* colours, size_t count,
+	const PositionQuantization& quantization, QuantizedVertex* out)
+{
+	glm::vec3 inverseScale = 1.0f / quantization.scale;
+	for (size_t i = 0; i < count; i++)
+	{
+		glm::uint64 position = glm::packSnorm4x16(glm::vec4((positions[i] - quantization.offset) * inverseScale, 1.0f));
+		memcpy(out[i].position, &position, sizeof(position));
+		out[i].normal = octahedralEncode(normals[i]);
+		out[i].colour = glm::packUnorm4x8(colours[i]);
+	}
+}
+
+/* Converts positions to half floats one at a time with glm */
+void packHalfPositionsReference(const glm::vec3* positions, size_t count, glm::uint64* out)
+{
+	for (size_t i = 0; i < count; i++)
+		out[i] = glm::packHalf4x16(glm::vec4(positions[i], 1.0f));
+}
+
+#if USE_SSE2
+/* Four floats to half floats, rounded to nearest even, in the low 16 bits of each lane with the sign
+   extended so _mm_packs_epi32 keeps them intact. Overflows become infinity and NaNs stay NaNs */
+inline __m128i floatToHalf(__m128 value)
+{
+	const __m128i signMask = _mm_set1_epi32((int)0x80000000u);
+	const __m128i halfOverflow = _mm_set1_epi32((127 + 16) << 23);	// rounds to infinity from here on
+	const __m128i smallestNormal = _mm_set1_epi32((127 - 14) << 23);
+	const __m128i subnormalMagic = _mm_set1_epi32(((127 - 15) + (23 - 10) + 1) << 23);
+	const __m128i normalBias = _mm_set1_epi32(0xFFF - ((127 - 15) << 23));	// exponent rebias and half ulp
+
+	__m128 sign = _mm_and_ps(value, _mm_castsi128_ps(signMask));
+	__m128 magnitude = _mm_xor_ps(value, sign);
+	__m128i bits = _mm_castps_si128(magnitude);
+	__m128i isNaN = _mm_castps_si128(_mm_cmpunord_ps(magnitude, magnitude));
+	__m128i isFinite = _mm_cmpgt_epi32(halfOverflow, bits);
+	__m128i isSubnormal = _mm_cmpgt_epi32(smallestNormal, bits);
+	__m128i special = _mm_or_si128(_mm_and_si128(isNaN, _mm_set1_epi32(0x200)), _mm_set1_epi32(0x7C00));
+
+	// Subnormal results: adding the magic number shifts the mantissa into place with the FPU's rounding
+	__m128i subnormal = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(magnitude, _mm_castsi128_ps(subnormalMagic))), subnormalMagic);
+
+	// Normal results: rebias, add the rounding bias (one more when the kept mantissa is odd) and shift
+	__m128i odd = _mm_srai_epi32(_mm_slli_epi32(bits, 31 - 13), 31);
+	__m128i normal = _mm_srli_epi32(_mm_sub_epi32(_mm_add_epi32(bits, normalBias), odd), 13);
+
+	__m128i finite = _mm_or_si128(_mm_and_si128(isSubnormal, subnormal), _mm_andnot_si128(isSubnormal, normal));
+	__m128i half = _mm_or_si128(_mm_and_si128(isFinite, finite), _mm_andnot_si128(isFinite, special));
+	return _mm_or_si128(half, _mm_srai_epi32(_mm_castps_si128(sign), 16));
+}
+
+/* Four floats in [-1, 1] to snorm16 in 32-bit lanes, rounded to nearest */
+inline __m128i floatToSnorm16(__m128 value)
+{
+	value = _mm_min_ps(_mm_max_ps(value, _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f));
+	return _mm_cvtps_epi32(_mm_mul_ps(value, _mm_set1_ps(32767.0f)));
+}
+#endif
+
+/* Converts positions to half floats, two vertices per SSE2 iteration */
+void packHalfPositions(const glm::vec3* positions, size_t count, glm::uint64* out)
+{
+#if USE_SSE2
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		__m128i first = floatToHalf(_mm_setr_ps(positions[i].x, positions[i].y, positions[i].z, 1.0f));
+		__m128i second = floatToHalf(_mm_setr_ps(positions[i + 1].x, positions[i + 1].y, positions[i + 1].z, 1.0f));
+		_mm_storeu_si128((__m128i*)&out[i], _mm_packs_epi32(first, second));
+	}
+	packHalfPositionsReference(positions + i, count - i, out + i);
+#else
+	packHalfPositionsReference(positions, count, out);
+#endif
+}
+
+/* Quantizes a batch of vertices into QuantizedVertex. Positions and colours convert one vertex per SSE2
+   instruction, normals four at a time in SoA form */
+void quantizeVertices(const glm::vec3* positions, const glm::vec3* normals, const glm::vec4* colours, size_t count,
+	const PositionQuantization& quantization, QuantizedVertex* out)
+{
+#if USE_SSE2
+	__m128 offset = _mm_setr_ps(quantization.offset.x, quantization.offset.y, quantization.offset.z, 0.0f);
+	__m128 inverseScale = _mm_setr_ps(1.0f / quantization.scale.x, 1.0f / quantization.scale.y, 1.0f / quantization.scale.z, 1.0f);
+	__m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+	__m128 signMask = _mm_castsi128_ps(_mm_set1_epi32((int)0x80000000u));
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		for (int k = 0; k < 4; k++)
+		{
+			const glm::vec3& p = positions[i + k];
+			__m128i position = floatToSnorm16(_mm_mul_ps(_mm_sub_ps(_mm_setr_ps(p.x, p.y, p.z, 1.0f), offset), inverseScale));
+			_mm_storel_epi64((__m128i*)out[i + k].position, _mm_packs_epi32(position, position));
+
+			__m128 c = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(&colours[i + k].x), zero), one);
+			__m128i colour = _mm_cvtps_epi32(_mm_mul_ps(c, _mm_set1_ps(255.0f)));
+			colour = _mm_packs_epi32(colour, colour);
+			out[i + k].colour = (unsigned int)_mm_cvtsi128_si32(_mm_packus_epi16(colour, colour));
+		}
+
+		// Octahedral normals of the four vertices
+		__m128 x = _mm_setr_ps(normals[i].x, normals[i + 1].x, normals[i + 2].x, normals[i + 3].x);
+		__m128 y = _mm_setr_ps(normals[i].y, normals[i + 1].y, normals[i + 2].y, normals[i + 3].y);
+		__m128 z = _mm_setr_ps(normals[i].z, normals[i + 1].z, normals[i + 2].z, normals[i + 3].z);
+		__m128 length = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signMask, x), _mm_andnot_ps(signMask, y)), _mm_andnot_ps(signMask, z));
+		__m128 directed = _mm_cmpgt_ps(length, zero);	// zero normals encode as +z, as in octahedralEncode
+		x = _mm_and_ps(directed, _mm_div_ps(x, length));
+		y = _mm_and_ps(directed, _mm_div_ps(y, length));
+		__m128 lower = _mm_and_ps(directed, _mm_cmplt_ps(z, zero));
+		__m128 signX = _mm_or_ps(_mm_and_ps(x, signMask), one), signY = _mm_or_ps(_mm_and_ps(y, signMask), one);
+		__m128 foldedX = _mm_mul_ps(_mm_sub_ps(one, _mm_andnot_ps(signMask, y)), signX);
+		__m128 foldedY = _mm_mul_ps(_mm_sub_ps(one, _mm_andnot_ps(signMask, x)), signY);
+		x = _mm_or_ps(_mm_and_ps(lower, foldedX), _mm_andnot_ps(lower, x));
+		y = _mm_or_ps(_mm_and_ps(lower, foldedY), _mm_andnot_ps(lower, y));
+		__m128i encoded = _mm_or_si128(_mm_and_si128(floatToSnorm16(x), _mm_set1_epi32(0xFFFF)), _mm_slli_epi32(floatToSnorm16(y), 16));
+		unsigned int words[4];
+		_mm_storeu_si128((__m128i*)words, encoded);
+		for (int k = 0; k < 4; k++)
+			out[i + k].normal = words[k];
+	}
+	quantizeVerticesReference(positions + i, normals + i, colours + i, count - i, quantization, out + i);
+#else
+	quantizeVerticesReference(positions, normals, colours, count, quantization, out);
+#endif
+}
+
+// Mesh Optimization
+// ---------------------------------
+
+const unsigned int InvalidVertex = 0xFFFFFFFFu;
+
+/* Post-transform cache efficiency of a triangle list: ACMR, vertices transformed per triangle, is 3
+   at worst and about 0.5 to 0.7 for well ordered meshes, and ATVR, vertices transformed per vertex,
+   is 1 at best */
+struct VertexCacheStats
+{
+	float acmr;
+	float atvr;
+};
+
+/* Replays a triangle list through a FIFO vertex cache of cacheSize entries */
+VertexCacheStats analyzeVertexCache(const unsigned int* indices, size_t indexCount, unsigned int vertexCount, unsigned int cacheSize = 16)
+{
+	// A vertex is in the cache while fewer than cacheSize vertices entered after it
+	std::vector<unsigned int> entered(vertexCount, 0);
+	unsigned int time = cacheSize + 1, misses = 0;
+	for (size_t i = 0; i < indexCount; i++)
+	{
+		if (time - entered[indices[i]] > cacheSize)
+		{
+			entered[indices[i]] = time++;
+			misses++;
+		}
+	}
+	VertexCacheStats stats = { indexCount ? misses * 3.0f / indexCount : 0.0f, vertexCount ? (float)misses / vertexCount : 0.0f };
+	return stats;
+}
+
+/* Reorders triangles for a FIFO vertex cache with Tipsify (Sander et al., "Fast Triangle Reordering for
+   Vertex Locality and Reduced Overdraw"): it fans around one vertex at a time, moving on to the
+   neighbour that will still be cached once its own fan is emitted. clusters, when given, receives the
+   first triangle of every run that had to jump to an unrelated vertex */
+void optimizeVertexCache(const unsigned int* indices, size_t indexCount, unsigned int vertexCount, unsigned int* out,
+	std::vector<unsigned int>* clusters = nullptr, unsigned int cacheSize = 16)
+{
+	size_t triangleCount = indexCount / 3;
+	if (clusters)
+		clusters->clear();
+	if (triangleCount == 0)
+		return;
+
+	// Triangles around each vertex, and how many of them are not emitted yet
+	std::vector<unsigned int> live(vertexCount, 0), offsets(vertexCount + 1, 0), adjacency(triangleCount * 3);
+	for (size_t i = 0; i < triangleCount * 3; i++)
+		live[indices[i]]++;
+	for (unsigned int v = 0; v < vertexCount; v++)
+		offsets[v + 1] = offsets[v] + live[v];
+	std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+	for (size_t i = 0; i < triangleCount * 3; i++)
+		adjacency[fill[indices[i]]++] = (unsigned int)(i / 3);
+
+	std::vector<unsigned int> entered(vertexCount, 0), deadEnds, candidates;
+	std::vector<unsigned char> emitted(triangleCount, 0);
+	deadEnds.reserve(triangleCount * 3);
+	unsigned int time = cacheSize + 1, cursor = 0;
+	size_t written = 0;
+	unsigned int fan = indices[0];
+	bool jumped = true;
+	while (fan != InvalidVertex)
+	{
+		if (clusters && jumped)
+			clusters->push_back((unsigned int)(written / 3));
+
+		candidates.clear();
+		for (unsigned int a = offsets[fan]; a < offsets[fan + 1]; a++)
+		{
+			unsigned int triangle = adjacency[a];
+			if (emitted[triangle])
+				continue;
+			emitted[triangle] = 1;
+			for (int k = 0; k < 3; k++)
+			{
+				unsigned int v = indices[triangle * 3 + k];
+				out[written++] = v;
+				deadEnds.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (time - entered[v] > cacheSize)
+					entered[v] = time++;
+			}
+		}
+
+		// The oldest candidate that stays cached while its remaining triangles are emitted, or any
+		// candidate with triangles left
+		unsigned int next = InvalidVertex;
+		int bestPriority = -1;
+		for (size_t c = 0; c < candidates.size(); c++)
+		{
+			unsigned int v = candidates[c];
+			if (live[v] == 0)
+				continue;
+			int priority = time - entered[v] + 2 * live[v] <= cacheSize ? (int)(time - entered[v]) : 0;
+			if (priority > bestPriority)
+			{
+				bestPriority = priority;
+				next = v;
+			}
+		}
+
+		// Dead end: back to the most recent vertex with triangles left, else the next one in input order
+		jumped = next == InvalidVertex;
+		while (next == InvalidVertex && !deadEnds.empty())
+		{
+			if (live[deadEnds.back()])
+				next = deadEnds.back();
+			deadEnds.pop_back();
+		}
+		for (; next == InvalidVertex && cursor < vertexCount; cursor++)
+		{
+			if (live[cursor])
+				next = cursor;
+		}
+		fan = next;
+	}
+}
+
+/* Reorders the clusters of a cache-optimized triangle list so the ones facing outwards from the
+   mesh's centre draw first and hide the rest from most views. The runs from optimizeVertexCache are
+   cut further wherever the cache efficiency so far is within threshold of the run's, which keeps the
+   ACMR close to that of the input. Positions are the first three floats of each vertex */
+void optimizeOverdraw(unsigned int* indices, size_t indexCount, const void* vertexData, unsigned int stride, unsigned int vertexCount,
+	const std::vector<unsigned int>& clusters, float threshold = 1.05f, unsigned int cacheSize = 16)
+{
+	unsigned int triangleCount = (unsigned int)(indexCount / 3);
+	std::vector<unsigned int> entered(vertexCount, 0), starts;
+	unsigned int time = cacheSize + 1;
+	for (size_t c = 0; c < clusters.size(); c++)
+	{
+		unsigned int start = clusters[c], end = c + 1 < clusters.size() ? clusters[c + 1] : triangleCount;
+
+		// The run's own ACMR from a cold cache
+		time += cacheSize + 1;
+		unsigned int runMisses = 0;
+		for (unsigned int i = start * 3; i < end * 3; i++)
+		{
+			if (time - entered[indices[i]] > cacheSize)
+			{
+				entered[indices[i]] = time++;
+				runMisses++;
+			}
+		}
+		float limit = threshold * runMisses / (end - start);
+
+		time += cacheSize + 1;
+		unsigned int misses = 0, clusterStart = start;
+		starts.push_back(start);
+		for (unsigned int t = start; t < end; t++)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				if (time - entered[indices[t * 3 + k]] > cacheSize)
+				{
+					entered[indices[t * 3 + k]] = time++;
+					misses++;
+				}
+			}
+			if (t + 1 < end && misses <= limit * (t + 1 - clusterStart))
+			{
+				starts.push_back(t + 1);
+				clusterStart = t + 1;
+				misses = 0;
+				time += cacheSize + 1;
+			}
+		}
+	}
+
+	// Area-weighted centroid and normal of every cluster
+	struct Cluster
+	{
+		unsigned int start;
+		unsigned int end;
+		glm::vec3 centroid;
+		glm::vec3 normal;
+		float area;
+		float sortKey;
+	};
+	struct ByKey
+	{
+		bool operator()(const Cluster& a, const Cluster& b) const { return a.sortKey > b.sortKey; }
+	};
+	std::vector<Cluster> sorted(starts.size());
+	glm::vec3 meshCentroid(0.0f);
+	float meshArea = 0.0f;
+	for (size_t c = 0; c < starts.size(); c++)
+	{
+		Cluster& cluster = sorted[c];
+		cluster.start = starts[c];
+		cluster.end = c + 1 < starts.size() ? starts[c + 1] : triangleCount;
+		cluster.centroid = glm::vec3(0.0f);
+		cluster.normal = glm::vec3(0.0f);
+		cluster.area = 0.0f;
+		for (unsigned int t = cluster.start; t < cluster.end; t++)
+		{
+			glm::vec3 corners[3];
+			for (int k = 0; k < 3; k++)
+				memcpy(&corners[k], (const unsigned char*)vertexData + (size_t)indices[t * 3 + k] * stride, sizeof(glm::vec3));
+			glm::vec3 normal = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+			float area = glm::length(normal);
+			cluster.centroid += (corners[0] + corners[1] + corners[2]) * (area / 3.0f);
+			cluster.normal += normal;
+			cluster.area += area;
+		}
+		meshCentroid += cluster.centroid;
+		meshArea += cluster.area;
+		cluster.centroid /= std::max(cluster.area, FLT_MIN);
+	}
+	meshCentroid /= std::max(meshArea, FLT_MIN);
+	for (size_t c = 0; c < sorted.size(); c++)
+	{
+		float length = glm::length(sorted[c].normal);
+		sorted[c].sortKey = length > 0.0f ? glm::dot(sorted[c].centroid - meshCentroid, sorted[c].normal / length) : 0.0f;
+	}
+	std::stable_sort(sorted.begin(), sorted.end(), ByKey());
+
+	std::vector<unsigned int> source(indices, indices + triangleCount * 3);
+	size_t written = 0;
+	for (size_t c = 0; c < sorted.size(); c++)
+	{
+		for (unsigned int i = sorted[c].start * 3; i < sorted[c].end * 3; i++)
+			indices[written++] = source[i];
+	}
+}
+
+/* Renumbers vertices in order of first use so vertex fetch walks memory forwards. remap receives the
+   new number of every vertex, with unused vertices moved to the end. Returns the number used */
+unsigned int optimizeVertexFetch(unsigned int* indices, size_t indexCount, unsigned int vertexCount, std::vector<unsigned int>& remap)
+{
+	remap.assign(vertexCount, InvalidVertex);
+	unsigned int next = 0;
+	for (size_t i = 0; i < indexCount; i++)
+	{
+		if (remap[indices[i]] == InvalidVertex)
+			remap[indices[i]] = next++;
+		indices[i] = remap[indices[i]];
+	}
+	unsigned int used = next;
+	for (unsigned int v = 0; v < vertexCount; v++)
+	{
+		if (remap[v] == InvalidVertex)
+			remap[v] = next++;
+	}
+	return used;
+}
+
+/* Moves every vertex to its slot in remap */
+void remapVertices(void* vertexData, unsigned int stride, unsigned int vertexCount, const std::vector<unsigned int>& remap)
+{
+	std::vector<unsigned char> source((const unsigned char*)vertexData, (const unsigned char*)vertexData + (size_t)vertexCount * stride);
+	for (unsigned int v = 0; v < vertexCount; v++)
+		memcpy((unsigned char*)vertexData + (size_t)remap[v] * stride, &source[(size_t)v * stride], stride);
+}
+
+struct MeshOptimizationStats
+{
+	VertexCacheStats before;
+	VertexCacheStats after;
+	double milliseconds;
+};
+
+/* Optimizes an indexed triangle mesh in place for the vertex cache, overdraw and vertex fetch, in that
+   order. Positions are the first three floats of each vertex */
+MeshOptimizationStats optimizeMesh(void* vertexData, unsigned int stride, unsigned int vertexCount, unsigned int* indices, size_t indexCount)
+{
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	MeshOptimizationStats stats;
+	stats.before = analyzeVertexCache(indices, indexCount, vertexCount);
+
+	std::vector<unsigned int> source(indices, indices + indexCount), clusters, remap;
+	optimizeVertexCache(source.data(), indexCount, vertexCount, indices, &clusters);
+	optimizeOverdraw(indices, indexCount, vertexData, stride, vertexCount, clusters);
+	optimizeVertexFetch(indices, indexCount, vertexCount, remap);
+	remapVertices(vertexData, stride, vertexCount, remap);
+
+	stats.after = analyzeVertexCache(indices, indexCount, vertexCount);
+	stats.milliseconds = elapsedMilliseconds(start);
+	return stats;
+}
+
+/* Runs optimizeMesh on a worker thread, so an importer can go on reading the next mesh. The mesh's
+   vertices and indices belong to the task until Finish() returns */
+struct MeshOptimizationTask
+{
+	std::thread worker;
+	std::atomic<bool> done;
+	MeshOptimizationStats stats;
+
+	MeshOptimizationTask() : done(false) {}
+	~MeshOptimizationTask() { Finish(); }
+
+	void Start(void* vertexData, unsigned int stride, unsigned int vertexCount, unsigned int* indices, size_t indexCount)
+	{
+		Finish();
+		done = false;
+		worker = std::thread([=]()
+		{
+			stats = optimizeMesh(vertexData, stride, vertexCount, indices, indexCount);
+			done = true;
+		});
+	}
+
+	bool Ready() const { return done; }
+
+	const MeshOptimizationStats& Finish()
+	{
+		if (worker.joinable())
+			worker.join();
+		return stats;
+	}
+};
+
+// File Mapping
+// ---------------------------------
+
+/* A whole file mapped read-only into memory, so parsers read it in place without copying it. Empty
+   files open with a null data pointer */
+struct MappedFile
+{
+	const char* data;
+	size_t size;
+#if defined(_WIN32)
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int descriptor;
+#endif
+
+#if defined(_WIN32)
+	MappedFile() : data(nullptr), size(0), file(INVALID_HANDLE_VALUE), mapping(nullptr) {}
+#else
+	MappedFile() : data(nullptr), size(0), descriptor(-1) {}
+#endif
+	~MappedFile() { Close(); }
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool Open(const char* filePath)
+	{
+		Close();
+#if defined(_WIN32)
+		file = CreateFileA(filePath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		LARGE_INTEGER fileSize;
+		if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize)) {
+			std::cerr << "Could not read file " << filePath << ". File does not exist." << std::endl;
+			Close();
+			return false;
+		}
+		size = (size_t)fileSize.QuadPart;
+		if (size > 0)
+		{
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			data = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+		}
+#else
+		descriptor = open(filePath, O_RDONLY);
+		struct stat status;
+		if (descriptor < 0 || fstat(descriptor, &status) != 0) {
+			std::cerr << "Could not read file " << filePath << ". File does not exist." << std::endl;
+			Close();
+			return false;
+		}
+		size = (size_t)status.st_size;
+		if (size > 0)
+		{
+			void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+			data = view != MAP_FAILED ? (const char*)view : nullptr;
+		}
+#endif
+		if (size > 0 && !data) {
+			std::cerr << "Could not map file " << filePath << "." << std::endl;
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	void Close()
+	{
+#if defined(_WIN32)
+		if (data)
+			UnmapViewOfFile(data);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data)
+			munmap((void*)data, size);
+		if (descriptor >= 0)
+			close(descriptor);
+		descriptor = -1;
+#endif
+		data = nullptr;
+		size = 0;
+	}
+};
+
+/* Size and last write time of a file, to tell when something derived from it is out of date */
+bool fileStamp(const char* filePath, glm::uint64& size, glm::uint64& writeTime)
+{
+#if defined(_WIN32)
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExA(filePath, GetFileExInfoStandard, &attributes))
+		return false;
+	size = (glm::uint64)attributes.nFileSizeHigh << 32 | attributes.nFileSizeLow;
+	writeTime = (glm::uint64)attributes.ftLastWriteTime.dwHighDateTime << 32 | attributes.ftLastWriteTime.dwLowDateTime;
+#else
+	struct stat status;
+	if (stat(filePath, &status) != 0)
+		return false;
+	size = (glm::uint64)status.st_size;
+#if defined(__APPLE__)
+	writeTime = (glm::uint64)status.st_mtimespec.tv_sec * 1000000000ull + (glm::uint64)status.st_mtimespec.tv_nsec;
+#else
+	writeTime = (glm::uint64)status.st_mtim.tv_sec * 1000000000ull + (glm::uint64)status.st_mtim.tv_nsec;
+#endif
+#endif
+	return true;
+}
+
+// Resources
+// ---------------------------------
+
+/* Read a whole file into content with one read of its size. Text is kept as it is on disk */
+bool readFile(const char* filePath, std::string& content)
+{
+	std::ifstream fileStream(filePath, std::ios::in | std::ios::binary | std::ios::ate);
+	if (!fileStream.is_open()) {
+		std::cerr << "Could not read file " << filePath << ". File does not exist." << std::endl;
+		return false;
+	}
+	std::streamoff size = fileStream.tellg();
+	content.resize(size > 0 ? (size_t)size : 0);
+	fileStream.seekg(0, std::ios::beg);
+	if (size > 0 && !fileStream.read(&content[0], size)) {
+		std::cerr << "Could not read file " << filePath << "." << std::endl;
+		content.clear();
+		return false;
+	}
+	return true;
+}
+
+/* Directory of the running executable, or "." when it cannot be found */
+std::string executableDirectory()
+{
+	std::string path;
+#if defined(_WIN32)
+	char buffer[MAX_PATH];
+	DWORD length = GetModuleFileNameA(nullptr, buffer, sizeof(buffer));
+	if (length > 0 && length < sizeof(buffer))
+		path.assign(buffer, length);
+#elif defined(__APPLE__)
+	char buffer[4096];
+	uint32_t length = sizeof(buffer);
+	if (_NSGetExecutablePath(buffer, &length) == 0)
+		path = buffer;
+#else
+	char buffer[4096];
+	ssize_t length = readlink("/proc/self/exe", buffer, sizeof(buffer));
+	if (length > 0 && length < (ssize_t)sizeof(buffer))
+		path.assign(buffer, length);
+#endif
+	size_t slash = path.find_last_of("/\\");
+	return slash == std::string::npos ? std::string(".") : path.substr(0, slash);
+}
+
+bool directoryExists(const std::string& path)
+{
+#if defined(_WIN32)
+	DWORD attributes = GetFileAttributesA(path.c_str());
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	struct stat status;
+	return stat(path.c_str(), &status) == 0 && S_ISDIR(status.st_mode);
+#endif
+}
+
+/* Bytes of a cached resource, valid until it is released. Not followed by a 0: mapped files end
+   where the file does */
+struct ResourceView
+{
+	const char* data;
+	size_t size;
+	ResourceView() : data(nullptr), size(0) {}
+};
+
+/* A file held by the resource cache, read whole or mapped */
+struct CachedResource
+{
+	std::string content;
+	MappedFile mapping;
+	bool mapped;
+	CachedResource() : mapped(false) {}
+};
+
+/* Hit and load counters since the cache was created */
+struct ResourceStats
+{
+	unsigned int hits;
+	unsigned int filesRead;
+	unsigned int filesMapped;
+	size_t bytesRead;
+	size_t bytesMapped;
+	double loadMilliseconds;
+	ResourceStats() : hits(0), filesRead(0), filesMapped(0), bytesRead(0), bytesMapped(0), loadMilliseconds(0.0) {}
+};
+
+/* Loads files once and hands out views of them. Names are relative to the res directory, found by
+   walking up from the executable's directory, then from the working directory, so the application
+   runs from anywhere in the tree. Files up to mapThreshold bytes are read whole, larger ones are
+   mapped so only the pages touched are ever read. Render thread only */
+struct ResourceCache
+{
+	std::string root;
+	size_t mapThreshold;
+	std::unordered_map<std::string, std::unique_ptr<CachedResource>> entries;
+	ResourceStats stats;
+
+	ResourceCache() : mapThreshold(1 << 20) {}
+
+	// The res directory, located on first use. Falls back to the layout of the build directories
+	const std::string& Root()
+	{
+		if (!root.empty())
+			return root;
+		std::string starts[2] = { executableDirectory(), "." };
+		for (int s = 0; s < 2 && root.empty(); s++)
+		{
+			std::string directory = starts[s];
+			for (int up = 0; up < 4 && root.empty(); up++, directory += "/..")
+			{
+				if (directoryExists(directory + "/res/shaders"))
+					root = directory + "/res";
+			}
+		}
+		if (root.empty())
+			root = "../../res";
+		return root;
+	}
+
+	std::string Path(const std::string& name)
+	{
+		bool absolute = !name.empty() && (name[0] == '/' || name[0] == '\\' || (name.size() > 1 && name[1] == ':'));
+		return absolute ? name : Root() + "/" + name;
+	}
+
+	// View the contents of a resource, loading it the first time. Returns false when it cannot be read
+	bool Load(const std::string& name, ResourceView& view)
+	{
+		std::string path = Path(name);
+		std::unordered_map<std::string, std::unique_ptr<CachedResource>>::iterator it = entries.find(path);
+		if (it != entries.end())
+		{
+			stats.hits++;
+			view = View(*it->second);
+			return true;
+		}
+
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		std::unique_ptr<CachedResource> resource(new CachedResource());
+		glm::uint64 size = 0, writeTime = 0;
+		resource->mapped = fileStamp(path.c_str(), size, writeTime) && size > mapThreshold;
+		if (resource->mapped ? !resource->mapping.Open(path.c_str()) : !readFile(path.c_str(), resource->content))
+			return false;
+		if (resource->mapped)
+		{
+			stats.filesMapped++;
+			stats.bytesMapped += resource->mapping.size;
+		}
+		else
+		{
+			stats.filesRead++;
+			stats.bytesRead += resource->content.size();
+		}
+		view = View(*resource);
+		entries[path] = std::move(resource);
+		stats.loadMilliseconds += elapsedMilliseconds(start);
+		return true;
+	}
+
+	// A resource as a string, empty when it cannot be read
+	std::string Text(const std::string& name)
+	{
+		ResourceView view;
+		return Load(name, view) ? std::string(view.data ? view.data : "", view.size) : std::string();
+	}
+
+	// Drop a resource, invalidating its views, so the next Load reads it again
+	void Release(const std::string& name)
+	{
+		entries.erase(Path(name));
+	}
+
+	void Clear()
+	{
+		entries.clear();
+	}
+
+	static ResourceView View(const CachedResource& resource)
+	{
+		ResourceView view;
+		view.data = resource.mapped ? resource.mapping.data : resource.content.data();
+		view.size = resource.mapped ? resource.mapping.size : resource.content.size();
+		return view;
+	}
+};
+
+// Shaders and other files under res
+ResourceCache resources;
+
+// Mesh Import
+// ---------------------------------
+
+/* Interleaved vertex produced by the importers */
+struct ImportVertex
+{
+	glm::vec3 position;
+	glm::vec3 normal;
+	glm::vec2 texCoord;
+};
+
+// Normals and colours share the attribute numbers of LitVertexFormat, texture coordinates follow them
+const VertexFormat ImportVertexFormat = { sizeof(ImportVertex), 3, { { 0, 3, GL_FLOAT, GL_FALSE, 0 },
+	{ 6, 3, GL_FLOAT, GL_FALSE, offsetof(ImportVertex, normal) }, { 8, 2, GL_FLOAT, GL_FALSE, offsetof(ImportVertex, texCoord) } } };
+
+/* An imported triangle mesh, welded and ready for GeometryRegistry::Add with ImportVertexFormat */
+struct ImportedMesh
+{
+	std::vector<ImportVertex> vertices;
+	std::vector<unsigned int> indices;
+	BoundingVolume bounds;
+};
+
+// Exact powers of ten for the float parser
+const double PowersOfTen[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+	1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+/* Parses a decimal number such as 3, -0.25 or 1.5e-3 at p, stopping at end, and moves p past it.
+   Up to 19 significant digits are accumulated in an integer and scaled once by a power of ten, which
+   stays within one float ulp of strtod. Leaves p in place when there is no number */
+inline float parseFloat(const char*& p, const char* end)
+{
+	const char* start = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+	unsigned long long mantissa = 0;
+	int significant = 0, exponent = 0;
+	bool digits = false;
+	for (; p < end && (unsigned int)(*p - '0') < 10; p++, digits = true)
+	{
+		if (significant < 19)
+		{
+			mantissa = mantissa * 10 + (*p - '0');
+			significant += mantissa != 0;
+		}
+		else
+			exponent++;
+	}
+	if (p < end && *p == '.')
+	{
+		for (p++; p < end && (unsigned int)(*p - '0') < 10; p++, digits = true)
+		{
+			if (significant < 19)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				significant += mantissa != 0;
+				exponent--;
+			}
+		}
+	}
+	if (!digits)
+	{
+		p = start;
+		return 0.0f;
+	}
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		const char* e = p + 1;
+		bool negativeExponent = false;
+		if (e < end && (*e == '-' || *e == '+'))
+			negativeExponent = *e++ == '-';
+		if (e < end && (unsigned int)(*e - '0') < 10)
+		{
+			int value = 0;
+			for (; e < end && (unsigned int)(*e - '0') < 10; e++)
+				value = std::min(value * 10 + (*e - '0'), 100000);
+			exponent += negativeExponent ? -value : value;
+			p = e;
+		}
+	}
+	double value = (double)mantissa;
+	if (exponent < -22 || exponent > 22)
+		value *= std::pow(10.0, exponent);
+	else if (exponent < 0)
+		value /= PowersOfTen[-exponent];
+	else
+		value *= PowersOfTen[exponent];
+	return (float)(negative ? -value : value);
+}
+
+/* Parses a decimal integer at p, moving p past it. Returns false when there is none or it does not
+   fit in an int */
+inline bool parseInt(const char*& p, const char* end, int& value)
+{
+	bool negative = false;
+	const char* start = p;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+	if (p == end || (unsigned int)(*p - '0') >= 10)
+	{
+		p = start;
+		return false;
+	}
+	int magnitude = 0;
+	for (; p < end && (unsigned int)(*p - '0') < 10; p++)
+	{
+		if (magnitude > (INT_MAX - (*p - '0')) / 10)
+		{
+			p = start;
+			return false;
+		}
+		magnitude = magnitude * 10 + (*p - '0');
+	}
+	value = negative ? -magnitude : magnitude;
+	return true;
+}
+
+inline void skipBlanks(const char*& p, const char* end)
+{
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+}
+
+/* Welds equal vertices. keys holds count keys of keySize bytes, compared bytewise; remap receives the
+   unique vertex of every key, numbered in order of first appearance, and firsts the first key of every
+   unique vertex. Returns the number of unique vertices */
+unsigned int weldVertices(const void* keys, size_t keySize, size_t count, std::vector<unsigned int>& remap, std::vector<unsigned int>& firsts)
+{
+	// Open addressing table of first keys, at most half full
+	size_t tableSize = 16;
+	while (tableSize < count * 2)
+		tableSize *= 2;
+	std::vector<unsigned int> table(tableSize, InvalidVertex);
+	remap.resize(count);
+	firsts.clear();
+	const unsigned char* bytes = (const unsigned char*)keys;
+	for (size_t i = 0; i < count; i++)
+	{
+		const unsigned char* key = bytes + i * keySize;
+		unsigned int hash = 2166136261u;
+		for (size_t b = 0; b + 4 <= keySize; b += 4)
+		{
+			unsigned int word;
+			memcpy(&word, key + b, 4);
+			hash = (hash ^ word) * 16777619u;
+		}
+		hash ^= hash >> 15;
+		hash *= 0x2C1B3C6Du;
+		hash ^= hash >> 12;
+		for (size_t slot = hash & (tableSize - 1); ; slot = (slot + 1) & (tableSize - 1))
+		{
+			unsigned int first = table[slot];
+			if (first == InvalidVertex)
+			{
+				table[slot] = (unsigned int)i;
+				remap[i] = (unsigned int)firsts.size();
+				firsts.push_back((unsigned int)i);
+				break;
+			}
+			if (memcmp(bytes + (size_t)first * keySize, key, keySize) == 0)
+			{
+				remap[i] = remap[first];
+				break;
+			}
+		}
+	}
+	return (unsigned int)firsts.size();
+}
+
+/* Area-weighted smooth normals for the vertices whose normal is zero */
+void generateMissingNormals(ImportedMesh& mesh)
+{
+	std::vector<glm::vec3> generated(mesh.vertices.size(), glm::vec3(0.0f));
+	bool missing = false;
+	for (size_t v = 0; v < mesh.vertices.size() && !missing; v++)
+		missing = mesh.vertices[v].normal == glm::vec3(0.0f);
+	if (!missing)
+		return;
+	for (size_t i = 0; i + 3 <= mesh.indices.size(); i += 3)
+	{
+		const unsigned int* triangle = &mesh.indices[i];
+		glm::vec3 normal = glm::cross(mesh.vertices[triangle[1]].position - mesh.vertices[triangle[0]].position,
+			mesh.vertices[triangle[2]].position - mesh.vertices[triangle[0]].position);
+		for (int k = 0; k < 3; k++)
+			generated[triangle[k]] += normal;
+	}
+	for (size_t v = 0; v < mesh.vertices.size(); v++)
+	{
+		float length = glm::length(generated[v]);
+		if (mesh.vertices[v].normal == glm::vec3(0.0f) && length > 0.0f)
+			mesh.vertices[v].normal = generated[v] / length;
+	}
+}
+
+/* One corner of an OBJ face: position, texture coordinate and normal numbers, -1 when absent. While a
+   chunk is parsed, negative references are kept relative to the chunk's own counts */
+struct ObjCorner
+{
+	int index[3];
+};
+
+/* A line-aligned slice of an OBJ file, parsed on its own */
+struct ObjChunk
+{
+	const char* begin;
+	const char* end;
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec2> texCoords;
+	std::vector<glm::vec3> normals;
+	std::vector<ObjCorner> corners;		// triangulated faces
+	std::vector<unsigned char> relative;	// per corner, bit k set when index[k] counts back from the chunk's end so far
+	unsigned int base[3];					// positions, texture coordinates and normals in earlier chunks
+	bool malformed;
+};
+
+/* A parsed JSON value. Object members keep their file order, with names in keys and values in elements */
+struct JsonValue
+{
+	enum Type { Null, Boolean, Number, String, Array, Object };
+
+	Type type;
+	double number;
+	std::string string;
+	std::vector<std::string> keys;
+	std::vector<JsonValue> elements;
+
+	JsonValue() : type(Null), number(0.0) {}
+
+	const JsonValue* Find(const char* key) const
+	{
+		for (size_t i = 0; i < keys.size(); i++)
+		{
+			if (keys[i] == key)
+				return &elements[i];
+		}
+		return nullptr;
+	}
+
+	double NumberOr(const char* key, double fallback) const
+	{
+		const JsonValue* member = Find(key);
+		return member && member->type == Number ? member->number : fallback;
+	}
+
+	// A member holding a byte count or offset, fallback when there is none. Returns false when it is
+	// negative, fractional or too large for a double to hold exactly
+	bool SizeOr(const char* key, size_t fallback, size_t& value) const
+	{
+		double number = NumberOr(key, (double)fallback);
+		if (!(number >= 0.0 && number <= 9007199254740992.0 && number == std::floor(number)) || number > (double)SIZE_MAX)
+			return false;
+		value = (size_t)number;
+		return true;
+	}
+
+	size_t Size() const { return type == Array ? elements.size() : 0; }
+};
+
+inline void skipJsonSpace(const char*& p, const char* end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+		p++;
+}
+
+/* Reads the four hex digits after the u of a \u escape at p, leaving p on the last one */
+inline bool parseJsonHex(const char*& p, const char* end, unsigned int& value)
+{
+	if (end - p < 5)
+		return false;
+	value = 0;
+	for (int d = 1; d <= 4; d++)
+	{
+		char c = p[d];
+		int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+		if (digit < 0)
+			return false;
+		value = value * 16 + (unsigned int)digit;
+	}
+	p += 4;
+	return true;
+}
+
+bool parseJsonString(const char*& p, const char* end, std::string& out)
+{
+	out.clear();
+	for (p++; p < end && *p != '"'; p++)
+	{
+		if (*p != '\\')
+		{
+			out += *p;
+			continue;
+		}
+		if (++p == end)
+			return false;
+		switch (*p)
+		{
+		case 'b': out += '\b'; break;
+		case 'f': out += '\f'; break;
+		case 'n': out += '\n'; break;
+		case 'r': out += '\r'; break;
+		case 't': out += '\t'; break;
+		case 'u':
+		{
+			// Code points are written out as UTF-8, surrogate pairs combined
+			unsigned int code, low;
+			if (!parseJsonHex(p, end, code))
+				return false;
+			if (code >= 0xD800 && code <= 0xDBFF && end - p > 6 && p[1] == '\\' && p[2] == 'u')
+			{
+				p += 2;
+				if (!parseJsonHex(p, end, low))
+					return false;
+				code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+			}
+			if (code < 0x80)
+				out += (char)code;
+			else if (code < 0x800)
+			{
+				out += (char)(0xC0 | (code >> 6));
+				out += (char)(0x80 | (code & 0x3F));
+			}
+			else if (code < 0x10000)
+			{
+				out += (char)(0xE0 | (code >> 12));
+				out += (char)(0x80 | ((code >> 6) & 0x3F));
+				out += (char)(0x80 | (code & 0x3F));
+			}
+			else
+			{
+				out += (char)(0xF0 | (code >> 18));
+				out += (char)(0x80 | ((code >> 12) & 0x3F));
+				out += (char)(0x80 | ((code >> 6) & 0x3F));
+				out += (char)(0x80 | (code & 0x3F));
+			}
+			break;
+		}
+		default: out += *p; break;
+		}
+	}
+	if (p == end)
+		return false;
+	p++;
+	return true;
+}
+
+/* Parses the JSON value at p, moving p past it. Returns false on malformed input */
+bool parseJson(const char*& p, const char* end, JsonValue& value, int depth = 0)
+{
+	skipJsonSpace(p, end);
+	if (p == end || depth > 64)
+		return false;
+	if (*p == '{' || *p == '[')
+	{
+		bool object = *p == '{';
+		char close = object ? '}' : ']';
+		value.type = object ? JsonValue::Object : JsonValue::Array;
+		p++;
+		skipJsonSpace(p, end);
+		if (p < end && *p == close)
+		{
+			p++;
+			return true;
+		}
+		while (p < end)
+		{
+			if (object)
+			{
+				std::string key;
+				skipJsonSpace(p, end);
+				if (p == end || *p != '"' || !parseJsonString(p, end, key))
+					return false;
+				skipJsonSpace(p, end);
+				if (p == end || *p++ != ':')
+					return false;
+				value.keys.push_back(key);
+			}
+			value.elements.push_back(JsonValue());
+			if (!parseJson(p, end, value.elements.back(), depth + 1))
+				return false;
+			skipJsonSpace(p, end);
+			if (p < end && *p == ',')
+				p++;
+			else if (p < end && *p == close)
+			{
+				p++;
+				return true;
+			}
+			else
+				return false;
+		}
+		return false;
+	}
+	if (*p == '"')
+	{
+		value.type = JsonValue::String;
+		return parseJsonString(p, end, value.string);
+	}
+	const char* literals[] = { "true", "false", "null" };
+	for (int l = 0; l < 3; l++)
+	{
+		size_t length = strlen(literals[l]);
+		if ((size_t)(end - p) >= length && memcmp(p, literals[l], length) == 0)
+		{
+			value.type = l < 2 ? JsonValue::Boolean : JsonValue::Null;
+			value.number = l == 0 ? 1.0 : 0.0;
+			p += length;
+			return true;
+		}
+	}
+
+	// Numbers go through strtod on a terminated copy, as the mapped text is not terminated
+	char number[64];
+	size_t length = 0;
+	while (p + length < end && length + 1 < sizeof(number) && strchr("+-0123456789.eE", p[length]) && p[length])
+	{
+		number[length] = p[length];
+		length++;
+	}
+	number[length] = 0;
+	char* parsed;
+	value.type = JsonValue::Number;
+	value.number = strtod(number, &parsed);
+	if (parsed == number)
+		return false;
+	p += parsed - number;
+	return true;
+}
+
+/* Decodes the base64 text in [p, end), as in glTF data URIs */
+bool decodeBase64(const char* p, const char* end, std::vector<unsigned char>& out)
+{
+	out.clear();
+	out.reserve((end - p) / 4 * 3);
+	unsigned int bits = 0;
+	int bitCount = 0;
+	for (; p < end && *p != '='; p++)
+	{
+		char c = *p;
+		int digit = c >= 'A' && c <= 'Z' ? c - 'A' : c >= 'a' && c <= 'z' ? c - 'a' + 26 : c >= '0' && c <= '9' ? c - '0' + 52
+			: c == '+' ? 62 : c == '/' ? 63 : -1;
+		if (digit < 0)
+			return false;
+		bits = (bits << 6) | (unsigned int)digit;
+		bitCount += 6;
+		if (bitCount >= 8)
+		{
+			bitCount -= 8;
+			out.push_back((unsigned char)(bits >> bitCount));
+		}
+	}
+	return true;
+}
+
+/* A glTF buffer in memory: the GLB binary chunk, a mapped .bin file or a decoded data URI */
+struct GltfBuffer
+{
+	const unsigned char* data;
+	size_t size;
+};
+
+/* Where the elements of a glTF accessor are: the first one, the distance between them and their layout */
+struct GltfAccessor
+{
+	const unsigned char* data;
+	size_t stride;
+	size_t count;
+	int componentType;
+	int components;
+	bool normalized;
+};
+
+/* Resolves an accessor through its buffer view, checking that every element lies inside the buffer.
+   Sparse accessors and accessors without a buffer view are not supported */
+bool resolveGltfAccessor(const JsonValue& root, const std::vector<GltfBuffer>& buffers, const JsonValue* index, GltfAccessor& accessor)
+{
+	const JsonValue* accessors = root.Find("accessors");
+	const JsonValue* views = root.Find("bufferViews");
+	if (!index || index->type != JsonValue::Number || !accessors || !views || index->number < 0 || index->number >= accessors->Size())
+		return false;
+	const JsonValue& description = accessors->elements[(size_t)index->number];
+	const JsonValue* type = description.Find("type");
+	const char* types[] = { "SCALAR", "VEC2", "VEC3", "VEC4" };
+	accessor.components = 0;
+	for (int t = 0; t < 4 && type; t++)
+		accessor.components = type->string == types[t] ? t + 1 : accessor.components;
+	accessor.componentType = (int)description.NumberOr("componentType", 0);
+	int componentSize = accessor.componentType == GL_BYTE || accessor.componentType == GL_UNSIGNED_BYTE ? 1
+		: accessor.componentType == GL_SHORT || accessor.componentType == GL_UNSIGNED_SHORT ? 2
+		: accessor.componentType == GL_UNSIGNED_INT || accessor.componentType == GL_FLOAT ? 4 : 0;
+	double viewIndex = description.NumberOr("bufferView", -1.0);
+	if (accessor.components == 0 || componentSize == 0 || viewIndex < 0 || viewIndex >= views->Size())
+		return false;
+	const JsonValue& view = views->elements[(size_t)viewIndex];
+	double bufferIndex = view.NumberOr("buffer", -1.0);
+	if (bufferIndex < 0 || bufferIndex >= buffers.size())
+		return false;
+	const GltfBuffer& buffer = buffers[(size_t)bufferIndex];
+
+	size_t elementSize = (size_t)componentSize * accessor.components;
+	size_t viewOffset, viewLength, offset;
+	if (!view.SizeOr("byteOffset", 0, viewOffset) || !view.SizeOr("byteLength", 0, viewLength) || !description.SizeOr("byteOffset", 0, offset)
+		|| !view.SizeOr("byteStride", elementSize, accessor.stride) || !description.SizeOr("count", 0, accessor.count))
+		return false;
+	accessor.normalized = description.Find("normalized") && description.Find("normalized")->number != 0.0;
+	if (viewOffset > buffer.size || viewLength > buffer.size - viewOffset || accessor.stride < elementSize
+		|| (accessor.count > 0 && (offset > viewLength || (viewLength - offset - elementSize) / accessor.stride < accessor.count - 1 || viewLength - offset < elementSize)))
+		return false;
+	accessor.data = buffer.data + viewOffset + offset;
+	return true;
+}
+
+/* Reads component c of element i as a float, scaling normalized integers to [0, 1] */
+inline float gltfComponent(const GltfAccessor& accessor, size_t i, int c)
+{
+	const unsigned char* element = accessor.data + i * accessor.stride;
+	if (accessor.componentType == GL_FLOAT)
+	{
+		float value;
+		memcpy(&value, element + c * 4, 4);
+		return value;
+	}
+	if (accessor.componentType == GL_UNSIGNED_BYTE)
+		return element[c] * (accessor.normalized ? 1.0f / 255.0f : 1.0f);
+	unsigned short value;
+	memcpy(&value, element + c * 2, 2);
+	return value * (accessor.normalized ? 1.0f / 65535.0f : 1.0f);
+}
+
+inline unsigned int gltfIndex(const GltfAccessor& accessor, size_t i)
+{
+	const unsigned char* element = accessor.data + i * accessor.stride;
+	if (accessor.componentType == GL_UNSIGNED_BYTE)
+		return *element;
+	if (accessor.componentType == GL_UNSIGNED_SHORT)
+	{
+		unsigned short value;
+		memcpy(&value, element, 2);
+		return value;
+	}
+	unsigned int value;
+	memcpy(&value, element, 4);
+	return value;
+}
+
+/* A glTF triangle primitive and where its vertices and indices go in the imported mesh */
+struct GltfPrimitive
+{
+	GltfAccessor position;
+	GltfAccessor normal;
+	GltfAccessor texCoord;
+	GltfAccessor indices;
+	bool hasNormal;
+	bool hasTexCoord;
+	bool indexed;
+	size_t firstVertex;
+	size_t firstIndex;
+};
+
+/* Imports OBJ and glTF 2.0 (.gltf with external or embedded buffers, and .glb) triangle meshes from
+   memory-mapped files into a single welded ImportedMesh. OBJ files are parsed in line-aligned chunks
+   on threadCount threads. Groups, materials and glTF node transforms are ignored */
+struct MeshImporter
+{
+	unsigned int threadCount;
+
+	// Last import
+	size_t bytesRead;
+	double parseTime;
+	double weldTime;
+	unsigned int cornerCount;
+
+	MeshImporter() : threadCount(std::max(1u, std::thread::hardware_concurrency())), bytesRead(0), parseTime(0.0), weldTime(0.0), cornerCount(0) {}
+
+	bool Import(const char* filePath, ImportedMesh& mesh)
+	{
+		std::string path(filePath);
+		std::string extension = path.substr(path.find_last_of('.') == std::string::npos ? path.size() : path.find_last_of('.'));
+		std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+		if (extension == ".obj")
+			return ImportObj(filePath, mesh);
+		if (extension == ".gltf" || extension == ".glb")
+			return ImportGltf(filePath, mesh);
+		std::cerr << "Could not import " << filePath << ". Unknown mesh format." << std::endl;
+		return false;
+	}
+
+	bool ImportObj(const char* filePath, ImportedMesh& mesh)
+	{
+		MappedFile file;
+		if (!file.Open(filePath))
+			return false;
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		bytesRead = file.size;
+
+		// Chunks of about 1MB, split after a newline
+		size_t chunkCount = std::max<size_t>(1, std::min<size_t>(file.size >> 20, threadCount * 16));
+		std::vector<ObjChunk> chunks(chunkCount);
+		const char* end = file.data + file.size;
+		for (size_t c = 0; c < chunkCount; c++)
+		{
+			const char* begin = c == 0 ? file.data : chunks[c - 1].end;
+			const char* split = c + 1 == chunkCount ? end : std::max(begin, file.data + file.size / chunkCount * (c + 1));
+			const char* newline = split < end ? (const char*)memchr(split, '\n', end - split) : nullptr;
+			chunks[c].begin = begin;
+			chunks[c].end = c + 1 == chunkCount || !newline ? end : newline + 1;
+		}
+
+		std::atomic<int> nextChunk(0);
+		std::vector<std::thread> workers;
+		for (unsigned int w = 1; w < std::min<size_t>(threadCount, chunkCount); w++)
+			workers.push_back(std::thread([&]() { for (int c; (c = nextChunk++) < (int)chunkCount;) ParseObjChunk(chunks[c]); }));
+		for (int c; (c = nextChunk++) < (int)chunkCount;)
+			ParseObjChunk(chunks[c]);
+		for (size_t w = 0; w < workers.size(); w++)
+			workers[w].join();
+
+		// Number every chunk's elements after the earlier chunks', then resolve the corners to global numbers
+		unsigned int totals[3] = { 0, 0, 0 };
+		size_t corners = 0;
+		for (size_t c = 0; c < chunkCount; c++)
+		{
+			if (chunks[c].malformed) {
+				std::cerr << "Could not import " << filePath << ". Malformed face." << std::endl;
+				return false;
+			}
+			memcpy(chunks[c].base, totals, sizeof(totals));
+			totals[0] += (unsigned int)chunks[c].positions.size();
+			totals[1] += (unsigned int)chunks[c].texCoords.size();
+			totals[2] += (unsigned int)chunks[c].normals.size();
+			corners += chunks[c].corners.size();
+		}
+		std::vector<ObjCorner> resolved(corners);
+		std::vector<glm::vec3> positions, normals;
+		std::vector<glm::vec2> texCoords;
+		positions.reserve(totals[0]);
+		texCoords.reserve(totals[1]);
+		normals.reserve(totals[2]);
+		size_t written = 0;
+		for (size_t c = 0; c < chunkCount; c++)
+		{
+			const ObjChunk& chunk = chunks[c];
+			positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+			texCoords.insert(texCoords.end(), chunk.texCoords.begin(), chunk.texCoords.end());
+			normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+			for (size_t i = 0; i < chunk.corners.size(); i++)
+			{
+				ObjCorner& corner = resolved[written++];
+				for (int k = 0; k < 3; k++)
+				{
+					int index = chunk.corners[i].index[k];
+					bool relative = (chunk.relative[i] & (1 << k)) != 0;
+					corner.index[k] = relative ? (int)chunk.base[k] + index : index;
+					if (!relative && index == -1)
+						continue;
+					if (corner.index[k] < 0 || corner.index[k] >= (int)totals[k]) {
+						std::cerr << "Could not import " << filePath << ". Face refers to a missing vertex." << std::endl;
+						return false;
+					}
+				}
+			}
+		}
+		parseTime = elapsedMilliseconds(start);
+
+		// Weld corners with the same position, texture coordinate and normal
+		start = std::chrono::high_resolution_clock::now();
+		std::vector<unsigned int> firsts;
+		unsigned int vertexCount = weldVertices(resolved.data(), sizeof(ObjCorner), corners, mesh.indices, firsts);
+		mesh.vertices.resize(vertexCount);
+		for (unsigned int v = 0; v < vertexCount; v++)
+		{
+			const ObjCorner& corner = resolved[firsts[v]];
+			ImportVertex& vertex = mesh.vertices[v];
+			vertex.position = positions[corner.index[0]];
+			vertex.texCoord = corner.index[1] >= 0 ? texCoords[corner.index[1]] : glm::vec2(0.0f);
+			vertex.normal = corner.index[2] >= 0 ? normals[corner.index[2]] : glm::vec3(0.0f);
+		}
+		generateMissingNormals(mesh);
+		mesh.bounds = computeBounds(vertexCount ? &mesh.vertices[0].position : nullptr, vertexCount, sizeof(ImportVertex));
+		weldTime = elapsedMilliseconds(start);
+		cornerCount = (unsigned int)corners;
+		return true;
+	}
+
+	static void ParseObjChunk(ObjChunk& chunk)
+	{
+		chunk.malformed = false;
+		std::vector<ObjCorner> polygon;
+		std::vector<unsigned char> polygonRelative;
+		for (const char* p = chunk.begin; p < chunk.end;)
+		{
+			const char* lineEnd = (const char*)memchr(p, '\n', chunk.end - p);
+			if (!lineEnd)
+				lineEnd = chunk.end;
+			skipBlanks(p, lineEnd);
+			if (lineEnd - p > 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+			{
+				p += 2;
+				skipBlanks(p, lineEnd);
+				glm::vec3 position;
+				for (int k = 0; k < 3; k++, skipBlanks(p, lineEnd))
+					position[k] = parseFloat(p, lineEnd);
+				chunk.positions.push_back(position);
+			}
+			else if (lineEnd - p > 3 && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t'))
+			{
+				p += 3;
+				skipBlanks(p, lineEnd);
+				glm::vec2 texCoord;
+				for (int k = 0; k < 2; k++, skipBlanks(p, lineEnd))
+					texCoord[k] = parseFloat(p, lineEnd);
+				chunk.texCoords.push_back(texCoord);
+			}
+			else if (lineEnd - p > 3 && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t'))
+			{
+				p += 3;
+				skipBlanks(p, lineEnd);
+				glm::vec3 normal;
+				for (int k = 0; k < 3; k++, skipBlanks(p, lineEnd))
+					normal[k] = parseFloat(p, lineEnd);
+				chunk.normals.push_back(normal);
+			}
+			else if (lineEnd - p > 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+			{
+				// Corners are v, v/vt, v//vn or v/vt/vn, 1-based or negative from the last element so far
+				polygon.clear();
+				polygonRelative.clear();
+				unsigned int counts[3] = { (unsigned int)chunk.positions.size(), (unsigned int)chunk.texCoords.size(), (unsigned int)chunk.normals.size() };
+				for (p++, skipBlanks(p, lineEnd); p < lineEnd && *p != '\r' && *p != '#'; skipBlanks(p, lineEnd))
+				{
+					ObjCorner corner = { { -1, -1, -1 } };
+					unsigned char relative = 0;
+					for (int k = 0; k < 3; k++)
+					{
+						int value;
+						if (k > 0)
+						{
+							if (p == lineEnd || *p != '/')
+								break;
+							p++;
+						}
+						if (!parseInt(p, lineEnd, value))
+						{
+							if (k == 1)
+								continue;
+							chunk.malformed = true;
+							return;
+						}
+						if (value == 0)
+						{
+							chunk.malformed = true;
+							return;
+						}
+						corner.index[k] = value > 0 ? value - 1 : (int)counts[k] + value;
+						relative |= (unsigned char)(value < 0 ? 1 << k : 0);
+					}
+					polygon.push_back(corner);
+					polygonRelative.push_back(relative);
+				}
+				for (size_t i = 2; i < polygon.size(); i++)
+				{
+					size_t fan[3] = { 0, i - 1, i };
+					for (int k = 0; k < 3; k++)
+					{
+						chunk.corners.push_back(polygon[fan[k]]);
+						chunk.relative.push_back(polygonRelative[fan[k]]);
+					}
+				}
+			}
+			p = lineEnd + 1;
+		}
+	}
+
+	bool ImportGltf(const char* filePath, ImportedMesh& mesh)
+	{
+		MappedFile file;
+		if (!file.Open(filePath))
+			return false;
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		bytesRead = file.size;
+
+		// A .glb is a 12 byte header followed by a JSON chunk and an optional binary chunk
+		const char* json = file.data;
+		size_t jsonSize = file.size;
+		GltfBuffer binary = { nullptr, 0 };
+		if (file.size >= 12 && memcmp(file.data, "glTF", 4) == 0)
+		{
+			unsigned int header[3];
+			memcpy(header, file.data, sizeof(header));
+			json = nullptr;
+			for (size_t offset = 12; header[1] == 2 && offset + 8 <= file.size;)
+			{
+				unsigned int chunk[2];
+				memcpy(chunk, file.data + offset, sizeof(chunk));
+				if (chunk[0] > file.size - offset - 8)
+					break;
+				if (chunk[1] == 0x4E4F534A)
+				{
+					json = file.data + offset + 8;
+					jsonSize = chunk[0];
+				}
+				else if (chunk[1] == 0x004E4942)
+				{
+					binary.data = (const unsigned char*)file.data + offset + 8;
+					binary.size = chunk[0];
+				}
+				offset += 8 + (size_t)chunk[0];
+			}
+		}
+		JsonValue root;
+		const char* p = json;
+		if (!json || !parseJson(p, json + jsonSize, root) || root.type != JsonValue::Object) {
+			std::cerr << "Could not import " << filePath << ". Not a glTF 2.0 file." << std::endl;
+			return false;
+		}
+
+		// Buffers: the GLB binary chunk, data URIs or files next to the .gltf
+		const JsonValue* bufferList = root.Find("buffers");
+		size_t bufferCount = bufferList ? bufferList->Size() : 0;
+		std::vector<GltfBuffer> buffers(bufferCount);
+		std::vector<MappedFile> bufferFiles(bufferCount);
+		std::vector<std::vector<unsigned char> > decoded(bufferCount);
+		std::string path(filePath);
+		std::string directory = path.substr(0, path.find_last_of("/\\") == std::string::npos ? 0 : path.find_last_of("/\\") + 1);
+		for (size_t b = 0; b < bufferCount; b++)
+		{
+			const JsonValue* uri = bufferList->elements[b].Find("uri");
+			buffers[b].data = nullptr;
+			buffers[b].size = 0;
+			if (!uri && b == 0)
+				buffers[b] = binary;
+			else if (uri && uri->string.compare(0, 5, "data:") == 0)
+			{
+				size_t comma = uri->string.find(',');
+				if (comma != std::string::npos && uri->string.rfind(";base64", comma) != std::string::npos
+					&& decodeBase64(uri->string.data() + comma + 1, uri->string.data() + uri->string.size(), decoded[b]))
+				{
+					buffers[b].data = decoded[b].data();
+					buffers[b].size = decoded[b].size();
+				}
+			}
+			else if (uri && bufferFiles[b].Open((directory + uri->string).c_str()))
+			{
+				buffers[b].data = (const unsigned char*)bufferFiles[b].data;
+				buffers[b].size = bufferFiles[b].size;
+				bytesRead += bufferFiles[b].size;
+			}
+			size_t byteLength;
+			if (!bufferList->elements[b].SizeOr("byteLength", 0, byteLength) || buffers[b].size < byteLength || (!buffers[b].data && buffers[b].size)) {
+				std::cerr << "Could not import " << filePath << ". Buffer " << b << " is missing or short." << std::endl;
+				return false;
+			}
+		}
+
+		// Triangle primitives of every mesh, laid out one after the other
+		std::vector<GltfPrimitive> primitives;
+		size_t vertexTotal = 0, indexTotal = 0;
+		const JsonValue* meshes = root.Find("meshes");
+		for (size_t m = 0; meshes && m < meshes->Size(); m++)
+		{
+			const JsonValue* primitiveList = meshes->elements[m].Find("primitives");
+			for (size_t i = 0; primitiveList && i < primitiveList->Size(); i++)
+			{
+				const JsonValue& description = primitiveList->elements[i];
+				const JsonValue* attributes = description.Find("attributes");
+				if (description.NumberOr("mode", 4.0) != 4.0 || !attributes)
+					continue;
+				GltfPrimitive primitive;
+				bool valid = resolveGltfAccessor(root, buffers, attributes->Find("POSITION"), primitive.position)
+					&& primitive.position.componentType == GL_FLOAT && primitive.position.components == 3;
+				primitive.hasNormal = valid && attributes->Find("NORMAL");
+				primitive.hasTexCoord = valid && attributes->Find("TEXCOORD_0");
+				primitive.indexed = valid && description.Find("indices");
+				if (primitive.hasNormal)
+					valid = resolveGltfAccessor(root, buffers, attributes->Find("NORMAL"), primitive.normal) && primitive.normal.componentType == GL_FLOAT
+						&& primitive.normal.components == 3 && primitive.normal.count == primitive.position.count;
+				if (valid && primitive.hasTexCoord)
+					valid = resolveGltfAccessor(root, buffers, attributes->Find("TEXCOORD_0"), primitive.texCoord) && primitive.texCoord.components == 2
+						&& primitive.texCoord.count == primitive.position.count && primitive.texCoord.componentType != GL_UNSIGNED_INT;
+				if (valid && primitive.indexed)
+					valid = resolveGltfAccessor(root, buffers, description.Find("indices"), primitive.indices) && primitive.indices.components == 1
+						&& (primitive.indices.componentType == GL_UNSIGNED_BYTE || primitive.indices.componentType == GL_UNSIGNED_SHORT
+						|| primitive.indices.componentType == GL_UNSIGNED_INT);
+				if (!valid) {
+					std::cerr << "Could not import " << filePath << ". Mesh " << m << " primitive " << i << " has unsupported or out of range accessors." << std::endl;
+					return false;
+				}
+				primitive.firstVertex = vertexTotal;
+				primitive.firstIndex = indexTotal;
+				vertexTotal += primitive.position.count;
+				indexTotal += (primitive.indexed ? primitive.indices.count : primitive.position.count) / 3 * 3;
+				primitives.push_back(primitive);
+			}
+		}
+
+		// Primitives are converted in parallel, each into its own range
+		std::vector<ImportVertex> vertices(vertexTotal);
+		std::vector<unsigned int> indices(indexTotal);
+		std::atomic<int> nextPrimitive(0);
+		std::atomic<bool> outOfRange(false);
+		int primitiveCount = (int)primitives.size();
+		struct Converter
+		{
+			static void Run(const GltfPrimitive& primitive, ImportVertex* vertices, unsigned int* indices, std::atomic<bool>& outOfRange)
+			{
+				for (size_t v = 0; v < primitive.position.count; v++)
+				{
+					ImportVertex& vertex = vertices[primitive.firstVertex + v];
+					for (int c = 0; c < 3; c++)
+					{
+						vertex.position[c] = gltfComponent(primitive.position, v, c);
+						vertex.normal[c] = primitive.hasNormal ? gltfComponent(primitive.normal, v, c) : 0.0f;
+					}
+					for (int c = 0; c < 2; c++)
+						vertex.texCoord[c] = primitive.hasTexCoord ? gltfComponent(primitive.texCoord, v, c) : 0.0f;
+				}
+				size_t indexCount = (primitive.indexed ? primitive.indices.count : primitive.position.count) / 3 * 3;
+				for (size_t i = 0; i < indexCount; i++)
+				{
+					unsigned int index = primitive.indexed ? gltfIndex(primitive.indices, i) : (unsigned int)i;
+					if (index >= primitive.position.count)
+						outOfRange = true;
+					indices[primitive.firstIndex + i] = (unsigned int)primitive.firstVertex + index;
+				}
+			}
+		};
+		std::vector<std::thread> workers;
+		for (unsigned int w = 1; w < std::min<unsigned int>(threadCount, primitiveCount); w++)
+			workers.push_back(std::thread([&]() { for (int i; (i = nextPrimitive++) < primitiveCount;) Converter::Run(primitives[i], vertices.data(), indices.data(), outOfRange); }));
+		for (int i; (i = nextPrimitive++) < primitiveCount;)
+			Converter::Run(primitives[i], vertices.data(), indices.data(), outOfRange);
+		for (size_t w = 0; w < workers.size(); w++)
+			workers[w].join();
+		if (outOfRange) {
+			std::cerr << "Could not import " << filePath << ". Index out of range." << std::endl;
+			return false;
+		}
+		parseTime = elapsedMilliseconds(start);
+
+		// Weld identical vertices, within and across primitives
+		start = std::chrono::high_resolution_clock::now();
+		std::vector<unsigned int> remap, firsts;
+		unsigned int vertexCount = weldVertices(vertices.data(), sizeof(ImportVertex), vertices.size(), remap, firsts);
+		mesh.vertices.resize(vertexCount);
+		for (unsigned int v = 0; v < vertexCount; v++)
+			mesh.vertices[v] = vertices[firsts[v]];
+		mesh.indices.resize(indexTotal);
+		for (size_t i = 0; i < indexTotal; i++)
+			mesh.indices[i] = remap[indices[i]];
+		generateMissingNormals(mesh);
+		mesh.bounds = computeBounds(vertexCount ? &mesh.vertices[0].position : nullptr, vertexCount, sizeof(ImportVertex));
+		weldTime = elapsedMilliseconds(start);
+		cornerCount = (unsigned int)indexTotal;
+		return true;
+	}
+};
+
+// Mesh Cache
+// ---------------------------------
+
+/* Binary mesh cache: a header, the vertex and index blobs of every mesh, each aligned to
+   MeshCacheAlignment bytes, and a table of contents at the end. Vertices are stored in their vertex
+   format and indices in the narrowest type for the mesh, so both go to the GPU straight from the
+   mapped file. Little-endian, like the formats it is built from */
+struct MeshCacheHeader
+{
+	char magic[4];
+	unsigned int version;
+	unsigned int meshCount;
+	unsigned int alignment;
+	glm::uint64 tableOffset;
+	glm::uint64 fileSize;
+
+	// fileStamp of the source the cache was built from, zero when there is none
+	glm::uint64 sourceSize;
+	glm::uint64 sourceWriteTime;
+};
+
+/* Table of contents entry of a cached mesh. Offsets are from the start of the file */
+struct MeshCacheEntry
+{
+	char name[48];
+	VertexFormat format;
+	unsigned int vertexCount;
+	unsigned int indexCount;
+	unsigned int indexType;		// 0 for non-indexed meshes
+	unsigned int maxIndex;		// largest index, below vertexCount
+	BoundingVolume bounds;
+	glm::uint64 vertexOffset;
+	glm::uint64 indexOffset;
+	glm::uint64 indexChecksum;	// meshCacheChecksum of the index blob
+};
+
+const char MeshCacheMagic[4] = { 'M', 'S', 'H', 'C' };
+const unsigned int MeshCacheVersion = 2;
+const unsigned int MeshCacheAlignment = 64;
+
+/* A mesh to write to a cache, with 32-bit indices relative to its first vertex */
+struct MeshCacheSource
+{
+	std::string name;
+	VertexFormat format;
+	const void* vertexData;
+	unsigned int vertexCount;
+	const unsigned int* indexData;
+	unsigned int indexCount;
+	BoundingVolume bounds;
+};
+
+/* FNV-1a of a cached blob */
+glm::uint64 meshCacheChecksum(const void* data, size_t size)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	glm::uint64 hash = 14695981039346656037ull;
+	for (size_t b = 0; b < size; b++)
+		hash = (hash ^ bytes[b]) * 1099511628211ull;
+	return hash;
+}
+
+/* Fails without writing anything when an index is out of range of its mesh's vertices */
+bool saveMeshCache(const char* filePath, const std::vector<MeshCacheSource>& meshes, glm::uint64 sourceSize = 0, glm::uint64 sourceWriteTime = 0)
+{
+	for (size_t m = 0; m < meshes.size(); m++)
+	{
+		for (unsigned int i = 0; i < meshes[m].indexCount; i++)
+		{
+			if (meshes[m].indexData[i] >= meshes[m].vertexCount) {
+				std::cerr << "Mesh " << meshes[m].name << " has index " << meshes[m].indexData[i] << " past its "
+					<< meshes[m].vertexCount << " vertices, not caching it." << std::endl;
+				return false;
+			}
+		}
+	}
+
+	std::ofstream fileStream(filePath, std::ios::out | std::ios::binary);
+	if (!fileStream.is_open()) {
+		std::cerr << "Could not write file " << filePath << "." << std::endl;
+		return false;
+	}
+
+	MeshCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MeshCacheMagic, sizeof(header.magic));
+	header.version = MeshCacheVersion;
+	header.meshCount = (unsigned int)meshes.size();
+	header.alignment = MeshCacheAlignment;
+	header.sourceSize = sourceSize;
+	header.sourceWriteTime = sourceWriteTime;
+	fileStream.write((const char*)&header, sizeof(header));
+
+	const char padding[MeshCacheAlignment] = {};
+	glm::uint64 offset = sizeof(header);
+	std::vector<MeshCacheEntry> entries(meshes.size());		// zeroed, padding included
+	std::vector<unsigned char> narrowed;
+	for (size_t m = 0; m < meshes.size(); m++)
+	{
+		const MeshCacheSource& mesh = meshes[m];
+		MeshCacheEntry& entry = entries[m];
+		strncpy(entry.name, mesh.name.c_str(), sizeof(entry.name) - 1);
+		entry.format = mesh.format;
+		entry.vertexCount = mesh.vertexCount;
+		entry.indexCount = mesh.indexCount;
+		entry.indexType = mesh.indexCount ? indexTypeFor(mesh.vertexCount) : 0;
+		entry.bounds = mesh.bounds;
+
+		size_t vertexBytes = (size_t)mesh.vertexCount * mesh.format.stride;
+		size_t pad = (size_t)(-offset & (MeshCacheAlignment - 1));
+		fileStream.write(padding, pad);
+		entry.vertexOffset = offset + pad;
+		fileStream.write((const char*)mesh.vertexData, vertexBytes);
+		offset = entry.vertexOffset + vertexBytes;
+
+		if (mesh.indexCount)
+		{
+			unsigned int indexSize = indexTypeSize(entry.indexType);
+			narrowed.resize((size_t)mesh.indexCount * indexSize);
+			for (unsigned int i = 0; i < mesh.indexCount; i++)
+			{
+				entry.maxIndex = std::max(entry.maxIndex, mesh.indexData[i]);
+				if (indexSize == 4)
+					((unsigned int*)narrowed.data())[i] = mesh.indexData[i];
+				else if (indexSize == 2)
+					((unsigned short*)narrowed.data())[i] = (unsigned short)mesh.indexData[i];
+				else
+					narrowed[i] = (unsigned char)mesh.indexData[i];
+			}
+			pad = (size_t)(-offset & (MeshCacheAlignment - 1));
+			fileStream.write(padding, pad);
+			entry.indexOffset = offset + pad;
+			entry.indexChecksum = meshCacheChecksum(narrowed.data(), narrowed.size());
+			fileStream.write((const char*)narrowed.data(), narrowed.size());
+			offset = entry.indexOffset + narrowed.size();
+		}
+	}
+
+	size_t pad = (size_t)(-offset & (MeshCacheAlignment - 1));
+	fileStream.write(padding, pad);
+	header.tableOffset = offset + pad;
+	fileStream.write((const char*)entries.data(), entries.size() * sizeof(MeshCacheEntry));
+	header.fileSize = header.tableOffset + entries.size() * sizeof(MeshCacheEntry);
+	fileStream.seekp(0);
+	fileStream.write((const char*)&header, sizeof(header));
+	return fileStream.good();
+}
+
+/* A mesh cache mapped into memory. Meshes are read in place, with no copy before the driver's */
+struct MeshCache
+{
+	MappedFile file;
+	const MeshCacheHeader* header;
+	const MeshCacheEntry* entries;
+
+	MeshCache() : header(nullptr), entries(nullptr) {}
+
+	// Maps the file and checks its header and table of contents. Index blobs must match their
+	// checksums, so the largest index recorded when the cache was written holds for what is mapped
+	bool Open(const char* filePath)
+	{
+		Close();
+		if (!file.Open(filePath))
+			return false;
+		header = file.size >= sizeof(MeshCacheHeader) ? (const MeshCacheHeader*)file.data : nullptr;
+		if (!header || memcmp(header->magic, MeshCacheMagic, sizeof(header->magic)) != 0 || header->version != MeshCacheVersion
+			|| header->alignment != MeshCacheAlignment || header->fileSize != file.size) {
+			std::cerr << "Mesh cache " << filePath << " is not a version " << MeshCacheVersion << " mesh cache." << std::endl;
+			Close();
+			return false;
+		}
+
+		bool valid = header->tableOffset % MeshCacheAlignment == 0 && header->tableOffset <= file.size
+			&& header->meshCount <= (file.size - header->tableOffset) / sizeof(MeshCacheEntry);
+		entries = valid ? (const MeshCacheEntry*)(file.data + header->tableOffset) : nullptr;
+		for (unsigned int m = 0; valid && m < header->meshCount; m++)
+		{
+			const MeshCacheEntry& entry = entries[m];
+			unsigned int expectedType = entry.indexCount ? indexTypeFor(entry.vertexCount) : 0;
+			valid = memchr(entry.name, 0, sizeof(entry.name)) != nullptr && isValidVertexFormat(entry.format) && entry.indexType == expectedType
+				&& entry.vertexOffset % MeshCacheAlignment == 0 && entry.indexOffset % MeshCacheAlignment == 0
+				&& entry.vertexOffset <= file.size && (glm::uint64)entry.vertexCount * entry.format.stride <= file.size - entry.vertexOffset
+				&& entry.indexOffset <= file.size && (glm::uint64)entry.indexCount * indexTypeSize(entry.indexType) <= file.size - entry.indexOffset
+				&& (entry.indexCount == 0 || (entry.maxIndex < entry.vertexCount
+				&& meshCacheChecksum(file.data + entry.indexOffset, (size_t)entry.indexCount * indexTypeSize(entry.indexType)) == entry.indexChecksum));
+		}
+		if (!valid) {
+			std::cerr << "Mesh cache " << filePath << " is corrupt." << std::endl;
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	void Close()
+	{
+		file.Close();
+		header = nullptr;
+		entries = nullptr;
+	}
+
+	unsigned int MeshCount() const { return header ? header->meshCount : 0; }
+
+	// Index of the named mesh, or InvalidRange
+	unsigned int Find(const char* name) const
+	{
+		for (unsigned int m = 0; m < MeshCount(); m++)
+		{
+			if (strcmp(entries[m].name, name) == 0)
+				return m;
+		}
+		return InvalidRange;
+	}
+
+	const void* Vertices(unsigned int mesh) const { return file.data + entries[mesh].vertexOffset; }
+	const void* Indices(unsigned int mesh) const { return file.data + entries[mesh].indexOffset; }
+
+	// Whether the cache was built from the source file as it is now
+	bool IsCurrent(const char* sourcePath) const
+	{
+		glm::uint64 size, writeTime;
+		return header && fileStamp(sourcePath, size, writeTime) && size == header->sourceSize && writeTime == header->sourceWriteTime;
+	}
+
+	// Add a cached mesh to the registry straight from the mapping. Only indices narrower than the
+	// registry's smallest index type go through a copy, to widen them
+	void Upload(GeometryRegistry& registry, unsigned int mesh, Geometry& geometry) const
+	{
+		const MeshCacheEntry& entry = entries[mesh];
+		if (entry.indexCount && indexTypeSize(entry.indexType) < indexTypeSize(registry.smallestIndexType))
+		{
+			std::vector<unsigned int> indices(entry.indexCount);
+			for (unsigned int i = 0; i < entry.indexCount; i++)
+				indices[i] = entry.indexType == GL_UNSIGNED_BYTE ? ((const unsigned char*)Indices(mesh))[i] : ((const unsigned short*)Indices(mesh))[i];
+			registry.Add(geometry, entry.format, Vertices(mesh), entry.vertexCount, indices.data(), entry.indexCount);
+		}
+		else
+			registry.AddTyped(geometry, entry.format, Vertices(mesh), entry.vertexCount, Indices(mesh), entry.indexCount, entry.indexType);
+		geometry.bounds = entry.bounds;
+	}
+};
+
+/* Imports a mesh file and optimizes it for the vertex cache, overdraw and vertex fetch, as every mesh
+   is before it is cached or drawn */
+bool importOptimizedMesh(MeshImporter& importer, const char* filePath, ImportedMesh& mesh)
+{
+	if (!importer.Import(filePath, mesh))
+		return false;
+	if (!mesh.indices.empty())
+		optimizeMesh(mesh.vertices.data(), sizeof(ImportVertex), (unsigned int)mesh.vertices.size(), mesh.indices.data(), mesh.indices.size());
+	return true;
+}
+
+/* Opens the cache of a mesh file, importing the source and rewriting the cache first when the cache
+   is missing, out of date or unreadable. The imported mesh is optimized and cached under the source's
+   path. When the source was imported and imported is given, the mesh is left there, so a caller can
+   still draw it if the cache could not be written; it is emptied when the import failed */
+bool openMeshCache(const char* sourcePath, const char* cachePath, MeshCache& cache, MeshImporter& importer, ImportedMesh* imported = nullptr)
+{
+	glm::uint64 sourceSize, sourceWriteTime;
+	if (!fileStamp(sourcePath, sourceSize, sourceWriteTime))
+		return cache.Open(cachePath);
+	glm::uint64 cacheSize, cacheWriteTime;
+	if (fileStamp(cachePath, cacheSize, cacheWriteTime) && cache.Open(cachePath) && cache.IsCurrent(sourcePath))
+		return true;
+	cache.Close();
+
+	ImportedMesh localMesh;
+	ImportedMesh& mesh = imported ? *imported : localMesh;
+	if (!importOptimizedMesh(importer, sourcePath, mesh))
+	{
+		mesh = ImportedMesh();
+		return false;
+	}
+	MeshCacheSource source = { sourcePath, ImportVertexFormat, mesh.vertices.data(), (unsigned int)mesh.vertices.size(),
+		mesh.indices.data(), (unsigned int)mesh.indices.size(), mesh.bounds };
+	return saveMeshCache(cachePath, std::vector<MeshCacheSource>(1, source), sourceSize, sourceWriteTime) && cache.Open(cachePath);
+}
+
+// Asset Streaming
+// ---------------------------------
+
+/* Where a streamed asset is. Read and written by the render thread only */
+enum AssetState
+{
+	AssetQueued,		// waiting for or on a loader thread
+	AssetUploading,		// decoded, going to the GPU a slice per frame
+	AssetResident,
+	AssetFailed
+};
+
+/* A mesh loaded in the background. The loader threads fill the decoded data, then hand the asset to
+   the render thread, which uploads it into geometry. Until then it is drawn as a placeholder */
+struct StreamedAsset
+{
+	std::string path;
+	std::string cachePath;		// mesh cache of the source, none when empty
+	glm::mat4 transform;
+	glm::vec4 colour;
+
+	// Decoded on a loader thread: either an imported mesh, with its indices narrowed, or a mapped cache.
+	// Meshes without vertices count as failed
+	bool decoded;
+	ImportedMesh mesh;
+	std::vector<unsigned char> narrowedIndices;
+	MeshCache cache;
+	VertexFormat format;
+	const unsigned char* vertexData;
+	const unsigned char* indexData;
+	unsigned int vertexCount;
+	unsigned int indexCount;
+	unsigned int indexType;
+	BoundingVolume bounds;
+	double decodeTime;
+
+	// Render thread
+	AssetState state;
+	Geometry geometry;
+	size_t bytesUploaded;
+	unsigned int uploadFrames;
+	glm::mat4 drawTransform;	// of the placeholder until the asset is resident
+
+	StreamedAsset() : transform(1.0f), colour(1.0f), decoded(false), vertexData(nullptr), indexData(nullptr), vertexCount(0), indexCount(0),
+		indexType(0), decodeTime(0.0), state(AssetQueued), bytesUploaded(0), uploadFrames(0), drawTransform(1.0f) {}
+
+	size_t VertexBytes() const { return (size_t)vertexCount * format.stride; }
+	size_t TotalBytes() const { return VertexBytes() + (size_t)indexCount * indexTypeSize(indexType); }
+
+	// Drop the decoded data once it is on the GPU
+	void ReleaseDecoded()
+	{
+		std::vector<ImportVertex>().swap(mesh.vertices);
+		std::vector<unsigned int>().swap(mesh.indices);
+		std::vector<unsigned char>().swap(narrowedIndices);
+		cache.Close();
+		vertexData = nullptr;
+		indexData = nullptr;
+	}
+};
+
+/* Bounded lock-free queue of assets, safe for any number of producers and consumers. Every cell
+   carries a sequence number saying whether it is ready to be written or read on the current lap, so
+   Push and Pop each claim a cell with one compare-exchange and never wait on each other */
+struct AssetQueue
+{
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		StreamedAsset* asset;
+	};
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+
+	// On separate cache lines, so producers and the consumer do not invalidate each other's
+	alignas(64) std::atomic<size_t> pushPosition;
+	alignas(64) std::atomic<size_t> popPosition;
+
+	AssetQueue() : mask(0), pushPosition(0), popPosition(0) {}
+
+	// capacity is rounded up to a power of two
+	void Create(size_t capacity)
+	{
+		size_t size = 1;
+		while (size < capacity)
+			size *= 2;
+		cells.reset(new Cell[size]);
+		mask = size - 1;
+		for (size_t i = 0; i < size; i++)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		pushPosition.store(0, std::memory_order_relaxed);
+		popPosition.store(0, std::memory_order_relaxed);
+	}
+
+	// Returns false when the queue is full
+	bool Push(StreamedAsset* asset)
+	{
+		size_t position = pushPosition.load(std::memory_order_relaxed);
+		Cell* cell;
+		for (;;)
+		{
+			cell = &cells[position & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			ptrdiff_t lap = (ptrdiff_t)sequence - (ptrdiff_t)position;
+			if (lap == 0 && pushPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				break;
+			if (lap < 0)
+				return false;
+			if (lap > 0)
+				position = pushPosition.load(std::memory_order_relaxed);
+		}
+		cell->asset = asset;
+		cell->sequence.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Returns null when the queue is empty
+	StreamedAsset* Pop()
+	{
+		size_t position = popPosition.load(std::memory_order_relaxed);
+		Cell* cell;
+		for (;;)
+		{
+			cell = &cells[position & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			ptrdiff_t lap = (ptrdiff_t)sequence - (ptrdiff_t)(position + 1);
+			if (lap == 0 && popPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				break;
+			if (lap < 0)
+				return nullptr;
+			if (lap > 0)
+				position = popPosition.load(std::memory_order_relaxed);
+		}
+		StreamedAsset* asset = cell->asset;
+		cell->sequence.store(position + mask + 1, std::memory_order_release);
+		return asset;
+	}
+};
+
+/* Upload counters of the last frame and since the streamer was created */
+struct AssetUploadStats
+{
+	double frameMilliseconds;
+	size_t frameBytes;
+	unsigned int frameSlices;
+	double maxFrameMilliseconds;
+	size_t bytesUploaded;
+	unsigned int assetsResident;
+	unsigned int assetsFailed;
+
+	AssetUploadStats() : frameMilliseconds(0.0), frameBytes(0), frameSlices(0), maxFrameMilliseconds(0.0), bytesUploaded(0),
+		assetsResident(0), assetsFailed(0) {}
+};
+
+/* Loads meshes on a pool of loader threads and uploads them from the render thread within a budget
+   per frame. Requests are rare and come from the render thread, so they go through a lock; finished
+   assets come back through an AssetQueue so Update never blocks on a loader. Slices are copied into
+   a staging StreamBuffer and from there into the registry's buffers with glCopyBufferSubData, so the
+   driver never has to stall on a buffer the GPU is drawing from */
+struct AssetStreamer
+{
+	std::deque<StreamedAsset> assets;		// stable addresses, the registry keeps pointers to their geometry
+	GeometryRegistry* registry;
+	StreamBuffer staging;
+
+	// Budget of an Update: at most uploadBudget bytes, and no new slice after uploadMilliseconds
+	size_t uploadBudget;
+	double uploadMilliseconds;
+	AssetUploadStats stats;
+
+	std::vector<std::thread> loaders;
+	std::mutex requestMutex;
+	std::condition_variable requestReady;
+	std::deque<StreamedAsset*> requests;
+	std::atomic<bool> stopping;
+	AssetQueue finished;
+	std::deque<StreamedAsset*> uploads;		// render thread only
+
+	AssetStreamer() : registry(nullptr), uploadBudget(1 << 20), uploadMilliseconds(2.0), stopping(false) {}
+	~AssetStreamer() { StopLoaders(); }
+
+	// Start loaderCount threads, 0 for one per hardware thread less the render thread. Needs a context
+	// for the staging buffer unless hasContext is false, then assets are decoded but never uploaded
+	void Create(GeometryRegistry& geometryRegistry, unsigned int loaderCount = 0, bool hasContext = true)
+	{
+		registry = &geometryRegistry;
+		if (hasContext)
+			staging.Create(GL_COPY_READ_BUFFER, uploadBudget);
+		finished.Create(256);
+		stopping = false;
+		if (loaderCount == 0)
+			loaderCount = std::max(2u, std::thread::hardware_concurrency()) - 1;
+		for (unsigned int i = 0; i < loaderCount; i++)
+			loaders.push_back(std::thread([this]() { LoaderLoop(); }));
+	}
+
+	void Destroy()
+	{
+		StopLoaders();
+		for (size_t a = 0; a < assets.size(); a++)
+		{
+			if (assets[a].geometry.pool != InvalidRange)
+				registry->Remove(assets[a].geometry);
+		}
+		assets.clear();
+		uploads.clear();
+		if (staging.buffer)
+			staging.Destroy();
+	}
+
+	void StopLoaders()
+	{
+		{
+			std::lock_guard<std::mutex> lock(requestMutex);
+			stopping = true;
+			requests.clear();
+		}
+		requestReady.notify_all();
+		for (size_t i = 0; i < loaders.size(); i++)
+			loaders[i].join();
+		loaders.clear();
+	}
+
+	// Queue a mesh file for loading, through its mesh cache when cachePath is given. Returns the
+	// asset, which is drawn as a placeholder until it is resident
+	StreamedAsset& Load(const std::string& path, const std::string& cachePath = std::string(), const glm::mat4& transform = glm::mat4(1.0f),
+		const glm::vec4& colour = glm::vec4(1.0f))
+	{
+		assets.emplace_back();
+		StreamedAsset& asset = assets.back();
+		asset.path = path;
+		asset.cachePath = cachePath;
+		asset.transform = transform;
+		asset.colour = colour;
+		{
+			std::lock_guard<std::mutex> lock(requestMutex);
+			requests.push_back(&asset);
+		}
+		requestReady.notify_one();
+		return asset;
+	}
+
+	bool Idle() const { return stats.assetsResident + stats.assetsFailed == assets.size(); }
+
+	void LoaderLoop()
+	{
+		MeshImporter importer;
+		importer.threadCount = 1;	// the loaders are the parallelism
+		for (;;)
+		{
+			StreamedAsset* asset;
+			{
+				std::unique_lock<std::mutex> lock(requestMutex);
+				while (!stopping && requests.empty())
+					requestReady.wait(lock);
+				if (stopping)
+					return;
+				asset = requests.front();
+				requests.pop_front();
+			}
+			Decode(*asset, importer);
+			while (!finished.Push(asset))
+			{
+				if (stopping)
+					return;
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	static void Decode(StreamedAsset& asset, MeshImporter& importer)
+	{
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+		// Without a cache the source is imported here. With one, it is only imported when the cache is out
+		// of date, and that mesh is drawn straight away should the cache not be written
+		bool cached = false, imported = false;
+		if (!asset.cachePath.empty())
+		{
+			cached = openMeshCache(asset.path.c_str(), asset.cachePath.c_str(), asset.cache, importer, &asset.mesh) && asset.cache.MeshCount() > 0;
+			imported = !cached && !asset.mesh.vertices.empty();
+		}
+		else
+			imported = importOptimizedMesh(importer, asset.path.c_str(), asset.mesh);
+
+		if (cached)
+		{
+			asset.mesh = ImportedMesh();
+			const MeshCacheEntry& entry = asset.cache.entries[0];
+			asset.format = entry.format;
+			asset.vertexData = (const unsigned char*)asset.cache.Vertices(0);
+			asset.indexData = (const unsigned char*)asset.cache.Indices(0);
+			asset.vertexCount = entry.vertexCount;
+			asset.indexCount = entry.indexCount;
+			asset.indexType = entry.indexType;
+			asset.bounds = entry.bounds;
+		}
+		else if (imported)
+		{
+			asset.format = ImportVertexFormat;
+			asset.vertexCount = (unsigned int)asset.mesh.vertices.size();
+			asset.indexCount = (unsigned int)asset.mesh.indices.size();
+			asset.indexType = asset.indexCount ? indexTypeFor(asset.vertexCount) : 0;
+			asset.narrowedIndices.resize((size_t)asset.indexCount * indexTypeSize(asset.indexType));
+			for (unsigned int i = 0; i < asset.indexCount; i++)
+			{
+				if (asset.indexType == GL_UNSIGNED_INT)
+					((unsigned int*)asset.narrowedIndices.data())[i] = asset.mesh.indices[i];
+				else if (asset.indexType == GL_UNSIGNED_SHORT)
+					((unsigned short*)asset.narrowedIndices.data())[i] = (unsigned short)asset.mesh.indices[i];
+				else
+					asset.narrowedIndices[i] = (unsigned char)asset.mesh.indices[i];
+			}
+			asset.vertexData = (const unsigned char*)asset.mesh.vertices.data();
+			asset.indexData = asset.narrowedIndices.data();
+			asset.bounds = asset.mesh.bounds;
+		}
+		asset.decoded = asset.vertexCount > 0;
+		asset.decodeTime = elapsedMilliseconds(start);
+	}
+
+	// Once per frame on the render thread: take the assets the loaders finished, then upload slices of
+	// them until the frame's budget is spent
+	void Update()
+	{
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		stats.frameBytes = 0;
+		stats.frameSlices = 0;
+		for (StreamedAsset* asset; (asset = finished.Pop()) != nullptr;)
+		{
+			if (!asset->decoded)
+			{
+				std::cerr << "Could not load " << asset->path << "." << std::endl;
+				asset->state = AssetFailed;
+				stats.assetsFailed++;
+				continue;
+			}
+			asset->state = AssetUploading;
+			uploads.push_back(asset);
+		}
+
+		if (staging.buffer)
+			staging.BeginFrame();
+		while (staging.buffer && !uploads.empty() && stats.frameBytes < uploadBudget && elapsedMilliseconds(start) < uploadMilliseconds)
+		{
+			StreamedAsset& asset = *uploads.front();
+			// Reserving can grow the pool, which copies it, so the budget is checked again before the first slice
+			if (asset.geometry.pool == InvalidRange)
+			{
+				registry->Reserve(asset.geometry, asset.format, asset.vertexCount, asset.indexCount, asset.indexType);
+				continue;
+			}
+			UploadSlice(asset, std::min(uploadBudget - stats.frameBytes, staging.regionSize));
+			if (asset.bytesUploaded == asset.TotalBytes())
+			{
+				asset.geometry.bounds = asset.bounds;
+				asset.state = AssetResident;
+				asset.ReleaseDecoded();
+				stats.assetsResident++;
+				uploads.pop_front();
+			}
+		}
+		for (size_t u = 0; u < uploads.size(); u++)
+			uploads[u]->uploadFrames++;
+		stats.frameMilliseconds = elapsedMilliseconds(start);
+		stats.maxFrameMilliseconds = std::max(stats.maxFrameMilliseconds, stats.frameMilliseconds);
+	}
+
+	// Stage up to maxBytes of the asset's vertices, then indices, and copy them to their ranges
+	void UploadSlice(StreamedAsset& asset, size_t maxBytes)
+	{
+		size_t vertexBytes = asset.VertexBytes();
+		bool vertices = asset.bytesUploaded < vertexBytes;
+		size_t sectionOffset = vertices ? asset.bytesUploaded : asset.bytesUploaded - vertexBytes;
+		size_t sectionSize = vertices ? vertexBytes : asset.TotalBytes() - vertexBytes;
+		size_t bytes = std::min(maxBytes, sectionSize - sectionOffset);
+		const unsigned char* source = (vertices ? asset.vertexData : asset.indexData) + sectionOffset;
+		size_t destination = vertices ? (size_t)asset.geometry.baseVertex * asset.format.stride + sectionOffset
+			: (size_t)asset.geometry.firstIndex * indexTypeSize(asset.indexType) + sectionOffset;
+
+		size_t stagingOffset = staging.Write(source, bytes, 4);
+		glState.BindBuffer(GL_COPY_READ_BUFFER, staging.buffer);
+		glState.BindBuffer(GL_COPY_WRITE_BUFFER, vertices ? asset.geometry.vbo : asset.geometry.ebo);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, stagingOffset, destination, bytes);
+
+		asset.bytesUploaded += bytes;
+		stats.frameBytes += bytes;
+		stats.frameSlices++;
+		stats.bytesUploaded += bytes;
+	}
+};
+
+// Meshes given on the command line stream in through this
+AssetStreamer assetStreamer;
+
+// Terrain
+// ---------------------------------
+
+/* Fractal sum of glm::simplex octaves, each at lacunarity times the frequency and gain times the
+   amplitude of the one before. A pure function of the position and the seed, so a chunk comes out the
+   same on any thread and in any order. Heights are relative to the origin's, where the scene stands */
+struct TerrainNoise
+{
+	unsigned int seed;
+	unsigned int octaves;
+	float frequency;	// of the first octave, in cycles per unit
+	float amplitude;	// of the first octave
+	float lacunarity;
+	float gain;
+	float originHeight;
+
+	TerrainNoise() : seed(371), octaves(6), frequency(0.6f), amplitude(0.12f), lacunarity(2.0f), gain(0.5f), originHeight(0.0f)
+	{
+		Reseed(seed);
+	}
+
+	void Reseed(unsigned int newSeed)
+	{
+		seed = newSeed;
+		originHeight = 0.0f;
+		originHeight = Height(0.0f, 0.0f);
+	}
+
+	float Height(float x, float z) const
+	{
+		// The seed picks where in the noise each octave is read, within its period of 289
+		float height = 0.0f, octaveFrequency = frequency, octaveAmplitude = amplitude;
+		for (unsigned int o = 0; o < octaves; o++)
+		{
+			unsigned int hash = (seed + o) * 2654435761u;
+			glm::vec2 offset((hash & 0xFFFF) * (289.0f / 65536.0f), (hash >> 16) * (289.0f / 65536.0f));
+			height += octaveAmplitude * glm::simplex(glm::vec2(x, z) * octaveFrequency + offset);
+			octaveFrequency *= lacunarity;
+			octaveAmplitude *= gain;
+		}
+		return height - originHeight;
+	}
+
+	// Bound on |Height + originHeight|
+	float MaxAmplitude() const
+	{
+		float sum = 0.0f, octaveAmplitude = amplitude;
+		for (unsigned int o = 0; o < octaves; o++, octaveAmplitude *= gain)
+			sum += octaveAmplitude;
+		return sum;
+	}
+};
+
+/* A terrain vertex, and where it goes on the grid of the next coarser level: odd rows and columns
+   collapse onto the even ones before them */
+struct TerrainVertex
+{
+	glm::vec3 position;
+	glm::vec3 coarsePosition;
+	glm::vec3 normal;
+};
+
+// Positions and normals at the attribute numbers of LitVertexFormat, coarse positions before the normals
+const VertexFormat TerrainVertexFormat = { sizeof(TerrainVertex), 3, { { 0, 3, GL_FLOAT, GL_FALSE, 0 },
+	{ 5, 3, GL_FLOAT, GL_FALSE, offsetof(TerrainVertex, coarsePosition) }, { 6, 3, GL_FLOAT, GL_FALSE, offsetof(TerrainVertex, normal) } } };
+
+/* Where a chunk is. Read and written by the render thread only */
+enum TerrainChunkState
+{
+	TerrainWanted,		// queued for or on a worker
+	TerrainGenerated,	// waiting for its upload
+	TerrainResident
+};
+
+/* A square of terrain at a level of detail. Level 0 chunks are leafSize wide and each level doubles
+   their size, so the chunk at level, x, z covers the four of level - 1 at 2x to 2x + 1, 2z to 2z + 1.
+   Every chunk has the same grid of cells x cells, so resolution halves with each level */
+struct TerrainChunk
+{
+	unsigned int level;
+	int x;		// in chunks of its level
+	int z;
+
+	// Generated on a worker thread. The vertices are dropped once uploaded
+	std::vector<TerrainVertex> vertices;
+	BoundingVolume bounds;
+	double generateTime;
+	bool taken;		// by a worker, under the streamer's request lock
+
+	// Render thread
+	TerrainChunkState state;
+	Geometry geometry;
+	unsigned int lastUsedFrame;
+	float distance;	// from the eye when last wanted
+
+	TerrainChunk() : level(0), x(0), z(0), generateTime(0.0), taken(false), state(TerrainWanted), lastUsedFrame(0), distance(0.0f) {}
+};
+
+/* Fill the chunk's (cells + 1)^2 vertices, in rows along x. Positions come from integer sample
+   coordinates counted in level 0 spacings, so neighbouring chunks, and chunks of the levels above and
+   below, compute the same floats for the points they share and their edges match bit for bit without
+   a stitching pass. Normals are central differences over one sample of border for the same reason */
+void generateTerrainChunk(const TerrainNoise& noise, unsigned int cells, float leafSize, TerrainChunk& chunk)
+{
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	int side = (int)cells + 3;
+	int step = 1 << chunk.level;
+	float spacing = leafSize / cells;
+	int sampleX = chunk.x * (int)cells * step, sampleZ = chunk.z * (int)cells * step;
+
+	std::vector<float> heights((size_t)side * side);
+	for (int j = 0; j < side; j++)
+	{
+		for (int i = 0; i < side; i++)
+			heights[j * side + i] = noise.Height(float(sampleX + (i - 1) * step) * spacing, float(sampleZ + (j - 1) * step) * spacing);
+	}
+
+	chunk.vertices.resize((size_t)(cells + 1) * (cells + 1));
+	for (int j = 0; j <= (int)cells; j++)
+	{
+		for (int i = 0; i <= (int)cells; i++)
+		{
+			const float* row = &heights[(j + 1) * side + i + 1];
+			TerrainVertex& vertex = chunk.vertices[j * (cells + 1) + i];
+			vertex.position = glm::vec3(float(sampleX + i * step) * spacing, row[0], float(sampleZ + j * step) * spacing);
+			int ci = i & ~1, cj = j & ~1;
+			vertex.coarsePosition = glm::vec3(float(sampleX + ci * step) * spacing, heights[(cj + 1) * side + ci + 1],
+				float(sampleZ + cj * step) * spacing);
+			vertex.normal = glm::normalize(glm::vec3(row[-1] - row[1], 2.0f * spacing * step, row[-side] - row[side]));
+		}
+	}
+	chunk.bounds = computeBounds(&chunk.vertices[0].position, chunk.vertices.size(), sizeof(TerrainVertex));
+	chunk.generateTime = elapsedMilliseconds(start);
+}
+
+/* Generate chunks on threadCount threads, each taking the next chunk until none are left */
+void generateTerrainChunks(const TerrainNoise& noise, unsigned int cells, float leafSize, const std::vector<TerrainChunk*>& chunks,
+	unsigned int threadCount)
+{
+	std::atomic<int> nextChunk(0);
+	std::vector<std::thread> workers;
+	for (unsigned int t = 0; t < threadCount; t++)
+		workers.push_back(std::thread([&]() { for (int c; (c = nextChunk++) < (int)chunks.size();) generateTerrainChunk(noise, cells, leafSize, *chunks[c]); }));
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+}
+
+/* Triangles of the grid every chunk shares, a quadrant after the other so a quarter chunk is drawn from
+   a quarter of the indices. Each cell is split along the same diagonal, so once its odd vertices
+   collapse onto the even ones the grid is exactly the next level's */
+void buildTerrainIndices(unsigned int cells, std::vector<unsigned short>& indices)
+{
+	unsigned int half = cells / 2;
+	indices.clear();
+	indices.reserve((size_t)cells * cells * 6);
+	for (unsigned int q = 0; q < 4; q++)
+	{
+		unsigned int i0 = (q & 1) * half, j0 = (q >> 1) * half;
+		for (unsigned int j = j0; j < j0 + half; j++)
+		{
+			for (unsigned int i = i0; i < i0 + half; i++)
+			{
+				unsigned short corner = (unsigned short)(j * (cells + 1) + i);
+				unsigned short right = corner + 1, below = (unsigned short)(corner + cells + 1), diagonal = below + 1;
+				unsigned short cell[6] = { corner, below, diagonal, corner, diagonal, right };
+				indices.insert(indices.end(), cell, cell + 6);
+			}
+		}
+	}
+}
+
+/* A vertex where vertex0_terrain.vert puts it, for checking the morph on the CPU */
+glm::vec3 morphTerrainVertex(const TerrainVertex& vertex, const glm::vec3& eye, const glm::vec2& morphRange)
+{
+	float morph = glm::clamp((glm::distance(eye, vertex.position) - morphRange.x) / (morphRange.y - morphRange.x), 0.0f, 1.0f);
+	return glm::mix(vertex.position, vertex.coarsePosition, morph);
+}
+
+/* A chunk drawn whole, or one of its quadrants where the finer chunk there is out of range or not
+   loaded yet */
+struct TerrainPatch
+{
+	TerrainChunk* chunk;
+	int quadrant;	// -1 for the whole chunk, otherwise x + 2z of the quarter
+};
+
+/* Counters of the last Update and since the streamer was created */
+struct TerrainStats
+{
+	unsigned int chunksResident;
+	size_t bytesResident;
+	unsigned int chunksPending;		// wanted and not resident
+	unsigned int patchesDrawn;
+	unsigned int chunksGenerated;
+	double generateMilliseconds;	// summed over the workers
+	double frameMilliseconds;
+	double maxFrameMilliseconds;
+
+	TerrainStats() : chunksResident(0), bytesResident(0), chunksPending(0), patchesDrawn(0), chunksGenerated(0), generateMilliseconds(0.0),
+		frameMilliseconds(0.0), maxFrameMilliseconds(0.0) {}
+};
+
+/* Result of selecting a chunk for the eye */
+enum TerrainSelection
+{
+	TerrainOutOfRange,	// its parent covers the area
+	TerrainCovered,		// drawn, or culled
+	TerrainMissing		// in range but not resident, its parent covers the area for now
+};
+
+/* Streams the chunks around the eye in and out and picks their levels of detail the CDLOD way. A chunk
+   of level l is drawn within lodRange * 2^l of the eye, and gives way to its four children where they
+   are within lodRange * 2^(l - 1). Vertices morph onto the next coarser grid over the far end of their
+   level's range, so a chunk meets coarser neighbours fully morphed and the levels never pop. Chunks
+   are generated on worker threads, coarse levels and near chunks first, uploaded within a budget per
+   frame and evicted after evictFrames frames unused, or sooner past residentBudget. A chunk is only
+   split once it is resident, so the terrain sharpens a level at a time as it streams in */
+struct TerrainStreamer
+{
+	TerrainNoise noise;
+	unsigned int cells;		// a side of every chunk, even
+	float leafSize;			// of level 0 chunks
+	unsigned int levels;
+	float lodRange;			// of level 0, a few chunks wide so only neighbouring levels meet
+	float morphStart;		// from the previous level's range to this level's
+	size_t uploadBudget;	// bytes per Update
+	unsigned int evictFrames;
+	size_t residentBudget;	// bytes of chunks kept when unused
+
+	std::unordered_map<glm::uint64, std::unique_ptr<TerrainChunk>> chunks;
+	std::vector<unsigned short> indices;
+	Geometry sharedIndices;
+	GeometryRegistry* registry;		// null without a context, chunks then stay on the CPU
+
+	std::vector<std::thread> workers;
+	std::mutex requestMutex;
+	std::condition_variable requestReady;
+	std::deque<TerrainChunk*> requests;
+	std::vector<TerrainChunk*> generated;	// under requestMutex too
+	bool stopping;
+
+	// Render thread
+	std::deque<TerrainChunk*> uploads;
+	std::vector<TerrainChunk*> missing;
+	std::vector<TerrainPatch> patches;		// selected by the last Update
+	glm::vec3 eye;
+	unsigned int frame;
+	TerrainStats stats;
+
+	TerrainStreamer() : cells(32), leafSize(0.08f), levels(6), lodRange(0.3f), morphStart(0.7f), uploadBudget(1 << 20), evictFrames(60),
+		residentBudget(16 << 20), registry(nullptr), stopping(false), eye(0.0f), frame(0) {}
+	~TerrainStreamer() { StopWorkers(); }
+
+	// Start workerCount threads, 0 for one per hardware thread less the render thread. The registry's
+	// terrain pool is sized for residentBudget and a frame of uploads up front. Without a registry the chunks are generated but
+	// never uploaded
+	void Create(GeometryRegistry* geometryRegistry, unsigned int workerCount = 0)
+	{
+		registry = geometryRegistry;
+		buildTerrainIndices(cells, indices);
+		if (registry)
+		{
+			registry->ReserveCapacity(TerrainVertexFormat, (unsigned int)((residentBudget + uploadBudget) / sizeof(TerrainVertex)), 0);
+			registry->AddTyped(sharedIndices, TerrainVertexFormat, nullptr, 0, indices.data(), (unsigned int)indices.size(), GL_UNSIGNED_SHORT);
+		}
+		stopping = false;
+		if (workerCount == 0)
+			workerCount = std::max(2u, std::thread::hardware_concurrency()) - 1;
+		for (unsigned int i = 0; i < workerCount; i++)
+			workers.push_back(std::thread([this]() { WorkerLoop(); }));
+	}
+
+	void Destroy()
+	{
+		StopWorkers();
+		for (std::unordered_map<glm::uint64, std::unique_ptr<TerrainChunk>>::iterator it = chunks.begin(); it != chunks.end(); ++it)
+		{
+			if (registry && it->second->geometry.pool != InvalidRange)
+				registry->Remove(it->second->geometry);
+		}
+		if (registry)
+			registry->Remove(sharedIndices);
+		chunks.clear();
+		generated.clear();
+		uploads.clear();
+		missing.clear();
+		patches.clear();
+		stats = TerrainStats();
+		registry = nullptr;
+	}
+
+	void StopWorkers()
+	{
+		{
+			std::lock_guard<std::mutex> lock(requestMutex);
+			stopping = true;
+			requests.clear();
+		}
+		requestReady.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+		workers.clear();
+	}
+
+	void WorkerLoop()
+	{
+		for (;;)
+		{
+			TerrainChunk* chunk;
+			{
+				std::unique_lock<std::mutex> lock(requestMutex);
+				while (!stopping && requests.empty())
+					requestReady.wait(lock);
+				if (stopping)
+					return;
+				chunk = requests.front();
+				requests.pop_front();
+				chunk->taken = true;
+			}
+			generateTerrainChunk(noise, cells, leafSize, *chunk);
+			std::lock_guard<std::mutex> lock(requestMutex);
+			generated.push_back(chunk);
+		}
+	}
+
+	static glm::uint64 Key(unsigned int level, int x, int z)
+	{
+		return (glm::uint64)level << 56 | (glm::uint64)(glm::uint32)(x + (1 << 27)) << 28 | (glm::uint64)(glm::uint32)(z + (1 << 27));
+	}
+
+	float ChunkSize(unsigned int level) const { return leafSize * float(1 << level); }
+	float Range(unsigned int level) const { return lodRange * float(1 << level); }
+
+	// Distances from the eye over which the vertices of a level morph onto the next level's grid
+	glm::vec2 MorphRange(unsigned int level) const
+	{
+		float previous = level ? Range(level - 1) : 0.0f;
+		return glm::vec2(previous + (Range(level) - previous) * morphStart, Range(level));
+	}
+
+	// Vertices of a patch: the first column and row of the chunk's grid it covers, and its cells a side
+	void PatchGrid(const TerrainPatch& patch, int& i0, int& j0, int& size) const
+	{
+		size = patch.quadrant < 0 ? (int)cells : (int)cells / 2;
+		i0 = patch.quadrant < 0 ? 0 : (patch.quadrant & 1) * size;
+		j0 = patch.quadrant < 0 ? 0 : (patch.quadrant >> 1) * size;
+	}
+
+	TerrainChunk* Find(unsigned int level, int x, int z) const
+	{
+		std::unordered_map<glm::uint64, std::unique_ptr<TerrainChunk>>::const_iterator it = chunks.find(Key(level, x, z));
+		return it != chunks.end() ? it->second.get() : nullptr;
+	}
+
+	bool Idle() const { return missing.empty() && uploads.empty(); }
+
+	// Once per frame on the render thread: evict the chunks left unused, upload the ones the workers
+	// finished within the budget, select the patches to draw from eye and request the chunks they lack.
+	// frustum may be null to draw every patch in range
+	void Update(const glm::vec3& eyePosition, const Frustum* frustum)
+	{
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		frame++;
+		eye = eyePosition;
+
+		// Evict what the last frame did not use for evictFrames, and the least recently used beyond the
+		// budget, before uploading into the space. Chunks still on their way in are left alone
+		std::vector<TerrainChunk*> unused;
+		for (std::unordered_map<glm::uint64, std::unique_ptr<TerrainChunk>>::iterator it = chunks.begin(); it != chunks.end(); ++it)
+		{
+			if (it->second->state == TerrainResident && it->second->lastUsedFrame + 1 != frame)
+				unused.push_back(it->second.get());
+		}
+		struct ByLastUse
+		{
+			bool operator()(const TerrainChunk* a, const TerrainChunk* b) const { return a->lastUsedFrame < b->lastUsedFrame; }
+		};
+		std::sort(unused.begin(), unused.end(), ByLastUse());
+		for (size_t u = 0; u < unused.size() && (frame - unused[u]->lastUsedFrame > evictFrames || stats.bytesResident > residentBudget); u++)
+		{
+			TerrainChunk& chunk = *unused[u];
+			if (registry)
+				registry->Remove(chunk.geometry);
+			stats.chunksResident--;
+			stats.bytesResident -= (size_t)(cells + 1) * (cells + 1) * sizeof(TerrainVertex);
+			chunks.erase(Key(chunk.level, chunk.x, chunk.z));
+		}
+
+		size_t frameBytes = 0;
+		while (!uploads.empty() && frameBytes < uploadBudget)
+		{
+			TerrainChunk& chunk = *uploads.front();
+			uploads.pop_front();
+			size_t bytes = chunk.vertices.size() * sizeof(TerrainVertex);
+			if (registry)
+			{
+				registry->AddTyped(chunk.geometry, TerrainVertexFormat, chunk.vertices.data(), (unsigned int)chunk.vertices.size(), nullptr, 0, 0);
+				std::vector<TerrainVertex>().swap(chunk.vertices);
+			}
+			chunk.state = TerrainResident;
+			stats.chunksResident++;
+			stats.bytesResident += bytes;
+			frameBytes += bytes;
+		}
+
+		// Select from the roots, the top level chunks around the eye
+		missing.clear();
+		patches.clear();
+		unsigned int top = levels - 1;
+		float rootSize = ChunkSize(top);
+		int x0 = (int)floorf((eye.x - Range(top)) / rootSize), x1 = (int)floorf((eye.x + Range(top)) / rootSize);
+		int z0 = (int)floorf((eye.z - Range(top)) / rootSize), z1 = (int)floorf((eye.z + Range(top)) / rootSize);
+		for (int z = z0; z <= z1; z++)
+		{
+			for (int x = x0; x <= x1; x++)
+				Select(top, x, z, frustum, true);
+		}
+
+		// Requests are replaced by this frame's, coarse levels and near chunks first. Queued chunks no
+		// longer wanted are dropped before a worker gets to them
+		struct ByPriority
+		{
+			bool operator()(const TerrainChunk* a, const TerrainChunk* b) const
+			{
+				return a->level != b->level ? a->level > b->level : a->distance < b->distance;
+			}
+		};
+		std::sort(missing.begin(), missing.end(), ByPriority());
+		{
+			std::lock_guard<std::mutex> lock(requestMutex);
+			for (size_t r = 0; r < requests.size(); r++)
+			{
+				if (requests[r]->lastUsedFrame != frame)
+					chunks.erase(Key(requests[r]->level, requests[r]->x, requests[r]->z));
+			}
+			requests.clear();
+			for (size_t m = 0; m < missing.size(); m++)
+			{
+				if (missing[m]->state == TerrainWanted && !missing[m]->taken)
+					requests.push_back(missing[m]);
+			}
+			for (size_t g = 0; g < generated.size(); g++)
+			{
+				generated[g]->state = TerrainGenerated;
+				stats.chunksGenerated++;
+				stats.generateMilliseconds += generated[g]->generateTime;
+				uploads.push_back(generated[g]);
+			}
+			generated.clear();
+		}
+		if (!requests.empty())
+			requestReady.notify_all();
+
+		stats.chunksPending = (unsigned int)missing.size();
+		stats.patchesDrawn = (unsigned int)patches.size();
+		stats.frameMilliseconds = elapsedMilliseconds(start);
+		stats.maxFrameMilliseconds = std::max(stats.maxFrameMilliseconds, stats.frameMilliseconds);
+	}
+
+	// Select the chunk at level, x, z and its descendants for the eye. Chunks not generated yet are
+	// bounded by the noise's amplitude
+	TerrainSelection Select(unsigned int level, int x, int z, const Frustum* frustum, bool visible)
+	{
+		// Chunks whose bounds are known stay in use while they are looked at, even out of range, or they
+		// would be evicted and come back each time the amplitude bound puts them in range
+		TerrainChunk* chunk = Find(level, x, z);
+		glm::vec3 center, extent;
+		if (chunk && chunk->state != TerrainWanted)
+		{
+			center = chunk->bounds.center;
+			extent = chunk->bounds.extent;
+			chunk->lastUsedFrame = frame;
+		}
+		else
+		{
+			float size = ChunkSize(level);
+			center = glm::vec3((x + 0.5f) * size, -noise.originHeight, (z + 0.5f) * size);
+			extent = glm::vec3(size * 0.5f, noise.MaxAmplitude(), size * 0.5f);
+		}
+		float distance = glm::length(glm::max(glm::abs(eye - center) - extent, glm::vec3(0.0f)));
+		if (distance > Range(level))
+			return TerrainOutOfRange;
+
+		if (!chunk)
+		{
+			chunk = new TerrainChunk();
+			chunk->level = level;
+			chunk->x = x;
+			chunk->z = z;
+			chunks[Key(level, x, z)].reset(chunk);
+		}
+		chunk->lastUsedFrame = frame;
+		chunk->distance = distance;
+		if (chunk->state != TerrainResident)
+		{
+			missing.push_back(chunk);
+			return TerrainMissing;
+		}
+
+		visible = visible && (!frustum || frustumIntersectsBox(*frustum, center, extent));
+		if (level == 0 || distance > Range(level - 1))
+		{
+			if (visible)
+				patches.push_back(TerrainPatch{ chunk, -1 });
+			return TerrainCovered;
+		}
+		for (int q = 0; q < 4; q++)
+		{
+			if (Select(level - 1, 2 * x + (q & 1), 2 * z + (q >> 1), frustum, visible) != TerrainCovered && visible)
+				patches.push_back(TerrainPatch{ chunk, q });
+		}
+		return TerrainCovered;
+	}
+
+	// Draw the patches of the last Update, all from the shared indices with the chunks' base vertices
+	void Draw(ShaderProgram& program)
+	{
+		if (!registry || patches.empty())
+			return;
+		glState.UseProgram(program.id);
+		program.SetVec3(UniformEyePosition, eye);
+		glState.BindVertexArray(sharedIndices.vao);
+		unsigned int quadrantIndices = (unsigned int)indices.size() / 4;
+		for (size_t p = 0; p < patches.size(); p++)
+		{
+			const TerrainPatch& patch = patches[p];
+			program.SetVec2(UniformMorphRange, MorphRange(patch.chunk->level));
+			unsigned int first = sharedIndices.firstIndex + (patch.quadrant < 0 ? 0 : patch.quadrant * quadrantIndices);
+			glState.DrawElements(GL_TRIANGLES, patch.quadrant < 0 ? (int)indices.size() : (int)quadrantIndices, GL_UNSIGNED_SHORT,
+				(void*)(size_t)(first * sizeof(unsigned short)), 1, patch.chunk->geometry.baseVertex);
+		}
+	}
+};
+
+// Terrain around the camera, with --terrain
+TerrainStreamer terrain;
+
+// Create Geometry
+// ---------------------------------
+
+/* Line grid of cells x cells GridUnit squares centered on the origin, for when the procedural grid
+   is not available */
+void createGeometryGrid(unsigned int cells)
+{
+	std::vector<glm::vec3> vertexArray;
+	vertexArray.reserve((cells + 1) * 4);
+	float halfSize = GridUnit * cells / 2;
+	// Z Lines
+	for (unsigned int x = 0; x <= cells; x++)
+	{
+		float xCoord = -halfSize + GridUnit * x;
+		vertexArray.push_back(glm::vec3(xCoord, 0.0f, -halfSize));
+		vertexArray.push_back(glm::vec3(xCoord, 0.0f, halfSize));
+	}
+
+	// X Lines
+	for (unsigned int z = 0; z <= cells; z++)
+	{
+		float zCoord = -halfSize + GridUnit * z;
+		vertexArray.push_back(glm::vec3(-halfSize, 0.0f, zCoord));
+		vertexArray.push_back(glm::vec3(halfSize, 0.0f, zCoord));
+	}
+	Grid.bounds = computeBounds(vertexArray.data(), vertexArray.size());
+
+	// Upload the line vertices into the shared position buffers as half floats
+	std::vector<glm::uint64> halfPositions(vertexArray.size());
+	packHalfPositions(vertexArray.data(), vertexArray.size(), halfPositions.data());
+	geometryRegistry.Add(Grid, PositionHalfFormat, halfPositions.data(), (unsigned int)halfPositions.size());
+}
+
+/* Draws the grid procedurally over the whole screen with gridShaderProgram: one triangle and no
+   vertex data, so its extent costs nothing. Drawn after the scene, as it blends over what is behind it */
+void drawProceduralGrid(const glm::vec4& colour)
+{
+	glState.UseProgram(gridShaderProgram.id);
+	gridShaderProgram.SetFloat(UniformGridUnit, GridUnit);
+	gridShaderProgram.SetVec4(UniformFragmentColour, colour);
+	glState.BindVertexArray(gridVao);
+	glState.Enable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glDepthMask(GL_FALSE);
+	glState.DrawArrays(GL_TRIANGLES, 0, 3);
+	glDepthMask(GL_TRUE);
+	glState.Disable(GL_BLEND);
+}
+
+void createGeometryUnitCube()
+{
+	glm::vec3 vertexArray[] =
+	{
+		// Axis Polygon (X Default)
+		glm::vec3(-(GridUnit/2), 0.0f, -(GridUnit / 2)),			// Bottom-left		0
+		glm::vec3((GridUnit / 2), 0.0f, -(GridUnit / 2)),			// Bottom-right		1
+		glm::vec3((GridUnit / 2), GridUnit, -(GridUnit / 2)),		// Top-right		2
+		glm::vec3(-(GridUnit / 2), GridUnit, -(GridUnit / 2)),		// Top-left			3
+
+		glm::vec3(-(GridUnit / 2), 0.0f, (GridUnit / 2)),			// Bottom-left		4
+		glm::vec3((GridUnit / 2), 0.0f, (GridUnit / 2)),			// Bottom-right		5
+		glm::vec3((GridUnit / 2), GridUnit, (GridUnit / 2)),		// Top-right		6
+		glm::vec3(-(GridUnit / 2), GridUnit, (GridUnit / 2))		// Top-left			7
+	};
+	Cube.bounds = computeBounds(vertexArray, 8);
+
+	unsigned int elements[] =
+	{
+		// Back Face
+		2, 1, 0,
+		0, 3, 2,
+
+		// Front Face
+		4, 5, 6,
+		6, 7, 4,
+
+		// Top Face
+		2, 3, 7,
+		7, 6, 2,
+
+		// Bottom Face
+		1, 5, 4,
+		4, 0, 1,
+
+		// Right Face
+		2, 6, 5,
+		5, 1, 2,
+
+		// Left Face
+		3, 0, 4,
+		4, 7, 3
+	};
+
+	// Order the hand-written faces for the vertex cache, then upload the vertices and elements into the
+	// shared half float buffers, next to the grid
+	optimizeMesh(vertexArray, sizeof(glm::vec3), 8, elements, 36);
+	glm::uint64 halfPositions[8];
+	packHalfPositions(vertexArray, 8, halfPositions);
+	geometryRegistry.Add(Cube, PositionHalfFormat, halfPositions, 8, elements, 36);
+}
+
+/* Per-instance data read by vertex0_instanced.vert */
+struct InstanceData
+{
+	glm::mat4 mvp;
+	glm::vec4 fragmentColour;
+};
+
+/* This struct holds a vao drawing a geometry once per entry of its instance buffer */
+struct InstancedGeometry
+{
+	unsigned int vao;
+	unsigned int instanceVbo;
+	unsigned int capacity;		// in instances
+
+	// Where the per-instance attributes currently point, instanceVbo or a stream buffer
+	unsigned int sourceBuffer;
+	size_t sourceOffset;
+
+	InstancedGeometry() : vao(0), instanceVbo(0), capacity(0), sourceBuffer(0), sourceOffset(0) {}
+};
+
+InstancedGeometry CubeInstances;
+
+/* Points the per-instance attributes of the bound instanced vao at the InstanceData array at offset in buffer */
+void pointInstanceAttributes(InstancedGeometry& instanced, unsigned int buffer, size_t offset)
+{
+	if (instanced.sourceBuffer == buffer && instanced.sourceOffset == offset)
+		return;
+	instanced.sourceBuffer = buffer;
+	instanced.sourceOffset = offset;
+
+	glState.BindBuffer(GL_ARRAY_BUFFER, buffer);
+	for (int column = 0; column < 4; column++)
+		glVertexAttribPointer(1 + column, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+			(void*)(offset + sizeof(glm::vec4) * column));
+	glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(offset + offsetof(InstanceData, fragmentColour)));
+}
+
+void createInstancedGeometry(const Geometry& geometry, InstancedGeometry& instanced)
+{
+	// Per-vertex attributes and indices of every mesh in the geometry's pool
+	glGenVertexArrays(1, &instanced.vao);
+	geometryRegistry.Attach(geometry, instanced.vao);
+
+	// Per-instance transform (attributes 1 to 4, one per column) and colour (attribute 5)
+	glGenBuffers(1, &instanced.instanceVbo);
+	pointInstanceAttributes(instanced, instanced.instanceVbo, 0);
+	for (int attribute = 1; attribute <= 5; attribute++)
+	{
+		glEnableVertexAttribArray(attribute);
+		glVertexAttribDivisor(attribute, 1);
+	}
+
+	glState.BindVertexArray(0);
+}
+
+/* Streams the instance data to the GPU, through instanceStream when it has room and otherwise
+   by orphaning the instance buffer. Leaves the instanced vao bound */
+void uploadInstances(InstancedGeometry& instanced, const std::vector<InstanceData>& instances)
+{
+	glState.BindVertexArray(instanced.vao);
+	if (instanceStream.buffer)
+	{
+		size_t offset = instanceStream.Write(instances.data(), instances.size() * sizeof(InstanceData));
+		if (offset != InvalidStreamOffset)
+		{
+			pointInstanceAttributes(instanced, instanceStream.buffer, offset);
+			return;
+		}
+	}
+
+	pointInstanceAttributes(instanced, instanced.instanceVbo, 0);
+	glState.BindBuffer(GL_ARRAY_BUFFER, instanced.instanceVbo);
+	if (instances.size() > instanced.capacity)
+	{
+		instanced.capacity = (unsigned int)instances.size();
+		glState.BufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(InstanceData), instances.data(), GL_STREAM_DRAW);
+	}
+	else
+	{
+		glState.BufferData(GL_ARRAY_BUFFER, instanced.capacity * sizeof(InstanceData), NULL, GL_STREAM_DRAW);
+		glState.BufferSubData(GL_ARRAY_BUFFER, 0, instances.size() * sizeof(InstanceData), instances.data());
+	}
+}
+
+// ---------------------------------
+
+/* Compiles and Links Shader sources into a Shader Program, returning the program id. A negative
+   length means the source ends with a 0 */
+unsigned int compileShaderProgram(const char* vertexShaderSource, const char* fragmentShaderSource, int vertexShaderLength = -1, int fragmentShaderLength = -1)
+{
+    // vertex shader
+    int vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertexShader, 1, &vertexShaderSource, &vertexShaderLength);
+    glCompileShader(vertexShader);
+    
+    // check for shader compile errors
+    int success;
+    char infoLog[512];
+    glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(vertexShader, 512, NULL, infoLog);
+        std::cerr << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+    }
+    
+    // grid fragment shader
+    int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fragmentShader, 1, &fragmentShaderSource, &fragmentShaderLength);
+    glCompileShader(fragmentShader);
+    
+    // check for shader compile errors
+    glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(fragmentShader, 512, NULL, infoLog);
+        std::cerr << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+    }
+    
+    // link shaders
+    int shaderProgram = glCreateProgram();
+    glAttachShader(shaderProgram, vertexShader);
+    glAttachShader(shaderProgram, fragmentShader);
+    glLinkProgram(shaderProgram);
+    
+    // check for linking errors
+    glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
+    if (!success) {
+        glGetProgramInfoLog(shaderProgram, 512, NULL, infoLog);
+        std::cerr << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+    }
+    
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+    
+    return shaderProgram;
+}
+
+/* Compiles and Links Shader files under res into a Shader Program, returning the program id. The
+   sources are compiled straight from the resource cache, without copies */
+unsigned int createShaderProgram(const char* vertexShaderName, const char* fragmentShaderName)
+{
+	ResourceView vertexShader, fragmentShader;
+	resources.Load(vertexShaderName, vertexShader);
+	resources.Load(fragmentShaderName, fragmentShader);
+	return compileShaderProgram(vertexShader.data ? vertexShader.data : "", fragmentShader.data ? fragmentShader.data : "",
+		(int)vertexShader.size, (int)fragmentShader.size);
+}
+
+
+
+/* Sets the final model-view-projection matrix of the object being drawn */
+void setMvpMatrix(ShaderProgram& shaderProgram, glm::mat4 mvpMatrix)
+{
+	shaderProgram.SetMat4(UniformMvpMatrix, mvpMatrix);
+}
+
+void setFragmentColour(ShaderProgram& shaderProgram, glm::vec4 fragmentColour)
+{
+	shaderProgram.SetVec4(UniformFragmentColour, fragmentColour);
+}
+
+// Per-Frame Uniform Buffer
+// ---------------------------------
+
+/* Camera data shared by every program through the FrameData uniform block (std140 layout) */
+struct FrameData
+{
+	glm::mat4 viewMatrix;
+	glm::mat4 projectionMatrix;
+	glm::mat4 viewProjectionMatrix;
+	glm::mat4 inverseViewProjectionMatrix;
+};
+
+unsigned int frameDataUbo = 0;
+FrameData lastFrameData;
+
+void createFrameDataBuffer()
+{
+	glGenBuffers(1, &frameDataUbo);
+	glState.BindBuffer(GL_UNIFORM_BUFFER, frameDataUbo);
+	glState.BufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), NULL, GL_DYNAMIC_DRAW);
+	glState.BindBufferBase(GL_UNIFORM_BUFFER, FrameDataBinding, frameDataUbo);
+	memset(&lastFrameData, 0, sizeof(lastFrameData));
+}
+
+/* Uploads the camera matrices once per frame, skipped when the camera did not move */
+void updateFrameData(const glm::mat4& view, const glm::mat4& projection)
+{
+	FrameData data;
+	data.viewMatrix = view;
+	data.projectionMatrix = projection;
+	data.viewProjectionMatrix = projection * view;
+	data.inverseViewProjectionMatrix = glm::inverse(data.viewProjectionMatrix);
+	if (memcmp(&data, &lastFrameData, sizeof(data)) == 0)
+		return;
+
+	lastFrameData = data;
+	glState.BindBuffer(GL_UNIFORM_BUFFER, frameDataUbo);
+	glState.BufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(data), &data);
+}
+
+// MVP Kernel
+// ---------------------------------
+
+/* Writes viewProjection * models[i] to the matrix mvpStride bytes after the previous one. The
+   SSE path computes each output column as a linear combination of the view-projection columns */
+void computeMvpMatrices(const glm::mat4& viewProjection, const glm::mat4* models, size_t count,
+	glm::mat4* mvps, size_t mvpStride = sizeof(glm::mat4))
+{
+	unsigned char* out = (unsigned char*)mvps;
+#if USE_SSE
+	__m128 c0 = _mm_loadu_ps(&viewProjection[0][0]);
+	__m128 c1 = _mm_loadu_ps(&viewProjection[1][0]);
+	__m128 c2 = _mm_loadu_ps(&viewProjection[2][0]);
+	__m128 c3 = _mm_loadu_ps(&viewProjection[3][0]);
+	for (size_t i = 0; i < count; i++)
+	{
+		const float* m = &models[i][0][0];
+		float* o = (float*)(out + i * mvpStride);
+		for (int column = 0; column < 4; column++)
+		{
+			const float* mc = m + column * 4;
+			__m128 r = _mm_mul_ps(c0, _mm_set1_ps(mc[0]));
+			r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(mc[1])));
+			r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(mc[2])));
+			r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_set1_ps(mc[3])));
+			_mm_storeu_ps(o + column * 4, r);
+		}
+	}
+#else
+	for (size_t i = 0; i < count; i++)
+		*(glm::mat4*)(out + i * mvpStride) = viewProjection * models[i];
+#endif
+}
+
+// Render Queue
+// ---------------------------------
+
+/* A range of a vao drawn by one draw call. indexType is 0 for non-indexed draws */
+struct DrawRange
+{
+	unsigned int vao;
+	unsigned int mode;
+	unsigned int count;
+	unsigned int first;		// first vertex, or first index for indexed draws
+	unsigned int indexType;
+	int baseVertex;			// added to every index
+};
+
+/* Draw range of a whole registered mesh */
+DrawRange geometryRange(const Geometry& geometry, unsigned int mode)
+{
+	DrawRange range = { geometry.vao, mode, geometry.indexCount ? geometry.indexCount : geometry.vertexCount,
+		geometry.indexCount ? geometry.firstIndex : geometry.baseVertex, geometry.indexType,
+		geometry.indexCount ? (int)geometry.baseVertex : 0 };
+	return range;
+}
+
+/* Command layouts read by glMultiDrawArraysIndirect and glMultiDrawElementsIndirect */
+struct DrawArraysIndirectCommand
+{
+	unsigned int count;
+	unsigned int instanceCount;
+	unsigned int first;
+	unsigned int baseInstance;
+};
+
+struct DrawElementsIndirectCommand
+{
+	unsigned int count;
+	unsigned int instanceCount;
+	unsigned int firstIndex;
+	int baseVertex;
+	unsigned int baseInstance;
+};
+
+/* Per-draw data of a multi-draw indirect batch, read through gl_DrawID. The model matrix rather than
+   the final one, so it only changes when the node does */
+struct IndirectDrawData
+{
+	glm::mat4 model;
+	glm::vec4 fragmentColour;
+};
+
+/* A draw emitted by scene traversal. Programs and ranges are interned by the queue, and the
+   transform and colour must stay valid until the queue is flushed */
+struct DrawPacket
+{
+	unsigned long long sortKey;
+	const glm::mat4* transform;
+	const glm::vec4* fragmentColour;
+	unsigned int program;
+	unsigned int range;
+};
+
+/* Per-flush statistics */
+struct RenderQueueStats
+{
+	unsigned int packetsIn;
+	unsigned int batchesOut;
+	unsigned int stateChanges;	// program and vao switches between batches
+
+	// Multi-draw indirect only: bytes of commands and draw data rewritten, the time to sort the packets
+	// and build them, and the time to upload the changes and issue the draws
+	size_t bytesUploaded;
+	double buildMilliseconds;
+	double submitMilliseconds;
+};
+
+/* Collects draw packets, radix-sorts them by a 64-bit key (program, vao, range, material, depth)
+   and merges runs of compatible packets into instanced or multi-draw batches. Programs, vaos and
+   ranges are interned per frame and forgotten by Flush. Past 256 programs or vaos, or 65536 ranges,
+   in a frame their key fields saturate: packets still draw what they hold, only batched less */
+struct RenderQueue
+{
+	std::vector<ShaderProgram*> programs;
+	std::vector<DrawRange> ranges;
+	std::vector<unsigned int> rangeVaoSlots;	// per range, the index of its vao in vaos
+	std::vector<unsigned int> vaos;
+	std::unordered_map<ShaderProgram*, unsigned int> programIndices;
+	std::unordered_map<glm::uint64, unsigned int> rangeIndices;	// FNV-1a of a range, to the first range with that hash
+	std::vector<DrawPacket> packets;
+	RenderQueueStats stats;
+
+	// Instanced variant of a vao: the program and instanced vao drawing it
+	struct Instancing
+	{
+		unsigned int vao;
+		ShaderProgram* program;
+		InstancedGeometry* instanced;
+	};
+	std::vector<Instancing> instancing;
+
+	// Multi-draw indirect mode: every packet becomes a command, and the program reads the packet's
+	// model matrix and colour from the draw data buffer through gl_DrawID. Both buffers keep their
+	// contents between frames, changes are copied in from staging. Disabled while program is null
+	struct Indirect
+	{
+		ShaderProgram* program;
+		unsigned int commandBuffer;
+		unsigned int drawDataBuffer;
+		StreamBuffer* staging;
+	};
+	Indirect indirect;
+
+	// What the indirect buffers hold, to upload only what differs, and their sizes in bytes
+	std::vector<unsigned char> residentCommands, residentDrawData;
+	unsigned int residentCommandBuffer, residentDrawDataBuffer;
+	size_t commandCapacity, drawDataCapacity;
+
+	// A glMultiDraw*Indirect call over consecutive commands
+	struct IndirectBatch
+	{
+		unsigned int vao;
+		unsigned int mode;
+		unsigned int indexType;
+		size_t commandOffset;	// in bytes
+		unsigned int firstDraw;
+		unsigned int drawCount;
+	};
+
+	// View-space depth of the packets, quantized over [0, farPlane]
+	glm::vec4 depthRow;
+	float farPlane;
+
+	// Combined with each packet's transform into its final matrix
+	glm::mat4 viewProjection;
+
+	// Sort and batching scratch
+	std::vector<unsigned long long> keys, sortedKeys;
+	std::vector<unsigned int> order, sortedOrder;
+	std::vector<InstanceData> instances;
+	std::vector<glm::mat4> models;
+	std::vector<int> multiFirst, multiCount, multiBaseVertex;
+	std::vector<const void*> multiIndices;
+	std::vector<unsigned int> commandWords;
+	std::vector<IndirectDrawData> drawData;
+	std::vector<IndirectBatch> indirectBatches;
+
+	RenderQueue() : residentCommandBuffer(0), residentDrawDataBuffer(0), commandCapacity(0), drawDataCapacity(0),
+		depthRow(0.0f, 0.0f, -1.0f, 0.0f), farPlane(10.0f), viewProjection(1.0f)
+	{
+		memset(&stats, 0, sizeof(stats));
+		memset(&indirect, 0, sizeof(indirect));
+	}
+
+	// Start a frame, the view matrix orders packets front to back
+	void Begin(const glm::mat4& view, const glm::mat4& projection, float far)
+	{
+		packets.clear();
+		ClearTables();
+		depthRow = -glm::vec4(view[0][2], view[1][2], view[2][2], view[3][2]);
+		farPlane = far;
+		viewProjection = projection * view;
+	}
+
+	void RegisterInstancing(unsigned int vao, ShaderProgram& program, InstancedGeometry& instanced)
+	{
+		Instancing entry = { vao, &program, &instanced };
+		instancing.push_back(entry);
+	}
+
+	// The buffers are treated as empty, whatever they held before
+	void EnableIndirect(ShaderProgram& program, unsigned int commandBuffer, unsigned int drawDataBuffer, StreamBuffer& staging)
+	{
+		Indirect entry = { &program, commandBuffer, drawDataBuffer, &staging };
+		indirect = entry;
+		ForgetResident();
+	}
+
+	void ForgetResident()
+	{
+		residentCommands.clear();
+		residentDrawData.clear();
+		residentCommandBuffer = indirect.commandBuffer;
+		residentDrawDataBuffer = indirect.drawDataBuffer;
+		commandCapacity = 0;
+		drawDataCapacity = 0;
+	}
+
+	void DisableIndirect()
+	{
+		indirect.program = nullptr;
+	}
+
+	// Index of a program in this frame's table, valid until the next Flush
+	unsigned int ProgramIndex(ShaderProgram& program)
+	{
+		std::pair<std::unordered_map<ShaderProgram*, unsigned int>::iterator, bool> entry =
+			programIndices.insert(std::make_pair(&program, (unsigned int)programs.size()));
+		if (entry.second)
+			programs.push_back(&program);
+		return entry.first->second;
+	}
+
+	// Index of a range in this frame's table, valid until the next Flush
+	unsigned int RangeIndex(const DrawRange& range)
+	{
+		glm::uint64 hash = 14695981039346656037ull;
+		const unsigned char* bytes = (const unsigned char*)&range;
+		for (size_t b = 0; b < sizeof(range); b++)
+			hash = (hash ^ bytes[b]) * 1099511628211ull;
+		std::pair<std::unordered_map<glm::uint64, unsigned int>::iterator, bool> entry =
+			rangeIndices.insert(std::make_pair(hash, (unsigned int)ranges.size()));
+		if (!entry.second)
+		{
+			if (memcmp(&ranges[entry.first->second], &range, sizeof(range)) == 0)
+				return entry.first->second;
+
+			// Two ranges with the same hash, rare enough to look through the table
+			for (size_t i = 0; i < ranges.size(); i++)
+			{
+				if (memcmp(&ranges[i], &range, sizeof(range)) == 0)
+					return (unsigned int)i;
+			}
+		}
+		ranges.push_back(range);
+		unsigned int vaoSlot = 0;
+		while (vaoSlot < vaos.size() && vaos[vaoSlot] != range.vao)
+			vaoSlot++;
+		if (vaoSlot == vaos.size())
+			vaos.push_back(range.vao);
+		rangeVaoSlots.push_back(vaoSlot);
+		return (unsigned int)(ranges.size() - 1);
+	}
+
+	void ClearTables()
+	{
+		programs.clear();
+		ranges.clear();
+		rangeVaoSlots.clear();
+		vaos.clear();
+		programIndices.clear();
+		rangeIndices.clear();
+	}
+
+	// A table index as a key field of bits bits, saturated
+	static unsigned long long KeyField(unsigned int index, unsigned int bits)
+	{
+		return std::min(index, (1u << bits) - 1);
+	}
+
+	void Submit(unsigned int program, unsigned int range, const glm::mat4* transform, const glm::vec4* fragmentColour)
+	{
+		// Material: a hash of the colour, so equal colours end up adjacent
+		unsigned int colourBits[4];
+		memcpy(colourBits, fragmentColour, sizeof(colourBits));
+		unsigned int material = (colourBits[0] * 73856093u) ^ (colourBits[1] * 19349663u) ^ (colourBits[2] * 83492791u) ^ colourBits[3];
+		material = (material ^ (material >> 16) ^ (material >> 8)) & 0xFF;
+
+		// Indirect draws keep their submission order within a batch instead, so a camera move does not
+		// shuffle the commands and draw data the buffers already hold
+		float depth = glm::dot(depthRow, (*transform)[3]) / farPlane;
+		unsigned int quantizedDepth = indirect.program ? 0 : (unsigned int)(glm::clamp(depth, 0.0f, 1.0f) * 0xFFFFFF);
+
+		DrawPacket packet;
+		packet.sortKey = (KeyField(program, 8) << 56)
+			| (KeyField(rangeVaoSlots[range], 8) << 48)
+			| (KeyField(range, 16) << 32)
+			| ((unsigned long long)material << 24)
+			| quantizedDepth;
+		packet.transform = transform;
+		packet.fragmentColour = fragmentColour;
+		packet.program = program;
+		packet.range = range;
+		packets.push_back(packet);
+	}
+
+	void Submit(ShaderProgram& program, const DrawRange& range, const glm::mat4* transform, const glm::vec4* fragmentColour)
+	{
+		Submit(ProgramIndex(program), RangeIndex(range), transform, fragmentColour);
+	}
+
+	// LSD radix sort of the keys, 8 bits per pass. Passes where every key has the same digit are skipped
+	void Sort()
+	{
+		size_t n = packets.size();
+		keys.resize(n);
+		order.resize(n);
+		sortedKeys.resize(n);
+		sortedOrder.resize(n);
+		for (size_t i = 0; i < n; i++)
+		{
+			keys[i] = packets[i].sortKey;
+			order[i] = (unsigned int)i;
+		}
+		if (n < 2)
+			return;
+
+		for (int shift = 0; shift < 64; shift += 8)
+		{
+			unsigned int offsets[256] = { 0 };
+			for (size_t i = 0; i < n; i++)
+				offsets[(keys[i] >> shift) & 0xFF]++;
+			if (offsets[(keys[0] >> shift) & 0xFF] == n)
+				continue;
+
+			unsigned int sum = 0;
+			for (int d = 0; d < 256; d++)
+			{
+				unsigned int c = offsets[d];
+				offsets[d] = sum;
+				sum += c;
+			}
+			for (size_t i = 0; i < n; i++)
+			{
+				unsigned int slot = offsets[(keys[i] >> shift) & 0xFF]++;
+				sortedKeys[slot] = keys[i];
+				sortedOrder[slot] = order[i];
+			}
+			keys.swap(sortedKeys);
+			order.swap(sortedOrder);
+		}
+	}
+
+	const Instancing* FindInstancing(unsigned int vao) const
+	{
+		for (size_t i = 0; i < instancing.size(); i++)
+		{
+			if (instancing[i].vao == vao)
+				return &instancing[i];
+		}
+		return nullptr;
+	}
+
+	// Sort, batch and submit every packet
+	void Flush()
+	{
+		if (indirect.program)
+		{
+			FlushIndirect();
+			return;
+		}
+		Sort();
+		memset(&stats, 0, sizeof(stats));
+		stats.packetsIn = (unsigned int)packets.size();
+
+		unsigned int lastProgram = UnknownState;
+		unsigned int lastVao = UnknownState;
+		size_t n = packets.size();
+		size_t begin = 0;
+		while (begin < n)
+		{
+			const DrawPacket& first = packets[order[begin]];
+			const DrawRange& range = ranges[first.range];
+
+			// An instanced batch takes the whole run of packets with the same program and range
+			const Instancing* instanced = range.indexType != 0 ? FindInstancing(range.vao) : nullptr;
+			size_t end = begin + 1;
+			if (instanced)
+			{
+				while (end < n && packets[order[end]].program == first.program && packets[order[end]].range == first.range)
+					end++;
+				if (end - begin == 1)
+					instanced = nullptr;
+			}
+
+			ShaderProgram* program = programs[first.program];
+			unsigned int vao = range.vao;
+			if (instanced)
+			{
+				program = instanced->program;
+				vao = instanced->instanced->vao;
+			}
+			else
+			{
+				// Single draws, or a multi-draw of adjacent ranges sharing the same transform and colour
+				while (end < n && packets[order[end]].program == first.program
+					&& ranges[packets[order[end]].range].vao == range.vao
+					&& ranges[packets[order[end]].range].mode == range.mode
+					&& ranges[packets[order[end]].range].indexType == range.indexType
+					&& *packets[order[end]].transform == *first.transform
+					&& *packets[order[end]].fragmentColour == *first.fragmentColour)
+					end++;
+			}
+
+			if (program->id != lastProgram || vao != lastVao)
+				stats.stateChanges++;
+			lastProgram = program->id;
+			lastVao = vao;
+			program->Use();
+			glState.BindVertexArray(vao);
+			stats.batchesOut++;
+
+			if (instanced)
+			{
+				instances.resize(end - begin);
+				models.resize(end - begin);
+				for (size_t i = begin; i < end; i++)
+				{
+					models[i - begin] = *packets[order[i]].transform;
+					instances[i - begin].fragmentColour = *packets[order[i]].fragmentColour;
+				}
+				computeMvpMatrices(viewProjection, models.data(), models.size(), &instances[0].mvp, sizeof(InstanceData));
+				uploadInstances(*instanced->instanced, instances);
+				glState.DrawElements(range.mode, range.count, range.indexType,
+					(void*)(size_t)(range.first * indexTypeSize(range.indexType)), (int)instances.size(), range.baseVertex);
+			}
+			else
+			{
+				glm::mat4 mvp;
+				computeMvpMatrices(viewProjection, first.transform, 1, &mvp);
+				setMvpMatrix(*program, mvp);
+				setFragmentColour(*program, *first.fragmentColour);
+				if (end - begin == 1)
+				{
+					if (range.indexType == 0)
+						glState.DrawArrays(range.mode, range.first, range.count);
+					else
+						glState.DrawElements(range.mode, range.count, range.indexType,
+							(void*)(size_t)(range.first * indexTypeSize(range.indexType)), 1, range.baseVertex);
+				}
+				else
+				{
+					multiFirst.clear();
+					multiCount.clear();
+					multiIndices.clear();
+					multiBaseVertex.clear();
+					for (size_t i = begin; i < end; i++)
+					{
+						const DrawRange& r = ranges[packets[order[i]].range];
+						multiFirst.push_back(r.first);
+						multiCount.push_back(r.count);
+						multiIndices.push_back((void*)(size_t)(r.first * indexTypeSize(r.indexType)));
+						multiBaseVertex.push_back(r.baseVertex);
+					}
+					if (range.indexType == 0)
+						glState.MultiDrawArrays(range.mode, multiFirst.data(), multiCount.data(), (int)multiCount.size());
+					else
+						glState.MultiDrawElements(range.mode, multiCount.data(), range.indexType, multiIndices.data(), (int)multiCount.size(),
+							multiBaseVertex.data());
+				}
+			}
+			begin = end;
+		}
+		packets.clear();
+		ClearTables();
+	}
+
+	// Sort the packets, build their commands and draw data, and draw each run of packets sharing a vao,
+	// mode and index type with one glMultiDraw*Indirect. Only the commands and draw data that differ
+	// from what the buffers hold are uploaded. The GL calls grow with the runs and the changes, the
+	// CPU time still with the packets, which are sorted and compared every frame
+	void FlushIndirect()
+	{
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		Sort();
+		memset(&stats, 0, sizeof(stats));
+		size_t n = packets.size();
+		stats.packetsIn = (unsigned int)n;
+		if (n == 0)
+		{
+			ClearTables();
+			return;
+		}
+
+		// Per-draw data, in sorted order so draw i of a batch is at firstDraw + gl_DrawID
+		drawData.resize(n);
+		for (size_t i = 0; i < n; i++)
+		{
+			drawData[i].model = *packets[order[i]].transform;
+			drawData[i].fragmentColour = *packets[order[i]].fragmentColour;
+		}
+
+		commandWords.clear();
+		indirectBatches.clear();
+		size_t begin = 0;
+		while (begin < n)
+		{
+			const DrawRange& range = ranges[packets[order[begin]].range];
+			size_t end = begin + 1;
+			while (end < n && ranges[packets[order[end]].range].vao == range.vao
+				&& ranges[packets[order[end]].range].mode == range.mode
+				&& ranges[packets[order[end]].range].indexType == range.indexType)
+				end++;
+
+			IndirectBatch batch = { range.vao, range.mode, range.indexType, commandWords.size() * sizeof(unsigned int),
+				(unsigned int)begin, (unsigned int)(end - begin) };
+			indirectBatches.push_back(batch);
+			for (size_t i = begin; i < end; i++)
+			{
+				const DrawRange& r = ranges[packets[order[i]].range];
+				if (range.indexType == 0)
+				{
+					DrawArraysIndirectCommand command = { r.count, 1, r.first, 0 };
+					commandWords.insert(commandWords.end(), (unsigned int*)&command, (unsigned int*)(&command + 1));
+				}
+				else
+				{
+					DrawElementsIndirectCommand command = { r.count, 1, r.first, r.baseVertex, 0 };
+					commandWords.insert(commandWords.end(), (unsigned int*)&command, (unsigned int*)(&command + 1));
+				}
+			}
+			begin = end;
+		}
+		stats.buildMilliseconds = elapsedMilliseconds(start);
+
+		start = std::chrono::high_resolution_clock::now();
+		if (indirect.commandBuffer != residentCommandBuffer || indirect.drawDataBuffer != residentDrawDataBuffer)
+			ForgetResident();
+		indirect.staging->BeginFrame();
+		UploadChanges(indirect.commandBuffer, (const unsigned char*)commandWords.data(), commandWords.size() * sizeof(unsigned int),
+			sizeof(unsigned int), residentCommands, commandCapacity);
+		UploadChanges(indirect.drawDataBuffer, (const unsigned char*)drawData.data(), n * sizeof(IndirectDrawData),
+			sizeof(IndirectDrawData), residentDrawData, drawDataCapacity);
+		glState.BindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect.commandBuffer);
+		glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, DrawDataBinding, indirect.drawDataBuffer);
+
+		indirect.program->Use();
+		indirect.program->SetMat4(UniformViewProjectionMatrix, viewProjection);
+		stats.stateChanges++;
+		unsigned int lastVao = UnknownState;
+		for (size_t i = 0; i < indirectBatches.size(); i++)
+		{
+			const IndirectBatch& batch = indirectBatches[i];
+			if (batch.vao != lastVao && i > 0)
+				stats.stateChanges++;
+			lastVao = batch.vao;
+			indirect.program->SetInt(UniformDrawOffset, (int)batch.firstDraw);
+			glState.BindVertexArray(batch.vao);
+			glState.MultiDrawIndirect(batch.mode, batch.indexType, batch.commandOffset, (int)batch.drawCount);
+			stats.batchesOut++;
+		}
+		packets.clear();
+		ClearTables();
+		stats.submitMilliseconds = elapsedMilliseconds(start);
+	}
+
+	// Bring buffer up to date with bytes of data. Unchanged blocks are skipped with one compare, the
+	// others compared with resident elementSize bytes at a time. Runs of changed elements less than a
+	// few commands apart are merged, and each run is written to the staging stream and copied into
+	// place. A buffer too small is reallocated and filled whole
+	void UploadChanges(unsigned int buffer, const unsigned char* data, size_t bytes, size_t elementSize,
+		std::vector<unsigned char>& resident, size_t& capacity)
+	{
+		const size_t mergeGap = 256;
+		const size_t skipBlock = 1024 / elementSize * elementSize;
+		if (bytes > capacity)
+		{
+			capacity = std::max(bytes, capacity * 2);
+			glState.BindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+			glState.BufferData(GL_COPY_WRITE_BUFFER, capacity, NULL, GL_DYNAMIC_DRAW);
+			resident.clear();
+		}
+		size_t residentBytes = std::min(resident.size(), bytes);
+		resident.resize(bytes);
+		size_t maxRun = indirect.staging->regionSize / elementSize * elementSize;
+		size_t runBegin = 0, runEnd = 0;
+		bool inRun = false;
+		for (size_t offset = 0; offset <= bytes; offset += elementSize)
+		{
+			while (offset + skipBlock <= residentBytes && memcmp(data + offset, &resident[offset], skipBlock) == 0)
+				offset += skipBlock;
+			bool last = offset == bytes;
+			bool changed = !last && (offset + elementSize > residentBytes || memcmp(data + offset, &resident[offset], elementSize) != 0);
+			if (inRun && (last || (changed && (offset - runEnd > mergeGap || offset + elementSize - runBegin > maxRun))))
+			{
+				CopyIn(buffer, data + runBegin, runBegin, runEnd - runBegin);
+				memcpy(&resident[runBegin], data + runBegin, runEnd - runBegin);
+				inRun = false;
+			}
+			if (!changed)
+				continue;
+			if (!inRun)
+				runBegin = offset;
+			runEnd = offset + elementSize;
+			inRun = true;
+		}
+	}
+
+	// Write bytes to the staging stream and copy them to offset in buffer
+	void CopyIn(unsigned int buffer, const unsigned char* data, size_t offset, size_t bytes)
+	{
+		size_t source = indirect.staging->Write(data, bytes, 4);
+		glState.BindBuffer(GL_COPY_READ_BUFFER, indirect.staging->buffer);
+		glState.BindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		glState.CopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, source, offset, bytes);
+		stats.bytesUploaded += bytes;
+	}
+};
+
+// Scene Hierarchy
+// ---------------------------------
+
+/* Builds T(position) * T(pivot) * R(rotation) * S(scale) * T(-pivot) directly into a matrix,
+   without going through translate/rotate/scale intermediates. rotation must be normalized */
+glm::mat4 composeTransform(glm::vec3 position, glm::quat rotation, glm::vec3 scale, glm::vec3 pivot)
+{
+	float xx = rotation.x * rotation.x, yy = rotation.y * rotation.y, zz = rotation.z * rotation.z;
+	float xy = rotation.x * rotation.y, xz = rotation.x * rotation.z, yz = rotation.y * rotation.z;
+	float wx = rotation.w * rotation.x, wy = rotation.w * rotation.y, wz = rotation.w * rotation.z;
+
+	glm::mat4 m;
+	m[0] = glm::vec4((1.0f - 2.0f * (yy + zz)) * scale.x, 2.0f * (xy + wz) * scale.x, 2.0f * (xz - wy) * scale.x, 0.0f);
+	m[1] = glm::vec4(2.0f * (xy - wz) * scale.y, (1.0f - 2.0f * (xx + zz)) * scale.y, 2.0f * (yz + wx) * scale.y, 0.0f);
+	m[2] = glm::vec4(2.0f * (xz + wy) * scale.z, 2.0f * (yz - wx) * scale.z, (1.0f - 2.0f * (xx + yy)) * scale.z, 0.0f);
+
+	// The pivot is mapped onto itself, then everything is moved by position
+	glm::vec3 t = position + pivot
+		- glm::vec3(m[0]) * pivot.x - glm::vec3(m[1]) * pivot.y - glm::vec3(m[2]) * pivot.z;
+	m[3] = glm::vec4(t, 1.0f);
+	return m;
+}
+
+/* parent * local for affine matrices, whose last row is 0 0 0 1. Skips the products with that row */
+glm::mat4 multiplyAffine(const glm::mat4& parent, const glm::mat4& local)
+{
+	glm::mat4 m;
+	for (int column = 0; column < 3; column++)
+		m[column] = parent[0] * local[column].x + parent[1] * local[column].y + parent[2] * local[column].z;
+	m[3] = parent[0] * local[3].x + parent[1] * local[3].y + parent[2] * local[3].z + parent[3];
+	return m;
+}
+
+/* Handle used to address a scene node. Handles stay valid when the node arrays are reordered */
+typedef unsigned int NodeHandle;
+const unsigned int InvalidIndex = 0xFFFFFFFFu;
+const NodeHandle InvalidNode = InvalidIndex;
+
+// Node flags
+const unsigned char NodeDrawable = 1 << 0;
+const unsigned char NodeRemoved = 1 << 1;
+const unsigned char NodeLocalDirty = 1 << 2;
+
+/* Data-oriented transform hierarchy. Node data lives in parallel arrays kept in topological order
+   (a parent always precedes its children), so world matrices are propagated in one linear sweep.
+   Edits only flag the node dirty; world matrices are recomputed lazily, for changed subtrees only.
+   Local transforms are kept as position, rotation and scale about a pivot, and never accumulated
+   as matrices, so repeated edits do not drift */
+struct SceneHierarchy
+{
+	// Dense node data, indexed by position in the topological order
+	std::vector<unsigned int> parent;		// dense index of the parent, InvalidIndex for roots
+	std::vector<glm::vec3> position;
+	std::vector<glm::quat> rotation;
+	std::vector<glm::vec3> scale;
+	std::vector<glm::vec3> pivot;
+	std::vector<glm::mat4> world;
+	std::vector<glm::vec4> fragmentColour;
+	std::vector<unsigned char> flags;
+	std::vector<unsigned int> worldGeneration;	// update generation that last recomputed the world matrix
+	std::vector<NodeHandle> handle;			// dense index -> handle
+
+	// Bounds of the node's geometry, and their world-space box and sphere radius, refreshed with the world matrix
+	std::vector<BoundingVolume> localBounds;
+	BoundingBoxArrays worldBoxes;
+	std::vector<float> worldRadius;
+
+	// Handle indirection
+	std::vector<unsigned int> denseIndex;	// handle -> dense index
+	std::vector<NodeHandle> freeHandles;
+
+	// Set when a reparent or removal broke the topological order
+	bool orderDirty;
+
+	// Dirty tracking
+	unsigned int generation;
+	unsigned int dirtyCount;
+
+	// Number of world matrices recomputed by the last UpdateWorldTransforms()
+	unsigned int lastRecomputedCount;
+
+	// Scratch buffer for the instanced draw path
+	std::vector<InstanceData> instances;
+
+	// Frustum test results of the last Cull(), indexed like the node data
+	std::vector<unsigned char> visible;
+	CullStats lastCullStats;
+
+	// Spatial index over worldBoxes, rebuilt after nodes are added or reordered and refitted after they move
+	Bvh bvh;
+	bool bvhStale;
+	unsigned int bvhGeneration;
+	unsigned int bvhThreadCount;	// threads of a full rebuild
+
+	SceneHierarchy() : orderDirty(false), generation(0), dirtyCount(0), lastRecomputedCount(0), bvhStale(true), bvhGeneration(0),
+		bvhThreadCount(std::max(1u, std::thread::hardware_concurrency())) {}
+
+	unsigned int Size() const
+	{
+		return (unsigned int)parent.size();
+	}
+
+	void Reserve(unsigned int count)
+	{
+		parent.reserve(count);
+		position.reserve(count);
+		rotation.reserve(count);
+		scale.reserve(count);
+		pivot.reserve(count);
+		world.reserve(count);
+		fragmentColour.reserve(count);
+		flags.reserve(count);
+		worldGeneration.reserve(count);
+		handle.reserve(count);
+		localBounds.reserve(count);
+		worldBoxes.Reserve(count);
+		worldRadius.reserve(count);
+		denseIndex.reserve(count);
+	}
+
+	// Append a node under the given parent (InvalidNode for a root). The parent already precedes
+	// the new node, so the topological order is preserved
+	NodeHandle AddNode(NodeHandle parentNode, bool drawable = true)
+	{
+		NodeHandle h;
+		if (freeHandles.size() > 0)
+		{
+			h = freeHandles.back();
+			freeHandles.pop_back();
+		}
+		else
+		{
+			h = (NodeHandle)denseIndex.size();
+			denseIndex.push_back(InvalidIndex);
+		}
+
+		denseIndex[h] = Size();
+		parent.push_back(parentNode == InvalidNode ? InvalidIndex : denseIndex[parentNode]);
+		position.push_back(glm::vec3(0.0f));
+		rotation.push_back(glm::quat(1.0f, 0.0f, 0.0f, 0.0f));
+		scale.push_back(glm::vec3(1.0f));
+		pivot.push_back(glm::vec3(0.0f));
+		world.push_back(glm::mat4(1.0f));
+		fragmentColour.push_back(glm::vec4(1.0f));
+		flags.push_back(drawable ? NodeDrawable : 0);
+		worldGeneration.push_back(0);
+		handle.push_back(h);
+		localBounds.push_back(drawable ? unitCubeBounds() : BoundingVolume());
+		worldBoxes.PushBack(BoundingVolume());
+		worldRadius.push_back(0.0f);
+		MarkDirty(Size() - 1);
+		bvhStale = true;
+		return h;
+	}
+
+	// Move a node (and its subtree) under a new parent. Returns false if that would create a cycle,
+	// including parenting a node to itself
+	bool Reparent(NodeHandle node, NodeHandle newParent)
+	{
+		if (node == newParent)
+			return false;
+		unsigned int index = denseIndex[node];
+		if (newParent == InvalidNode)
+		{
+			parent[index] = InvalidIndex;
+			MarkDirty(index);
+			return true;
+		}
+
+		unsigned int parentIndex = denseIndex[newParent];
+		if (parentIndex > index || orderDirty)
+		{
+			// The new parent may be a descendant of the node, walk up to make sure it is not
+			for (unsigned int i = parentIndex; i != InvalidIndex; i = parent[i])
+			{
+				if (i == index)
+					return false;
+			}
+			orderDirty = true;
+		}
+		parent[index] = parentIndex;
+		MarkDirty(index);
+		return true;
+	}
+
+	// Remove a node and its subtree. The slots are reclaimed by the next Linearize()
+	void RemoveNode(NodeHandle node)
+	{
+		flags[denseIndex[node]] |= NodeRemoved;
+		orderDirty = true;
+	}
+
+	// Flag a node whose local transform or parent changed
+	void MarkDirty(unsigned int index)
+	{
+		if (!(flags[index] & NodeLocalDirty))
+		{
+			flags[index] |= NodeLocalDirty;
+			dirtyCount++;
+		}
+	}
+
+	void SetPosition(NodeHandle node, glm::vec3 p)
+	{
+		unsigned int index = denseIndex[node];
+		position[index] = p;
+		MarkDirty(index);
+	}
+
+	void SetRotation(NodeHandle node, glm::quat r)
+	{
+		unsigned int index = denseIndex[node];
+		rotation[index] = glm::normalize(r);
+		MarkDirty(index);
+	}
+
+	void SetScale(NodeHandle node, glm::vec3 s)
+	{
+		unsigned int index = denseIndex[node];
+		scale[index] = s;
+		MarkDirty(index);
+	}
+
+	// Rotation and scale are applied about the pivot, given in the node's local space
+	void SetPivot(NodeHandle node, glm::vec3 p)
+	{
+		unsigned int index = denseIndex[node];
+		pivot[index] = p;
+		MarkDirty(index);
+	}
+
+	glm::vec3 GetPosition(NodeHandle node) const
+	{
+		return position[denseIndex[node]];
+	}
+
+	glm::quat GetRotation(NodeHandle node) const
+	{
+		return rotation[denseIndex[node]];
+	}
+
+	glm::vec3 GetScale(NodeHandle node) const
+	{
+		return scale[denseIndex[node]];
+	}
+
+	void Translate(NodeHandle node, glm::vec3 translation)
+	{
+		SetPosition(node, GetPosition(node) + translation);
+	}
+
+	// Rotate about the pivot, on top of the current rotation
+	void Rotate(NodeHandle node, glm::quat r)
+	{
+		SetRotation(node, r * GetRotation(node));
+	}
+
+	// Scale about the pivot, on top of the current scale
+	void Scale(NodeHandle node, glm::vec3 s)
+	{
+		SetScale(node, GetScale(node) * s);
+	}
+
+	glm::mat4 GetWorldTransform(NodeHandle node) const
+	{
+		return world[denseIndex[node]];
+	}
+
+	void SetFragmentColour(NodeHandle node, glm::vec4 colour)
+	{
+		fragmentColour[denseIndex[node]] = colour;
+	}
+
+	// Bounds of what the node draws, in its local space. Nodes draw the unit cube by default
+	void SetLocalBounds(NodeHandle node, const BoundingVolume& bounds)
+	{
+		unsigned int index = denseIndex[node];
+		localBounds[index] = bounds;
+		MarkDirty(index);
+	}
+
+	BoundingVolume GetWorldBounds(NodeHandle node) const
+	{
+		unsigned int i = denseIndex[node];
+		BoundingVolume bounds;
+		bounds.center = glm::vec3(worldBoxes.centerX[i], worldBoxes.centerY[i], worldBoxes.centerZ[i]);
+		bounds.extent = glm::vec3(worldBoxes.extentX[i], worldBoxes.extentY[i], worldBoxes.extentZ[i]);
+		bounds.radius = worldRadius[i];
+		return bounds;
+	}
+
+	// Restore the topological order and compact away removed subtrees, O(n)
+	void Linearize()
+	{
+		unsigned int count = Size();
+
+		// Bucket children by parent
+		std::vector<unsigned int> childStart(count + 1, 0);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (parent[i] != InvalidIndex)
+				childStart[parent[i] + 1]++;
+		}
+		for (unsigned int i = 0; i < count; i++)
+			childStart[i + 1] += childStart[i];
+
+		std::vector<unsigned int> children(childStart[count]);
+		std::vector<unsigned int> cursor(childStart.begin(), childStart.end() - 1);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (parent[i] != InvalidIndex)
+				children[cursor[parent[i]]++] = i;
+		}
+
+		// Breadth-first walk from the roots, skipping removed subtrees
+		std::vector<unsigned int> order;
+		order.reserve(count);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (parent[i] == InvalidIndex && !(flags[i] & NodeRemoved))
+				order.push_back(i);
+		}
+		for (size_t head = 0; head < order.size(); head++)
+		{
+			unsigned int i = order[head];
+			for (unsigned int c = childStart[i]; c < childStart[i + 1]; c++)
+			{
+				if (!(flags[children[c]] & NodeRemoved))
+					order.push_back(children[c]);
+			}
+		}
+
+		std::vector<unsigned int> newIndex(count, InvalidIndex);
+		for (unsigned int k = 0; k < order.size(); k++)
+			newIndex[order[k]] = k;
+
+		// Release the handles of dropped nodes
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (newIndex[i] == InvalidIndex)
+			{
+				if (flags[i] & NodeLocalDirty)
+					dirtyCount--;
+				denseIndex[handle[i]] = InvalidIndex;
+				freeHandles.push_back(handle[i]);
+			}
+		}
+
+		std::vector<unsigned int> newParent(order.size());
+		for (unsigned int k = 0; k < order.size(); k++)
+		{
+			unsigned int p = parent[order[k]];
+			newParent[k] = p == InvalidIndex ? InvalidIndex : newIndex[p];
+		}
+		parent.swap(newParent);
+		Permute(position, order);
+		Permute(rotation, order);
+		Permute(scale, order);
+		Permute(pivot, order);
+		Permute(world, order);
+		Permute(fragmentColour, order);
+		Permute(flags, order);
+		Permute(worldGeneration, order);
+		Permute(handle, order);
+		Permute(localBounds, order);
+		Permute(worldBoxes.centerX, order);
+		Permute(worldBoxes.centerY, order);
+		Permute(worldBoxes.centerZ, order);
+		Permute(worldBoxes.extentX, order);
+		Permute(worldBoxes.extentY, order);
+		Permute(worldBoxes.extentZ, order);
+		Permute(worldRadius, order);
+		for (unsigned int k = 0; k < order.size(); k++)
+			denseIndex[handle[k]] = k;
+
+		orderDirty = false;
+		bvhStale = true;
+	}
+
+	template <typename T>
+	static void Permute(std::vector<T>& values, const std::vector<unsigned int>& order)
+	{
+		std::vector<T> permuted(order.size());
+		for (size_t k = 0; k < order.size(); k++)
+			permuted[k] = values[order[k]];
+		values.swap(permuted);
+	}
+
+	// Propagate world matrices in a single linear sweep. A node is recomputed when its own transform
+	// is dirty or its parent was recomputed in this generation; a static scene costs nothing
+	void UpdateWorldTransforms()
+	{
+		if (orderDirty)
+			Linearize();
+
+		lastRecomputedCount = 0;
+		if (dirtyCount == 0)
+			return;
+		generation++;
+
+		unsigned int count = Size();
+		for (unsigned int i = 0; i < count; i++)
+		{
+			unsigned int p = parent[i];
+			bool parentChanged = p != InvalidIndex && worldGeneration[p] == generation;
+			if (!(flags[i] & NodeLocalDirty) && !parentChanged)
+				continue;
+
+			glm::mat4 local = composeTransform(position[i], rotation[i], scale[i], pivot[i]);
+			world[i] = p == InvalidIndex ? local : multiplyAffine(world[p], local);
+			BoundingVolume bounds = transformBounds(world[i], localBounds[i]);
+			worldBoxes.Set(i, bounds);
+			worldRadius[i] = bounds.radius;
+			worldGeneration[i] = generation;
+			flags[i] &= ~NodeLocalDirty;
+			lastRecomputedCount++;
+		}
+		dirtyCount = 0;
+	}
+
+	// Draw every drawable node with the unit cube, one draw call per node. Returns the number of draw calls
+	unsigned int Draw(ShaderProgram& shaderProgram, unsigned int renderMode, const glm::mat4& viewProjection)
+	{
+		shaderProgram.Use();
+		glState.BindVertexArray(Cube.vao);
+
+		unsigned int drawCalls = 0;
+		unsigned int count = Size();
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (!(flags[i] & NodeDrawable))
+				continue;
+			setMvpMatrix(shaderProgram, viewProjection * world[i]);
+			setFragmentColour(shaderProgram, fragmentColour[i]);
+			drawGeometry(Cube, renderMode);
+			drawCalls++;
+		}
+		return drawCalls;
+	}
+
+	// Test every node's world box against the frustum, filling visible. The world matrices must be up to date
+	CullStats Cull(const Frustum& frustum)
+	{
+		unsigned int count = Size();
+		visible.resize(count);
+		cullBoxes(frustum, worldBoxes, 0, count, visible.data());
+
+		lastCullStats = CullStats();
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (!(flags[i] & NodeDrawable))
+				continue;
+			if (visible[i])
+				lastCullStats.visible++;
+			else
+				lastCullStats.culled++;
+		}
+		return lastCullStats;
+	}
+
+	// Rasterize the boxes of the nodes covering the most screen into the occlusion buffer, then hide
+	// the visible nodes behind them. Runs after Cull(), whose visible flags and stats it narrows
+	CullStats OcclusionCull(OcclusionBuffer& occlusion, const glm::mat4& viewProjection, unsigned int maxOccluders = 256)
+	{
+		unsigned int count = Size();
+		occlusion.Begin(viewProjection);
+
+		// Rank candidates by radius over clip-space w, which is proportional to their projected size
+		std::vector<std::pair<float, unsigned int> > candidates;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (!(flags[i] & NodeDrawable) || !visible[i])
+				continue;
+			glm::vec4 clip = viewProjection * glm::vec4(worldBoxes.centerX[i], worldBoxes.centerY[i], worldBoxes.centerZ[i], 1.0f);
+			if (clip.w > worldRadius[i])
+				candidates.push_back(std::make_pair(-worldRadius[i] / clip.w, i));
+		}
+		if (candidates.size() > maxOccluders)
+		{
+			std::nth_element(candidates.begin(), candidates.begin() + maxOccluders, candidates.end());
+			candidates.resize(maxOccluders);
+		}
+		for (size_t c = 0; c < candidates.size(); c++)
+			occlusion.AddOccluder(world[candidates[c].second], localBounds[candidates[c].second]);
+		occlusion.Rasterize();
+
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (!(flags[i] & NodeDrawable) || !visible[i])
+				continue;
+			glm::vec3 center(worldBoxes.centerX[i], worldBoxes.centerY[i], worldBoxes.centerZ[i]);
+			glm::vec3 extent(worldBoxes.extentX[i], worldBoxes.extentY[i], worldBoxes.extentZ[i]);
+			if (!occlusion.IsVisible(center, extent))
+			{
+				visible[i] = 0;
+				lastCullStats.visible--;
+				lastCullStats.occluded++;
+			}
+		}
+		return lastCullStats;
+	}
+
+	// Bring the world transforms and the BVH up to date: a full SAH build on bvhThreadCount threads
+	// when the node set changed, otherwise a refit when anything moved
+	void UpdateBvh()
+	{
+		UpdateWorldTransforms();
+		if (bvhStale)
+		{
+			bvh.Build(worldBoxes, bvhThreadCount);
+			bvhStale = false;
+		}
+		else if (bvhGeneration != generation)
+			bvh.Refit();
+		bvhGeneration = generation;
+	}
+
+	// Closest drawable node hit by the ray, or InvalidNode
+	NodeHandle Pick(const glm::vec3& origin, const glm::vec3& direction, float maxDistance = FLT_MAX)
+	{
+		UpdateBvh();
+		unsigned int hit = bvh.Raycast(origin, direction, maxDistance, nullptr, flags.data(), NodeDrawable);
+		return hit == BvhNoHit ? InvalidNode : handle[hit];
+	}
+
+	// Append the drawable nodes whose box overlaps the sphere
+	void QueryNear(const glm::vec3& center, float radius, std::vector<NodeHandle>& results)
+	{
+		UpdateBvh();
+		std::vector<unsigned int> hits;
+		bvh.QuerySphere(center, radius, hits);
+		for (size_t i = 0; i < hits.size(); i++)
+		{
+			if (flags[hits[i]] & NodeDrawable)
+				results.push_back(handle[hits[i]]);
+		}
+	}
+
+	// Append the drawable nodes whose box intersects the frustum
+	void QueryFrustum(const Frustum& frustum, std::vector<NodeHandle>& results)
+	{
+		UpdateBvh();
+		std::vector<unsigned int> hits;
+		bvh.QueryFrustum(frustum, hits);
+		for (size_t i = 0; i < hits.size(); i++)
+		{
+			if (flags[hits[i]] & NodeDrawable)
+				results.push_back(handle[hits[i]]);
+		}
+	}
+
+	// Emit a draw packet for every drawable node, or only for those the last Cull() and OcclusionCull()
+	// left visible when culled is set. The world matrices must be up to date
+	void EmitDrawPackets(RenderQueue& queue, ShaderProgram& shaderProgram, const DrawRange& range, bool culled = false)
+	{
+		unsigned int programIndex = queue.ProgramIndex(shaderProgram);
+		unsigned int rangeIndex = queue.RangeIndex(range);
+		unsigned int count = Size();
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if ((flags[i] & NodeDrawable) && (!culled || visible[i]))
+				queue.Submit(programIndex, rangeIndex, &world[i], &fragmentColour[i]);
+		}
+	}
+
+	// Gather the final matrix and colour of every drawable node
+	void PackInstances(const glm::mat4& viewProjection)
+	{
+		instances.resize(Size());
+		unsigned int packed = 0;
+		unsigned int count = Size();
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (!(flags[i] & NodeDrawable))
+				continue;
+
+			// Extend the current run of drawable nodes, the kernel converts it in one go
+			unsigned int runEnd = i + 1;
+			while (runEnd < count && (flags[runEnd] & NodeDrawable))
+				runEnd++;
+			computeMvpMatrices(viewProjection, &world[i], runEnd - i, &instances[packed].mvp, sizeof(InstanceData));
+			for (; i < runEnd; i++)
+				instances[packed++].fragmentColour = fragmentColour[i];
+		}
+		instances.resize(packed);
+	}
+
+	// Draw every drawable node with a single instanced draw call. Needs a program built from
+	// vertex0_instanced.vert. Returns the number of draw calls
+	unsigned int DrawInstanced(ShaderProgram& shaderProgram, InstancedGeometry& instanced, unsigned int renderMode,
+		const glm::mat4& viewProjection)
+	{
+		PackInstances(viewProjection);
+		if (instances.size() == 0)
+			return 0;
+
+		uploadInstances(instanced, instances);
+		shaderProgram.Use();
+		glState.BindVertexArray(instanced.vao);
+		drawGeometry(Cube, renderMode, (int)instances.size());
+		return 1;
+	}
+};
+
+/* Adds Olaf to the scene and returns the root of his hierarchy */
+NodeHandle addOlaf(SceneHierarchy& scene)
+{
+	// Olaf is the root of the hierarchy
+	NodeHandle Olaf = scene.AddNode(InvalidNode, false);
+	scene.SetPivot(Olaf, glm::vec3(0.0f, (GridUnit/4), 0.0f)); // Olaf scales and rotates about his own position
+	// Add children to olaf and define each child's world transform
+	// Olaf/Body
+	NodeHandle Olaf_Body = scene.AddNode(Olaf);
+	scene.SetPosition(Olaf_Body, glm::vec3(0.0f, GridUnit / 4, 0.0f));
+	scene.SetScale(Olaf_Body, glm::vec3(1.5f, 2.0f, 2.0f));
+	scene.SetFragmentColour(Olaf_Body, glm::vec4(0.75f, 0.75f, 0.75f, 1.0f));
+	// Olaf/Head
+	NodeHandle Olaf_Head = scene.AddNode(Olaf);
+	scene.SetPosition(Olaf_Head, glm::vec3(0.0f, (9*GridUnit/4), 0.0f));
+	// Olaf/Nose
+	NodeHandle Olaf_Nose = scene.AddNode(Olaf);
+	scene.SetPosition(Olaf_Nose, glm::vec3(0.0f, (10 * GridUnit / 4), (GridUnit/2)));
+	scene.SetScale(Olaf_Nose, glm::vec3(0.1f, 0.2f, 0.1f));
+	scene.SetFragmentColour(Olaf_Nose, glm::vec4(1.0f, 0.55f, 0.0f, 1.0f));
+	// Olaf/LHand
+	NodeHandle Olaf_LHand = scene.AddNode(Olaf);
+	scene.SetPosition(Olaf_LHand, glm::vec3((7 * GridUnit / 8), (8 * GridUnit / 4), GridUnit));
+	scene.SetScale(Olaf_LHand, glm::vec3(0.25f, 0.25f, 2.0f));
+	// Olaf/LHand
+	NodeHandle Olaf_RHand = scene.AddNode(Olaf);
+	scene.SetPosition(Olaf_RHand, glm::vec3(-(7 * GridUnit / 8), (8 * GridUnit / 4), GridUnit));
+	scene.SetScale(Olaf_RHand, glm::vec3(0.25f, 0.25f, 2.0f));
+	// Olaf/RLeg
+	NodeHandle Olaf_RLeg = scene.AddNode(Olaf);
+	scene.SetPosition(Olaf_RLeg, glm::vec3((GridUnit / 2), 0.0f, 0.0f));
+	scene.SetScale(Olaf_RLeg, glm::vec3(0.25f, 0.25f, 2.0f));
+	// Olaf/LLeg
+	NodeHandle Olaf_LLeg = scene.AddNode(Olaf);
+	scene.SetPosition(Olaf_LLeg, glm::vec3(-(GridUnit / 2), 0.0f, 0.0f));
+	scene.SetScale(Olaf_LLeg, glm::vec3(0.25f, 0.25f, 2.0f));
+	// Olaf/REye
+	NodeHandle Olaf_REye = scene.AddNode(Olaf);
+	scene.SetPosition(Olaf_REye, glm::vec3(-(GridUnit / 4), (11 * GridUnit / 4), (GridUnit/2)));
+	scene.SetScale(Olaf_REye, glm::vec3(0.1f, 0.1f, 0.1f));
+	scene.SetFragmentColour(Olaf_REye, glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+	// Olaf/LEye
+	NodeHandle Olaf_LEye = scene.AddNode(Olaf);
+	scene.SetPosition(Olaf_LEye, glm::vec3((GridUnit / 4), (11 * GridUnit / 4), (GridUnit / 2)));
+	scene.SetScale(Olaf_LEye, glm::vec3(0.1f, 0.1f, 0.1f));
+	scene.SetFragmentColour(Olaf_LEye, glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+
+	return Olaf;
+}
+
+// Occlusion Queries
+// ---------------------------------
+
+/* Occlusion query counts of a frame: queries issued, results read back, and how many of those found
+   their subtree hidden so its draws were skipped */
+struct OcclusionQueryStats
+{
+	unsigned int issued;
+	unsigned int resolved;
+	unsigned int skipped;
+	OcclusionQueryStats() : issued(0), resolved(0), skipped(0) {}
+
+	float SkipRate() const
+	{
+		return resolved ? (float)skipped / resolved : 0.0f;
+	}
+};
+
+/* GPU occlusion culling of the subtree below each scene root. Every frame draws each subtree under
+   conditional render on the query its bounding box issued the frame before, then issues this frame's
+   queries against the finished depth buffer. The GPU runs commands in order, so a previous frame's
+   result is always ready when the conditional draw executes and waiting on it never stalls. The CPU
+   only reads results for the statistics, once they are available. A subtree coming into view shows
+   up one frame late */
+struct OcclusionQueries
+{
+	unsigned int target;				// GL_ANY_SAMPLES_PASSED_CONSERVATIVE where supported
+	std::vector<unsigned int> queries[2];		// per subtree, for even and odd frames
+	std::vector<unsigned char> issued[2];
+	unsigned int frameIndex;
+
+	// Subtrees of the scene, their drawable nodes and world bounds
+	std::vector<NodeHandle> roots;
+	std::vector<unsigned int> subtreeOf;
+	std::vector<unsigned int> nodeStart;
+	std::vector<unsigned int> nodes;
+	std::vector<glm::vec3> lower;
+	std::vector<glm::vec3> upper;
+
+	// The frame being drawn and the last complete one
+	OcclusionQueryStats frame;
+	OcclusionQueryStats lastFrame;
+
+	OcclusionQueries() : target(0), frameIndex(0) {}
+
+	void Create()
+	{
+		target = GLEW_VERSION_4_3 || GLEW_ARB_ES3_compatibility ? GL_ANY_SAMPLES_PASSED_CONSERVATIVE : GL_ANY_SAMPLES_PASSED;
+	}
+
+	void Destroy()
+	{
+		for (int set = 0; set < 2; set++)
+		{
+			if (!queries[set].empty())
+				glDeleteQueries((int)queries[set].size(), queries[set].data());
+			queries[set].clear();
+			issued[set].clear();
+		}
+		roots.clear();
+	}
+
+	// Group the drawable nodes by root. Query results are dropped when the set of roots changed, since
+	// they would belong to other subtrees. The world matrices must be up to date
+	void Group(const SceneHierarchy& scene)
+	{
+		unsigned int count = scene.Size();
+		std::vector<NodeHandle> sceneRoots;
+		subtreeOf.resize(count);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (scene.parent[i] == InvalidIndex)
+			{
+				subtreeOf[i] = (unsigned int)sceneRoots.size();
+				sceneRoots.push_back(scene.handle[i]);
+			}
+			else
+				subtreeOf[i] = subtreeOf[scene.parent[i]];
+		}
+		unsigned int subtreeCount = (unsigned int)sceneRoots.size();
+		if (sceneRoots != roots)
+		{
+			roots.swap(sceneRoots);
+			issued[0].assign(subtreeCount, 0);
+			issued[1].assign(subtreeCount, 0);
+		}
+		for (int set = 0; set < 2; set++)
+		{
+			unsigned int existing = (unsigned int)queries[set].size();
+			if (existing < subtreeCount)
+			{
+				queries[set].resize(subtreeCount);
+				glGenQueries(subtreeCount - existing, &queries[set][existing]);
+			}
+		}
+
+		// Bucket the drawable nodes and grow the subtree bounds around them
+		nodeStart.assign(subtreeCount + 1, 0);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (scene.flags[i] & NodeDrawable)
+				nodeStart[subtreeOf[i] + 1]++;
+		}
+		for (unsigned int s = 0; s < subtreeCount; s++)
+			nodeStart[s + 1] += nodeStart[s];
+		nodes.resize(nodeStart[subtreeCount]);
+		lower.assign(subtreeCount, glm::vec3(FLT_MAX));
+		upper.assign(subtreeCount, glm::vec3(-FLT_MAX));
+		std::vector<unsigned int> cursor(nodeStart.begin(), nodeStart.end() - 1);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (!(scene.flags[i] & NodeDrawable))
+				continue;
+			unsigned int s = subtreeOf[i];
+			nodes[cursor[s]++] = i;
+			glm::vec3 center(scene.worldBoxes.centerX[i], scene.worldBoxes.centerY[i], scene.worldBoxes.centerZ[i]);
+			glm::vec3 extent(scene.worldBoxes.extentX[i], scene.worldBoxes.extentY[i], scene.worldBoxes.extentZ[i]);
+			lower[s] = glm::min(lower[s], center - extent);
+			upper[s] = glm::max(upper[s], center + extent);
+		}
+	}
+
+	// Draw the drawable nodes, skipping the last Cull() rejects when culled is set, then query the
+	// subtree boxes for the next frame
+	void Draw(SceneHierarchy& scene, ShaderProgram& shaderProgram, unsigned int renderMode, const glm::mat4& viewProjection, bool culled)
+	{
+		Group(scene);
+		unsigned int current = frameIndex & 1, previous = current ^ 1;
+		unsigned int subtreeCount = (unsigned int)roots.size();
+		lastFrame = frame;
+		frame = OcclusionQueryStats();
+
+		// The queries about to be reused drove the last frame's conditional draws
+		for (unsigned int s = 0; s < subtreeCount; s++)
+		{
+			if (!issued[current][s])
+				continue;
+			unsigned int available = 0, result = 1;
+			glGetQueryObjectuiv(queries[current][s], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available)
+				continue;
+			glGetQueryObjectuiv(queries[current][s], GL_QUERY_RESULT, &result);
+			frame.resolved++;
+			frame.skipped += result == 0;
+		}
+
+		shaderProgram.Use();
+		glState.BindVertexArray(Cube.vao);
+		std::vector<unsigned char> drawn(subtreeCount, 0);
+		for (unsigned int s = 0; s < subtreeCount; s++)
+		{
+			bool conditional = issued[previous][s] != 0;
+			for (unsigned int n = nodeStart[s]; n < nodeStart[s + 1]; n++)
+			{
+				unsigned int i = nodes[n];
+				if (culled && !scene.visible[i])
+					continue;
+				if (conditional && !drawn[s])
+					glBeginConditionalRender(queries[previous][s], GL_QUERY_WAIT);
+				drawn[s] = 1;
+				setMvpMatrix(shaderProgram, viewProjection * scene.world[i]);
+				setFragmentColour(shaderProgram, scene.fragmentColour[i]);
+				drawGeometry(Cube, renderMode);
+			}
+			if (conditional && drawn[s])
+				glEndConditionalRender();
+		}
+
+		// Test slightly inflated boxes, so a subtree passes against its own faces, without writing
+		// colour or depth. Subtrees the camera is inside or that were culled are drawn unconditionally
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		glDepthMask(GL_FALSE);
+		glDepthFunc(GL_LEQUAL);
+		for (unsigned int s = 0; s < subtreeCount; s++)
+		{
+			issued[current][s] = 0;
+			if (!drawn[s])
+				continue;
+			glm::vec3 center = (lower[s] + upper[s]) * 0.5f;
+			glm::vec3 extent = (upper[s] - lower[s]) * 0.5f * 1.01f + glm::vec3(GridUnit * 0.01f);
+			bool crossesNearPlane = false;
+			for (int c = 0; c < 8 && !crossesNearPlane; c++)
+			{
+				glm::vec4 clip = viewProjection * glm::vec4(center + glm::vec3(c & 1 ? extent.x : -extent.x,
+					c & 2 ? extent.y : -extent.y, c & 4 ? extent.z : -extent.z), 1.0f);
+				crossesNearPlane = clip.w <= 0.0f || clip.z < -clip.w;
+			}
+			if (crossesNearPlane)
+				continue;
+
+			glm::mat4 box = glm::translate(glm::mat4(1.0f), center) * glm::scale(glm::mat4(1.0f), extent / Cube.bounds.extent)
+				* glm::translate(glm::mat4(1.0f), -Cube.bounds.center);
+			setMvpMatrix(shaderProgram, viewProjection * box);
+			glBeginQuery(target, queries[current][s]);
+			drawGeometry(Cube, GL_TRIANGLES);
+			glEndQuery(target);
+			issued[current][s] = 1;
+			frame.issued++;
+		}
+		glDepthFunc(GL_LESS);
+		glDepthMask(GL_TRUE);
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		frameIndex++;
+	}
+};
+
+// Draw the scene through occlusion queries and conditional render when enabled, needs GL 3.3
+OcclusionQueries occlusionQueries;
+bool occlusionQueriesEnabled = false;
+
+// Render queue shared by every frame
+RenderQueue renderQueue;
+
+/* Queues the grid, the axes and the scene hierarchy, then submits them in sorted batches. The terrain,
+   when enabled, draws the patches its last Update selected */
+void drawScene(SceneHierarchy& scene, const glm::mat4 axisTransforms[3], unsigned int renderMode)
+{
+	static const glm::mat4 gridTransform(1.0f); // Grid is at Origin
+	static const glm::vec4 gridColour(0.7f, 0.7f, 0.7f, 1.0f);
+	static const glm::vec4 axisColours[3] =
+	{
+		glm::vec4(1.0f, 0.0f, 0.0f, 1.0f),
+		glm::vec4(0.0f, 1.0f, 0.0f, 1.0f),
+		glm::vec4(0.0f, 0.0f, 1.0f, 1.0f)
+	};
+
+	renderQueue.Begin(viewMatrix * worldMatrix, projectionMatrix, 10.0f);
+	Frustum frustum = extractFrustum(projectionMatrix * viewMatrix * worldMatrix);
+	CullStats stats;
+
+	// Grid, unless it is drawn procedurally after everything else or the terrain replaces it
+	if (!proceduralGridEnabled && !terrainEnabled)
+	{
+		DrawRange gridRange = geometryRange(Grid, GL_LINES);
+		BoundingVolume gridBounds = transformBounds(gridTransform, Grid.bounds);
+		if (!frustumCullingEnabled || frustumIntersectsBox(frustum, gridBounds.center, gridBounds.extent))
+		{
+			renderQueue.Submit(shaderProgram, gridRange, &gridTransform, &gridColour);
+			stats.visible++;
+		}
+		else
+			stats.culled++;
+	}
+
+	// X, Y and Z Axes
+	DrawRange cubeRange = geometryRange(Cube, GL_TRIANGLES);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		BoundingVolume axisBounds = transformBounds(axisTransforms[axis], Cube.bounds);
+		if (!frustumCullingEnabled || frustumIntersectsBox(frustum, axisBounds.center, axisBounds.extent))
+		{
+			renderQueue.Submit(shaderProgram, cubeRange, &axisTransforms[axis], &axisColours[axis]);
+			stats.visible++;
+		}
+		else
+			stats.culled++;
+	}
+
+	// Streamed meshes, drawn as a box over their bounds until they are resident, or as the unit cube at
+	// their transform before their bounds are known
+	static const glm::vec4 placeholderColour(0.35f, 0.35f, 0.35f, 1.0f);
+	for (size_t a = 0; a < assetStreamer.assets.size(); a++)
+	{
+		StreamedAsset& asset = assetStreamer.assets[a];
+		if (asset.state == AssetFailed)
+			continue;
+		bool resident = asset.state == AssetResident;
+		const Geometry& geometry = resident ? asset.geometry : Cube;
+		if (resident)
+			asset.drawTransform = asset.transform;
+		else if (asset.state == AssetUploading)
+			asset.drawTransform = asset.transform * glm::translate(glm::mat4(1.0f), asset.bounds.center)
+				* glm::scale(glm::mat4(1.0f), glm::max(asset.bounds.extent, glm::vec3(1e-4f)) / Cube.bounds.extent)
+				* glm::translate(glm::mat4(1.0f), -Cube.bounds.center);
+		else
+			asset.drawTransform = asset.transform;
+		BoundingVolume bounds = transformBounds(asset.drawTransform, geometry.bounds);
+		if (!frustumCullingEnabled || frustumIntersectsBox(frustum, bounds.center, bounds.extent))
+		{
+			renderQueue.Submit(shaderProgram, geometryRange(geometry, resident ? renderMode : GL_TRIANGLES), &asset.drawTransform,
+				resident ? &asset.colour : &placeholderColour);
+			stats.visible++;
+		}
+		else
+			stats.culled++;
+	}
+
+	// Scene hierarchy
+	scene.UpdateWorldTransforms();
+	cubeRange.mode = renderMode;
+	if (frustumCullingEnabled)
+	{
+		scene.Cull(frustum);
+		if (occlusionCullingEnabled && scene.Size() >= occlusionCullingMinNodes)
+			scene.OcclusionCull(occlusionBuffer, projectionMatrix * viewMatrix * worldMatrix);
+		stats.visible += scene.lastCullStats.visible;
+		stats.culled += scene.lastCullStats.culled;
+		stats.occluded += scene.lastCullStats.occluded;
+	}
+	frameCullStats = stats;
+	if (occlusionQueriesEnabled)
+	{
+		// Conditional render needs the subtrees drawn one by one, after the grid and axes reached the depth buffer
+		renderQueue.Flush();
+		occlusionQueries.Draw(scene, shaderProgram, renderMode, projectionMatrix * viewMatrix * worldMatrix, frustumCullingEnabled);
+	}
+	else
+	{
+		scene.EmitDrawPackets(renderQueue, shaderProgram, cubeRange, frustumCullingEnabled);
+		renderQueue.Flush();
+	}
+	if (terrainEnabled)
+		terrain.Draw(terrainShaderProgram);
+	else if (proceduralGridEnabled)
+		drawProceduralGrid(gridColour);
+}
+
+/* Callback function for mouse controls */
+void mouseButtonCallback(GLFWwindow *window, int button, int action, int mods)
+{
+	double xPos, yPos;
+	glfwGetCursorPos(window, &xPos, &yPos);
+	if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE)
+	{
+		lastCursorPosY = yPos;
+		lastCursorPosX = xPos;
+		isLeftButtonPressed = false;
+		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+		return;
+	}
+	if (button == GLFW_MOUSE_BUTTON_LEFT && action== GLFW_PRESS)
+	{
+		lastCursorPosY = yPos;
+		lastCursorPosX = xPos;
+		isLeftButtonPressed = true;
+		isRightButtonPressed = false;
+		isMiddleButtonPressed = false;
+		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+		return;
+	}
+	if (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_RELEASE)
+	{
+		lastCursorPosY = yPos;
+		lastCursorPosX = xPos;
+		isRightButtonPressed = false;
+		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+		return;
+	}
+	if (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS)
+	{
+		lastCursorPosY = yPos;
+		lastCursorPosX = xPos;
+		isLeftButtonPressed = false;
+		isRightButtonPressed = true;
+		isMiddleButtonPressed = false;
+		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+		return;
+	}
+	if (button == GLFW_MOUSE_BUTTON_MIDDLE && action == GLFW_RELEASE)
+	{
+		lastCursorPosY = yPos;
+		lastCursorPosX = xPos;
+		isMiddleButtonPressed = false;
+		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+		return;
+	}
+	if (button == GLFW_MOUSE_BUTTON_MIDDLE && action == GLFW_PRESS)
+	{
+		lastCursorPosY = yPos;
+		lastCursorPosX = xPos;
+		isLeftButtonPressed = false;
+		isRightButtonPressed = false;
+		isMiddleButtonPressed = true;
+		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+		return;
+	}
+}
+
+// Benchmarks
+// ---------------------------------
+
+/* Path of a scratch file in the system's temporary directory */
+std::string temporaryFilePath(const char* name)
+{
+#if defined(_WIN32)
+	char directory[MAX_PATH + 1];
+	DWORD length = GetTempPathA(sizeof(directory), directory);
+	return std::string(length ? directory : ".\\") + name;
+#else
+	const char* directory = getenv("TMPDIR");
+	return std::string(directory && *directory ? directory : "/tmp") + "/" + name;
+#endif
+}
+
+/* Pointer-based hierarchy the SceneHierarchy replaced, kept as the benchmark reference */
+struct HierarchicalModel
+{
+	HierarchicalModel* Parent;
+	std::vector<HierarchicalModel*> Children;
+	glm::mat4 transform;
+	glm::vec4 fragmentColour;
+	glm::vec3 center;
+
+	HierarchicalModel(HierarchicalModel* parent)
+	{
+		Parent = parent;
+		transform = glm::mat4(1.0f);
+		fragmentColour = glm::vec4(1.0f);
+	}
+
+	// Add a child to the current node
+	void AddChild(HierarchicalModel* child)
+	{
+		Children.push_back(child);
+	}
+
+	// Transformations are applied recursively through the children
+	void ApplyTransform(glm::mat4 t)
+	{
+		if (Children.size() > 0)
+		{
+			for (int i = 0; i < Children.size(); i++)
+			{
+				Children[i]->ApplyTransform(t);
+			}
+		}
+		transform = t * transform;
+	}
+
+	// Get current node's transform
+	glm::mat4 GetTransform()
+	{
+		return transform;
+	}
+
+	void SetFragmentColour(glm::vec4 colour)
+	{
+		fragmentColour = colour;
+	}
+
+	// Get current node's fragment colour
+	glm::vec4 GetFragmentColour()
+	{
+		return fragmentColour;
+	}
+
+	// Draw Hierarchy
+	void Draw(ShaderProgram& shaderProgram, unsigned int renderMode, const glm::mat4& viewProjection)
+	{
+		if (Children.size() > 0)
+		{
+			shaderProgram.Use();
+			glState.BindVertexArray(Cube.vao);
+
+			for (int i = 0; i < Children.size(); i++)
+			{
+				setMvpMatrix(shaderProgram, viewProjection * Children[i]->GetTransform());
+				setFragmentColour(shaderProgram, Children[i]->GetFragmentColour());
+				drawGeometry(Cube, renderMode);
+			}
+		}
+	}
+};
+
+/* Compares the flat SceneHierarchy against the recursive ApplyTransform on forests of Olaf-shaped trees.
+   Both sides do the same work per node: the world matrix, then the world bounds the culling reads */
+void benchmarkSceneHierarchy(bool hasContext)
+{
+	const unsigned int nodeCounts[] = { 1000, 100000, 1000000 };
+	const unsigned int nodesPerTree = 10;
+	glm::mat4 step = glm::translate(glm::mat4(1.0f), glm::vec3(0.001f, 0.0f, 0.0f));
+
+	for (int n = 0; n < 3; n++)
+	{
+		unsigned int treeCount = nodeCounts[n] / nodesPerTree;
+
+		// Pointer-based reference
+		std::vector<HierarchicalModel*> legacyRoots;
+		for (unsigned int t = 0; t < treeCount; t++)
+		{
+			HierarchicalModel* root = new HierarchicalModel(nullptr);
+			for (unsigned int c = 1; c < nodesPerTree; c++)
+			{
+				HierarchicalModel* child = new HierarchicalModel(root);
+				child->ApplyTransform(glm::translate(glm::mat4(1.0f), glm::vec3((float)c, (float)t, 0.0f)));
+				root->AddChild(child);
+			}
+			legacyRoots.push_back(root);
+		}
+
+		// Flat hierarchy
+		SceneHierarchy scene;
+		scene.Reserve(treeCount * nodesPerTree);
+		std::vector<NodeHandle> roots;
+		for (unsigned int t = 0; t < treeCount; t++)
+		{
+			NodeHandle root = scene.AddNode(InvalidNode, false);
+			for (unsigned int c = 1; c < nodesPerTree; c++)
+			{
+				NodeHandle child = scene.AddNode(root);
+				scene.SetPosition(child, glm::vec3((float)c, (float)t, 0.0f));
+			}
+			roots.push_back(root);
+		}
+
+		// Leave the linearization of the new nodes out of the timing
+		scene.UpdateWorldTransforms();
+
+		BoundingVolume unitBounds;
+		unitBounds.extent = glm::vec3(0.5f);
+		unitBounds.radius = glm::length(unitBounds.extent);
+		std::vector<BoundingVolume> legacyBounds(treeCount * nodesPerTree);
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		for (unsigned int t = 0; t < treeCount; t++)
+		{
+			HierarchicalModel* root = legacyRoots[t];
+			root->ApplyTransform(step);
+			legacyBounds[t * nodesPerTree] = transformBounds(root->transform, unitBounds);
+			for (size_t c = 0; c < root->Children.size(); c++)
+				legacyBounds[t * nodesPerTree + c + 1] = transformBounds(root->Children[c]->transform, unitBounds);
+		}
+		double legacyUpdate = elapsedMilliseconds(start);
+
+		start = std::chrono::high_resolution_clock::now();
+		for (unsigned int t = 0; t < treeCount; t++)
+			scene.Translate(roots[t], glm::vec3(step[3]));
+		scene.UpdateWorldTransforms();
+		double flatUpdate = elapsedMilliseconds(start);
+
+		// Static frame and a frame where a single tree moved
+		scene.UpdateWorldTransforms();
+		unsigned int staticRecomputed = scene.lastRecomputedCount;
+		scene.Translate(roots[0], glm::vec3(step[3]));
+		start = std::chrono::high_resolution_clock::now();
+		scene.UpdateWorldTransforms();
+		double singleUpdate = elapsedMilliseconds(start);
+		unsigned int singleRecomputed = scene.lastRecomputedCount;
+
+		std::cout << "SceneHierarchy nodes=" << nodeCounts[n]
+			<< " update: recursive " << legacyUpdate << " ms, flat " << flatUpdate << " ms"
+			<< " | recomputed: static " << staticRecomputed << ", one tree " << singleRecomputed
+			<< " (" << singleUpdate << " ms)";
+
+		if (hasContext)
+		{
+			start = std::chrono::high_resolution_clock::now();
+			for (unsigned int t = 0; t < treeCount; t++)
+				legacyRoots[t]->Draw(shaderProgram, GL_TRIANGLES, glm::mat4(1.0f));
+			glFinish();
+			double legacyDraw = elapsedMilliseconds(start);
+
+			start = std::chrono::high_resolution_clock::now();
+			scene.Draw(shaderProgram, GL_TRIANGLES, glm::mat4(1.0f));
+			glFinish();
+			double flatDraw = elapsedMilliseconds(start);
+
+			std::cout << " | draw: recursive " << legacyDraw << " ms, flat " << flatDraw << " ms";
+		}
+		std::cout << std::endl;
+
+		for (unsigned int t = 0; t < treeCount; t++)
+		{
+			for (size_t c = 0; c < legacyRoots[t]->Children.size(); c++)
+				delete legacyRoots[t]->Children[c];
+			delete legacyRoots[t];
+		}
+	}
+}
+
+/* Compares one draw call per node against the instanced path on a stress scene of 100k Olafs */
+void benchmarkInstancedDraw(bool hasContext)
+{
+	const unsigned int olafCount = 100000;
+	SceneHierarchy scene;
+	scene.Reserve(olafCount * 10);
+	for (unsigned int i = 0; i < olafCount; i++)
+	{
+		NodeHandle olaf = addOlaf(scene);
+		scene.SetPosition(olaf, glm::vec3((i % 316) * GridUnit * 4, 0.0f, (i / 316) * GridUnit * 4));
+	}
+	scene.UpdateWorldTransforms();
+	scene.PackInstances(glm::mat4(1.0f));
+
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	scene.PackInstances(glm::mat4(1.0f));
+	double packTime = elapsedMilliseconds(start);
+
+	std::cout << "InstancedDraw olafs=" << olafCount << " instances=" << scene.instances.size()
+		<< " pack: " << packTime << " ms";
+
+	if (hasContext && instancingSupported)
+	{
+		start = std::chrono::high_resolution_clock::now();
+		unsigned int perNodeCalls = scene.Draw(shaderProgram, GL_TRIANGLES, glm::mat4(1.0f));
+		double perNodeSubmit = elapsedMilliseconds(start);
+		glFinish();
+
+		start = std::chrono::high_resolution_clock::now();
+		unsigned int instancedCalls = scene.DrawInstanced(instancedShaderProgram, CubeInstances, GL_TRIANGLES, glm::mat4(1.0f));
+		double instancedSubmit = elapsedMilliseconds(start);
+		glFinish();
+
+		std::cout << " | per node: " << perNodeCalls << " draw calls, submit " << perNodeSubmit << " ms"
+			<< " | instanced: " << instancedCalls << " draw calls, submit " << instancedSubmit << " ms";
+	}
+	std::cout << std::endl;
+}
+
+/* Returns the GPU time in milliseconds of the instanced draw of a packed scene */
+double timeInstancedDraw(ShaderProgram& program, SceneHierarchy& scene, const glm::mat4& viewProjection)
+{
+	unsigned int query;
+	glGenQueries(1, &query);
+	glFinish();
+	glBeginQuery(GL_TIME_ELAPSED, query);
+	scene.DrawInstanced(program, CubeInstances, GL_TRIANGLES, viewProjection);
+	glEndQuery(GL_TIME_ELAPSED);
+	GLuint64 nanoseconds = 0;
+	glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanoseconds);
+	glDeleteQueries(1, &query);
+	return nanoseconds / 1.0e6;
+}
+
+/* Compares the batch MVP kernel against a plain glm loop on 1M matrices, and with a context the
+   GPU time of the precomputed-MVP vertex shader against one multiplying every matrix per vertex */
+void benchmarkMvpKernel(bool hasContext)
+{
+	const size_t matrixCount = 1000000;
+	glm::mat4 viewProjection = glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.01f, 100.0f)
+		* glm::lookAt(glm::vec3(2.0f, 3.0f, 4.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	std::vector<glm::mat4> models(matrixCount);
+	for (size_t i = 0; i < matrixCount; i++)
+		models[i] = composeTransform(glm::vec3((float)(i % 1000), 0.0f, (float)(i / 1000)),
+			glm::angleAxis((float)i, glm::vec3(0.0f, 1.0f, 0.0f)), glm::vec3(1.0f + (i % 7)), glm::vec3(0.0f));
+	std::vector<glm::mat4> reference(matrixCount), batched(matrixCount);
+
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	for (size_t i = 0; i < matrixCount; i++)
+		reference[i] = viewProjection * models[i];
+	double referenceTime = elapsedMilliseconds(start);
+
+	start = std::chrono::high_resolution_clock::now();
+	computeMvpMatrices(viewProjection, models.data(), matrixCount, batched.data());
+	double batchedTime = elapsedMilliseconds(start);
+
+	float maxError = 0.0f;
+	for (size_t i = 0; i < matrixCount; i++)
+		for (int c = 0; c < 4; c++)
+			for (int r = 0; r < 4; r++)
+				maxError = std::max(maxError, std::abs(reference[i][c][r] - batched[i][c][r]));
+
+	std::cout << "MvpKernel matrices=" << matrixCount << (USE_SSE ? " sse" : " scalar")
+		<< " glm " << referenceTime << " ms, batched " << batchedTime << " ms, max error " << maxError;
+
+	if (hasContext && instancingSupported)
+	{
+		ShaderProgram perVertexProgram(createShaderProgram("shaders/vertex0_per_vertex.vert", "shaders/fragment0_instanced.frag"));
+		SceneHierarchy scene;
+		for (unsigned int i = 0; i < 10000; i++)
+		{
+			NodeHandle olaf = addOlaf(scene);
+			scene.SetPosition(olaf, glm::vec3((i % 100) * GridUnit * 4, 0.0f, (i / 100) * GridUnit * 4));
+		}
+		scene.UpdateWorldTransforms();
+
+		// The old shader gets the model matrices and the camera matrices as separate uniforms
+		perVertexProgram.Use();
+		perVertexProgram.SetMat4(hashName("worldMatrix"), glm::mat4(1.0f));
+		perVertexProgram.SetMat4(hashName("viewMatrix"), glm::mat4(1.0f));
+		perVertexProgram.SetMat4(hashName("projectionMatrix"), viewProjection);
+		double perVertexTime = timeInstancedDraw(perVertexProgram, scene, glm::mat4(1.0f));
+		double precomputedTime = timeInstancedDraw(instancedShaderProgram, scene, viewProjection);
+		glState.UseProgram(0);
+		glDeleteProgram(perVertexProgram.id);
+
+		std::cout << " | gpu instances=" << scene.instances.size() << " per vertex " << perVertexTime
+			<< " ms, precomputed " << precomputedTime << " ms";
+	}
+	std::cout << std::endl;
+}
+
+/* A program with a hand-made uniform table matching vertex0.vert and fragment0.frag,
+   for driving the recording backend without a context */
+ShaderProgram mockShaderProgram(unsigned int id)
+{
+	ShaderProgram program;
+	program.id = id;
+	program.AddUniform(UniformMvpMatrix, 0, GL_FLOAT_MAT4, 1);
+	program.AddUniform(UniformFragmentColour, 1, GL_FLOAT_VEC4, 1);
+	program.SortUniforms();
+	return program;
+}
+
+/* Sets the camera matrices main starts with */
+void useDefaultCamera()
+{
+	worldMatrix = glm::mat4(1.0f);
+	viewMatrix = glm::lookAt(glm::vec3(0.0f, 0.075f, 0.05f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	projectionMatrix = glm::perspective(70.0f, 1024.0f / 768.0f, 0.01f, 10.0f);
+}
+
+/* Swaps the recording backend, mock programs and mock geometry in for its lifetime, so the
+   render path can run without a context */
+struct MockGL
+{
+	GLBackend savedBackend;
+	ShaderProgram savedProgram;
+	ShaderProgram savedInstancedProgram;
+	bool savedInstancing;
+	bool savedProceduralGrid;
+	Geometry savedGrid;
+	Geometry savedCube;
+	InstancedGeometry savedCubeInstances;
+	std::vector<RenderQueue::Instancing> savedQueueInstancing;
+	ShaderProgram savedIndirectProgram;
+	RenderQueue::Indirect savedQueueIndirect;
+	glm::mat4 savedWorldMatrix, savedViewMatrix, savedProjectionMatrix;
+
+	explicit MockGL(bool instancing = false)
+		: savedBackend(glState.backend), savedProgram(shaderProgram), savedInstancedProgram(instancedShaderProgram),
+		savedInstancing(instancingSupported), savedProceduralGrid(proceduralGridEnabled), savedGrid(Grid), savedCube(Cube), savedCubeInstances(CubeInstances),
+		savedQueueInstancing(renderQueue.instancing), savedIndirectProgram(indirectShaderProgram),
+		savedQueueIndirect(renderQueue.indirect), savedWorldMatrix(worldMatrix), savedViewMatrix(viewMatrix),
+		savedProjectionMatrix(projectionMatrix)
+	{
+		glState.backend = recordingBackend();
+		glState.Invalidate();
+		shaderProgram = mockShaderProgram(1);
+		instancedShaderProgram = mockShaderProgram(2);
+		// Both meshes in one position pool, the cube's vertices after the grid's
+		proceduralGridEnabled = false;
+		Grid.vao = 1;
+		Grid.vbo = 1;
+		Grid.ebo = 2;
+		Grid.vertexCount = 400;
+		Cube.vao = 1;
+		Cube.vbo = 1;
+		Cube.ebo = 2;
+		Cube.baseVertex = 400;
+		Cube.vertexCount = 8;
+		Cube.indexCount = 36;
+		Cube.indexType = GL_UNSIGNED_BYTE;
+		Cube.bounds = unitCubeBounds();
+		Grid.bounds.extent = glm::vec3(GridUnit * 50, 0.0f, GridUnit * 50);
+		Grid.bounds.radius = glm::length(Grid.bounds.extent);
+		CubeInstances.vao = 3;
+		CubeInstances.instanceVbo = 4;
+		CubeInstances.capacity = 0;
+		CubeInstances.sourceBuffer = CubeInstances.instanceVbo;
+		CubeInstances.sourceOffset = 0;
+		instancingSupported = instancing;
+		renderQueue.instancing.clear();
+		if (instancing)
+			renderQueue.RegisterInstancing(Cube.vao, instancedShaderProgram, CubeInstances);
+
+		// Indirect mode stays off until a benchmark enables it with mock buffers
+		indirectShaderProgram = mockShaderProgram(3);
+		indirectShaderProgram.AddUniform(UniformDrawOffset, 2, GL_INT, 1);
+		indirectShaderProgram.AddUniform(UniformViewProjectionMatrix, 3, GL_FLOAT_MAT4, 1);
+		indirectShaderProgram.SortUniforms();
+		renderQueue.DisableIndirect();
+
+		useDefaultCamera();
+	}
+
+	~MockGL()
+	{
+		glState.backend = savedBackend;
+		glState.Invalidate();
+		shaderProgram = savedProgram;
+		instancedShaderProgram = savedInstancedProgram;
+		instancingSupported = savedInstancing;
+		proceduralGridEnabled = savedProceduralGrid;
+		Grid = savedGrid;
+		Cube = savedCube;
+		CubeInstances = savedCubeInstances;
+		renderQueue.instancing = savedQueueInstancing;
+		indirectShaderProgram = savedIndirectProgram;
+		renderQueue.indirect = savedQueueIndirect;
+		worldMatrix = savedWorldMatrix;
+		viewMatrix = savedViewMatrix;
+		projectionMatrix = savedProjectionMatrix;
+		recordedGLCalls.clear();
+	}
+};
+
+/* Replays frames of the default scene through the recording backend and reports how many
+   calls the state cache issued and dropped. Runs without a context */
+void benchmarkStateCache()
+{
+	MockGL mock;
+	SceneHierarchy scene;
+	NodeHandle olaf = addOlaf(scene);
+	glm::mat4 axisTransforms[3] = { glm::mat4(1.0f), glm::mat4(1.0f), glm::mat4(1.0f) };
+
+	const int frameCount = 1000;
+	GLCallCounters total;
+	size_t recordedCalls = 0;
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	for (int frame = 0; frame < frameCount; frame++)
+	{
+		glState.BeginFrame();
+		recordedGLCalls.clear();
+		scene.Translate(olaf, glm::vec3(0.001f, 0.0f, 0.0f));
+		drawScene(scene, axisTransforms, GL_TRIANGLES);
+		recordedCalls += recordedGLCalls.size();
+		for (int kind = 0; kind < GLCallKindCount; kind++)
+		{
+			total.issued[kind] += glState.frame.issued[kind];
+			total.elided[kind] += glState.frame.elided[kind];
+		}
+	}
+	double frameTime = elapsedMilliseconds(start) / frameCount;
+
+	const char* kindNames[GLCallKindCount] = { "program", "vao", "buffer", "capability", "uniform", "draw", "upload" };
+	std::cout << "GLStateCache frames=" << frameCount << " per frame: issued " << total.TotalIssued() / frameCount
+		<< ", elided " << total.TotalElided() / frameCount << ", recorded " << recordedCalls / frameCount
+		<< ", " << frameTime << " ms |";
+	for (int kind = 0; kind < GLCallKindCount; kind++)
+		std::cout << " " << kindNames[kind] << " " << total.issued[kind] / frameCount << "/"
+			<< (total.issued[kind] + total.elided[kind]) / frameCount;
+	std::cout << std::endl;
+}
+
+/* Sorts and batches the packets of 10k Olafs through the recording backend, with and without instancing */
+void benchmarkRenderQueue()
+{
+	// Every packet reaches the queue, culling would hide most of the field
+	const unsigned int olafCount = 10000;
+	frustumCullingEnabled = false;
+	for (int instancing = 0; instancing < 2; instancing++)
+	{
+		MockGL mock(instancing != 0);
+		SceneHierarchy scene;
+		for (unsigned int i = 0; i < olafCount; i++)
+		{
+			NodeHandle olaf = addOlaf(scene);
+			scene.SetPosition(olaf, glm::vec3((i % 100) * GridUnit * 4, 0.0f, (i / 100) * GridUnit * 4));
+		}
+		glm::mat4 axisTransforms[3] = { glm::mat4(1.0f), glm::mat4(1.0f), glm::mat4(1.0f) };
+
+		// Warm up the interned tables and scratch buffers
+		drawScene(scene, axisTransforms, GL_TRIANGLES);
+		glState.BeginFrame();
+		recordedGLCalls.clear();
+
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		drawScene(scene, axisTransforms, GL_TRIANGLES);
+		double frameTime = elapsedMilliseconds(start);
+
+		std::cout << "RenderQueue olafs=" << olafCount << (instancing ? " instanced" : " uniforms")
+			<< " packets in " << renderQueue.stats.packetsIn << ", batches out " << renderQueue.stats.batchesOut
+			<< ", state changes " << renderQueue.stats.stateChanges << ", draw calls " << glState.frame.issued[CallDraw]
+			<< ", " << frameTime << " ms" << std::endl;
+	}
+	frustumCullingEnabled = true;
+}
+
+/* Streams the instances of 1000 Olafs for 500 frames, through the orphaning fallback on the recording
+   backend and, with a context, through both modes of a real buffer */
+void benchmarkStreamBuffer(bool hasContext)
+{
+	const int frameCount = 500;
+	SceneHierarchy scene;
+	for (unsigned int i = 0; i < 1000; i++)
+	{
+		NodeHandle olaf = addOlaf(scene);
+		scene.SetPosition(olaf, glm::vec3((i % 32) * GridUnit * 4, 0.0f, (i / 32) * GridUnit * 4));
+	}
+	scene.UpdateWorldTransforms();
+	scene.PackInstances(glm::mat4(1.0f));
+	size_t frameBytes = scene.instances.size() * sizeof(InstanceData);
+
+	for (int mode = 0; mode < (hasContext && instancingSupported ? 3 : 1); mode++)
+	{
+		MockGL* mock = nullptr;
+		StreamBuffer stream;
+		if (mode == 0)
+		{
+			// A stand-in buffer id, the recording backend never touches the driver
+			mock = new MockGL();
+			stream.target = GL_ARRAY_BUFFER;
+			stream.buffer = 5;
+			stream.regionSize = 1 << 20;
+			stream.regionCount = 1;
+		}
+		else
+			stream.Create(GL_ARRAY_BUFFER, 1 << 20, mode == 2);
+		if (mode == 2 && !stream.persistent)
+		{
+			stream.Destroy();
+			break;
+		}
+		std::swap(stream, instanceStream);
+
+		GLCallCounters total;
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		for (int frame = 0; frame < frameCount; frame++)
+		{
+			glState.BeginFrame();
+			instanceStream.BeginFrame();
+			scene.Translate(scene.handle[0], glm::vec3(0.001f, 0.0f, 0.0f));
+			scene.UpdateWorldTransforms();
+			if (mode == 0)
+			{
+				// Attribute pointers are not recorded, so only the upload half of the draw runs
+				scene.PackInstances(glm::mat4(1.0f));
+				instanceStream.Write(scene.instances.data(), frameBytes);
+			}
+			else
+				scene.DrawInstanced(instancedShaderProgram, CubeInstances, GL_TRIANGLES, glm::mat4(1.0f));
+			total.issued[CallUpload] += glState.frame.issued[CallUpload];
+			recordedGLCalls.clear();
+		}
+		if (mode != 0)
+			glFinish();
+		double frameTime = elapsedMilliseconds(start) / frameCount;
+
+		const char* modeNames[3] = { "orphaning (recorded)", "orphaning", "persistent" };
+		const StreamBufferStats& stats = instanceStream.stats;
+		std::cout << "StreamBuffer " << modeNames[mode] << " frames=" << frameCount << " bytes/frame " << frameBytes
+			<< " | streamed " << stats.bytesStreamed / (1024 * 1024) << " MB, writes " << stats.writes
+			<< ", wrap-arounds " << stats.wrapArounds << ", overflows " << stats.overflows
+			<< ", uploads/frame " << (double)total.issued[CallUpload] / frameCount
+			<< ", fence waits " << stats.fenceWaits << " (" << stats.fenceWaitMilliseconds << " ms)"
+			<< ", " << frameTime << " ms/frame" << std::endl;
+
+		std::swap(stream, instanceStream);
+		if (mode != 0)
+			stream.Destroy();
+		// The stream's id can be reused, so point the attributes again next time
+		CubeInstances.sourceBuffer = 0;
+		delete mock;
+	}
+}
+
+/* Compares per-object submission against multi-draw indirect as the scene grows: GL calls and time
+   on the recording backend, and with a context a pixel comparison of both paths. The indirect side is
+   timed on its first frame, which uploads everything, on a repeat of it, and after one Olaf moved */
+void benchmarkIndirectDraw(bool hasContext)
+{
+	glm::mat4 axisTransforms[3] = { glm::mat4(1.0f), glm::mat4(1.0f), glm::mat4(1.0f) };
+	const unsigned int olafCounts[] = { 100, 1000, 10000, 100000 };
+	frustumCullingEnabled = false;
+	for (int c = 0; c < 4; c++)
+	{
+		MockGL mock;
+		SceneHierarchy scene;
+		for (unsigned int i = 0; i < olafCounts[c]; i++)
+		{
+			NodeHandle olaf = addOlaf(scene);
+			scene.SetPosition(olaf, glm::vec3((i % 316) * GridUnit * 4, 0.0f, (i / 316) * GridUnit * 4));
+		}
+
+		drawScene(scene, axisTransforms, GL_TRIANGLES);
+		glState.BeginFrame();
+		recordedGLCalls.clear();
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		drawScene(scene, axisTransforms, GL_TRIANGLES);
+		double perObjectTime = elapsedMilliseconds(start);
+		unsigned int perObjectCalls = glState.frame.TotalIssued();
+		std::cout << "IndirectDraw olafs=" << olafCounts[c] << " per object: " << perObjectCalls << " GL calls, "
+			<< perObjectTime << " ms" << std::endl;
+
+		StreamBuffer staging;
+		staging.target = GL_COPY_READ_BUFFER;
+		staging.buffer = 8;
+		staging.regionSize = 1 << 20;
+		staging.regionCount = 1;
+		renderQueue.EnableIndirect(indirectShaderProgram, 6, 7, staging);
+		const char* frameNames[3] = { "first frame", "static", "one moved" };
+		for (int frame = 0; frame < 3; frame++)
+		{
+			if (frame == 2)
+				scene.Translate(scene.handle[0], glm::vec3(GridUnit, 0.0f, 0.0f));
+			glState.BeginFrame();
+			recordedGLCalls.clear();
+			start = std::chrono::high_resolution_clock::now();
+			drawScene(scene, axisTransforms, GL_TRIANGLES);
+			double frameTime = elapsedMilliseconds(start);
+			const RenderQueueStats& stats = renderQueue.stats;
+			std::cout << "IndirectDraw olafs=" << olafCounts[c] << " indirect " << frameNames[frame] << ": "
+				<< glState.frame.TotalIssued() << " GL calls, " << frameTime << " ms (queue build " << stats.buildMilliseconds
+				<< " ms, submit " << stats.submitMilliseconds << " ms), uploaded " << stats.bytesUploaded / 1024.0 << " KB" << std::endl;
+		}
+	}
+	frustumCullingEnabled = true;
+
+	if (!hasContext || !indirectSupported)
+		return;
+
+	// Both paths must produce the same image
+	SceneHierarchy scene;
+	for (unsigned int i = 0; i < 100; i++)
+	{
+		NodeHandle olaf = addOlaf(scene);
+		scene.SetPosition(olaf, glm::vec3((i % 10) * GridUnit * 4 - 0.2f, 0.0f, (i / 10) * GridUnit * 4 - 0.2f));
+	}
+	useDefaultCamera();
+	glState.Enable(GL_DEPTH_TEST);
+	unsigned int indirectBuffers[2];
+	glGenBuffers(2, indirectBuffers);
+	StreamBuffer staging;
+	staging.Create(GL_COPY_READ_BUFFER, 1 << 20);
+	std::vector<unsigned char> pixels[2];
+	double gpuTime[2];
+	for (int indirect = 0; indirect < 2; indirect++)
+	{
+		if (indirect)
+			renderQueue.EnableIndirect(indirectShaderProgram, indirectBuffers[0], indirectBuffers[1], staging);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glFinish();
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		drawScene(scene, axisTransforms, GL_TRIANGLES);
+		glFinish();
+		gpuTime[indirect] = elapsedMilliseconds(start);
+
+		pixels[indirect].resize(1024 * 768 * 4);
+		glReadPixels(0, 0, 1024, 768, GL_RGBA, GL_UNSIGNED_BYTE, pixels[indirect].data());
+	}
+	renderQueue.DisableIndirect();
+	glDeleteBuffers(2, indirectBuffers);
+	glState.ForgetBuffer(indirectBuffers[0]);
+	glState.ForgetBuffer(indirectBuffers[1]);
+	staging.Destroy();
+
+	// Colours reach the fragment shader as a uniform on one path and as an interpolated output on
+	// the other, so allow one step of rounding
+	size_t differing = 0, covered = 0;
+	for (size_t i = 0; i < pixels[0].size(); i += 4)
+	{
+		for (int channel = 0; channel < 3; channel++)
+		{
+			if (std::abs(pixels[0][i + channel] - pixels[1][i + channel]) > 1)
+			{
+				differing++;
+				break;
+			}
+		}
+		covered += pixels[0][i] | pixels[0][i + 1] | pixels[0][i + 2] ? 1 : 0;
+	}
+	std::cout << "IndirectDraw image olafs=100 per object " << gpuTime[0] << " ms, indirect " << gpuTime[1]
+		<< " ms | covered pixels " << covered << ", differing " << differing << std::endl;
+}
+
+/* Draws Olafs behind a wall with and without occlusion queries. Once its frame of latency has passed,
+   the query path must give the image of its first frame, which draws every subtree unconditionally */
+void benchmarkOcclusionQueries(bool hasContext)
+{
+	if (!hasContext || !GLEW_VERSION_3_3)
+		return;
+
+	const unsigned int olafCount = 400;
+	SceneHierarchy scene;
+	NodeHandle wall = scene.AddNode(InvalidNode);
+	scene.SetPosition(wall, glm::vec3(0.0f, 0.0f, -GridUnit * 3));
+	scene.SetScale(wall, glm::vec3(30.0f, 8.0f, 1.0f));
+	for (unsigned int i = 0; i < olafCount; i++)
+	{
+		// A few rows in front of the wall, the rest behind it
+		NodeHandle olaf = addOlaf(scene);
+		float z = i < 40 ? (i / 20) * GridUnit * 3 : -GridUnit * 6 - ((i - 40) / 20) * GridUnit * 3;
+		scene.SetPosition(olaf, glm::vec3(((i % 20) - 9.5f) * GridUnit * 1.5f, 0.0f, z));
+	}
+
+	// Eye level, below the top of the wall
+	glm::mat4 axisTransforms[3] = { glm::mat4(1.0f), glm::mat4(1.0f), glm::mat4(1.0f) };
+	useDefaultCamera();
+	viewMatrix = glm::lookAt(glm::vec3(0.0f, GridUnit * 4, GridUnit * 25), glm::vec3(0.0f, GridUnit * 2, -GridUnit * 20), glm::vec3(0.0f, 1.0f, 0.0f));
+	glState.Enable(GL_DEPTH_TEST);
+	bool occlusionCulling = occlusionCullingEnabled;
+	occlusionCullingEnabled = false;
+	std::vector<unsigned char> pixels[2];
+	double frameTime[2];
+	unsigned int drawCalls[2];
+	for (int queried = 0; queried < 2; queried++)
+	{
+		occlusionQueriesEnabled = queried != 0;
+		for (int frame = 0; frame < 4; frame++)
+		{
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			glState.BeginFrame();
+			glFinish();
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			drawScene(scene, axisTransforms, GL_TRIANGLES);
+			glFinish();
+			frameTime[queried] = elapsedMilliseconds(start);
+			drawCalls[queried] = glState.frame.issued[CallDraw];
+			if (queried && (frame == 0 || frame == 3))
+			{
+				pixels[frame != 0].resize(1024 * 768 * 4);
+				glReadPixels(0, 0, 1024, 768, GL_RGBA, GL_UNSIGNED_BYTE, pixels[frame != 0].data());
+			}
+		}
+	}
+	occlusionQueriesEnabled = false;
+	occlusionCullingEnabled = occlusionCulling;
+	occlusionQueries.Destroy();
+
+	size_t differing = 0;
+	for (size_t i = 0; i < pixels[0].size(); i++)
+		differing += pixels[0][i] != pixels[1][i];
+	const OcclusionQueryStats& stats = occlusionQueries.frame;
+	std::cout << "OcclusionQueries olafs=" << olafCount << " " << (occlusionQueries.target == GL_ANY_SAMPLES_PASSED_CONSERVATIVE
+		? "conservative" : "exact") << " | without queries " << drawCalls[0] << " draws " << frameTime[0] << " ms"
+		<< " | with queries " << drawCalls[1] << " draws " << frameTime[1] << " ms, " << stats.issued << " queries, "
+		<< stats.skipped << "/" << stats.resolved << " skipped (" << stats.SkipRate() * 100.0f << "%)"
+		<< " | differing bytes " << differing << std::endl;
+}
+
+/* Churns the range allocator with random meshes, then fills a registry with meshes, frees half of
+   them, and defragments it. Every surviving mesh is read back from the GPU and compared with its
+   source data */
+void benchmarkGeometryRegistry(bool hasContext)
+{
+	// Allocator only: 1M allocations and frees of 8 to 4096 entries, with about 4k ranges, half of the capacity, live
+	RangeAllocator allocator;
+	allocator.Reset(1 << 24);
+	std::vector<RangeAllocator::Range> live;
+	srand(13579);
+	unsigned int failures = 0;
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	for (int op = 0; op < 1000000; op++)
+	{
+		if (live.size() >= 4096 || (!live.empty() && rand() % 4 == 0))
+		{
+			size_t victim = rand() % live.size();
+			allocator.Free(live[victim].offset, live[victim].size);
+			live[victim] = live.back();
+			live.pop_back();
+		}
+		else
+		{
+			RangeAllocator::Range range = { 0, 8u + rand() % 4089u };
+			range.offset = allocator.Allocate(range.size);
+			if (range.offset == InvalidRange)
+				failures++;
+			else
+				live.push_back(range);
+		}
+	}
+	double churnTime = elapsedMilliseconds(start);
+	unsigned int freeSpace = allocator.capacity - allocator.used;
+	std::cout << "GeometryRegistry allocator 1M ops " << churnTime << " ms | live ranges " << live.size() << ", used "
+		<< allocator.used * 100.0 / allocator.capacity << "%, free ranges " << allocator.freeRanges.size() << ", fragmentation "
+		<< (freeSpace ? 1.0 - (double)allocator.LargestFree() / freeSpace : 0.0) << ", failed allocations " << failures << std::endl;
+
+	if (!hasContext)
+		return;
+
+	// Meshes of 24 to 2k vertices and as many indices, stored as 8 or 16-bit
+	const unsigned int meshCount = 4000;
+	GeometryRegistry registry;
+	registry.initialVertices = 1 << 12;
+	registry.initialIndices = 1 << 12;
+	std::vector<Geometry> meshes(meshCount);
+	std::vector<std::vector<glm::vec3> > vertexData(meshCount);
+	std::vector<std::vector<unsigned int> > indexData(meshCount);
+	for (unsigned int m = 0; m < meshCount; m++)
+	{
+		unsigned int vertexCount = 24 + rand() % 2000;
+		vertexData[m].resize(vertexCount);
+		indexData[m].resize(vertexCount);
+		for (unsigned int v = 0; v < vertexCount; v++)
+		{
+			vertexData[m][v] = glm::vec3((float)m, (float)v, (float)rand() / RAND_MAX);
+			indexData[m][v] = (v * 7) % vertexCount;
+		}
+	}
+	start = std::chrono::high_resolution_clock::now();
+	for (unsigned int m = 0; m < meshCount; m++)
+		registry.Add(meshes[m], PositionFormat, vertexData[m].data(), (unsigned int)vertexData[m].size(), indexData[m].data(), (unsigned int)indexData[m].size());
+	glFinish();
+	double addTime = elapsedMilliseconds(start);
+	unsigned int growths = registry.reallocations;
+
+	for (unsigned int m = 0; m < meshCount; m += 2)
+		registry.Remove(meshes[m]);
+	GeometryOccupancy before = registry.Occupancy(0);
+	size_t movedBefore = registry.bytesMoved;
+	start = std::chrono::high_resolution_clock::now();
+	registry.Defragment();
+	glFinish();
+	double defragmentTime = elapsedMilliseconds(start);
+	GeometryOccupancy after = registry.Occupancy(0);
+
+	unsigned int mismatches = 0;
+	std::vector<glm::vec3> vertices;
+	std::vector<unsigned char> indexBytes;
+	std::vector<unsigned int> indices;
+	glState.BindBuffer(GL_COPY_READ_BUFFER, registry.pools[0].vbo);
+	for (unsigned int m = 1; m < meshCount; m += 2)
+	{
+		vertices.resize(meshes[m].vertexCount);
+		glGetBufferSubData(GL_COPY_READ_BUFFER, meshes[m].baseVertex * sizeof(glm::vec3), vertices.size() * sizeof(glm::vec3), vertices.data());
+		mismatches += vertices != vertexData[m];
+	}
+	glState.BindBuffer(GL_COPY_READ_BUFFER, registry.pools[0].ebo);
+	for (unsigned int m = 1; m < meshCount; m += 2)
+	{
+		unsigned int indexSize = indexTypeSize(meshes[m].indexType);
+		indexBytes.resize(meshes[m].indexCount * indexSize);
+		glGetBufferSubData(GL_COPY_READ_BUFFER, meshes[m].firstIndex * indexSize, indexBytes.size(), indexBytes.data());
+		indices.resize(meshes[m].indexCount);
+		for (size_t i = 0; i < indices.size(); i++)
+			indices[i] = indexSize == 1 ? indexBytes[i] : ((const unsigned short*)indexBytes.data())[i];
+		mismatches += indices != indexData[m];
+	}
+	registry.Destroy();
+
+	std::cout << "GeometryRegistry meshes=" << meshCount << " add " << addTime << " ms (" << growths << " growths)"
+		<< " | half removed: vertices " << before.verticesUsed << "/" << before.vertexCapacity << " in " << before.vertexFreeRanges
+		<< " free ranges, fragmentation " << before.vertexFragmentation << " | defragment " << defragmentTime << " ms, "
+		<< (registry.bytesMoved - movedBefore) / 1024 << " KB moved, " << after.vertexFreeRanges << " free range, fragmentation "
+		<< after.vertexFragmentation << ", index fragmentation " << after.indexFragmentation << " | mismatched meshes " << mismatches << std::endl;
+}
+
+/* A UV sphere resting on the origin, its vertices in rings from the top and its triangles row by row */
+void buildSphere(unsigned int rings, unsigned int segments, float radius, std::vector<glm::vec3>& positions,
+	std::vector<glm::vec3>& normals, std::vector<unsigned int>& indices)
+{
+	positions.resize((rings + 1) * (segments + 1));
+	normals.resize(positions.size());
+	for (unsigned int r = 0; r <= rings; r++)
+	{
+		float theta = 3.14159265f * r / rings;
+		for (unsigned int s = 0; s <= segments; s++)
+		{
+			float phi = 6.2831853f * s / segments;
+			unsigned int v = r * (segments + 1) + s;
+			normals[v] = glm::vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+			positions[v] = normals[v] * radius + glm::vec3(0.0f, radius, 0.0f);
+		}
+	}
+	indices.clear();
+	indices.reserve(rings * segments * 6);
+	for (unsigned int r = 0; r < rings; r++)
+	{
+		for (unsigned int s = 0; s < segments; s++)
+		{
+			unsigned int v = r * (segments + 1) + s;
+			unsigned int quad[] = { v, v + 1, v + segments + 1, v + 1, v + segments + 2, v + segments + 1 };
+			indices.insert(indices.end(), quad, quad + 6);
+		}
+	}
+}
+
+/* Quantizes a 1M vertex sphere with the glm reference and the batch kernels, measuring the error of
+   each attribute, and with a context compares upload time and the rendered image against floats */
+void benchmarkVertexQuantization(bool hasContext)
+{
+	const unsigned int rings = 1000, segments = 1000;
+	const float radius = 0.03f;
+	std::vector<glm::vec3> positions, normals;
+	std::vector<unsigned int> indices;
+	buildSphere(rings, segments, radius, positions, normals, indices);
+	const unsigned int vertexCount = (unsigned int)positions.size();
+	std::vector<glm::vec4> colours(vertexCount);
+	for (unsigned int v = 0; v < vertexCount; v++)
+		colours[v] = glm::vec4(0.5f + 0.5f * normals[v], 1.0f);
+	BoundingVolume bounds = computeBounds(positions.data(), vertexCount);
+	PositionQuantization quantization = positionQuantization(bounds);
+
+	std::vector<QuantizedVertex> reference(vertexCount), batched(vertexCount);
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	quantizeVerticesReference(positions.data(), normals.data(), colours.data(), vertexCount, quantization, reference.data());
+	double referenceTime = elapsedMilliseconds(start);
+	start = std::chrono::high_resolution_clock::now();
+	quantizeVertices(positions.data(), normals.data(), colours.data(), vertexCount, quantization, batched.data());
+	double batchTime = elapsedMilliseconds(start);
+
+	std::vector<glm::uint64> halfReference(vertexCount), halfBatched(vertexCount);
+	start = std::chrono::high_resolution_clock::now();
+	packHalfPositionsReference(positions.data(), vertexCount, halfReference.data());
+	double halfReferenceTime = elapsedMilliseconds(start);
+	start = std::chrono::high_resolution_clock::now();
+	packHalfPositions(positions.data(), vertexCount, halfBatched.data());
+	double halfBatchTime = elapsedMilliseconds(start);
+
+	// glm rounds ties away from zero and the kernels to even, so the two may differ by one step
+	struct Within
+	{
+		static bool Step(const short* a, const short* b, int count)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				if (std::abs(a[i] - b[i]) > 1)
+					return false;
+			}
+			return true;
+		}
+	};
+	unsigned int mismatches = 0;
+	float positionError = 0.0f, halfError = 0.0f, normalError = 0.0f, colourError = 0.0f;
+	for (unsigned int v = 0; v < vertexCount; v++)
+	{
+		const QuantizedVertex& q = batched[v];
+		short normals16[2][2], halves[2][4];
+		memcpy(normals16[0], &q.normal, 4);
+		memcpy(normals16[1], &reference[v].normal, 4);
+		memcpy(halves[0], &halfBatched[v], 8);
+		memcpy(halves[1], &halfReference[v], 8);
+		glm::vec4 colourStep = glm::abs(glm::unpackUnorm4x8(q.colour) - glm::unpackUnorm4x8(reference[v].colour)) * 255.0f;
+		mismatches += !Within::Step(q.position, reference[v].position, 4) || !Within::Step(normals16[0], normals16[1], 2)
+			|| !Within::Step(halves[0], halves[1], 4) || glm::any(glm::greaterThan(colourStep, glm::vec4(1.5f)));
+
+		glm::uint64 packedPosition;
+		memcpy(&packedPosition, q.position, sizeof(packedPosition));
+		glm::vec3 position = glm::vec3(glm::unpackSnorm4x16(packedPosition)) * quantization.scale + quantization.offset;
+		positionError = std::max(positionError, glm::length(position - positions[v]));
+		halfError = std::max(halfError, glm::length(glm::vec3(glm::unpackHalf4x16(halfBatched[v])) - positions[v]));
+		normalError = std::max(normalError, glm::degrees(std::acos(glm::clamp(glm::dot(octahedralDecode(q.normal), normals[v]), -1.0f, 1.0f))));
+		glm::vec4 colour = glm::unpackUnorm4x8(q.colour) - colours[v];
+		colourError = std::max(colourError, std::max(std::max(std::abs(colour.r), std::abs(colour.g)), std::max(std::abs(colour.b), std::abs(colour.a))));
+	}
+
+	std::cout << "VertexQuantization vertices=" << vertexCount << " lit " << sizeof(LitVertex) << " -> " << sizeof(QuantizedVertex)
+		<< " bytes (" << (sizeof(LitVertex) - sizeof(QuantizedVertex)) * vertexCount / 1024 << " KB saved), positions 12 -> "
+		<< PositionHalfFormat.stride << " bytes | glm " << referenceTime << " ms, " << (USE_SSE2 ? "sse2" : "scalar") << " batch "
+		<< batchTime << " ms | half positions glm " << halfReferenceTime << " ms, batch " << halfBatchTime << " ms"
+		<< " | max error: position " << positionError / radius << " radii (half " << halfError / radius << "), normal "
+		<< normalError << " deg, colour " << colourError * 255.0f << "/255 | batch vs glm mismatches " << mismatches << std::endl;
+
+	if (!hasContext)
+		return;
+
+	std::vector<LitVertex> litVertices(vertexCount);
+	for (unsigned int v = 0; v < vertexCount; v++)
+	{
+		litVertices[v].position = positions[v];
+		litVertices[v].normal = normals[v];
+		litVertices[v].colour = colours[v];
+	}
+
+	// Pools sized for the mesh up front, so Add is a single upload
+	GeometryRegistry registry;
+	registry.initialVertices = vertexCount;
+	registry.initialIndices = (unsigned int)indices.size();
+	Geometry litSphere, quantizedSphere;
+	const VertexFormat* formats[] = { &LitVertexFormat, &QuantizedVertexFormat };
+	Geometry* spheres[] = { &litSphere, &quantizedSphere };
+	const void* vertexData[] = { litVertices.data(), batched.data() };
+	double uploadTime[2];
+	for (int quantized = 0; quantized < 2; quantized++)
+	{
+		registry.PoolIndex(*formats[quantized]);
+		glFinish();
+		start = std::chrono::high_resolution_clock::now();
+		registry.Add(*spheres[quantized], *formats[quantized], vertexData[quantized], vertexCount, indices.data(), (unsigned int)indices.size());
+		glFinish();
+		uploadTime[quantized] = elapsedMilliseconds(start);
+	}
+
+	ShaderProgram programs[2] = {
+		ShaderProgram(createShaderProgram("shaders/vertex0_lit.vert", "shaders/fragment0_instanced.frag")),
+		ShaderProgram(createShaderProgram("shaders/vertex0_quantized.vert", "shaders/fragment0_instanced.frag")) };
+	useDefaultCamera();
+	glm::mat4 mvp = projectionMatrix * viewMatrix;
+	glState.Enable(GL_DEPTH_TEST);
+	std::vector<unsigned char> pixels[2];
+	double drawTime[2];
+	for (int quantized = 0; quantized < 2; quantized++)
+	{
+		programs[quantized].Use();
+		programs[quantized].SetMat4(UniformMvpMatrix, mvp);
+		if (quantized)
+		{
+			programs[quantized].SetVec3(UniformPositionScale, quantization.scale);
+			programs[quantized].SetVec3(UniformPositionOffset, quantization.offset);
+		}
+		glState.BindVertexArray(spheres[quantized]->vao);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glFinish();
+		start = std::chrono::high_resolution_clock::now();
+		drawGeometry(*spheres[quantized], GL_TRIANGLES);
+		glFinish();
+		drawTime[quantized] = elapsedMilliseconds(start);
+
+		pixels[quantized].resize(1024 * 768 * 4);
+		glReadPixels(0, 0, 1024, 768, GL_RGBA, GL_UNSIGNED_BYTE, pixels[quantized].data());
+	}
+	registry.Destroy();
+	glDeleteProgram(programs[0].id);
+	glDeleteProgram(programs[1].id);
+
+	// unorm8 colours and snorm16 normals shift the shading by a step or two
+	size_t differing = 0, covered = 0;
+	for (size_t i = 0; i < pixels[0].size(); i += 4)
+	{
+		for (int channel = 0; channel < 3; channel++)
+		{
+			if (std::abs(pixels[0][i + channel] - pixels[1][i + channel]) > 2)
+			{
+				differing++;
+				break;
+			}
+		}
+		covered += pixels[0][i] | pixels[0][i + 1] | pixels[0][i + 2] ? 1 : 0;
+	}
+	std::cout << "VertexQuantization upload float " << (size_t)vertexCount * sizeof(LitVertex) / 1024 << " KB " << uploadTime[0]
+		<< " ms, quantized " << (size_t)vertexCount * sizeof(QuantizedVertex) / 1024 << " KB " << uploadTime[1] << " ms"
+		<< " (indices included) | draw float " << drawTime[0] << " ms, quantized " << drawTime[1] << " ms | covered pixels "
+		<< covered << ", differing " << differing << std::endl;
+}
+
+/* Index bytes of the cube and a 1M vertex sphere at 32 bits, at the registry's automatic width and
+   split into 16-bit clusters, and the speed of the compressed encoding. With a context, draws the
+   sphere from 32-bit indices and from its clusters and compares the images */
+void benchmarkIndexBuffers(bool hasContext)
+{
+	std::vector<glm::vec3> positions, normals;
+	std::vector<unsigned int> indices;
+	buildSphere(1000, 1000, 0.03f, positions, normals, indices);
+	const unsigned int vertexCount = (unsigned int)positions.size(), indexCount = (unsigned int)indices.size();
+
+	std::vector<IndexCluster> clusters;
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	buildIndexClusters(indices.data(), indexCount, 0x10000, clusters);
+	double clusterTime = elapsedMilliseconds(start);
+	size_t clusterVertices = 0;
+	for (size_t c = 0; c < clusters.size(); c++)
+		clusterVertices += clusters[c].vertices.size();
+
+	std::vector<unsigned char> encoded;
+	start = std::chrono::high_resolution_clock::now();
+	encodeIndices(indices.data(), indexCount, encoded);
+	double encodeTime = elapsedMilliseconds(start);
+	std::vector<unsigned int> decoded(indexCount);
+	start = std::chrono::high_resolution_clock::now();
+	bool valid = decodeIndices(encoded.data(), encoded.size(), decoded.data(), indexCount);
+	double decodeTime = elapsedMilliseconds(start);
+
+	std::cout << "IndexBuffers cube " << indexTypeSize(indexTypeFor(8)) * 36 << " bytes (32-bit " << 36 * 4
+		<< ") | sphere vertices=" << vertexCount << " indices=" << indexCount << " 32-bit " << indexCount * 4 / 1024 << " KB"
+		<< ", 16-bit clusters " << clusters.size() << " (" << clusterTime << " ms, " << (clusterVertices - vertexCount) * 100.0 / vertexCount
+		<< "% vertices duplicated) " << indexCount * 2 / 1024 << " KB | compressed " << encoded.size() / 1024 << " KB, "
+		<< encoded.size() * 8.0 / indexCount << " bits/index, encode " << encodeTime << " ms, decode " << decodeTime << " ms ("
+		<< indexCount * 4.0 / 1048576.0 / (decodeTime / 1000.0) << " MB/s) | round trip " << (valid && decoded == indices ? "exact" : "FAILED") << std::endl;
+
+	// Through an index file, then files that must be rejected: a header claiming more indices than it
+	// has bytes, and an index past the vertex count
+	std::string indexPath = temporaryFilePath("benchmark_sphere.idx"), badPath = temporaryFilePath("benchmark_bad.idx");
+	start = std::chrono::high_resolution_clock::now();
+	bool saved = saveIndexFile(indexPath.c_str(), indices.data(), indexCount, vertexCount);
+	double saveTime = elapsedMilliseconds(start);
+	std::vector<unsigned int> loaded;
+	unsigned int loadedVertexCount = 0;
+	start = std::chrono::high_resolution_clock::now();
+	bool loadedFile = saved && loadIndexFile(indexPath.c_str(), loaded, loadedVertexCount);
+	double loadTime = elapsedMilliseconds(start);
+
+	IndexFileHeader forged;
+	memcpy(forged.magic, IndexFileMagic, sizeof(forged.magic));
+	forged.version = IndexFileVersion;
+	forged.indexCount = 0xFFFFFFF0;
+	forged.vertexCount = 3;
+	forged.dataSize = 4;
+	const unsigned char forgedData[4] = { 0, 0, 0, 0 };
+	{
+		std::ofstream fileStream(badPath.c_str(), std::ios::out | std::ios::binary);
+		fileStream.write((const char*)&forged, sizeof(forged));
+		fileStream.write((const char*)forgedData, sizeof(forgedData));
+	}
+	std::vector<unsigned int> rejected;
+	unsigned int rejectedVertexCount = 0;
+	unsigned int rejections = !loadIndexFile(badPath.c_str(), rejected, rejectedVertexCount) && rejected.empty();
+	const unsigned int outOfRange[] = { 0, 1, 2 };
+	rejections += saveIndexFile(badPath.c_str(), outOfRange, 3, 2) && !loadIndexFile(badPath.c_str(), rejected, rejectedVertexCount);
+	std::cout << "IndexBuffers file " << (sizeof(IndexFileHeader) + encoded.size()) / 1024 << " KB, save " << saveTime << " ms, load "
+		<< loadTime << " ms | round trip " << (loadedFile && loaded == indices && loadedVertexCount == vertexCount ? "exact" : "FAILED")
+		<< " | corrupt files rejected " << rejections << "/2" << std::endl;
+	std::remove(indexPath.c_str());
+	std::remove(badPath.c_str());
+
+	if (!hasContext)
+		return;
+
+	// The whole sphere with 32-bit indices, and its clusters with 16-bit indices
+	GeometryRegistry wideRegistry, registry;
+	wideRegistry.smallestIndexType = GL_UNSIGNED_INT;
+	wideRegistry.initialVertices = registry.initialVertices = (unsigned int)clusterVertices;
+	wideRegistry.initialIndices = registry.initialIndices = indexCount;
+	Geometry wideSphere;
+	std::vector<Geometry> sphereClusters;
+	wideRegistry.Add(wideSphere, PositionFormat, positions.data(), vertexCount, indices.data(), indexCount);
+	registry.AddClustered(sphereClusters, PositionFormat, positions.data(), vertexCount, indices.data(), indexCount);
+
+	ShaderProgram program(createShaderProgram("shaders/vertex0.vert", "shaders/fragment0.frag"));
+	program.Use();
+	useDefaultCamera();
+	program.SetMat4(UniformMvpMatrix, projectionMatrix * viewMatrix);
+	program.SetVec4(UniformFragmentColour, glm::vec4(0.8f, 0.5f, 0.2f, 1.0f));
+	glState.Enable(GL_DEPTH_TEST);
+	std::vector<unsigned char> pixels[2];
+	double drawTime[2];
+	for (int clustered = 0; clustered < 2; clustered++)
+	{
+		glState.BindVertexArray(clustered ? sphereClusters[0].vao : wideSphere.vao);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glFinish();
+		start = std::chrono::high_resolution_clock::now();
+		if (clustered)
+		{
+			for (size_t c = 0; c < sphereClusters.size(); c++)
+				drawGeometry(sphereClusters[c], GL_TRIANGLES);
+		}
+		else
+			drawGeometry(wideSphere, GL_TRIANGLES);
+		glFinish();
+		drawTime[clustered] = elapsedMilliseconds(start);
+
+		pixels[clustered].resize(1024 * 768 * 4);
+		glReadPixels(0, 0, 1024, 768, GL_RGBA, GL_UNSIGNED_BYTE, pixels[clustered].data());
+	}
+	wideRegistry.Destroy();
+	registry.Destroy();
+	glDeleteProgram(program.id);
+
+	size_t differing = 0;
+	for (size_t i = 0; i < pixels[0].size(); i += 4)
+		differing += memcmp(&pixels[0][i], &pixels[1][i], 4) != 0;
+	std::cout << "IndexBuffers draw 32-bit " << drawTime[0] << " ms, 16-bit clusters " << drawTime[1] << " ms | differing pixels "
+		<< differing << std::endl;
+}
+
+/* Fragments that pass the depth test per covered pixel, averaged over views from around the mesh */
+double measureOverdraw(const Geometry& geometry, ShaderProgram& program, const glm::vec3& center, float distance)
+{
+	unsigned int query;
+	glGenQueries(1, &query);
+	std::vector<unsigned char> pixels(1024 * 768 * 4);
+	double overdraw = 0.0;
+	const int views = 8;
+	for (int view = 0; view < views; view++)
+	{
+		float angle = 6.2831853f * view / views;
+		glm::vec3 eye = center + distance * glm::vec3(std::cos(angle), view % 2 ? 0.5f : -0.5f, std::sin(angle));
+		program.SetMat4(UniformMvpMatrix, glm::perspective(glm::radians(45.0f), 1024.0f / 768.0f, 0.01f, 10.0f)
+			* glm::lookAt(eye, center, glm::vec3(0.0f, 1.0f, 0.0f)));
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glBeginQuery(GL_SAMPLES_PASSED, query);
+		drawGeometry(geometry, GL_TRIANGLES);
+		glEndQuery(GL_SAMPLES_PASSED);
+		unsigned int samples = 0;
+		glGetQueryObjectuiv(query, GL_QUERY_RESULT, &samples);
+		glReadPixels(0, 0, 1024, 768, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+		size_t covered = 0;
+		for (size_t i = 0; i < pixels.size(); i += 4)
+			covered += pixels[i] != 0;
+		overdraw += covered ? (double)samples / covered : 0.0;
+	}
+	glDeleteQueries(1, &query);
+	return overdraw / views;
+}
+
+/* Optimizes a bumpy 490k vertex sphere whose triangles and vertices arrive shuffled, as from an
+   arbitrary exporter: cache stats of each stage, with the whole pipeline on a worker thread. With a
+   context, the overdraw of each ordering */
+void benchmarkMeshOptimization(bool hasContext)
+{
+	std::vector<glm::vec3> positions, normals;
+	std::vector<unsigned int> indices;
+	buildSphere(700, 700, 0.03f, positions, normals, indices);
+	const unsigned int vertexCount = (unsigned int)positions.size();
+	const size_t indexCount = indices.size(), triangleCount = indexCount / 3;
+	glm::vec3 center(0.0f, 0.03f, 0.0f);
+	for (unsigned int v = 0; v < vertexCount; v++)
+	{
+		float theta = std::acos(glm::clamp(normals[v].y, -1.0f, 1.0f)), phi = std::atan2(normals[v].z, normals[v].x);
+		positions[v] = center + normals[v] * 0.03f * (1.0f + 0.3f * std::sin(8.0f * theta) * std::sin(8.0f * phi));
+	}
+
+	// Shuffle the triangles and renumber the vertices
+	srand(24680);
+	std::vector<unsigned int> order(triangleCount), renumber(vertexCount);
+	for (size_t t = 0; t < triangleCount; t++)
+		order[t] = (unsigned int)t;
+	for (unsigned int v = 0; v < vertexCount; v++)
+		renumber[v] = v;
+	for (size_t t = triangleCount - 1; t > 0; t--)
+		std::swap(order[t], order[((size_t)rand() * (RAND_MAX + 1u) + rand()) % (t + 1)]);
+	for (unsigned int v = vertexCount - 1; v > 0; v--)
+		std::swap(renumber[v], renumber[((size_t)rand() * (RAND_MAX + 1u) + rand()) % (v + 1)]);
+	std::vector<unsigned int> shuffled(indexCount);
+	std::vector<glm::vec3> shuffledPositions(vertexCount);
+	for (size_t t = 0; t < triangleCount; t++)
+	{
+		for (int k = 0; k < 3; k++)
+			shuffled[t * 3 + k] = renumber[indices[order[t] * 3 + k]];
+	}
+	for (unsigned int v = 0; v < vertexCount; v++)
+		shuffledPositions[renumber[v]] = positions[v];
+
+	// Each stage on its own
+	VertexCacheStats input = analyzeVertexCache(shuffled.data(), indexCount, vertexCount);
+	VertexCacheStats rows = analyzeVertexCache(indices.data(), indexCount, vertexCount);
+	std::vector<unsigned int> cacheOrdered(indexCount), clusters;
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	optimizeVertexCache(shuffled.data(), indexCount, vertexCount, cacheOrdered.data(), &clusters);
+	double cacheTime = elapsedMilliseconds(start);
+	VertexCacheStats cache = analyzeVertexCache(cacheOrdered.data(), indexCount, vertexCount);
+	std::vector<unsigned int> overdrawOrdered(cacheOrdered);
+	start = std::chrono::high_resolution_clock::now();
+	optimizeOverdraw(overdrawOrdered.data(), indexCount, shuffledPositions.data(), sizeof(glm::vec3), vertexCount, clusters);
+	double overdrawTime = elapsedMilliseconds(start);
+	VertexCacheStats sorted = analyzeVertexCache(overdrawOrdered.data(), indexCount, vertexCount);
+
+	// The whole pipeline on a copy, on the worker, while this thread measures the compressed input
+	std::vector<glm::vec3> optimizedPositions(shuffledPositions);
+	std::vector<unsigned int> optimized(shuffled);
+	MeshOptimizationTask task;
+	task.Start(optimizedPositions.data(), sizeof(glm::vec3), vertexCount, optimized.data(), indexCount);
+	std::vector<unsigned char> inputEncoded, optimizedEncoded;
+	encodeIndices(shuffled.data(), (unsigned int)indexCount, inputEncoded);
+	const MeshOptimizationStats& stats = task.Finish();
+	encodeIndices(optimized.data(), (unsigned int)indexCount, optimizedEncoded);
+
+	std::cout << "MeshOptimization triangles=" << triangleCount << " ACMR/ATVR: shuffled " << input.acmr << "/" << input.atvr
+		<< ", generated rows " << rows.acmr << "/" << rows.atvr << ", tipsify " << cache.acmr << "/" << cache.atvr << " (" << cacheTime
+		<< " ms, " << clusters.size() << " runs), overdraw sort " << sorted.acmr << "/" << sorted.atvr << " (" << overdrawTime
+		<< " ms) | worker pipeline " << stats.after.acmr << "/" << stats.after.atvr << " in " << stats.milliseconds
+		<< " ms | compressed indices " << inputEncoded.size() * 8.0 / indexCount << " -> " << optimizedEncoded.size() * 8.0 / indexCount
+		<< " bits/index" << std::endl;
+
+	if (!hasContext)
+		return;
+
+	GeometryRegistry registry;
+	registry.initialVertices = vertexCount * 3;
+	registry.initialIndices = (unsigned int)indexCount * 3;
+	Geometry meshes[3];
+	registry.Add(meshes[0], PositionFormat, shuffledPositions.data(), vertexCount, shuffled.data(), (unsigned int)indexCount);
+	registry.Add(meshes[1], PositionFormat, shuffledPositions.data(), vertexCount, cacheOrdered.data(), (unsigned int)indexCount);
+	registry.Add(meshes[2], PositionFormat, optimizedPositions.data(), vertexCount, optimized.data(), (unsigned int)indexCount);
+	ShaderProgram program(createShaderProgram("shaders/vertex0.vert", "shaders/fragment0.frag"));
+	program.Use();
+	program.SetVec4(UniformFragmentColour, glm::vec4(1.0f));
+	glState.Enable(GL_DEPTH_TEST);
+	glState.BindVertexArray(meshes[0].vao);
+	double overdraw[3], drawTime[3];
+	for (int m = 0; m < 3; m++)
+	{
+		glFinish();
+		start = std::chrono::high_resolution_clock::now();
+		overdraw[m] = measureOverdraw(meshes[m], program, center, 0.12f);
+		glFinish();
+		drawTime[m] = elapsedMilliseconds(start) / 8.0;
+	}
+	registry.Destroy();
+	glDeleteProgram(program.id);
+	std::cout << "MeshOptimization overdraw over 8 views: shuffled " << overdraw[0] << " (" << drawTime[0] << " ms/view), tipsify "
+		<< overdraw[1] << " (" << drawTime[1] << " ms/view), optimized " << overdraw[2] << " (" << drawTime[2] << " ms/view)" << std::endl;
+}
+
+/* Writes a sphere as an OBJ file of quads with positions, texture coordinates and normals */
+void writeSyntheticObj(const char* filePath, unsigned int rings, unsigned int segments, const std::vector<glm::vec3>& positions,
+	const std::vector<glm::vec3>& normals)
+{
+	std::string text;
+	text.reserve(positions.size() * 120);
+	char line[160];
+	text += "# synthetic sphere\no sphere\n";
+	for (size_t v = 0; v < positions.size(); v++)
+	{
+		snprintf(line, sizeof(line), "v %.6f %.6f %.6f\nvt %.6f %.6f\nvn %.6f %.6f %.6f\n", positions[v].x, positions[v].y, positions[v].z,
+			(float)(v % (segments + 1)) / segments, (float)(v / (segments + 1)) / rings, normals[v].x, normals[v].y, normals[v].z);
+		text += line;
+	}
+	for (unsigned int r = 0; r < rings; r++)
+	{
+		for (unsigned int s = 0; s < segments; s++)
+		{
+			unsigned int v = r * (segments + 1) + s + 1;
+			unsigned int quad[] = { v, v + 1, v + segments + 2, v + segments + 1 };
+			snprintf(line, sizeof(line), "f %u/%u/%u %u/%u/%u %u/%u/%u %u/%u/%u\n", quad[0], quad[0], quad[0], quad[1], quad[1], quad[1],
+				quad[2], quad[2], quad[2], quad[3], quad[3], quad[3]);
+			text += line;
+		}
+	}
+	std::ofstream fileStream(filePath, std::ios::out | std::ios::binary);
+	fileStream.write(text.data(), text.size());
+}
+
+/* Sphere vertices from buildSphere, with the texture coordinates writeSyntheticObj gives them */
+std::vector<ImportVertex> syntheticVertices(unsigned int rings, unsigned int segments, const std::vector<glm::vec3>& positions,
+	const std::vector<glm::vec3>& normals)
+{
+	std::vector<ImportVertex> vertices(positions.size());
+	for (size_t v = 0; v < positions.size(); v++)
+	{
+		vertices[v].position = positions[v];
+		vertices[v].normal = normals[v];
+		vertices[v].texCoord = glm::vec2((float)(v % (segments + 1)) / segments, (float)(v / (segments + 1)) / rings);
+	}
+	return vertices;
+}
+
+/* Writes interleaved vertices and 32-bit indices as a .glb with one primitive */
+void writeSyntheticGlb(const char* filePath, const std::vector<ImportVertex>& vertices, const std::vector<unsigned int>& indices)
+{
+	size_t vertexBytes = vertices.size() * sizeof(ImportVertex), indexBytes = indices.size() * sizeof(unsigned int);
+	BoundingVolume bounds = computeBounds(&vertices[0].position, vertices.size(), sizeof(ImportVertex));
+	glm::vec3 lower = bounds.center - bounds.extent, upper = bounds.center + bounds.extent;
+	char json[2048];
+	snprintf(json, sizeof(json),
+		"{\"asset\":{\"version\":\"2.0\"},\"buffers\":[{\"byteLength\":%zu}],"
+		"\"bufferViews\":[{\"buffer\":0,\"byteOffset\":0,\"byteLength\":%zu,\"byteStride\":%zu,\"target\":34962},"
+		"{\"buffer\":0,\"byteOffset\":%zu,\"byteLength\":%zu,\"target\":34963}],"
+		"\"accessors\":[{\"bufferView\":0,\"byteOffset\":0,\"componentType\":5126,\"count\":%zu,\"type\":\"VEC3\",\"min\":[%g,%g,%g],\"max\":[%g,%g,%g]},"
+		"{\"bufferView\":0,\"byteOffset\":12,\"componentType\":5126,\"count\":%zu,\"type\":\"VEC3\"},"
+		"{\"bufferView\":0,\"byteOffset\":24,\"componentType\":5126,\"count\":%zu,\"type\":\"VEC2\"},"
+		"{\"bufferView\":1,\"componentType\":5125,\"count\":%zu,\"type\":\"SCALAR\"}],"
+		"\"meshes\":[{\"primitives\":[{\"attributes\":{\"POSITION\":0,\"NORMAL\":1,\"TEXCOORD_0\":2},\"indices\":3}]}],"
+		"\"nodes\":[{\"mesh\":0}],\"scenes\":[{\"nodes\":[0]}],\"scene\":0}",
+		vertexBytes + indexBytes, vertexBytes, sizeof(ImportVertex), vertexBytes, indexBytes, vertices.size(),
+		lower.x, lower.y, lower.z, upper.x, upper.y, upper.z, vertices.size(), vertices.size(), indices.size());
+	std::string jsonChunk(json);
+	jsonChunk.resize((jsonChunk.size() + 3) & ~(size_t)3, ' ');
+	unsigned int header[3] = { 0x46546C67, 2, (unsigned int)(12 + 8 + jsonChunk.size() + 8 + vertexBytes + indexBytes) };
+	unsigned int jsonHeader[2] = { (unsigned int)jsonChunk.size(), 0x4E4F534A };
+	unsigned int binaryHeader[2] = { (unsigned int)(vertexBytes + indexBytes), 0x004E4942 };
+	std::ofstream fileStream(filePath, std::ios::out | std::ios::binary);
+	fileStream.write((const char*)header, sizeof(header));
+	fileStream.write((const char*)jsonHeader, sizeof(jsonHeader));
+	fileStream.write(jsonChunk.data(), jsonChunk.size());
+	fileStream.write((const char*)binaryHeader, sizeof(binaryHeader));
+	fileStream.write((const char*)vertices.data(), vertexBytes);
+	fileStream.write((const char*)indices.data(), indexBytes);
+}
+
+/* Compares parseFloat with strtof, then imports a generated sphere of 360k vertices as OBJ and as
+   GLB on one thread and on every hardware thread, checking the welded result */
+void benchmarkMeshImport()
+{
+	// Float parsing
+	const unsigned int numberCount = 1000000;
+	std::string numbers;
+	char number[32];
+	srand(97531);
+	for (unsigned int i = 0; i < numberCount; i++)
+	{
+		float value = ((float)rand() / RAND_MAX - 0.5f) * std::pow(10.0f, (float)(rand() % 12 - 6));
+		snprintf(number, sizeof(number), i % 2 ? "%.9g " : "%.6f ", value);
+		numbers += number;
+	}
+	std::vector<float> fast(numberCount), reference(numberCount);
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	const char* p = numbers.data();
+	for (unsigned int i = 0; i < numberCount; i++, p++)
+		fast[i] = parseFloat(p, numbers.data() + numbers.size());
+	double fastTime = elapsedMilliseconds(start);
+	start = std::chrono::high_resolution_clock::now();
+	char* next = (char*)numbers.c_str();
+	for (unsigned int i = 0; i < numberCount; i++)
+		reference[i] = strtof(next, &next);
+	double referenceTime = elapsedMilliseconds(start);
+	int maxUlps = 0;
+	for (unsigned int i = 0; i < numberCount; i++)
+	{
+		int a, b;
+		memcpy(&a, &fast[i], 4);
+		memcpy(&b, &reference[i], 4);
+		maxUlps = std::max(maxUlps, std::abs(a - b));
+	}
+	std::cout << "MeshImport floats=" << numberCount << " parseFloat " << fastTime << " ms, strtof " << referenceTime
+		<< " ms, max difference " << maxUlps << " ulp" << std::endl;
+
+	// The same sphere as text and as binary
+	const unsigned int rings = 600, segments = 600;
+	std::vector<glm::vec3> positions, normals;
+	std::vector<unsigned int> indices;
+	buildSphere(rings, segments, 0.03f, positions, normals, indices);
+	std::string objPath = temporaryFilePath("benchmark_sphere.obj"), glbPath = temporaryFilePath("benchmark_sphere.glb");
+	writeSyntheticObj(objPath.c_str(), rings, segments, positions, normals);
+	writeSyntheticGlb(glbPath.c_str(), syntheticVertices(rings, segments, positions, normals), indices);
+
+	// The OBJ's quads come back as fans from their first corner
+	std::vector<unsigned int> fanIndices;
+	fanIndices.reserve(indices.size());
+	for (size_t i = 0; i < indices.size(); i += 6)
+	{
+		unsigned int fan[] = { indices[i], indices[i + 1], indices[i + 4], indices[i], indices[i + 4], indices[i + 5] };
+		fanIndices.insert(fanIndices.end(), fan, fan + 6);
+	}
+	const std::vector<unsigned int>* expected[] = { &fanIndices, &indices };
+
+	const char* paths[] = { objPath.c_str(), glbPath.c_str() };
+	const char* names[] = { "obj", "glb" };
+	unsigned int threadCounts[] = { 1, std::max(1u, std::thread::hardware_concurrency()) };
+	for (int format = 0; format < 2; format++)
+	{
+		std::cout << "MeshImport " << names[format];
+		for (int threaded = 0; threaded < 2; threaded++)
+		{
+			MeshImporter importer;
+			importer.threadCount = threadCounts[threaded];
+			ImportedMesh mesh;
+			bool imported = importer.Import(paths[format], mesh);
+
+			// Every triangle must come back with the source positions, in the same order
+			float maxError = 0.0f;
+			bool complete = imported && mesh.indices.size() == expected[format]->size();
+			for (size_t i = 0; complete && i < mesh.indices.size(); i++)
+				maxError = std::max(maxError, glm::length(mesh.vertices[mesh.indices[i]].position - positions[(*expected[format])[i]]));
+			double total = importer.parseTime + importer.weldTime;
+			std::cout << " | " << importer.threadCount << " threads: " << importer.bytesRead / 1048576.0 << " MB in " << total << " ms ("
+				<< importer.bytesRead / 1048576.0 / (total / 1000.0) << " MB/s, parse " << importer.parseTime << " ms, weld " << importer.weldTime
+				<< " ms), " << importer.cornerCount << " corners -> " << mesh.vertices.size() << " vertices, " << mesh.indices.size() / 3
+				<< " triangles, max position error " << (complete ? maxError : -1.0f);
+		}
+		std::cout << std::endl;
+	}
+	std::remove(objPath.c_str());
+	std::remove(glbPath.c_str());
+}
+
+/* Drops a file from the operating system's file cache, so the next read of it comes from the disk.
+   Returns false where that is not possible */
+bool evictFileCache(const char* filePath)
+{
+#if defined(_WIN32)
+	// Opening the file without buffering purges its cached pages
+	HANDLE file = CreateFileA(filePath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	CloseHandle(file);
+	return true;
+#elif defined(POSIX_FADV_DONTNEED)
+	int descriptor = open(filePath, O_RDONLY);
+	if (descriptor < 0)
+		return false;
+	bool evicted = fsync(descriptor) == 0 && posix_fadvise(descriptor, 0, 0, POSIX_FADV_DONTNEED) == 0;
+	close(descriptor);
+	return evicted;
+#else
+	return false;
+#endif
+}
+
+/* Startup with a generated sphere of 360k vertices: importing and optimizing its OBJ and GLB sources against mapping
+   the mesh caches built from them, cold out of the disk and warm out of the file cache. With a
+   context the mesh goes all the way into a registry, without one the driver's copy is stood in for
+   by a memcpy */
+void benchmarkMeshCache(bool hasContext)
+{
+	const unsigned int rings = 600, segments = 600;
+	std::vector<glm::vec3> positions, normals;
+	std::vector<unsigned int> indices;
+	buildSphere(rings, segments, 0.03f, positions, normals, indices);
+	std::string sourcePaths[] = { temporaryFilePath("benchmark_cache.obj"), temporaryFilePath("benchmark_cache.glb") };
+	std::string cachePaths[] = { temporaryFilePath("benchmark_cache.obj.mesh"), temporaryFilePath("benchmark_cache.glb.mesh") };
+	writeSyntheticObj(sourcePaths[0].c_str(), rings, segments, positions, normals);
+	writeSyntheticGlb(sourcePaths[1].c_str(), syntheticVertices(rings, segments, positions, normals), indices);
+
+	struct Startup
+	{
+		// Sends a mesh to the GPU, returning the bytes sent
+		static size_t Upload(bool hasContext, const VertexFormat& format, const void* vertexData, unsigned int vertexCount,
+			const void* indexData, unsigned int indexCount, unsigned int indexType, std::vector<unsigned char>& staging)
+		{
+			size_t vertexBytes = (size_t)vertexCount * format.stride, indexBytes = (size_t)indexCount * indexTypeSize(indexType);
+			if (hasContext)
+			{
+				GeometryRegistry registry;
+				registry.initialVertices = vertexCount;
+				registry.initialIndices = (unsigned int)((indexBytes + 3) / 4);
+				Geometry geometry;
+				registry.AddTyped(geometry, format, vertexData, vertexCount, indexData, indexCount, indexType);
+				glFinish();
+				registry.Destroy();
+			}
+			else
+			{
+				staging.resize(vertexBytes + indexBytes);
+				memcpy(staging.data(), vertexData, vertexBytes);
+				memcpy(staging.data() + vertexBytes, indexData, indexBytes);
+			}
+			return vertexBytes + indexBytes;
+		}
+	};
+
+	const char* names[] = { "obj", "glb" };
+	std::vector<unsigned char> staging;
+	for (int format = 0; format < 2; format++)
+	{
+		const char* sourcePath = sourcePaths[format].c_str();
+		const char* cachePath = cachePaths[format].c_str();
+		std::remove(cachePath);
+
+		// First launch imports the source and writes the cache
+		MeshImporter importer;
+		MeshCache cache;
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		bool built = openMeshCache(sourcePath, cachePath, cache, importer);
+		double buildTime = elapsedMilliseconds(start);
+		cache.Close();
+
+		// Importing and optimizing the source every launch, the mesh drawn with 32-bit indices as it would be without a cache
+		double importTimes[2] = {};
+		bool evicted = true;
+		ImportedMesh mesh;
+		for (int warm = 0; warm < 2; warm++)
+		{
+			if (!warm)
+				evicted = evictFileCache(sourcePath) && evicted;
+			start = std::chrono::high_resolution_clock::now();
+			importOptimizedMesh(importer, sourcePath, mesh);
+			Startup::Upload(hasContext, ImportVertexFormat, mesh.vertices.data(), (unsigned int)mesh.vertices.size(), mesh.indices.data(),
+				(unsigned int)mesh.indices.size(), GL_UNSIGNED_INT, staging);
+			importTimes[warm] = elapsedMilliseconds(start);
+		}
+
+		// Mapping the cache, which is still current
+		double cacheTimes[2] = {};
+		size_t uploaded = 0;
+		bool current = false;
+		for (int warm = 0; warm < 2; warm++)
+		{
+			if (!warm)
+				evicted = evictFileCache(cachePath) && evicted;
+			start = std::chrono::high_resolution_clock::now();
+			current = openMeshCache(sourcePath, cachePath, cache, importer) && cache.MeshCount() == 1;
+			if (current)
+			{
+				const MeshCacheEntry& entry = cache.entries[0];
+				uploaded = Startup::Upload(hasContext, entry.format, cache.Vertices(0), entry.vertexCount, cache.Indices(0), entry.indexCount,
+					entry.indexType, staging);
+			}
+			cacheTimes[warm] = elapsedMilliseconds(start);
+			if (!warm)
+				cache.Close();
+		}
+
+		// The cache must hold exactly what the import produced
+		unsigned int mismatches = 0;
+		if (current)
+		{
+			const MeshCacheEntry& entry = cache.entries[0];
+			mismatches += entry.vertexCount != mesh.vertices.size() || entry.indexCount != mesh.indices.size()
+				|| memcmp(cache.Vertices(0), mesh.vertices.data(), mesh.vertices.size() * sizeof(ImportVertex)) != 0;
+			const unsigned int* cachedIndices = (const unsigned int*)cache.Indices(0);
+			for (unsigned int i = 0; entry.indexType == GL_UNSIGNED_INT && i < entry.indexCount && i < mesh.indices.size(); i++)
+				mismatches += cachedIndices[i] != mesh.indices[i];
+		}
+		size_t cacheSize = cache.file.size;
+		cache.Close();
+
+		std::cout << "MeshCache " << names[format] << " source " << importer.bytesRead / 1048576.0 << " MB, cache " << cacheSize / 1048576.0
+			<< " MB (" << uploaded / 1048576.0 << " MB " << (hasContext ? "uploaded" : "copied") << ") | first launch " << (built ? buildTime : -1.0)
+			<< " ms | import cold " << importTimes[0] << " ms, warm " << importTimes[1] << " ms | cache cold " << cacheTimes[0] << " ms, warm "
+			<< cacheTimes[1] << " ms (" << importTimes[1] / cacheTimes[1] << "x) | " << (evicted ? "" : "cold runs not evicted, ")
+			<< (current ? "" : "cache not used, ") << "mismatches " << mismatches << std::endl;
+		std::remove(sourcePath);
+		std::remove(cachePath);
+	}
+}
+
+/* Reads a shader sized text file and a 64 MB one line by line as readFile used to, whole with one
+   read, mapped and through a ResourceCache, each followed by a pass over every byte so mapped pages
+   are really read. Then times cached lookups and checks the shaders resolve from here */
+void benchmarkResources()
+{
+	struct Reading
+	{
+		// The old readFile: a line at a time, with a newline added after the last line
+		static std::string ByLine(const char* filePath)
+		{
+			std::string content;
+			std::ifstream fileStream(filePath, std::ios::in);
+			std::string line = "";
+			while (!fileStream.eof()) {
+				std::getline(fileStream, line);
+				content.append(line + "\n");
+			}
+			return content;
+		}
+
+		static glm::uint64 Sum(const char* data, size_t size)
+		{
+			glm::uint64 sum = 0;
+			for (size_t i = 0; i < size; i++)
+				sum += (unsigned char)data[i];
+			return sum;
+		}
+	};
+
+	const size_t sizes[] = { 24 * 1024, 64 * 1024 * 1024 };
+	const int repeats[] = { 200, 2 };
+	const char* names[] = { "shader", "large" };
+	for (int f = 0; f < 2; f++)
+	{
+		// Lines of varying length, as in source files
+		std::string text;
+		text.reserve(sizes[f] + 128);
+		char line[128];
+		for (unsigned int l = 0; text.size() < sizes[f]; l++)
+		{
+			snprintf(line, sizeof(line), "%*svec3 value%u = vec3(%u.0, %u.5, 0.25); // %u\n", (int)(l % 4) * 4, "", l, l % 97, l % 13, l * 2654435761u);
+			text += line;
+		}
+		std::string filePath = temporaryFilePath(f ? "benchmark_resource_large.txt" : "benchmark_resource_shader.txt");
+		std::ofstream(filePath.c_str(), std::ios::out | std::ios::binary).write(text.data(), text.size());
+		glm::uint64 expectedSum = Reading::Sum(text.data(), text.size());
+		std::string content;
+		readFile(filePath.c_str(), content);
+
+		// Each way of reading, the file warm in the operating system's cache
+		double times[3] = {};
+		unsigned int mismatches = 0;
+		for (int method = 0; method < 3; method++)
+		{
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			for (int r = 0; r < repeats[f]; r++)
+			{
+				bool same = false;
+				if (method == 0)
+				{
+					std::string byLine = Reading::ByLine(filePath.c_str());
+					same = Reading::Sum(byLine.data(), byLine.size()) == expectedSum + '\n' && byLine.compare(0, text.size(), text) == 0;
+				}
+				else if (method == 1)
+				{
+					same = readFile(filePath.c_str(), content) && Reading::Sum(content.data(), content.size()) == expectedSum && content == text;
+				}
+				else
+				{
+					MappedFile mapping;
+					same = mapping.Open(filePath.c_str()) && Reading::Sum(mapping.data, mapping.size) == expectedSum
+						&& mapping.size == text.size() && memcmp(mapping.data, text.data(), text.size()) == 0;
+				}
+				mismatches += !same;
+			}
+			times[method] = elapsedMilliseconds(start) / repeats[f];
+		}
+
+		// Through a cache: the first load, then lookups
+		const int lookups = 100000;
+		ResourceCache cache;
+		ResourceView view;
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		mismatches += !cache.Load(filePath, view) || Reading::Sum(view.data, view.size) != expectedSum;
+		double firstTime = elapsedMilliseconds(start);
+		start = std::chrono::high_resolution_clock::now();
+		for (int l = 0; l < lookups; l++)
+			mismatches += !cache.Load(filePath, view) || view.size != text.size();
+		double lookupTime = elapsedMilliseconds(start) * 1000.0 / lookups;
+
+		double megabytes = text.size() / 1048576.0;
+		std::cout << "Resources " << names[f] << " " << text.size() / 1024 << " KB | by line " << times[0] << " ms (" << megabytes * 1000.0 / times[0]
+			<< " MB/s) | one read " << times[1] << " ms (" << megabytes * 1000.0 / times[1] << " MB/s) | mapped " << times[2] << " ms ("
+			<< megabytes * 1000.0 / times[2] << " MB/s) | cache " << (cache.stats.filesMapped ? "mapped" : "read") << " " << firstTime
+			<< " ms, lookup " << lookupTime << " us, " << cache.stats.hits << " hits | mismatches " << mismatches << std::endl;
+		std::remove(filePath.c_str());
+	}
+
+	// The shaders, wherever this is run from
+	const char* shaders[] = { "shaders/vertex0.vert", "shaders/fragment0.frag", "shaders/vertex0_instanced.vert", "shaders/fragment0_instanced.frag",
+		"shaders/vertex0_indirect.vert", "shaders/vertex0_quantized.vert", "shaders/vertex0_grid.vert", "shaders/fragment0_grid.frag",
+		"shaders/vertex0_terrain.vert" };
+	ResourceCache cache;
+	ResourceView view;
+	unsigned int found = 0;
+	for (size_t s = 0; s < sizeof(shaders) / sizeof(shaders[0]); s++)
+		found += cache.Load(shaders[s], view) && view.size > 0;
+	std::cout << "Resources root " << cache.Root() << " | " << found << " of " << sizeof(shaders) / sizeof(shaders[0]) << " shaders, "
+		<< cache.stats.bytesRead << " bytes in " << cache.stats.loadMilliseconds << " ms" << std::endl;
+}
+
+/* Pushes 1M tokens through an AssetQueue from three threads while the main thread pops them, then
+   loads eight generated meshes of 23k vertices: synchronously in one frame, streamed from their OBJ
+   sources and streamed from their mesh caches, at 60 frames per second. Without a context only the
+   loading is measured */
+void benchmarkAssetStreaming(bool hasContext)
+{
+	// Queue: every token must come out exactly once
+	const unsigned int tokenCount = 1000000, producerCount = 3;
+	std::vector<unsigned char> tokens(tokenCount);
+	std::vector<unsigned char> seen(tokenCount, 0);
+	AssetQueue queue;
+	queue.Create(1024);
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	std::vector<std::thread> producers;
+	for (unsigned int p = 0; p < producerCount; p++)
+	{
+		producers.push_back(std::thread([&queue, &tokens, p]() {
+			// Tokens are addresses in a byte array, never dereferenced
+			unsigned char* base = tokens.data();
+			for (unsigned int t = p; t < tokenCount; t += producerCount)
+			{
+				while (!queue.Push((StreamedAsset*)(base + t)))
+					std::this_thread::yield();
+			}
+		}));
+	}
+	unsigned int popped = 0, duplicates = 0;
+	while (popped < tokenCount)
+	{
+		StreamedAsset* token = queue.Pop();
+		if (!token)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+		size_t t = (unsigned char*)token - tokens.data();
+		duplicates += t >= tokenCount || seen[t]++;
+		popped++;
+	}
+	for (unsigned int p = 0; p < producerCount; p++)
+		producers[p].join();
+	double queueTime = elapsedMilliseconds(start);
+	std::cout << "AssetStreaming queue " << tokenCount << " tokens from " << producerCount << " threads " << queueTime << " ms ("
+		<< queueTime * 1e6 / tokenCount << " ns/token), lost " << (tokenCount - (unsigned int)std::count(seen.begin(), seen.end(), 1))
+		<< ", duplicated " << duplicates << ", left " << (queue.Pop() != nullptr) << std::endl;
+
+	// Meshes
+	const unsigned int meshCount = 8, rings = 150, segments = 150;
+	std::vector<glm::vec3> positions, normals;
+	std::vector<unsigned int> indices;
+	buildSphere(rings, segments, 0.03f, positions, normals, indices);
+	std::vector<std::string> sourcePaths, cachePaths;
+	size_t sourceBytes = 0;
+	for (unsigned int m = 0; m < meshCount; m++)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "benchmark_stream%u.obj", m);
+		sourcePaths.push_back(temporaryFilePath(name));
+		cachePaths.push_back(sourcePaths.back() + ".mesh");
+		writeSyntheticObj(sourcePaths[m].c_str(), rings, segments, positions, normals);
+		std::remove(cachePaths[m].c_str());
+		glm::uint64 size, writeTime;
+		if (fileStamp(sourcePaths[m].c_str(), size, writeTime))
+			sourceBytes += (size_t)size;
+	}
+
+	// Everything on the render thread, as main used to: one long frame
+	GeometryRegistry registry;
+	MeshImporter importer;
+	std::vector<ImportedMesh> meshes(meshCount);
+	std::vector<Geometry> geometries(meshCount);
+	start = std::chrono::high_resolution_clock::now();
+	for (unsigned int m = 0; m < meshCount; m++)
+	{
+		importOptimizedMesh(importer, sourcePaths[m].c_str(), meshes[m]);
+		if (hasContext)
+			registry.Add(geometries[m], ImportVertexFormat, meshes[m].vertices.data(), (unsigned int)meshes[m].vertices.size(),
+				meshes[m].indices.data(), (unsigned int)meshes[m].indices.size());
+	}
+	if (hasContext)
+		glFinish();
+	double synchronousTime = elapsedMilliseconds(start);
+	if (hasContext)
+		registry.Destroy();
+	std::cout << "AssetStreaming meshes=" << meshCount << " (" << sourceBytes / 1048576.0 << " MB of obj) | synchronous " << synchronousTime
+		<< " ms in one frame";
+
+	// Streamed twice: the first run imports the sources and writes the caches, the second maps the caches
+	const char* runNames[] = { "from sources", "from caches" };
+	for (int run = 0; run < 2; run++)
+	{
+		AssetStreamer streamer;
+		streamer.Create(registry, 0, hasContext);
+		start = std::chrono::high_resolution_clock::now();
+		for (unsigned int m = 0; m < meshCount; m++)
+			streamer.Load(sourcePaths[m], cachePaths[m], glm::translate(glm::mat4(1.0f), glm::vec3(0.1f * m, 0.0f, 0.0f)));
+
+		unsigned int frames = 0, slices = 0;
+		double slowestFrame = 0.0;
+		for (;;)
+		{
+			std::chrono::high_resolution_clock::time_point frameStart = std::chrono::high_resolution_clock::now();
+			streamer.Update();
+			if (hasContext)
+				glFinish();
+			slowestFrame = std::max(slowestFrame, elapsedMilliseconds(frameStart));
+			slices += streamer.stats.frameSlices;
+			frames++;
+			bool done = hasContext ? streamer.Idle() : streamer.uploads.size() + streamer.stats.assetsFailed == meshCount;
+			if (done || elapsedMilliseconds(start) > 60000.0)
+				break;
+
+			// The rest of a 60Hz frame goes to the loaders
+			double frameTime = elapsedMilliseconds(frameStart);
+			if (frameTime < 1000.0 / 60.0)
+				std::this_thread::sleep_for(std::chrono::microseconds((int)((1000.0 / 60.0 - frameTime) * 1000.0)));
+		}
+		double loadTime = elapsedMilliseconds(start);
+
+		// Read the meshes back and compare them with the synchronous import
+		unsigned int mismatches = 0;
+		double decodeTime = 0.0;
+		for (unsigned int m = 0; m < meshCount; m++)
+		{
+			StreamedAsset& asset = streamer.assets[m];
+			decodeTime += asset.decodeTime;
+			if (!hasContext)
+			{
+				mismatches += !asset.decoded || asset.vertexCount != meshes[m].vertices.size()
+					|| memcmp(asset.vertexData, meshes[m].vertices.data(), asset.VertexBytes()) != 0;
+				continue;
+			}
+			if (asset.state != AssetResident || asset.geometry.vertexCount != meshes[m].vertices.size()
+				|| asset.geometry.indexCount != meshes[m].indices.size())
+			{
+				mismatches++;
+				continue;
+			}
+			std::vector<ImportVertex> vertices(asset.geometry.vertexCount);
+			glState.BindBuffer(GL_COPY_READ_BUFFER, asset.geometry.vbo);
+			glGetBufferSubData(GL_COPY_READ_BUFFER, (size_t)asset.geometry.baseVertex * sizeof(ImportVertex), vertices.size() * sizeof(ImportVertex),
+				vertices.data());
+			std::vector<unsigned char> gpuIndices((size_t)asset.geometry.indexCount * indexTypeSize(asset.geometry.indexType));
+			glState.BindBuffer(GL_COPY_READ_BUFFER, asset.geometry.ebo);
+			glGetBufferSubData(GL_COPY_READ_BUFFER, (size_t)asset.geometry.firstIndex * indexTypeSize(asset.geometry.indexType), gpuIndices.size(),
+				gpuIndices.data());
+			mismatches += memcmp(vertices.data(), meshes[m].vertices.data(), vertices.size() * sizeof(ImportVertex)) != 0;
+			for (unsigned int i = 0; i < asset.geometry.indexCount; i++)
+			{
+				unsigned int index = asset.geometry.indexType == GL_UNSIGNED_SHORT ? ((unsigned short*)gpuIndices.data())[i] : ((unsigned int*)gpuIndices.data())[i];
+				if (index != meshes[m].indices[i])
+				{
+					mismatches++;
+					break;
+				}
+			}
+		}
+		std::cout << " | " << runNames[run] << " on " << streamer.loaders.size() << " loaders: " << frames << " frames, " << loadTime
+			<< " ms to " << (hasContext ? "resident" : "decoded") << ", decode " << decodeTime / meshCount << " ms/mesh";
+		if (hasContext)
+			std::cout << ", " << slices << " slices, upload at most " << streamer.stats.maxFrameMilliseconds << " ms/frame (budget "
+				<< streamer.uploadBudget / 1024 << " KB, " << streamer.uploadMilliseconds << " ms), slowest frame " << slowestFrame << " ms";
+		std::cout << ", mismatches " << mismatches;
+		streamer.Destroy();
+	}
+	std::cout << std::endl;
+	if (hasContext)
+		registry.Destroy();
+	for (unsigned int m = 0; m < meshCount; m++)
+	{
+		std::remove(sourcePaths[m].c_str());
+		std::remove(cachePaths[m].c_str());
+	}
+}
+
+/* The line buffer grid at 100 to 10000 cells a side against the procedural grid: memory, draw time and
+   the share of the screen their lines cover, from the default camera and from 20 times further away */
+void benchmarkGrid(bool hasContext)
+{
+	static const glm::vec4 gridColour(0.7f, 0.7f, 0.7f, 1.0f);
+	const unsigned int cellCounts[] = { 100, 1000, 10000 };
+	const float heights[] = { 0.075f, 1.5f };
+	const int drawCount = 20;
+
+	struct Frame
+	{
+		static void Camera(float height)
+		{
+			worldMatrix = glm::mat4(1.0f);
+			viewMatrix = glm::lookAt(glm::vec3(0.0f, height, height * 2.0f / 3.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+			updateFrameData(viewMatrix * worldMatrix, projectionMatrix);
+		}
+
+		// Fraction of the pixels the grid drew to
+		static double Coverage()
+		{
+			std::vector<unsigned char> pixels(1024 * 768 * 4);
+			glReadPixels(0, 0, 1024, 768, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+			size_t covered = 0;
+			for (size_t p = 0; p < pixels.size(); p += 4)
+				covered += pixels[p] != 0;
+			return (double)covered / (1024 * 768);
+		}
+	};
+
+	bool drawing = hasContext && proceduralGridEnabled;
+	if (drawing)
+	{
+		useDefaultCamera();
+		glState.Enable(GL_DEPTH_TEST);
+	}
+	std::cout << "Grid procedural: 0 bytes, 1 draw";
+	for (int h = 0; drawing && h < 2; h++)
+	{
+		Frame::Camera(heights[h]);
+		glFinish();
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		for (int d = 0; d < drawCount; d++)
+		{
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			drawProceduralGrid(gridColour);
+		}
+		glFinish();
+		double drawTime = elapsedMilliseconds(start) / drawCount;
+		std::cout << " | height " << heights[h] << ": " << drawTime << " ms, covers " << Frame::Coverage() * 100.0 << "%";
+	}
+	std::cout << std::endl;
 
-/* Sets the projection matrix uniform for the given shader program */
-void setProjectionMatrix(int shaderProgram, glm::mat4 projectionMatrix)
-{
-	glUseProgram(shaderProgram);
-	GLuint projectionMatrixLocation = glGetUniformLocation(shaderProgram, "projectionMatrix");
-	glUniformMatrix4fv(projectionMatrixLocation, 1, GL_FALSE, &projectionMatrix[0][0]);
+	// The buffer grids replace the application's for the measurement
+	if (hasContext)
+		geometryRegistry.Remove(Grid);
+	for (unsigned int c = 0; c < 3; c++)
+	{
+		unsigned int cells = cellCounts[c];
+		std::cout << "Grid buffer " << cells << "x" << cells << ": " << (cells + 1) * 4 * sizeof(glm::uint64) / 1024.0 << " KB";
+		if (!hasContext)
+		{
+			std::cout << std::endl;
+			continue;
+		}
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		createGeometryGrid(cells);
+		glFinish();
+		std::cout << ", built in " << elapsedMilliseconds(start) << " ms";
+		for (int h = 0; h < 2; h++)
+		{
+			Frame::Camera(heights[h]);
+			glFinish();
+			start = std::chrono::high_resolution_clock::now();
+			for (int d = 0; d < drawCount; d++)
+			{
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+				setMvpMatrix(shaderProgram, projectionMatrix * viewMatrix * worldMatrix);
+				setFragmentColour(shaderProgram, gridColour);
+				glState.BindVertexArray(Grid.vao);
+				drawGeometry(Grid, GL_LINES);
+			}
+			glFinish();
+			double drawTime = elapsedMilliseconds(start) / drawCount;
+			std::cout << " | height " << heights[h] << ": " << drawTime << " ms, covers " << Frame::Coverage() * 100.0 << "%";
+		}
+		std::cout << std::endl;
+		geometryRegistry.Remove(Grid);
+	}
+	if (hasContext)
+	{
+		createGeometryGrid(gridCells);
+		useDefaultCamera();
+	}
 }
 
-/* Sets the view matrix uniform for the given shader program */
-void setViewMatrix(int shaderProgram, glm::mat4 viewMatrix)
+/* Vertices along the edges of the selected patches that, once morphed as the vertex shader does, are off
+   the edge of the patch next to them: the cracks a viewer would see. Needs the chunks' vertices, so a
+   streamer created without a registry */
+unsigned int countTerrainCracks(const TerrainStreamer& streamer)
 {
-	glUseProgram(shaderProgram);
-	GLuint viewMatrixLocation = glGetUniformLocation(shaderProgram, "viewMatrix");
-	glUniformMatrix4fv(viewMatrixLocation, 1, GL_FALSE, &viewMatrix[0][0]);
-}
+	// A side of a patch: where it lies in level 0 samples, and its morphed vertices in order along it
+	struct Side
+	{
+		int fixed;
+		int from;
+		int step;
+		std::vector<glm::vec3> points;
 
-/* Sets the world matrix uniform for the given shader program */
-void setWorldMatrix(int shaderProgram, glm::mat4 worldMatrix)
-{
-	glUseProgram(shaderProgram);
-	GLuint worldMatrixLocation = glGetUniformLocation(shaderProgram, "worldMatrix");
-	glUniformMatrix4fv(worldMatrixLocation, 1, GL_FALSE, &worldMatrix[0][0]);
-}
+		// Whether point lies on the polyline, at its coordinate along the side
+		bool Holds(const glm::vec3& point, int along) const
+		{
+			for (size_t k = 0; k + 1 < points.size(); k++)
+			{
+				const glm::vec3& a = points[k];
+				const glm::vec3& b = points[k + 1];
+				if (b[along] <= a[along] || point[along] < a[along] || point[along] > b[along])
+					continue;
+				glm::vec3 onSide = glm::mix(a, b, (point[along] - a[along]) / (b[along] - a[along]));
+				return glm::distance(onSide, point) < 1e-5f;
+			}
+			return false;
+		}
+	};
 
-void setTransformMatrix(int shaderProgram, glm::mat4 transformMatrix)
-{
-	glUseProgram(shaderProgram);
-	GLuint transformMatrixLocation = glGetUniformLocation(shaderProgram, "transformMatrix");
-	glUniformMatrix4fv(transformMatrixLocation, 1, GL_FALSE, &transformMatrix[0][0]);
-}
+	// West, east, south and north sides of every patch
+	const TerrainPatch* patches = streamer.patches.data();
+	size_t patchCount = streamer.patches.size();
+	std::vector<Side> sides(patchCount * 4);
+	for (size_t p = 0; p < patchCount; p++)
+	{
+		const TerrainChunk& chunk = *patches[p].chunk;
+		int i0, j0, size;
+		streamer.PatchGrid(patches[p], i0, j0, size);
+		int step = 1 << chunk.level, row = streamer.cells + 1;
+		int sampleX = (chunk.x * (int)streamer.cells + i0) * step, sampleZ = (chunk.z * (int)streamer.cells + j0) * step;
+		glm::vec2 morphRange = streamer.MorphRange(chunk.level);
+		for (int s = 0; s < 4; s++)
+		{
+			Side& side = sides[p * 4 + s];
+			side.fixed = s < 2 ? sampleX + (s & 1) * size * step : sampleZ + (s & 1) * size * step;
+			side.from = s < 2 ? sampleZ : sampleX;
+			side.step = step;
+			for (int k = 0; k <= size; k++)
+			{
+				int i = s < 2 ? i0 + (s & 1) * size : i0 + k;
+				int j = s < 2 ? j0 + k : j0 + (s & 1) * size;
+				side.points.push_back(morphTerrainVertex(chunk.vertices[j * row + i], streamer.eye, morphRange));
+			}
+		}
+	}
 
-void setFragmentColour(int shaderProgram, glm::vec4 fragmentColour)
-{
-	glUseProgram(shaderProgram);
-	GLuint fragmentColourLocation = glGetUniformLocation(shaderProgram, "fragmentColour");
-	glUniform4fv(fragmentColourLocation, 1, &fragmentColour[0]);
+	// Each side against the opposite sides of the other patches on the same line
+	unsigned int cracks = 0;
+	for (size_t a = 0; a < sides.size(); a++)
+	{
+		const Side& side = sides[a];
+		int along = (a & 3) < 2 ? 2 : 0;
+		for (size_t b = 0; b < sides.size(); b++)
+		{
+			const Side& other = sides[b];
+			if (b / 4 == a / 4 || (b & 3) != ((a & 3) ^ 1) || other.fixed != side.fixed)
+				continue;
+			int low = std::max(side.from, other.from);
+			int high = std::min(side.from + (int)(side.points.size() - 1) * side.step, other.from + (int)(other.points.size() - 1) * other.step);
+			for (int k = 0; low < high && k < (int)side.points.size(); k++)
+			{
+				int sample = side.from + k * side.step;
+				if (sample >= low && sample <= high && !other.Holds(side.points[k], along))
+					cracks++;
+			}
+		}
+	}
+	return cracks;
 }
 
-// Hierarchical Model Structure
-// ---------------------------------
-struct HierarchicalModel
+/* Generates a block of chunks on one and on every hardware thread, checks both hash the same and that
+   neighbours, and parents and children, share their edge points bit for bit. Then streams the terrain
+   along a path without a context, checking the morphed patches meet without cracks wherever it
+   settles, and with a context reports the update time per frame, draw time and resident memory */
+void benchmarkTerrain(bool hasContext)
 {
-	HierarchicalModel* Parent;
-	std::vector<HierarchicalModel*> Children;
-	glm::mat4 transform;
-	glm::vec4 fragmentColour;
-	glm::vec3 center;
+	TerrainNoise noise;
+	const unsigned int cells = 32;
+	const float leafSize = 0.08f;
+	const int leafSide = 16, parentSide = 8;
 
-	HierarchicalModel(HierarchicalModel* parent)
+	// Level 0 chunks around the origin, then their parents
+	std::vector<TerrainChunk> chunks(leafSide * leafSide + parentSide * parentSide);
+	for (int c = 0; c < (int)chunks.size(); c++)
 	{
-		Parent = parent;
-		transform = glm::mat4(1.0f);
-		fragmentColour = glm::vec4(1.0f);
+		bool leaf = c < leafSide * leafSide;
+		int side = leaf ? leafSide : parentSide, index = leaf ? c : c - leafSide * leafSide;
+		chunks[c].level = leaf ? 0 : 1;
+		chunks[c].x = index % side - side / 2;
+		chunks[c].z = index / side - side / 2;
 	}
+	std::vector<TerrainChunk*> jobs;
+	for (size_t c = 0; c < chunks.size(); c++)
+		jobs.push_back(&chunks[c]);
 
-	// Add a child to the current node
-	void AddChild(HierarchicalModel* child)
+	unsigned int threadCounts[] = { 1, std::max(1u, std::thread::hardware_concurrency()) };
+	glm::uint64 hashes[2];
+	std::cout << "Terrain generate " << chunks.size() << " chunks of " << cells + 1 << "x" << cells + 1 << " vertices, " << noise.octaves << " octaves";
+	for (int t = 0; t < 2; t++)
 	{
-		Children.push_back(child);
+		for (size_t c = 0; c < chunks.size(); c++)
+			std::vector<TerrainVertex>().swap(chunks[c].vertices);
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		generateTerrainChunks(noise, cells, leafSize, jobs, threadCounts[t]);
+		double time = elapsedMilliseconds(start);
+
+		// FNV-1a over every vertex, in chunk order
+		hashes[t] = 14695981039346656037ull;
+		for (size_t c = 0; c < chunks.size(); c++)
+		{
+			const unsigned char* bytes = (const unsigned char*)chunks[c].vertices.data();
+			for (size_t b = 0; b < chunks[c].vertices.size() * sizeof(TerrainVertex); b++)
+				hashes[t] = (hashes[t] ^ bytes[b]) * 1099511628211ull;
+		}
+		double chunksPerSecond = chunks.size() * 1000.0 / time;
+		std::cout << " | " << threadCounts[t] << " threads " << time << " ms, " << chunksPerSecond << " chunks/s, "
+			<< chunksPerSecond / threadCounts[t] << " per core";
 	}
+	std::cout << std::endl;
 
-	// Transformations are applied recursively through the children
-	void ApplyTransform(glm::mat4 t)
+	// Neighbours share whole vertices along their edges, children the positions of their even vertices with their parent
+	unsigned int mismatches = 0, row = cells + 1, half = cells / 2;
+	for (int z = 0; z < leafSide; z++)
 	{
-		if (Children.size() > 0)
+		for (int x = 0; x < leafSide; x++)
 		{
-			for (int i = 0; i < Children.size(); i++)
+			const TerrainVertex* chunk = chunks[z * leafSide + x].vertices.data();
+			for (unsigned int k = 0; k <= cells; k++)
 			{
-				Children[i]->ApplyTransform(t);
+				if (x + 1 < leafSide)
+					mismatches += memcmp(&chunk[k * row + cells], &chunks[z * leafSide + x + 1].vertices[k * row], sizeof(TerrainVertex)) != 0;
+				if (z + 1 < leafSide)
+					mismatches += memcmp(&chunk[cells * row + k], &chunks[(z + 1) * leafSide + x].vertices[k], sizeof(TerrainVertex)) != 0;
+			}
+			const TerrainVertex* parent = chunks[leafSide * leafSide + z / 2 * parentSide + x / 2].vertices.data();
+			for (unsigned int j = 0; j <= cells; j += 2)
+			{
+				for (unsigned int i = 0; i <= cells; i += 2)
+				{
+					const TerrainVertex& onParent = parent[((z & 1) * half + j / 2) * row + (x & 1) * half + i / 2];
+					mismatches += memcmp(&chunk[j * row + i].position, &onParent.position, sizeof(glm::vec3)) != 0;
+				}
 			}
 		}
-		transform = t * transform;
 	}
+	std::cout << "Terrain hash " << std::hex << hashes[0] << std::dec << ", same on " << threadCounts[1] << " threads "
+		<< (hashes[0] == hashes[1] ? "yes" : "no") << ", edge mismatches " << mismatches << std::endl;
 
-	// Get current node's transform
-	glm::mat4 GetTransform()
+	// Stream along a path, waiting at each stop for the terrain to settle. Without a registry the
+	// chunks keep their vertices, for the crack check
+	const glm::vec2 stops[] = { glm::vec2(0.0f), glm::vec2(0.6f, -0.4f), glm::vec2(3.0f, 1.0f), glm::vec2(-2.0f, 4.0f) };
+	const float eyeHeight = 0.1f;
+	for (int pass = 0; pass < (hasContext ? 2 : 1); pass++)
 	{
-		return transform;
+		bool drawing = pass == 1;
+		TerrainStreamer streamer;
+		streamer.Create(drawing ? &geometryRegistry : nullptr);
+		if (drawing)
+		{
+			glState.Enable(GL_DEPTH_TEST);
+			glState.Enable(GL_CULL_FACE);
+		}
+		std::cout << "Terrain streaming " << (drawing ? "uploaded" : "on the CPU");
+		for (int s = 0; s < 4; s++)
+		{
+			glm::vec3 eye(stops[s].x, streamer.noise.Height(stops[s].x, stops[s].y) + eyeHeight, stops[s].y);
+			worldMatrix = glm::mat4(1.0f);
+			viewMatrix = glm::lookAt(eye, eye + glm::vec3(1.0f, -0.3f, 1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+			Frustum frustum = extractFrustum(projectionMatrix * viewMatrix);
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			unsigned int frames = 0;
+			streamer.stats.maxFrameMilliseconds = 0.0;
+			do
+			{
+				streamer.Update(eye, drawing ? &frustum : nullptr);
+				if (drawing)
+				{
+					updateFrameData(viewMatrix, projectionMatrix);
+					glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+					streamer.Draw(terrainShaderProgram);
+					glFinish();
+				}
+				else
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				frames++;
+			} while (!streamer.Idle() && frames < 10000);
+			std::cout << " | stop " << s << ": settled in " << frames << " frames, " << elapsedMilliseconds(start) << " ms, update at most "
+				<< streamer.stats.maxFrameMilliseconds << " ms, " << streamer.stats.chunksResident << " chunks "
+				<< streamer.stats.bytesResident / (1024.0 * 1024.0) << " MB, " << streamer.stats.patchesDrawn << " patches";
+			if (!drawing)
+				std::cout << ", cracks " << countTerrainCracks(streamer);
+		}
+		if (drawing)
+		{
+			const int drawCount = 20;
+			glFinish();
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			for (int d = 0; d < drawCount; d++)
+			{
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+				streamer.Draw(terrainShaderProgram);
+			}
+			glFinish();
+			std::cout << " | draw " << elapsedMilliseconds(start) / drawCount << " ms";
+		}
+		std::cout << " | generated " << streamer.stats.chunksGenerated << " chunks in " << streamer.stats.generateMilliseconds << " ms" << std::endl;
+		streamer.Destroy();
 	}
+	if (hasContext)
+		useDefaultCamera();
+}
 
-	void SetFragmentColour(glm::vec4 colour)
+/* Culls a field of 1M objects with random rotations and scales: bounds propagation, the scalar test
+   and the SIMD kernel, checked against each other */
+void benchmarkFrustumCulling()
+{
+	const unsigned int objectCount = 1000000;
+	const unsigned int side = 1000;
+	SceneHierarchy scene;
+	scene.Reserve(objectCount);
+	srand(12345);
+	for (unsigned int i = 0; i < objectCount; i++)
 	{
-		fragmentColour = colour;
+		NodeHandle node = scene.AddNode(InvalidNode);
+		scene.SetPosition(node, glm::vec3(((i % side) - side / 2.0f) * GridUnit * 4, 0.0f, ((i / side) - side / 2.0f) * GridUnit * 4));
+		scene.SetRotation(node, glm::angleAxis((float)rand() / RAND_MAX * 6.2831853f, glm::vec3(0.0f, 1.0f, 0.0f)));
+		scene.SetScale(node, glm::vec3(1.0f + (float)rand() / RAND_MAX * 3.0f));
 	}
 
-	// Get current node's fragment colour
-	glm::vec4 GetFragmentColour()
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	scene.UpdateWorldTransforms();
+	double updateTime = elapsedMilliseconds(start);
+
+	// main's camera, pulled back so the frustum covers part of the field
+	glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 2.0f, 6.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	glm::mat4 projection = glm::perspective(70.0f, 1024.0f / 768.0f, 0.01f, 10.0f);
+	Frustum frustum = extractFrustum(projection * view);
+
+	start = std::chrono::high_resolution_clock::now();
+	unsigned int scalarVisible = 0;
+	for (unsigned int i = 0; i < objectCount; i++)
 	{
-		return fragmentColour;
+		BoundingVolume bounds = scene.GetWorldBounds(scene.handle[i]);
+		scalarVisible += frustumIntersectsBox(frustum, bounds.center, bounds.extent);
 	}
+	double scalarTime = elapsedMilliseconds(start);
 
-	// Draw Hierarchy
-	void Draw(unsigned int shaderProgram, unsigned int renderMode)
+	start = std::chrono::high_resolution_clock::now();
+	CullStats stats = scene.Cull(frustum);
+	double kernelTime = elapsedMilliseconds(start);
+
+	start = std::chrono::high_resolution_clock::now();
+	unsigned int sphereVisible = 0;
+	for (unsigned int i = 0; i < objectCount; i++)
 	{
-		if (Children.size() > 0)
-		{
-			glUseProgram(shaderProgram);
-			glBindVertexArray(Cube.vao);
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, Cube.ebo);
+		glm::vec3 center(scene.worldBoxes.centerX[i], scene.worldBoxes.centerY[i], scene.worldBoxes.centerZ[i]);
+		sphereVisible += frustumIntersectsSphere(frustum, center, scene.worldRadius[i]);
+	}
+	double sphereTime = elapsedMilliseconds(start);
 
-			for (int i = 0; i < Children.size(); i++)
+	std::cout << "FrustumCulling objects=" << objectCount << " visible " << stats.visible << ", culled " << stats.culled
+		<< " | bounds update " << updateTime << " ms, scalar boxes " << scalarTime << " ms (" << scalarVisible << " visible)"
+		<< ", " << (USE_SSE ? "sse" : "scalar") << " kernel " << kernelTime << " ms"
+		<< ", spheres " << sphereTime << " ms (" << sphereVisible << " visible)" << std::endl;
+}
+
+/* Reference for benchmarkOcclusionCulling: rasterizes the 12 triangles of every box at full resolution
+   with a plain depth test, and flags the boxes owning at least one pixel. Boxes crossing the near plane
+   are flagged without being drawn */
+void rasterizeVisibleBoxes(const glm::mat4& viewProjection, const std::vector<BoundingVolume>& boxes, int width, int height,
+	std::vector<unsigned char>& visible)
+{
+	static const int faces[6][4] = { { 0, 1, 3, 2 }, { 4, 6, 7, 5 }, { 0, 4, 5, 1 }, { 2, 3, 7, 6 }, { 0, 2, 6, 4 }, { 1, 5, 7, 3 } };
+	std::vector<float> depth(width * height, 1.0f);
+	std::vector<unsigned int> owner(width * height, 0xFFFFFFFF);
+	visible.assign(boxes.size(), 0);
+	for (unsigned int i = 0; i < boxes.size(); i++)
+	{
+		glm::vec3 corners[8];
+		bool clipped = false;
+		for (int c = 0; c < 8; c++)
+		{
+			glm::vec3 corner = boxes[i].center + glm::vec3(c & 1 ? boxes[i].extent.x : -boxes[i].extent.x,
+				c & 2 ? boxes[i].extent.y : -boxes[i].extent.y, c & 4 ? boxes[i].extent.z : -boxes[i].extent.z);
+			glm::vec4 clip = viewProjection * glm::vec4(corner, 1.0f);
+			clipped |= clip.w <= 1e-5f || clip.z < -clip.w;
+			corners[c] = glm::vec3((clip.x / clip.w * 0.5f + 0.5f) * width, (clip.y / clip.w * 0.5f + 0.5f) * height, clip.z / clip.w * 0.5f + 0.5f);
+		}
+		if (clipped)
+		{
+			visible[i] = 1;
+			continue;
+		}
+		for (int f = 0; f < 6; f++)
+		{
+			for (int t = 0; t < 2; t++)
 			{
-				setTransformMatrix(shaderProgram, Children[i]->GetTransform());
-				setFragmentColour(shaderProgram, Children[i]->GetFragmentColour());
-				glDrawElements(renderMode, 36, GL_UNSIGNED_INT, nullptr);
+				glm::vec3 v0 = corners[faces[f][0]], v1 = corners[faces[f][1 + t]], v2 = corners[faces[f][2 + t]];
+				float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+				if (area == 0.0f)
+					continue;
+				int minX = std::max(0, (int)std::floor(std::min(v0.x, std::min(v1.x, v2.x))));
+				int maxX = std::min(width - 1, (int)std::ceil(std::max(v0.x, std::max(v1.x, v2.x))));
+				int minY = std::max(0, (int)std::floor(std::min(v0.y, std::min(v1.y, v2.y))));
+				int maxY = std::min(height - 1, (int)std::ceil(std::max(v0.y, std::max(v1.y, v2.y))));
+				for (int y = minY; y <= maxY; y++)
+				{
+					for (int x = minX; x <= maxX; x++)
+					{
+						glm::vec2 p(x + 0.5f, y + 0.5f);
+						float w0 = ((v2.x - v1.x) * (p.y - v1.y) - (v2.y - v1.y) * (p.x - v1.x)) / area;
+						float w1 = ((v0.x - v2.x) * (p.y - v2.y) - (v0.y - v2.y) * (p.x - v2.x)) / area;
+						float w2 = 1.0f - w0 - w1;
+						if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+							continue;
+						float z = w0 * v0.z + w1 * v1.z + w2 * v2.z;
+						if (z < depth[y * width + x])
+						{
+							depth[y * width + x] = z;
+							owner[y * width + x] = i;
+						}
+					}
+				}
 			}
 		}
 	}
-};
+	for (size_t p = 0; p < owner.size(); p++)
+	{
+		if (owner[p] != 0xFFFFFFFF)
+			visible[owner[p]] = 1;
+	}
+}
 
-/* Callback function for mouse controls */
-void mouseButtonCallback(GLFWwindow *window, int button, int action, int mods)
+/* Occlusion culls a city of blocks seen from street level: occluder rasterization and hierarchical
+   test times, and the occluded set checked against a full resolution reference render. A false cull
+   is a box the reference shows that the occlusion test hid. Returns false on any false cull, or when
+   the threaded result differs */
+bool benchmarkOcclusionCulling()
 {
-	double xPos, yPos;
-	glfwGetCursorPos(window, &xPos, &yPos);
-	if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE)
+	const unsigned int side = 200;
+	SceneHierarchy scene;
+	scene.Reserve(side * side);
+	srand(24680);
+	for (unsigned int i = 0; i < side * side; i++)
 	{
-		lastCursorPosY = yPos;
-		lastCursorPosX = xPos;
-		isLeftButtonPressed = false;
-		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
-		return;
+		// Every fourth row is a street of small objects, the others are blocks of varying height
+		bool street = (i / side) % 4 == 0;
+		float height = street ? 1.0f : 1.0f + (float)rand() / RAND_MAX * 6.0f;
+		NodeHandle node = scene.AddNode(InvalidNode);
+		scene.SetPosition(node, glm::vec3(((i % side) - side / 2.0f) * GridUnit * 2, 0.0f,
+			-((float)(i / side)) * GridUnit * 2));
+		scene.SetScale(node, street ? glm::vec3(0.5f) : glm::vec3(1.8f, height, 1.8f));
 	}
-	if (button == GLFW_MOUSE_BUTTON_LEFT && action== GLFW_PRESS)
+	scene.UpdateWorldTransforms();
+
+	glm::mat4 view = glm::lookAt(glm::vec3(0.0f, GridUnit * 5, GridUnit * 4), glm::vec3(0.0f, GridUnit * 2, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	glm::mat4 viewProjection = glm::perspective(70.0f, 1024.0f / 768.0f, 0.01f, 10.0f) * view;
+	Frustum frustum = extractFrustum(viewProjection);
+
+	OcclusionBuffer occlusion;
+	CullStats stats[2];
+	double cullTime[2];
+	for (int threaded = 0; threaded < 2; threaded++)
 	{
-		lastCursorPosY = yPos;
-		lastCursorPosX = xPos;
-		isLeftButtonPressed = true;
-		isRightButtonPressed = false;
-		isMiddleButtonPressed = false;
-		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
-		return;
+		occlusion.threadCount = threaded ? std::max(1u, std::thread::hardware_concurrency()) : 1;
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		scene.Cull(frustum);
+		stats[threaded] = scene.OcclusionCull(occlusion, viewProjection);
+		cullTime[threaded] = elapsedMilliseconds(start);
 	}
-	if (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_RELEASE)
+
+	// Reference render of every box inside the frustum
+	std::vector<BoundingVolume> boxes;
+	std::vector<unsigned int> nodes;
+	scene.Cull(frustum);
+	for (unsigned int i = 0; i < scene.Size(); i++)
 	{
-		lastCursorPosY = yPos;
-		lastCursorPosX = xPos;
-		isRightButtonPressed = false;
-		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
-		return;
+		if (scene.visible[i])
+		{
+			boxes.push_back(scene.GetWorldBounds(scene.handle[i]));
+			nodes.push_back(i);
+		}
 	}
-	if (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS)
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	std::vector<unsigned char> reference;
+	rasterizeVisibleBoxes(viewProjection, boxes, 1024, 768, reference);
+	double referenceTime = elapsedMilliseconds(start);
+
+	scene.OcclusionCull(occlusion, viewProjection);
+	unsigned int hidden = 0, falseCulls = 0;
+	for (size_t b = 0; b < boxes.size(); b++)
 	{
-		lastCursorPosY = yPos;
-		lastCursorPosX = xPos;
-		isLeftButtonPressed = false;
-		isRightButtonPressed = true;
-		isMiddleButtonPressed = false;
-		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
-		return;
+		hidden += !reference[b];
+		falseCulls += reference[b] && !scene.visible[nodes[b]];
 	}
-	if (button == GLFW_MOUSE_BUTTON_MIDDLE && action == GLFW_RELEASE)
+
+	std::cout << "OcclusionCulling objects=" << scene.Size() << " in frustum " << boxes.size() << ", occluded " << stats[1].occluded
+		<< ", drawn " << stats[1].visible << " | " << occlusion.triangles.size() << " occluder triangles, raster "
+		<< occlusion.rasterTime << " ms, pyramid " << occlusion.pyramidTime << " ms, total 1 thread " << cullTime[0] << " ms, "
+		<< occlusion.threadCount << " threads " << cullTime[1] << " ms | reference " << referenceTime << " ms: hidden " << hidden
+		<< ", false culls " << falseCulls << (stats[0].occluded == stats[1].occluded ? "" : ", THREAD MISMATCH") << std::endl;
+	bool passed = falseCulls == 0 && stats[0].occluded == stats[1].occluded;
+	if (!passed)
+		std::cerr << "OcclusionCulling FAILED: boxes hidden that the reference render shows" << std::endl;
+	return passed;
+}
+
+/* Build, refit and query throughput of the BVH on random boxes, from 10k to 10M. Query results are
+   checked against brute force */
+void benchmarkBvh()
+{
+	const unsigned int boxCounts[] = { 10000, 100000, 1000000, 10000000 };
+	unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency());
+	for (int c = 0; c < 4; c++)
 	{
-		lastCursorPosY = yPos;
-		lastCursorPosX = xPos;
-		isMiddleButtonPressed = false;
-		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
-		return;
+		unsigned int count = boxCounts[c];
+		float fieldSize = std::sqrt((float)count) * GridUnit * 4;
+		BoundingBoxArrays boxes;
+		boxes.Reserve(count);
+		srand(54321);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			BoundingVolume bounds;
+			bounds.center = glm::vec3(((float)rand() / RAND_MAX - 0.5f) * fieldSize, (float)rand() / RAND_MAX * GridUnit * 4,
+				((float)rand() / RAND_MAX - 0.5f) * fieldSize);
+			bounds.extent = glm::vec3(GridUnit * (0.25f + (float)rand() / RAND_MAX));
+			boxes.PushBack(bounds);
+		}
+
+		double buildTime[2];
+		Bvh bvh;
+		for (int threaded = 0; threaded < 2; threaded++)
+		{
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			bvh.Build(boxes, threaded ? threadCount : 1);
+			buildTime[threaded] = elapsedMilliseconds(start);
+		}
+
+		// Move every box a little and refit
+		for (unsigned int i = 0; i < count; i++)
+			boxes.centerX[i] += GridUnit * ((i % 3) - 1.0f);
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		bvh.Refit();
+		double refitTime = elapsedMilliseconds(start);
+
+		// Frustum, from above one corner of the field
+		glm::mat4 view = glm::lookAt(glm::vec3(fieldSize * 0.25f, 1.0f, fieldSize * 0.25f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+		Frustum frustum = extractFrustum(glm::perspective(70.0f, 1024.0f / 768.0f, 0.01f, 10.0f) * view);
+		std::vector<unsigned int> results;
+		start = std::chrono::high_resolution_clock::now();
+		bvh.QueryFrustum(frustum, results);
+		double frustumTime = elapsedMilliseconds(start);
+		std::vector<unsigned char> visible(count);
+		start = std::chrono::high_resolution_clock::now();
+		size_t linearVisible = cullBoxes(frustum, boxes, 0, count, visible.data());
+		double linearTime = elapsedMilliseconds(start);
+		size_t frustumMismatches = results.size() != linearVisible;
+		for (size_t r = 0; r < results.size(); r++)
+			frustumMismatches += !visible[results[r]];
+
+		// Rays across the field, and spheres of a few grid units
+		const int queryCount = 10000;
+		std::vector<glm::vec3> origins(queryCount), directions(queryCount);
+		for (int q = 0; q < queryCount; q++)
+		{
+			origins[q] = glm::vec3(((float)rand() / RAND_MAX - 0.5f) * fieldSize, 1.0f, ((float)rand() / RAND_MAX - 0.5f) * fieldSize);
+			directions[q] = glm::normalize(glm::vec3((float)rand() / RAND_MAX - 0.5f, -1.0f, (float)rand() / RAND_MAX - 0.5f));
+		}
+		std::vector<unsigned int> rayHits(queryCount);
+		std::vector<float> rayDistances(queryCount);
+		start = std::chrono::high_resolution_clock::now();
+		unsigned int hitCount = 0;
+		for (int q = 0; q < queryCount; q++)
+		{
+			rayHits[q] = bvh.Raycast(origins[q], directions[q], FLT_MAX, &rayDistances[q]);
+			hitCount += rayHits[q] != BvhNoHit;
+		}
+		double rayTime = elapsedMilliseconds(start);
+
+		start = std::chrono::high_resolution_clock::now();
+		size_t nearCount = 0;
+		for (int q = 0; q < queryCount; q++)
+		{
+			std::vector<unsigned int> near;
+			bvh.QuerySphere(glm::vec3(origins[q].x, 0.0f, origins[q].z), GridUnit * 4, near);
+			nearCount += near.size();
+		}
+		double sphereTime = elapsedMilliseconds(start);
+
+		// Brute-force the first rays
+		int rayMismatches = 0;
+		for (int q = 0; q < 20; q++)
+		{
+			float closest = FLT_MAX;
+			for (unsigned int i = 0; i < count; i++)
+			{
+				float distance = intersectRayBox(origins[q], 1.0f / directions[q], closest, bvh.BoxLower(i), bvh.BoxUpper(i));
+				if (distance >= 0.0f && distance < closest)
+					closest = distance;
+			}
+			bool bruteHit = closest != FLT_MAX;
+			if (bruteHit != (rayHits[q] != BvhNoHit) || (bruteHit && std::abs(closest - rayDistances[q]) > 1e-5f))
+				rayMismatches++;
+		}
+
+		std::cout << "Bvh boxes=" << count << " nodes " << bvh.Size() << " | build " << buildTime[0] << " ms, "
+			<< threadCount << " threads " << buildTime[1] << " ms, refit " << refitTime << " ms"
+			<< " | frustum " << results.size() << " (linear " << linearVisible << ", mismatches " << frustumMismatches << ") "
+			<< frustumTime << " ms vs linear " << linearTime << " ms"
+			<< " | " << queryCount << " rays " << hitCount << " hits " << rayTime << " ms, mismatches " << rayMismatches
+			<< " | " << queryCount << " spheres " << nearCount << " found " << sphereTime << " ms" << std::endl;
 	}
-	if (button == GLFW_MOUSE_BUTTON_MIDDLE && action == GLFW_PRESS)
+}
+
+/* The scene's BVH queries on fields of Olafs around the default camera: rebuilds on one thread and on
+   every core, QueryFrustum against the linear Cull, and Pick and QueryNear against a scan of every
+   drawable node. Returns false on a mismatch */
+bool benchmarkSceneQueries()
+{
+	const unsigned int olafCounts[] = { 1000, 10000, 100000 };
+	bool passed = true;
+	for (int c = 0; c < 3; c++)
 	{
-		lastCursorPosY = yPos;
-		lastCursorPosX = xPos;
-		isLeftButtonPressed = false;
-		isRightButtonPressed = false;
-		isMiddleButtonPressed = true;
-		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
-		return;
+		unsigned int olafCount = olafCounts[c];
+		unsigned int side = (unsigned int)std::ceil(std::sqrt((float)olafCount));
+		SceneHierarchy scene;
+		scene.Reserve(olafCount * 10);
+		for (unsigned int i = 0; i < olafCount; i++)
+		{
+			NodeHandle olaf = addOlaf(scene);
+			scene.SetPosition(olaf, glm::vec3(((float)(i % side) - side * 0.5f) * GridUnit * 4, 0.0f, ((float)(i / side) - side * 0.5f) * GridUnit * 4));
+		}
+		scene.UpdateWorldTransforms();
+
+		unsigned int threadCounts[2] = { 1, std::max(1u, std::thread::hardware_concurrency()) };
+		double buildTime[2];
+		for (int threaded = 0; threaded < 2; threaded++)
+		{
+			scene.bvhStale = true;
+			scene.bvhThreadCount = threadCounts[threaded];
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			scene.UpdateBvh();
+			buildTime[threaded] = elapsedMilliseconds(start);
+		}
+
+		useDefaultCamera();
+		Frustum frustum = extractFrustum(projectionMatrix * viewMatrix);
+		std::vector<NodeHandle> inFrustum;
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		scene.QueryFrustum(frustum, inFrustum);
+		double queryTime = elapsedMilliseconds(start);
+		start = std::chrono::high_resolution_clock::now();
+		CullStats cullStats = scene.Cull(frustum);
+		double cullTime = elapsedMilliseconds(start);
+		size_t frustumMismatches = inFrustum.size() != cullStats.visible;
+		for (size_t r = 0; r < inFrustum.size(); r++)
+			frustumMismatches += !scene.visible[scene.denseIndex[inFrustum[r]]];
+
+		// Rays straight down onto the field and spheres around the same points, against a scan
+		const int queryCount = 200;
+		float fieldSize = side * GridUnit * 4;
+		srand(24680);
+		unsigned int pickHits = 0, pickMismatches = 0, nearFound = 0, nearMismatches = 0;
+		double pickTime = 0.0, nearTime = 0.0;
+		for (int q = 0; q < queryCount; q++)
+		{
+			glm::vec3 target(((float)rand() / RAND_MAX - 0.5f) * fieldSize, 0.0f, ((float)rand() / RAND_MAX - 0.5f) * fieldSize);
+			glm::vec3 origin = target + glm::vec3(0.0f, 1.0f, 0.0f), direction(0.0f, -1.0f, 0.0f);
+			start = std::chrono::high_resolution_clock::now();
+			NodeHandle picked = scene.Pick(origin, direction);
+			std::vector<NodeHandle> near;
+			double afterPick = elapsedMilliseconds(start);
+			scene.QueryNear(target, GridUnit * 2, near);
+			nearTime += elapsedMilliseconds(start) - afterPick;
+			pickTime += afterPick;
+
+			float closest = FLT_MAX;
+			unsigned int nearCount = 0;
+			for (unsigned int i = 0; i < scene.Size(); i++)
+			{
+				if (!(scene.flags[i] & NodeDrawable))
+					continue;
+				glm::vec3 lower = scene.bvh.BoxLower(i), upper = scene.bvh.BoxUpper(i);
+				float distance = intersectRayBox(origin, 1.0f / direction, closest, lower, upper);
+				if (distance >= 0.0f && distance < closest)
+					closest = distance;
+				glm::vec3 point = glm::clamp(target, lower, upper);
+				nearCount += glm::dot(point - target, point - target) <= GridUnit * 2 * GridUnit * 2;
+			}
+			float pickedDistance = FLT_MAX;
+			if (picked != InvalidNode)
+			{
+				unsigned int i = scene.denseIndex[picked];
+				pickedDistance = intersectRayBox(origin, 1.0f / direction, FLT_MAX, scene.bvh.BoxLower(i), scene.bvh.BoxUpper(i));
+				pickHits++;
+			}
+			pickMismatches += (picked == InvalidNode) != (closest == FLT_MAX) || std::abs(pickedDistance - closest) > 1e-5f;
+			nearFound += (unsigned int)near.size();
+			nearMismatches += near.size() != nearCount;
+		}
+
+		std::cout << "SceneQueries olafs=" << olafCount << " nodes " << scene.Size() << " | rebuild " << buildTime[0] << " ms, "
+			<< threadCounts[1] << " threads " << buildTime[1] << " ms | frustum " << inFrustum.size() << " " << queryTime
+			<< " ms vs cull " << cullTime << " ms, mismatches " << frustumMismatches << " | " << queryCount << " picks " << pickHits
+			<< " hits " << pickTime << " ms, mismatches " << pickMismatches << " | near " << nearFound << " found " << nearTime
+			<< " ms, mismatches " << nearMismatches << std::endl;
+		if (frustumMismatches || pickMismatches || nearMismatches)
+		{
+			std::cerr << "SceneQueries FAILED: BVH queries disagree with the linear scans" << std::endl;
+			passed = false;
+		}
 	}
+	return passed;
+}
+
+/* Runs every benchmark. GPU work is skipped when no context could be created. Returns false when a
+   benchmark's correctness check failed, for a non-zero exit */
+bool runBenchmarks(bool hasContext)
+{
+	benchmarkSceneHierarchy(hasContext);
+	benchmarkInstancedDraw(hasContext);
+	benchmarkStateCache();
+	benchmarkRenderQueue();
+	benchmarkMvpKernel(hasContext);
+	benchmarkStreamBuffer(hasContext);
+	benchmarkIndirectDraw(hasContext);
+	benchmarkOcclusionQueries(hasContext);
+	benchmarkGeometryRegistry(hasContext);
+	benchmarkVertexQuantization(hasContext);
+	benchmarkIndexBuffers(hasContext);
+	benchmarkMeshOptimization(hasContext);
+	benchmarkMeshImport();
+	benchmarkMeshCache(hasContext);
+	benchmarkResources();
+	benchmarkAssetStreaming(hasContext);
+	benchmarkGrid(hasContext);
+	benchmarkTerrain(hasContext);
+	benchmarkFrustumCulling();
+	bool passed = benchmarkOcclusionCulling();
+	benchmarkBvh();
+	passed = benchmarkSceneQueries() && passed;
+	return passed;
 }
 
 int main(int argc, char*argv[])
 {
+	// Run the benchmarks instead of the application with --benchmark, draw through multi-draw indirect with --indirect,
+	// cull with GPU occlusion queries with --occlusion-queries and stream in OBJ or glTF meshes with --mesh <file>.
+	// --buffer-grid draws the grid from a line buffer of --grid-cells <n> cells a side instead of procedurally,
+	// and --terrain streams in a heightfield around the camera in its place. --no-occlusion-culling turns off the
+	// software occlusion culling of large scenes
+	bool benchmarkMode = false;
+	bool indirectMode = false;
+	bool occlusionQueryMode = false;
+	bool bufferGridMode = false;
+	bool terrainMode = false;
+	std::vector<std::string> meshPaths;
+	for (int i = 1; i < argc; i++)
+	{
+		benchmarkMode |= std::string(argv[i]) == "--benchmark";
+		indirectMode |= std::string(argv[i]) == "--indirect";
+		occlusionQueryMode |= std::string(argv[i]) == "--occlusion-queries";
+		bufferGridMode |= std::string(argv[i]) == "--buffer-grid";
+		terrainMode |= std::string(argv[i]) == "--terrain";
+		if (std::string(argv[i]) == "--no-occlusion-culling")
+			occlusionCullingEnabled = false;
+		if (std::string(argv[i]) == "--mesh" && i + 1 < argc)
+			meshPaths.push_back(argv[++i]);
+		if (std::string(argv[i]) == "--grid-cells" && i + 1 < argc)
+			gridCells = std::max(1, atoi(argv[++i]));
+	}
+
     // Initialize GLFW and OpenGL version
-    glfwInit();
+    if (!glfwInit() && benchmarkMode)
+    {
+        return runBenchmarks(false) ? 0 : 1;
+    }
+    if (benchmarkMode)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
     
 #if defined(PLATFORM_OSX)
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -444,13 +10445,20 @@ int main(int argc, char*argv[])
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 #else
-    // On windows, we set OpenGL version to 2.1, to support more hardware
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+    // The shaders need GL 3.3, and the geometry registry draws with base vertices and copies buffers, which need 3.2
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 #endif
 
     // Create Window and rendering context using GLFW, resolution is 800x600
-    GLFWwindow* window = glfwCreateWindow(1024, 768, "Comp371 - Assignment 1 - Christian Galante", NULL, NULL);
+    const char* windowTitle = "Comp371 - Assignment 1 - Christian Galante";
+    GLFWwindow* window = glfwCreateWindow(1024, 768, windowTitle, NULL, NULL);
+    if (window == NULL && benchmarkMode)
+    {
+        bool passed = runBenchmarks(false);
+        glfwTerminate();
+        return passed ? 0 : 1;
+    }
     if (window == NULL)
     {
         std::cerr << "Failed to create GLFW window" << std::endl;
@@ -466,6 +10474,14 @@ int main(int argc, char*argv[])
         glfwTerminate();
         return -1;
     }
+	if (!GLEW_VERSION_3_2)
+	{
+		// Drivers can hand back an older context than the one asked for
+		std::cerr << "OpenGL 3.2 is needed, this context is " << glGetString(GL_VERSION) << std::endl;
+		bool passed = benchmarkMode && runBenchmarks(false);
+		glfwTerminate();
+		return passed ? 0 : -1;
+	}
 
 	// Initialize GLFW Input
 	glfwSetMouseButtonCallback(window, mouseButtonCallback);
@@ -475,16 +10491,74 @@ int main(int argc, char*argv[])
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     
     // Compile and link shaders here ...
-    shaderProgram = createShaderProgram();
+    shaderProgram = ShaderProgram(createShaderProgram("shaders/vertex0.vert", "shaders/fragment0.frag"));
+	instancingSupported = GLEW_VERSION_3_3 != 0;
+	if (instancingSupported)
+		instancedShaderProgram = ShaderProgram(createShaderProgram("shaders/vertex0_instanced.vert", "shaders/fragment0_instanced.frag"));
+	indirectSupported = GLEW_VERSION_4_3 && GLEW_ARB_shader_draw_parameters;
+	if (indirectSupported)
+		indirectShaderProgram = ShaderProgram(createShaderProgram("shaders/vertex0_indirect.vert", "shaders/fragment0_instanced.frag"));
+	proceduralGridEnabled = GLEW_VERSION_3_3 && !bufferGridMode;
+	if (proceduralGridEnabled)
+	{
+		gridShaderProgram = ShaderProgram(createShaderProgram("shaders/vertex0_grid.vert", "shaders/fragment0_grid.frag"));
+		glGenVertexArrays(1, &gridVao);
+	}
+	if (GLEW_VERSION_3_3)
+		terrainShaderProgram = ShaderProgram(createShaderProgram("shaders/vertex0_terrain.vert", "shaders/fragment0_instanced.frag"));
     
-    // Define and upload geometry to the GPU here ...
-    createGeometryGrid();
+    // Define and upload geometry to the GPU here ... The benchmarks compare both grids
+	if (!proceduralGridEnabled || benchmarkMode)
+		createGeometryGrid(gridCells);
 	createGeometryUnitCube();
+	createFrameDataBuffer();
+	if (instancingSupported)
+	{
+		createInstancedGeometry(Cube, CubeInstances);
+		renderQueue.RegisterInstancing(Cube.vao, instancedShaderProgram, CubeInstances);
+		instanceStream.Create(GL_ARRAY_BUFFER, 1 << 20);
+	}
+	if (indirectMode && indirectSupported)
+	{
+		unsigned int indirectBuffers[2];
+		glGenBuffers(2, indirectBuffers);
+		indirectStaging.Create(GL_COPY_READ_BUFFER, 1 << 20);
+		renderQueue.EnableIndirect(indirectShaderProgram, indirectBuffers[0], indirectBuffers[1], indirectStaging);
+	}
+	else if (indirectMode)
+		std::cerr << "Multi-draw indirect needs GL 4.3 and ARB_shader_draw_parameters, drawing per object" << std::endl;
+	if (GLEW_VERSION_3_3)
+		occlusionQueries.Create();
+	if (occlusionQueryMode && GLEW_VERSION_3_3)
+		occlusionQueriesEnabled = true;
+	else if (occlusionQueryMode)
+		std::cerr << "Occlusion queries need GL 3.3, drawing without them" << std::endl;
+
+	if (benchmarkMode)
+	{
+		bool passed = runBenchmarks(true);
+		glfwTerminate();
+		return passed ? 0 : 1;
+	}
+
+	// Meshes load in the background, each through a mesh cache next to it, and appear once uploaded
+	if (!meshPaths.empty())
+	{
+		assetStreamer.Create(geometryRegistry);
+		for (size_t m = 0; m < meshPaths.size(); m++)
+			assetStreamer.Load(meshPaths[m], meshPaths[m] + ".mesh");
+	}
+
+	// Chunks are generated on worker threads and appear as they are uploaded, coarse ones first
+	terrainEnabled = terrainMode && GLEW_VERSION_3_3;
+	if (terrainEnabled)
+		terrain.Create(&geometryRegistry);
+	else if (terrainMode)
+		std::cerr << "The terrain needs GL 3.3, drawing the grid" << std::endl;
 
 	// Initialize World, View and Projection Matrices
 
 	worldMatrix = glm::mat4(1.0f);
-	setWorldMatrix(shaderProgram, worldMatrix);
 
 
 	float cameraSpeed = 0.75f;
@@ -495,95 +10569,32 @@ int main(int argc, char*argv[])
 	viewMatrix = lookAt(cameraPosition,  // eye
 						cameraLookAt,  // center
 						cameraUp); // up
-	setViewMatrix(shaderProgram, viewMatrix);
 
 	projectionMatrix = glm::perspective(	70.0f,// field of view in degrees
 											1024.0f / 768.0f,  // aspect ratio
 											0.01f, 10.0f);   // near and far (near > 0)
-	setProjectionMatrix(shaderProgram, projectionMatrix);
 
 	// Define transforms to create axes from unit cube geometry
-	glm::mat4 transformXAxis(1.0f);
-	transformXAxis = glm::translate(transformXAxis, glm::vec3(GridUnit, 0.0f, 0.0f));
-	transformXAxis = glm::scale(transformXAxis, glm::vec3(2.0f, 0.025f, 0.025f));
+	glm::vec3 axisScale(2.0f, 0.025f, 0.025f);
+	glm::mat4 axisTransforms[3];
+	axisTransforms[0] = composeTransform(glm::vec3(GridUnit, 0.0f, 0.0f),
+		glm::quat(1.0f, 0.0f, 0.0f, 0.0f), axisScale, glm::vec3(0.0f));
 
-	glm::mat4 transformZAxis(1.0f);
-	transformZAxis = glm::translate(transformZAxis, glm::vec3(0.0f, 0.0f, GridUnit));
-	transformZAxis = glm::rotate(transformZAxis, glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-	transformZAxis = glm::scale(transformZAxis, glm::vec3(2.0f, 0.025f, 0.025f));
+	axisTransforms[1] = composeTransform(glm::vec3(0.0f, GridUnit, 0.0f),
+		glm::angleAxis(glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 1.0f)), axisScale, glm::vec3(0.0f));
 
-	glm::mat4 transformYAxis(1.0f);
-	transformYAxis = glm::translate(transformYAxis, glm::vec3(0.0f, GridUnit, 0.0f));
-	transformYAxis = glm::rotate(transformYAxis, glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-	transformYAxis = glm::scale(transformYAxis, glm::vec3(2.0f, 0.025f, 0.025f));
+	axisTransforms[2] = composeTransform(glm::vec3(0.0f, 0.0f, GridUnit),
+		glm::angleAxis(glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f)), axisScale, glm::vec3(0.0f));
 
 	// Initialize Olaf Hierarchical Model
 	glm::mat4 transform(1.0f);
-	glm::vec3 olafPosition(0.0f, (GridUnit/4), 0.0f);
-	glm::vec3 olafDirection(0.0f, 0.0f, 1.0f);
+	glm::vec3 olafForward(0.0f, 0.0f, 1.0f);
 	float olafRotationSpeed = 2.0f;
 	float olafMovementSpeed = 0.1f;
 	float olafScaleIncrement = 0.0125f;
 	// Olaf is the root of the hierarchy
-	HierarchicalModel* Olaf = new HierarchicalModel(nullptr);
-	// Add children to olaf and define each child's world transform
-	// Olaf/Body
-	HierarchicalModel* Olaf_Body = new HierarchicalModel(Olaf);
-	transform = glm::translate(transform, glm::vec3(0.0f, GridUnit / 4, 0.0f));
-	transform = glm::scale(transform, glm::vec3(1.5f, 2.0f, 2.0f));
-	Olaf_Body->ApplyTransform(transform);
-	Olaf_Body->SetFragmentColour(glm::vec4(0.75f, 0.75f, 0.75f, 1.0f));
-	Olaf->AddChild(Olaf_Body);
-	// Olaf/Head
-	HierarchicalModel* Olaf_Head = new HierarchicalModel(Olaf);
-	transform = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, (9*GridUnit/4), 0.0f));
-	Olaf_Head->ApplyTransform(transform);
-	Olaf->AddChild(Olaf_Head);
-	// Olaf/Nose
-	HierarchicalModel* Olaf_Nose = new HierarchicalModel(Olaf);
-	transform = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, (10 * GridUnit / 4), (GridUnit/2)));
-	transform = glm::scale(transform, glm::vec3(0.1f, 0.2f, 0.1f));
-	Olaf_Nose->ApplyTransform(transform);
-	Olaf_Nose->SetFragmentColour(glm::vec4(1.0f, 0.55f, 0.0f, 1.0f));
-	Olaf->AddChild(Olaf_Nose);
-	// Olaf/LHand
-	HierarchicalModel* Olaf_LHand = new HierarchicalModel(Olaf);
-	transform = glm::translate(glm::mat4(1.0f), glm::vec3((7 * GridUnit / 8), (8 * GridUnit / 4), GridUnit));
-	transform = glm::scale(transform, glm::vec3(0.25f, 0.25f, 2.0f));
-	Olaf_LHand->ApplyTransform(transform);
-	Olaf->AddChild(Olaf_LHand);
-	// Olaf/LHand
-	HierarchicalModel* Olaf_RHand = new HierarchicalModel(Olaf);
-	transform = glm::translate(glm::mat4(1.0f), glm::vec3(-(7 * GridUnit / 8), (8 * GridUnit / 4), GridUnit));
-	transform = glm::scale(transform, glm::vec3(0.25f, 0.25f, 2.0f));
-	Olaf_RHand->ApplyTransform(transform);
-	Olaf->AddChild(Olaf_RHand);
-	// Olaf/RLeg
-	HierarchicalModel* Olaf_RLeg = new HierarchicalModel(Olaf);
-	transform = glm::translate(glm::mat4(1.0f), glm::vec3((GridUnit / 2), 0.0f, 0.0f));
-	transform = glm::scale(transform, glm::vec3(0.25f, 0.25f, 2.0f));
-	Olaf_RLeg->ApplyTransform(transform);
-	Olaf->AddChild(Olaf_RLeg);
-	// Olaf/LLeg
-	HierarchicalModel* Olaf_LLeg = new HierarchicalModel(Olaf);
-	transform = glm::translate(glm::mat4(1.0f), glm::vec3(-(GridUnit / 2), 0.0f, 0.0f));
-	transform = glm::scale(transform, glm::vec3(0.25f, 0.25f, 2.0f));
-	Olaf_LLeg->ApplyTransform(transform);
-	Olaf->AddChild(Olaf_LLeg);
-	// Olaf/REye
-	HierarchicalModel* Olaf_REye = new HierarchicalModel(Olaf);
-	transform = glm::translate(glm::mat4(1.0f), glm::vec3(-(GridUnit / 4), (11 * GridUnit / 4), (GridUnit/2)));
-	transform = glm::scale(transform, glm::vec3(0.1f, 0.1f, 0.1f));
-	Olaf_REye->ApplyTransform(transform);
-	Olaf_REye->SetFragmentColour(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
-	Olaf->AddChild(Olaf_REye);
-	// Olaf/LEye
-	HierarchicalModel* Olaf_LEye = new HierarchicalModel(Olaf);
-	transform = glm::translate(glm::mat4(1.0f), glm::vec3((GridUnit / 4), (11 * GridUnit / 4), (GridUnit / 2)));
-	transform = glm::scale(transform, glm::vec3(0.1f, 0.1f, 0.1f));
-	Olaf_LEye->ApplyTransform(transform);
-	Olaf_LEye->SetFragmentColour(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
-	Olaf->AddChild(Olaf_LEye);
+	SceneHierarchy Scene;
+	NodeHandle Olaf = addOlaf(Scene);
 
 	// Initialize Fragment Colour
 	glm::vec4 fragmentColour(1.0f);
@@ -592,9 +10603,15 @@ int main(int argc, char*argv[])
 
 	// Frame calculation variables
 	float lastFrameTime = glfwGetTime();
+	CullStats lastCullStats;
+	OcclusionQueryStats lastQueryStats;
+	unsigned int lastAssetsLoaded = 0;
+	bool terrainSettled = false;
+	bool titleDirty = false;
+	float lastTitleTime = 0.0f;
 
-	glEnable(GL_CULL_FACE);
-	glEnable(GL_DEPTH_TEST);
+	glState.Enable(GL_CULL_FACE);
+	glState.Enable(GL_DEPTH_TEST);
 
 	// Default render mode is triangles
 	unsigned int renderMode = GL_TRIANGLES;
@@ -608,48 +10625,69 @@ int main(int argc, char*argv[])
 
         // Each frame, reset color of each pixel to glClearColor
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glState.BeginFrame();
+		instanceStream.BeginFrame();
+		updateFrameData(viewMatrix * worldMatrix, projectionMatrix);
+		if (assetStreamer.registry)
+			assetStreamer.Update();
+		if (terrainEnabled)
+		{
+			glm::mat4 view = viewMatrix * worldMatrix;
+			Frustum frustum = extractFrustum(projectionMatrix * view);
+			terrain.Update(glm::vec3(glm::inverse(view)[3]), &frustum);
+		}
 
-		/* Select Shader Program */
-		glUseProgram(shaderProgram);
-
-        /* Draw Geometry 
+		/* Draw Geometry
 		-------------------------*/
-		
-		// Draw Grid
-		glBindVertexArray(Grid.vao);
-		glBindBuffer(GL_ARRAY_BUFFER, Grid.vbo);
-		setTransformMatrix(shaderProgram, glm::mat4(1.0f)); // Grid is at Origin
-		setFragmentColour(shaderProgram, glm::vec4(0.7f, 0.7f, 0.7f, 1.0f));
-		glDrawArrays(GL_LINES, 0, 400);
-
-		// Bind unit cube
-		glBindVertexArray(Cube.vao);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, Cube.ebo);
-
-		// Draw X Axis
-		setTransformMatrix(shaderProgram, transformXAxis);
-		setFragmentColour(shaderProgram, glm::vec4(1.0f, 0.0f, 0.0f, 1.0f));
-		glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, nullptr);
-
-		// Draw Y Axis
-		setTransformMatrix(shaderProgram, transformYAxis);
-		setFragmentColour(shaderProgram, glm::vec4(0.0f, 1.0f, 0.0f, 1.0f));
-		glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, nullptr);
-
-		// Draw Z Axis
-		setTransformMatrix(shaderProgram, transformZAxis);
-		setFragmentColour(shaderProgram, glm::vec4(0.0f, 0.0f, 1.0f, 1.0f));
-		glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, nullptr);
-
-		//Draw Olaf
-		Olaf->ApplyTransform(glm::mat4(1.0f));
-		Olaf->Draw(shaderProgram, renderMode);
+		drawScene(Scene, axisTransforms, renderMode);
+
+		// Show culling, queries, streaming and terrain in the window title when they change, at most a few
+		// times a second, so the frame never waits on the console
+		if (frameCullStats.visible != lastCullStats.visible || frameCullStats.culled != lastCullStats.culled
+			|| frameCullStats.occluded != lastCullStats.occluded)
+		{
+			lastCullStats = frameCullStats;
+			titleDirty = true;
+		}
+		if (occlusionQueriesEnabled && (occlusionQueries.frame.issued != lastQueryStats.issued
+			|| occlusionQueries.frame.skipped != lastQueryStats.skipped))
+		{
+			lastQueryStats = occlusionQueries.frame;
+			titleDirty = true;
+		}
+		const AssetUploadStats& uploadStats = assetStreamer.stats;
+		if (uploadStats.assetsResident + uploadStats.assetsFailed != lastAssetsLoaded)
+		{
+			lastAssetsLoaded = uploadStats.assetsResident + uploadStats.assetsFailed;
+			titleDirty = true;
+		}
+		if (terrainEnabled && terrain.Idle() != terrainSettled)
+		{
+			terrainSettled = terrain.Idle();
+			titleDirty = true;
+		}
+		if (titleDirty && lastFrameTime - lastTitleTime >= 0.25f)
+		{
+			std::ostringstream title;
+			title << windowTitle << " | visible " << lastCullStats.visible << ", culled " << lastCullStats.culled
+				<< ", occluded " << lastCullStats.occluded;
+			if (occlusionQueriesEnabled)
+				title << " | queries " << lastQueryStats.issued << ", skipped " << (int)(lastQueryStats.SkipRate() * 100.0f) << "%";
+			if (!assetStreamer.assets.empty())
+				title << " | meshes " << uploadStats.assetsResident << "/" << assetStreamer.assets.size()
+					<< ", upload at most " << uploadStats.maxFrameMilliseconds << " ms";
+			if (terrainEnabled)
+				title << " | terrain " << terrain.stats.chunksResident << " chunks, " << (int)(terrain.stats.bytesResident / (1024 * 1024))
+					<< " MB, " << terrain.stats.patchesDrawn << " patches" << (terrainSettled ? "" : ", loading");
+			glfwSetWindowTitle(window, title.str().c_str());
+			lastTitleTime = lastFrameTime;
+			titleDirty = false;
+		}
 
 		// Handle Inputs
 		if (glfwGetKey(window, GLFW_KEY_HOME) == GLFW_PRESS) // Re-initialize world position and orientation
 		{
 			worldMatrix = glm::mat4(1.0f);
-			setWorldMatrix(shaderProgram, worldMatrix);
 
 			float cameraSpeed = 0.75f;
 			cameraPosition = glm::vec3(0.0f, 0.075f, 0.05f);
@@ -659,12 +10697,10 @@ int main(int argc, char*argv[])
 			viewMatrix = lookAt(cameraPosition,  // eye
 				cameraLookAt,  // center
 				cameraUp); // up
-			setViewMatrix(shaderProgram, viewMatrix);
 
 			projectionMatrix = glm::perspective(70.0f,// field of view in degrees
 				1024.0f / 768.0f,  // aspect ratio
 				0.01f, 10.0f);   // near and far (near > 0)
-			setProjectionMatrix(shaderProgram, projectionMatrix);
 		}
 		if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS) // Change render mode to points
 		{
@@ -680,83 +10716,51 @@ int main(int argc, char*argv[])
 		}
 		if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) // move Olaf left
 		{
-			glm::vec3 translation = glm::vec3(-olafMovementSpeed*dt, 0.0f, 0.0f);
-			olafPosition += translation;
-			Olaf->ApplyTransform(glm::translate(glm::mat4(1.0f), translation));
+			Scene.Translate(Olaf, glm::vec3(-olafMovementSpeed*dt, 0.0f, 0.0f));
 		}
 		if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) // move Olaf right
 		{
-			glm::vec3 translation = glm::vec3(olafMovementSpeed*dt, 0.0f, 0.0f);
-			olafPosition += translation;
-			Olaf->ApplyTransform(glm::translate(glm::mat4(1.0f), translation));
+			Scene.Translate(Olaf, glm::vec3(olafMovementSpeed*dt, 0.0f, 0.0f));
 		}
 		if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) // move Olaf forward
 		{
-			glm::vec3 translation = olafDirection * olafMovementSpeed*dt;
-			transform = glm::translate(glm::mat4(1.0f), translation);
-			glm::vec4 temp = transform * glm::vec4(olafPosition.x, olafPosition.y, olafPosition.z, 1.0f);
-			olafPosition = glm::vec3(temp.x, temp.y, temp.z);
-			Olaf->ApplyTransform(transform);
+			glm::vec3 olafDirection = Scene.GetRotation(Olaf) * olafForward;
+			Scene.Translate(Olaf, olafDirection * olafMovementSpeed*dt);
 		}
 		if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) // move Olaf backward
 		{
-			glm::vec3 translation = olafDirection * -olafMovementSpeed*dt;
-			transform = glm::translate(glm::mat4(1.0f), translation);
-			glm::vec4 temp = transform * glm::vec4(olafPosition.x, olafPosition.y, olafPosition.z, 1.0f);
-			olafPosition = glm::vec3(temp.x, temp.y, temp.z);
-			Olaf->ApplyTransform(transform);
+			glm::vec3 olafDirection = Scene.GetRotation(Olaf) * olafForward;
+			Scene.Translate(Olaf, olafDirection * -olafMovementSpeed*dt);
 		}
 		if (glfwGetKey(window, GLFW_KEY_U) == GLFW_PRESS) // scale Olaf up
 		{
-			float scaleIncrement = (1 + olafScaleIncrement);
-			Olaf->ApplyTransform(glm::translate(glm::mat4(1.0f), glm::vec3(-olafPosition.x, -olafPosition.y, -olafPosition.z)));
-			Olaf->ApplyTransform(glm::scale(glm::mat4(1.0f), glm::vec3(scaleIncrement, scaleIncrement, scaleIncrement)));
-			Olaf->ApplyTransform(glm::translate(glm::mat4(1.0f), glm::vec3(olafPosition.x, olafPosition.y, olafPosition.z)));
+			Scene.Scale(Olaf, glm::vec3(1 + olafScaleIncrement));
 		}
 		if (glfwGetKey(window, GLFW_KEY_J) == GLFW_PRESS) // scale Olaf down
 		{
-			float scaleIncrement = (1 - olafScaleIncrement);
-			Olaf->ApplyTransform(glm::translate(glm::mat4(1.0f), glm::vec3(-olafPosition.x, -olafPosition.y, -olafPosition.z)));
-			Olaf->ApplyTransform(glm::scale(glm::mat4(1.0f), glm::vec3(scaleIncrement, scaleIncrement, scaleIncrement)));
-			Olaf->ApplyTransform(glm::translate(glm::mat4(1.0f), glm::vec3(olafPosition.x, olafPosition.y, olafPosition.z)));		
+			Scene.Scale(Olaf, glm::vec3(1 - olafScaleIncrement));
 		}
 		if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS) // rotate Olaf left
 		{
 			float rotationAngle = olafRotationSpeed * dt;
-			Olaf->ApplyTransform(glm::translate(glm::mat4(1.0f), glm::vec3(-olafPosition.x, -olafPosition.y, -olafPosition.z)));
-
-			transform = glm::rotate(glm::mat4(1.0f), rotationAngle, glm::vec3(0.0f, 1.0f, 0.0f));
-			glm::vec4 temp = transform * glm::vec4(olafDirection.x, olafDirection.y, olafDirection.z, 1.0f);
-			olafDirection = glm::vec3(temp.x, temp.y, temp.z);
-			Olaf->ApplyTransform(transform);
-
-			Olaf->ApplyTransform(glm::translate(glm::mat4(1.0f), glm::vec3(olafPosition.x, olafPosition.y, olafPosition.z)));
+			Scene.Rotate(Olaf, glm::angleAxis(rotationAngle, glm::vec3(0.0f, 1.0f, 0.0f)));
 		}
 		if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS) // rotate Olaf right
 		{
 			float rotationAngle = olafRotationSpeed * dt;
-			Olaf->ApplyTransform(glm::translate(glm::mat4(1.0f), glm::vec3(-olafPosition.x, -olafPosition.y, -olafPosition.z)));
-
-			transform = glm::rotate(glm::mat4(1.0f), -rotationAngle, glm::vec3(0.0f, 1.0f, 0.0f));
-			glm::vec4 temp = transform * glm::vec4(olafDirection.x, olafDirection.y, olafDirection.z, 1.0f);
-			olafDirection = glm::vec3(temp.x, temp.y, temp.z);
-			Olaf->ApplyTransform(transform);
-
-			Olaf->ApplyTransform(glm::translate(glm::mat4(1.0f), glm::vec3(olafPosition.x, olafPosition.y, olafPosition.z)));
+			Scene.Rotate(Olaf, glm::angleAxis(-rotationAngle, glm::vec3(0.0f, 1.0f, 0.0f)));
 		}
 		if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS) // rotate world about y
 		{
 			float rotationAngle = cameraSpeed * dt;
 			transform = glm::rotate(glm::mat4(1.0f), -rotationAngle, glm::vec3(0.0f, 1.0f, 0.0f));
 			worldMatrix = transform * worldMatrix;
-			setWorldMatrix(shaderProgram, worldMatrix);
 		}
 		if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS) // rotate world about -y
 		{
 			float rotationAngle = cameraSpeed * dt;
 			transform = glm::rotate(glm::mat4(1.0f), rotationAngle, glm::vec3(0.0f, 1.0f, 0.0f));
 			worldMatrix = transform * worldMatrix;
-			setWorldMatrix(shaderProgram, worldMatrix);
 		}
 		if (isLeftButtonPressed) // Zooming
 		{
@@ -773,7 +10777,6 @@ int main(int argc, char*argv[])
 				viewMatrix = lookAt(cameraPosition,  // eye
 									cameraLookAt,  // center
 									cameraUp); // up	
-				setViewMatrix(shaderProgram, viewMatrix);
 			}
 			lastCursorPosY = yPos;
 		}
@@ -796,7 +10799,6 @@ int main(int argc, char*argv[])
 				viewMatrix = lookAt(cameraPosition,  // eye
 									cameraLookAt,  // center
 									cameraUp); // up	
-				setViewMatrix(shaderProgram, viewMatrix);
 			}
 			lastCursorPosX = xPos;
 		}
@@ -815,7 +10817,6 @@ int main(int argc, char*argv[])
 				viewMatrix = lookAt(cameraPosition,  // eye
 									cameraLookAt,  // center
 										cameraUp); // up	
-				setViewMatrix(shaderProgram, viewMatrix);
 			}
 			lastCursorPosY = yPos;
 		}
@@ -826,6 +10827,8 @@ int main(int argc, char*argv[])
     }
     
     // Shutdown GLFW
+	assetStreamer.Destroy();
+	terrain.Destroy();
     glfwTerminate();
     
 	return 0;
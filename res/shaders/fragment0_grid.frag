@@ -0,0 +1,51 @@
+#version 330 core
+
+layout (std140) uniform FrameData
+{
+	mat4 viewMatrix;
+	mat4 projectionMatrix;
+	mat4 viewProjectionMatrix;
+	mat4 inverseViewProjectionMatrix;
+};
+
+in vec3 nearPoint;
+in vec3 farPoint;
+flat in vec3 eyePosition;
+flat in float cellSize;
+flat in float levelBlend;
+flat in float fadeDistance;
+
+out vec4 FragColor;
+
+uniform vec4 fragmentColour;
+
+// Coverage of lines about one pixel wide along the edges of the cells
+float gridLines(vec2 position, float size)
+{
+	vec2 coordinate = position / size;
+	vec2 lines = abs(fract(coordinate - 0.5) - 0.5) / fwidth(coordinate);
+	return 1.0 - min(min(lines.x, lines.y), 1.0);
+}
+
+void main()
+{
+	// Where the view ray meets the y = 0 plane, if it does between the near and far planes
+	float t = -nearPoint.y / (farPoint.y - nearPoint.y);
+	if (!(t > 0.0 && t <= 1.0))
+		discard;
+	vec3 position = nearPoint + t * (farPoint - nearPoint);
+
+	// The plane's depth, so geometry in front of it hides the grid
+	vec4 clip = viewProjectionMatrix * vec4(position, 1.0);
+	gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+
+	// Lines of the current level, fading out, and of the next one
+	float coverage = max(gridLines(position.xz, cellSize * 10.0), gridLines(position.xz, cellSize) * (1.0 - levelBlend));
+
+	// Fade with distance, over a range that grows with the cells
+	float fade = 1.0 - smoothstep(0.5 * fadeDistance, fadeDistance, length(position - eyePosition));
+	float alpha = fragmentColour.a * coverage * fade;
+	if (alpha <= 0.0)
+		discard;
+	FragColor = vec4(fragmentColour.rgb, alpha);
+}
\ No newline at end of file
@@ -0,0 +1,51 @@
+#version 330 core
+
+// Camera matrices of the frame, shared with the other programs
+layout (std140) uniform FrameData
+{
+	mat4 viewMatrix;
+	mat4 projectionMatrix;
+	mat4 viewProjectionMatrix;
+	mat4 inverseViewProjectionMatrix;
+};
+
+// Size of the finest cells, shown when the eye is within lodHeight cells of the plane. Each time the
+// eye gets 10 times further, the cells grow by 10
+uniform float gridUnit = 0.01;
+uniform float lodHeight = 10.0;
+
+// Distance from the eye, in cells of the current level, where the grid has faded out
+uniform float fadeCells = 50.0;
+
+// The view ray through the pixel, from the near plane to the far plane
+out vec3 nearPoint;
+out vec3 farPoint;
+
+// The same for every pixel, so worked out here once
+flat out vec3 eyePosition;
+flat out float cellSize;
+flat out float levelBlend;
+flat out float fadeDistance;
+
+vec3 unproject(vec2 xy, float z)
+{
+	vec4 point = inverseViewProjectionMatrix * vec4(xy, z, 1.0);
+	return point.xyz / point.w;
+}
+
+void main()
+{
+	// One triangle covering the screen, made from the vertex number alone: no vertex buffer
+	vec2 xy = vec2(gl_VertexID == 1 ? 3.0 : -1.0, gl_VertexID == 2 ? 3.0 : -1.0);
+	nearPoint = unproject(xy, -1.0);
+	farPoint = unproject(xy, 1.0);
+	gl_Position = vec4(xy, 0.0, 1.0);
+
+	// Level of detail from the height of the eye. The lines of the finer level fade out as the next
+	// level takes over, so zooming never pops
+	eyePosition = inverse(viewMatrix)[3].xyz;
+	float level = max(log(abs(eyePosition.y) / (gridUnit * lodHeight)) / log(10.0), 0.0);
+	cellSize = gridUnit * pow(10.0, floor(level));
+	levelBlend = fract(level);
+	fadeDistance = fadeCells * gridUnit * pow(10.0, level);
+}
\ No newline at end of file
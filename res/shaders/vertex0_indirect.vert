@@ -0,0 +1,28 @@
+#version 430 core
+#extension GL_ARB_shader_draw_parameters : require
+layout (location = 0) in vec3 aPos;
+
+// Per-draw data of a multi-draw indirect batch, same layout as IndirectDrawData
+struct DrawData
+{
+	mat4 modelMatrix;
+	vec4 fragmentColour;
+};
+
+layout (std430, binding = 0) readonly buffer DrawDataBuffer
+{
+	DrawData draws[];
+};
+
+// Index of the batch's first draw in draws, gl_DrawID restarts at 0 for every batch
+uniform int drawOffset = 0;
+uniform mat4 viewProjectionMatrix;
+
+out vec4 vertexColour;
+
+void main()
+{
+	DrawData draw = draws[drawOffset + gl_DrawIDARB];
+	gl_Position = viewProjectionMatrix * draw.modelMatrix * vec4(aPos.x, aPos.y, aPos.z, 1.0);
+	vertexColour = draw.fragmentColour;
+}
\ No newline at end of file
@@ -0,0 +1,12 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in mat4 aMvp;     // per instance, occupies locations 1 to 4
+layout (location = 5) in vec4 aColour;  // per instance
+
+out vec4 vertexColour;
+
+void main()
+{
+	gl_Position = aMvp * vec4(aPos.x, aPos.y, aPos.z, 1.0);
+	vertexColour = aColour;
+}
\ No newline at end of file
@@ -0,0 +1,18 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 6) in vec3 aNormal;
+layout (location = 7) in vec4 aColour;
+
+uniform mat4 mvpMatrix = mat4(1.0);
+
+out vec4 vertexColour;
+
+// Float vertices lit like vertex0_quantized.vert, to compare the two
+void main()
+{
+	gl_Position = mvpMatrix * vec4(aPos, 1.0);
+
+	// Fixed directional light, so normals show in the output
+	float diffuse = max(dot(normalize(aNormal), normalize(vec3(0.3, 0.8, 0.5))), 0.0);
+	vertexColour = vec4(aColour.rgb * (0.25 + 0.75 * diffuse), aColour.a);
+}
\ No newline at end of file
@@ -0,0 +1,17 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in mat4 aTransform;  // per instance, occupies locations 1 to 4
+layout (location = 5) in vec4 aColour;     // per instance
+
+uniform mat4 worldMatrix;
+uniform mat4 viewMatrix;
+uniform mat4 projectionMatrix;
+
+out vec4 vertexColour;
+
+// The instanced vertex stage before matrices were combined on the CPU, multiplying all four per vertex
+void main()
+{
+	gl_Position = projectionMatrix * viewMatrix * worldMatrix * aTransform * vec4(aPos, 1.0);
+	vertexColour = aColour;
+}
\ No newline at end of file
@@ -0,0 +1,31 @@
+#version 330 core
+layout (location = 0) in vec4 aPos;     // snorm16, within the mesh bounds
+layout (location = 6) in vec2 aNormal;  // snorm16 octahedral coordinates
+layout (location = 7) in vec4 aColour;  // unorm8
+
+uniform mat4 mvpMatrix = mat4(1.0);
+
+// Bounds the positions were quantized to: position = aPos * positionScale + positionOffset
+uniform vec3 positionScale = vec3(1.0);
+uniform vec3 positionOffset = vec3(0.0);
+
+out vec4 vertexColour;
+
+vec3 octahedralDecode(vec2 p)
+{
+	vec3 normal = vec3(p, 1.0 - abs(p.x) - abs(p.y));
+	if (normal.z < 0.0)
+		normal.xy = (1.0 - abs(p.yx)) * vec2(p.x >= 0.0 ? 1.0 : -1.0, p.y >= 0.0 ? 1.0 : -1.0);
+	return normalize(normal);
+}
+
+void main()
+{
+	vec3 position = aPos.xyz * positionScale + positionOffset;
+	gl_Position = mvpMatrix * vec4(position, 1.0);
+
+	// Fixed directional light, so normals show in the output
+	vec3 normal = octahedralDecode(aNormal);
+	float diffuse = max(dot(normal, normalize(vec3(0.3, 0.8, 0.5))), 0.0);
+	vertexColour = vec4(aColour.rgb * (0.25 + 0.75 * diffuse), aColour.a);
+}
\ No newline at end of file
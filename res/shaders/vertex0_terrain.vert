@@ -0,0 +1,39 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 5) in vec3 aCoarsePos;  // where the vertex goes on the grid of the next coarser level
+layout (location = 6) in vec3 aNormal;
+
+// Camera matrices of the frame, shared with the other programs
+layout (std140) uniform FrameData
+{
+	mat4 viewMatrix;
+	mat4 projectionMatrix;
+	mat4 viewProjectionMatrix;
+	mat4 inverseViewProjectionMatrix;
+};
+
+// In the terrain's space, which is the world's
+uniform vec3 eyePosition;
+
+// Distances from the eye over which the chunk's level turns into the next coarser one
+uniform vec2 morphRange = vec2(1.0, 2.0);
+
+out vec4 vertexColour;
+
+void main()
+{
+	// Vertices slide onto the coarser grid as they get further away, so a chunk has become its parent
+	// by the end of its range, and its edges match any coarser chunk next to it
+	float morph = clamp((distance(eyePosition, aPos) - morphRange.x) / (morphRange.y - morphRange.x), 0.0, 1.0);
+	vec3 position = mix(aPos, aCoarsePos, morph);
+	gl_Position = viewProjectionMatrix * vec4(position, 1.0);
+
+	// Grass in the valleys to rock on the heights and slopes, under the fixed light of the lit shaders
+	vec3 normal = normalize(aNormal);
+	vec3 grass = vec3(0.30, 0.50, 0.22);
+	vec3 rock = vec3(0.50, 0.46, 0.42);
+	float rockiness = clamp(position.y * 8.0 + 0.5, 0.0, 1.0) * 0.6 + (1.0 - normal.y) * 2.0;
+	vec3 colour = mix(grass, rock, clamp(rockiness, 0.0, 1.0));
+	float diffuse = max(dot(normal, normalize(vec3(0.3, 0.8, 0.5))), 0.0);
+	vertexColour = vec4(colour * (0.25 + 0.75 * diffuse), 1.0);
+}
\ No newline at end of file